@@ -258,6 +258,11 @@ const char* usbip::device_control_name(ULONG ioctl_code)
 	case vhci::ioctl::GET_IMPORTED_DEVICES: return "vhci_get_imported_devices";
 	case vhci::ioctl::GET_PERSISTENT: return "vhci_get_persistent";
 	case vhci::ioctl::SET_PERSISTENT: return "vhci_set_persistent";
+	case vhci::ioctl::RESOLVER_CACHE: return "vhci_resolver_cache";
+	case vhci::ioctl::CONNECTION_POOL: return "vhci_connection_pool";
+	case vhci::ioctl::SET_HEARTBEAT: return "vhci_set_heartbeat";
+	case vhci::ioctl::GET_DEVICE_STATS: return "vhci_get_device_stats";
+	case vhci::ioctl::SET_BANDWIDTH_LIMIT: return "vhci_set_bandwidth_limit";
 
 	case IOCTL_USB_DIAG_IGNORE_HUBS_ON: return "USB_DIAG_IGNORE_HUBS_ON";
 	case IOCTL_USB_DIAG_IGNORE_HUBS_OFF: return "USB_DIAG_IGNORE_HUBS_OFF";
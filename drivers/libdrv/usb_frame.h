@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+#include <usbip\frame_clock.h>
+
+#include "wait_timeout.h"
+
+namespace libdrv
+{
+
+/*
+ * Microseconds since boot, the time base of the virtual frame clock.
+ */
+_IRQL_requires_max_(HIGH_LEVEL)
+inline UINT64 now_us()
+{
+	return KeQueryInterruptTime()/wdm::usec;
+}
+
+/*
+ * Virtual USB frame number, the same clock is used by usbip2_ude and usbip2_filter.
+ * @see usbip::frame::clock
+ */
+_IRQL_requires_max_(HIGH_LEVEL)
+inline auto current_frame()
+{
+	return usbip::frame::local_frame(now_us());
+}
+
+/*
+ * @return the current frame in bits 31..3 and the current 125us micro-frame in bits 2..0
+ */
+_IRQL_requires_max_(HIGH_LEVEL)
+inline ULONG current_microframe()
+{
+	auto now = now_us();
+	auto microframe = now % usbip::frame::us_per_frame / (usbip::frame::us_per_frame/8);
+
+	return usbip::frame::local_frame(now) << 3 | ULONG(microframe);
+}
+
+} // namespace libdrv
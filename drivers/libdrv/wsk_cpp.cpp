@@ -207,6 +207,7 @@ PAGED void ReleaseProviderNPI()
 struct wsk::SOCKET
 {
         WSK_SOCKET *Self;
+        ULONG Flags; // WSK_FLAG_XXX_SOCKET
 
         irp_cls recv_irp; // recv/send can be called concurrently
         irp_cls send_irp;
@@ -311,7 +312,9 @@ PAGED auto getsockopt(_In_ SOCKET *sock, int level, int optname, void *optval, s
 }
 
 _IRQL_requires_max_(APC_LEVEL)
-PAGED auto transfer(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _Out_ SIZE_T &actual, _In_ bool send)
+PAGED auto transfer(
+        _In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _Out_ SIZE_T &actual, _In_ bool send,
+        _In_opt_ on_pending_t *on_pending = nullptr, _In_opt_ void *context = nullptr)
 {
         PAGED_CODE();
         NT_ASSERT(sock);
@@ -333,6 +336,10 @@ PAGED auto transfer(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _
         irp->reset();
 
         auto st = sock->invoke(cnt, func, sock->Self, buffer, flags, irp->get());
+
+        if (st == STATUS_PENDING && on_pending) {
+                on_pending(context);
+        }
         irp->wait_for_completion(st);
 
         actual = NT_SUCCESS(st) ? (*irp)->IoStatus.Information : 0;
@@ -381,6 +388,45 @@ NTSTATUS wsk::receive(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags,
         return sock->invoke(nullptr /*&sock->recv_cnt*/, sock->Connection->WskReceive, sock->Self, buffer, flags, irp);
 }
 
+/*
+ * Datagram is sent as a whole or not sent at all, there are no partial sends.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS wsk::send_to(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ SOCKADDR *RemoteAddress, _In_ IRP *irp)
+{
+        NT_ASSERT(sock);
+        NT_ASSERT(sock->Flags & WSK_FLAG_DATAGRAM_SOCKET);
+
+        return sock->invoke(nullptr, sock->Datagram->WskSendTo, sock->Self, buffer, 0, RemoteAddress, 
+                            0, nullptr, // ControlInfo
+                            irp);
+}
+
+/*
+ * If a datagram is larger than the buffer, the excess is discarded.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS wsk::receive_from(
+        _In_ SOCKET *sock, _In_ WSK_BUF *buffer, _Out_opt_ SOCKADDR *RemoteAddress, _Out_ SIZE_T &actual)
+{
+        PAGED_CODE();
+
+        NT_ASSERT(sock);
+        NT_ASSERT(sock->Flags & WSK_FLAG_DATAGRAM_SOCKET);
+
+        auto &irp = sock->recv_irp;
+        irp.reset();
+
+        auto st = sock->invoke(&sock->recv_cnt, sock->Datagram->WskReceiveFrom, sock->Self, buffer, 0, RemoteAddress, 
+                                nullptr, nullptr, nullptr, // ControlLength, ControlInfo, ControlFlags
+                                irp.get());
+
+        irp.wait_for_completion(st);
+
+        actual = NT_SUCCESS(st) ? irp->IoStatus.Information : 0;
+        return st;
+}
+
 _IRQL_requires_max_(APC_LEVEL)
 PAGED NTSTATUS wsk::send(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags)
 {
@@ -398,6 +444,15 @@ PAGED NTSTATUS wsk::send(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG fla
 
 _IRQL_requires_max_(APC_LEVEL)
 PAGED NTSTATUS wsk::receive(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _Out_opt_ SIZE_T *actual)
+{
+        PAGED_CODE();
+        return receive(sock, buffer, flags, actual, nullptr, nullptr);
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS wsk::receive(
+        _In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _Out_opt_ SIZE_T *actual,
+        _In_opt_ on_pending_t *on_pending, _In_opt_ void *context)
 {
         PAGED_CODE();
 
@@ -406,7 +461,7 @@ PAGED NTSTATUS wsk::receive(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG
         }
 
         SIZE_T received = 0;
-        auto st = transfer(sock, buffer, flags, received, false);
+        auto st = transfer(sock, buffer, flags, received, false, on_pending, context);
 
         if (actual) {
                 *actual = received;
@@ -489,6 +544,7 @@ PAGED NTSTATUS wsk::socket(
 
         if (NT_SUCCESS(st)) {
                 sock->Self = reinterpret_cast<WSK_SOCKET*>(irp->IoStatus.Information);
+                sock->Flags = Flags;
                 sock->Basic = static_cast<decltype(sock->Basic)>(sock->Self->Dispatch);
         } else {
                 free(sock);
@@ -684,7 +740,10 @@ PAGED NTSTATUS wsk::getlocaladdr(_In_ SOCKET *sock, _Out_ SOCKADDR *LocalAddress
         auto &irp = sock->misc_irp;
         irp.reset();
 
-        auto st = sock->invoke(&sock->misc_cnt, sock->Connection->WskGetLocalAddress, sock->Self, LocalAddress, irp.get());
+        auto func = sock->Flags & WSK_FLAG_DATAGRAM_SOCKET ? 
+                    sock->Datagram->WskGetLocalAddress : sock->Connection->WskGetLocalAddress;
+
+        auto st = sock->invoke(&sock->misc_cnt, func, sock->Self, LocalAddress, irp.get());
         return irp.wait_for_completion(st);
 }
 
@@ -773,6 +832,26 @@ PAGED NTSTATUS wsk::get_keepalive_opts(_In_ SOCKET *sock, int *idle, int *cnt, i
         return STATUS_SUCCESS;
 }
 
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS wsk::set_buffer_sizes(_In_ SOCKET *sock, int rcvbuf, int sndbuf)
+{
+        PAGED_CODE();
+
+        if (rcvbuf > 0) {
+                if (auto err = setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf))) {
+                        return err;
+                }
+        }
+
+        if (sndbuf > 0) {
+                if (auto err = setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))) {
+                        return err;
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS wsk::initialize()
 {
@@ -73,12 +73,29 @@ PAGED NTSTATUS send(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags =
 _IRQL_requires_max_(APC_LEVEL)
 PAGED NTSTATUS receive(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags = 0, _Out_opt_ SIZE_T *actual = nullptr);
 
+/*
+ * Is called by the receiving thread if the data is not available yet and it is about to wait for it.
+ */
+using on_pending_t = void (_In_opt_ void *context);
+
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS receive(
+        _In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _Out_opt_ SIZE_T *actual,
+        _In_opt_ on_pending_t *on_pending, _In_opt_ void *context);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS send(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _In_ IRP *irp);
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS receive(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _In_ IRP *irp);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_to(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ SOCKADDR *RemoteAddress, _In_ IRP *irp);
+
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS receive_from(
+        _In_ SOCKET *sock, _In_ WSK_BUF *buffer, _Out_opt_ SOCKADDR *RemoteAddress, _Out_ SIZE_T &actual);
+
 _IRQL_requires_max_(APC_LEVEL)
 PAGED NTSTATUS disconnect(_In_ SOCKET *sock, _In_opt_ WSK_BUF *buffer = nullptr, _In_ ULONG flags = 0);
 
@@ -100,6 +117,12 @@ PAGED NTSTATUS get_keepalive_opts(_In_ SOCKET *sock, int *idle, int *cnt, int *i
 _IRQL_requires_max_(APC_LEVEL)
 PAGED NTSTATUS set_keepalive(_In_ SOCKET *sock, int idle = 0, int cnt = 0, int intvl = 0);
 
+/*
+ * SO_RCVBUF, SO_SNDBUF in bytes, an option is not set if its value is not positive.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS set_buffer_sizes(_In_ SOCKET *sock, int rcvbuf, int sndbuf);
+
 //
 
 _IRQL_requires_max_(APC_LEVEL)
@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "admission.h"
+#include "trace.h"
+#include "admission.tmh"
+
+#include "context.h"
+#include "device_ioctl.h"
+#include "wsk_receive.h"
+#include "persistent.h"
+#include "ioctl.h"
+
+namespace
+{
+
+using namespace usbip;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG transfer_buffer_length(_In_ WDFREQUEST request)
+{
+        auto &urb = get_urb(request);
+
+        switch (urb.UrbHeader.Function) {
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER_USING_CHAINED_MDL:
+                return urb.UrbBulkOrInterruptTransfer.TransferBufferLength;
+        case URB_FUNCTION_ISOCH_TRANSFER:
+        case URB_FUNCTION_ISOCH_TRANSFER_USING_CHAINED_MDL:
+                return urb.UrbIsochronousTransfer.TransferBufferLength;
+        case URB_FUNCTION_CONTROL_TRANSFER_EX:
+                return urb.UrbControlTransferEx.TransferBufferLength;
+        case URB_FUNCTION_CONTROL_TRANSFER:
+                return urb.UrbControlTransfer.TransferBufferLength;
+        }
+
+        return 0;
+}
+
+/*
+ * A request that exceeds a bytes limit is sent if nothing else is in flight.
+ * device_ctx::admission_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto fits(_In_ const device_ctx &dev, _In_ const endpoint_ctx &endp, _In_ ULONG bytes)
+{
+        auto &lim = dev.admission;
+
+        return  (!lim.max_urbs || dev.inflight_urbs < lim.max_urbs) &&
+                (!lim.max_bytes || !dev.inflight_urbs || dev.inflight_bytes + bytes <= lim.max_bytes) &&
+                (!lim.max_endpoint_urbs || endp.inflight_urbs < lim.max_endpoint_urbs) &&
+                (!lim.max_endpoint_bytes || !endp.inflight_urbs || endp.inflight_bytes + bytes <= lim.max_endpoint_bytes);
+}
+
+/*
+ * device_ctx::admission_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void charge(_Inout_ device_ctx &dev, _Inout_ endpoint_ctx &endp, _Inout_ request_ctx &req)
+{
+        NT_ASSERT(!req.admitted);
+        req.admitted = true;
+
+        ++endp.inflight_urbs;
+        endp.inflight_bytes += req.admitted_bytes;
+
+        if (++dev.inflight_urbs > dev.max_inflight_urbs) {
+                dev.max_inflight_urbs = dev.inflight_urbs;
+        }
+
+        if ((dev.inflight_bytes += req.admitted_bytes) > dev.max_inflight_bytes) {
+                dev.max_inflight_bytes = dev.inflight_bytes;
+        }
+}
+
+/*
+ * device_ctx::admission_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void uncharge(_Inout_ device_ctx &dev, _Inout_ endpoint_ctx &endp, _Inout_ request_ctx &req)
+{
+        NT_ASSERT(req.admitted);
+        req.admitted = false;
+
+        NT_ASSERT(endp.inflight_urbs);
+        --endp.inflight_urbs;
+        endp.inflight_bytes -= req.admitted_bytes;
+
+        NT_ASSERT(dev.inflight_urbs);
+        --dev.inflight_urbs;
+        dev.inflight_bytes -= req.admitted_bytes;
+}
+
+/*
+ * device_ctx::admission_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void unhold(_Inout_ device_ctx &dev, _Inout_ endpoint_ctx &endp)
+{
+        NT_ASSERT(endp.held_cnt);
+        --endp.held_cnt;
+
+        NT_ASSERT(dev.held_cnt);
+        --dev.held_cnt;
+}
+
+/*
+ * Find the first held request that fits into the limits. Requests of an endpoint are not reordered:
+ * if a request does not fit, the next requests of its endpoint are skipped.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST retrieve(_Inout_ device_ctx &dev)
+{
+        UDECXUSBENDPOINT blocked[32]; // endpoints of the device
+        int blocked_cnt = 0;
+
+        auto is_blocked = [&blocked, &blocked_cnt] (auto endpoint)
+        {
+                for (int i = 0; i < blocked_cnt; ++i) {
+                        if (blocked[i] == endpoint) {
+                                return true;
+                        }
+                }
+                return false;
+        };
+
+        WDFREQUEST result{};
+        WDFREQUEST prev{};
+
+        for (WDFREQUEST found{}; 
+             !result && NT_SUCCESS(WdfIoQueueFindRequest(dev.held_requests, prev, WDF_NO_HANDLE, nullptr, &found)); ) {
+
+                if (prev) {
+                        WdfObjectDereference(prev);
+                }
+                prev = found;
+
+                auto &req = *get_request_ctx(found);
+                if (is_blocked(req.endpoint)) {
+                        continue;
+                }
+
+                auto &endp = *get_endpoint_ctx(req.endpoint);
+                bool ok{};
+                {
+                        wdf::Lock lck(dev.admission_lock);
+                        if (fits(dev, endp, req.admitted_bytes)) {
+                                charge(dev, endp, req);
+                                ok = true;
+                        }
+                }
+
+                if (!ok) {
+                        if (blocked_cnt == ARRAYSIZE(blocked)) {
+                                break;
+                        }
+                        blocked[blocked_cnt++] = req.endpoint;
+                } else if (NT_SUCCESS(WdfIoQueueRetrieveFoundRequest(dev.held_requests, found, &result))) {
+                        wdf::Lock lck(dev.admission_lock);
+                        unhold(dev, endp);
+                } else { // cancelled, see canceled_on_queue
+                        {
+                                wdf::Lock lck(dev.admission_lock);
+                                uncharge(dev, endp, req);
+                        }
+                        WdfObjectDereference(prev); // is not in the queue, start over
+                        prev = WDF_NO_HANDLE;
+                }
+        }
+
+        if (prev) {
+                WdfObjectDereference(prev);
+        }
+
+        return result;
+}
+
+/*
+ * Only one thread sends held requests at a time, if a request is completed inline, 
+ * its release() sets device_ctx::redrain and this loop repeats.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void drain(_Inout_ device_ctx &dev)
+{
+        {
+                wdf::Lock lck(dev.admission_lock);
+
+                if (dev.draining) {
+                        dev.redrain = true;
+                        return;
+                }
+
+                dev.draining = true;
+        }
+
+        for (bool again = true; again; ) {
+
+                while (auto request = retrieve(dev)) {
+                        auto &req = *get_request_ctx(request);
+                        device::submit_urb(dev, req.endpoint, request);
+                }
+
+                wdf::Lock lck(dev.admission_lock);
+
+                again = dev.redrain;
+                dev.redrain = false;
+
+                if (!again) {
+                        dev.draining = false;
+                }
+        }
+}
+
+_Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI canceled_on_queue(_In_ WDFQUEUE, _In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+        auto &endp = *get_endpoint_ctx(req.endpoint);
+        auto &dev = *get_device_ctx(endp.device);
+
+        TraceDbg("dev %04x, req %04x", ptr04x(endp.device), ptr04x(request));
+        {
+                wdf::Lock lck(dev.admission_lock);
+                unhold(dev, endp);
+        }
+
+        complete(request, STATUS_CANCELLED);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::admission::init(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto &lim = dev.admission;
+
+        lim.max_urbs = get_parameter(max_device_urbs_value_name, 0);
+        lim.max_bytes = get_parameter(max_device_bytes_value_name, 0);
+        lim.max_endpoint_urbs = get_parameter(max_endpoint_urbs_value_name, 0);
+        lim.max_endpoint_bytes = get_parameter(max_endpoint_bytes_value_name, 0);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = device;
+
+        if (auto err = WdfSpinLockCreate(&attr, &dev.admission_lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        if (!(lim.max_urbs || lim.max_bytes || lim.max_endpoint_urbs || lim.max_endpoint_bytes)) {
+                return STATUS_SUCCESS; // only counters
+        }
+
+        WDF_IO_QUEUE_CONFIG cfg;
+        WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchManual);
+        cfg.PowerManaged = WdfFalse;
+        cfg.EvtIoCanceledOnQueue = canceled_on_queue;
+
+        if (auto err = WdfIoQueueCreate(dev.vhci, &cfg, &attr, &dev.held_requests)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoQueueCreate %!STATUS!", err);
+                return err;
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, limits: urbs %lu, bytes %lu, endpoint urbs %lu, endpoint bytes %lu", 
+                ptr04x(device), lim.max_urbs, lim.max_bytes, lim.max_endpoint_urbs, lim.max_endpoint_bytes);
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::admission::admit(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request)
+{
+        auto &endp = *get_endpoint_ctx(endpoint);
+
+        auto &req = *get_request_ctx(request); // is not zeroed
+        req.endpoint = endpoint;
+        req.admitted = false;
+        req.admitted_bytes = transfer_buffer_length(request);
+
+        {
+                wdf::Lock lck(dev.admission_lock);
+
+                if (!dev.held_requests || endpoint == dev.ep0 || (!endp.held_cnt && fits(dev, endp, req.admitted_bytes))) {
+                        charge(dev, endp, req);
+                        return STATUS_SUCCESS;
+                }
+
+                ++endp.held_cnt;
+                ++dev.held_total;
+
+                if (++dev.held_cnt > dev.max_held) {
+                        dev.max_held = dev.held_cnt;
+                }
+        }
+
+        if (auto err = WdfRequestForwardToIoQueue(request, dev.held_requests)) {
+                Trace(TRACE_LEVEL_ERROR, "req %04x, WdfRequestForwardToIoQueue %!STATUS!", ptr04x(request), err);
+                wdf::Lock lck(dev.admission_lock);
+                unhold(dev, endp);
+                return err;
+        }
+
+        TraceDbg("req %04x is held, endp %04x", ptr04x(request), ptr04x(endpoint));
+
+        drain(dev); // in case everything was completed before the request was queued
+        return STATUS_PENDING;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::admission::release(_In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+        if (!req.admitted) {
+                return;
+        }
+
+        auto &endp = *get_endpoint_ctx(req.endpoint);
+        auto &dev = *get_device_ctx(endp.device);
+
+        bool held{};
+        {
+                wdf::Lock lck(dev.admission_lock);
+                uncharge(dev, endp, req);
+                held = dev.held_cnt;
+        }
+
+        if (held && !dev.unplugged) {
+                drain(dev);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::admission::purge(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint)
+{
+        if (!dev.held_requests) {
+                return;
+        }
+
+        auto &endp = *get_endpoint_ctx(endpoint);
+        WDFREQUEST prev{};
+
+        for (WDFREQUEST found{}; NT_SUCCESS(WdfIoQueueFindRequest(dev.held_requests, prev, WDF_NO_HANDLE, nullptr, &found)); ) {
+
+                if (prev) {
+                        WdfObjectDereference(prev);
+                }
+                prev = found;
+
+                if (WDFREQUEST request{}; get_request_ctx(found)->endpoint != endpoint) {
+                        // continue;
+                } else if (NT_SUCCESS(WdfIoQueueRetrieveFoundRequest(dev.held_requests, found, &request))) {
+                        {
+                                wdf::Lock lck(dev.admission_lock);
+                                unhold(dev, endp);
+                        }
+                        complete(request, STATUS_CANCELLED);
+
+                        WdfObjectDereference(prev); // is not in the queue, start over
+                        prev = WDF_NO_HANDLE;
+                }
+        }
+
+        if (prev) {
+                WdfObjectDereference(prev);
+        }
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+        struct device_ctx;
+        struct endpoint_ctx;
+}
+
+/*
+ * Admission control of URBs that are sent to a server.
+ * A device and each of its endpoints can have limited number of outstanding URBs and bytes of their buffers.
+ * URBs over the limits are held in device_ctx::held_requests (manual queue) and are sent as completions arrive.
+ * The order of URBs of an endpoint is preserved. URBs of the default control pipe are never held.
+ */
+namespace usbip::admission
+{
+
+/*
+ * Read the limits, see max_device_urbs_value_name and others.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev);
+
+/*
+ * @return STATUS_SUCCESS if the request must be sent, STATUS_PENDING if it is held
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS admit(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request);
+
+/*
+ * Must be called before the request is completed. Held requests are sent if they fit into the limits.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release(_In_ WDFREQUEST request);
+
+/*
+ * Complete held requests of the endpoint, for EvtUsbEndpointPurge.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void purge(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint);
+
+} // namespace usbip::admission
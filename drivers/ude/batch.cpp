@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "batch.h"
+#include "trace.h"
+#include "batch.tmh"
+
+#include "context.h"
+#include "wsk_receive.h"
+
+#include <libdrv\irp.h>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * Must be called before the requests are completed, a device can be gone after completion of its last request.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void update_stats(_In_ const completion_batch &b)
+{
+        for (int i = 0; i < b.cnt; ++i) {
+
+                auto dev = b.entries[i].dev;
+                bool counted = false;
+
+                for (int j = 0; j < i && !counted; ++j) {
+                        counted = b.entries[j].dev == dev;
+                }
+
+                if (counted) {
+                        continue;
+                }
+
+                ULONG cnt = 1;
+                for (int j = i + 1; j < b.cnt; ++j) {
+                        cnt += b.entries[j].dev == dev;
+                }
+
+                ++dev->completion_batches;
+                dev->batched_urbs += cnt;
+
+                if (cnt > dev->max_completion_batch) {
+                        dev->max_completion_batch = cnt;
+                }
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::batch::flush(_Inout_ completion_batch &b)
+{
+        if (!b.cnt) {
+                return;
+        }
+
+        update_stats(b);
+
+        libdrv::RaiseIrql lvl(DISPATCH_LEVEL); // nested raises in complete do not change IRQL
+
+        for (int i = 0; i < b.cnt; ++i) {
+                auto &e = b.entries[i];
+                complete(e.request, e.status);
+        }
+
+        b.cnt = 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::batch::add(_Inout_ completion_batch &b, _In_ device_ctx &dev, _In_ WDFREQUEST request, _In_ NTSTATUS status)
+{
+        NT_ASSERT(request);
+        NT_ASSERT(b.cnt < b.max_size);
+
+        b.entries[b.cnt++] = { .request = request, .status = status, .dev = &dev };
+
+        if (b.cnt == b.max_size) {
+                flush(b);
+        }
+}
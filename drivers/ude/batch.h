@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+
+/*
+ * Requests that were finished but were not completed yet.
+ * It is owned by the thread that fills it, no locking is required.
+ */
+struct completion_batch
+{
+        enum { max_size = 16 };
+
+        struct entry
+        {
+                WDFREQUEST request;
+                NTSTATUS status;
+                device_ctx *dev;
+        };
+
+        entry entries[max_size]; // in the order the requests were finished
+        int cnt;
+};
+
+} // namespace usbip
+
+/*
+ * Batched completion of URBs.
+ *
+ * Completion of every URB raises IRQL to DISPATCH_LEVEL and lowers it back, see complete.
+ * When RET_SUBMIT-s arrive back to back, the receive thread finishes a request per PDU,
+ * so it gathers them and completes them at once when the batch is full or the socket has no more data,
+ * i.e. the thread is about to wait. The batch is always empty while the thread waits.
+ *
+ * Endpoint purge cancels the requests of the endpoint by a batch too, see send_cmd_unlink_and_cancel.
+ *
+ * The requests are completed in the order they were finished, thus the order of the requests
+ * of an endpoint is preserved. A request that is completed bypassing the batch must flush it first.
+ *
+ * Devices that share the connection (EXT_MULTIPLEX) do not use batches, a device must not be accessed
+ * by mux_recv_loop after mux_ctx::dispatch_lock is released, see mux::detach.
+ */
+namespace usbip::batch
+{
+
+/*
+ * Complete the requests of the batch under a single raise of IRQL.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void flush(_Inout_ completion_batch &b);
+
+/*
+ * The batch is flushed if it becomes full.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void add(_Inout_ completion_batch &b, _In_ device_ctx &dev, _In_ WDFREQUEST request, _In_ NTSTATUS status);
+
+/*
+ * @param context completion_batch*, can be NULL
+ * @see wsk::on_pending_t
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void on_pending(_In_opt_ void *context)
+{
+        if (context) {
+                flush(*static_cast<completion_batch*>(context));
+        }
+}
+
+} // namespace usbip::batch
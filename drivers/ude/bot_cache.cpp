@@ -0,0 +1,596 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bot_cache.h"
+#include "trace.h"
+#include "bot_cache.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "ioctl.h"
+#include "device_ioctl.h"
+#include "request_list.h"
+#include "endpoint_list.h"
+#include "wsk_receive.h"
+
+#include <usbip\bot.h>
+#include <libdrv\ch9.h>
+#include <libdrv\usbd_helper.h>
+
+namespace
+{
+
+using namespace usbip;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto endpoint_address(_In_ WDFREQUEST request)
+{
+        auto endpoint = get_request_ctx(request)->endpoint;
+        return get_endpoint_ctx(endpoint)->descriptor.bEndpointAddress;
+}
+
+/*
+ * The result of cancel_stages, it must be passed to finish when device_ctx::bot_lock is released.
+ */
+struct cancelled
+{
+        seqnum_t unlink[bot::pipeline::max_stages];
+        int unlink_cnt;
+
+        WDFREQUEST requests[bot::pipeline::max_stages];
+        int request_cnt;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_data(_Inout_ bot::stage &s)
+{
+        if (auto &data = s.data) {
+                ExFreePoolWithTag(data, pooltag);
+                data = nullptr;
+        }
+}
+
+/*
+ * device_ctx::bot_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void cancel_stages(_Inout_ device_ctx &dev, _Inout_ cancelled &c)
+{
+        for (auto &s: dev.bot_stages) {
+                if (s.request) {
+                        c.requests[c.request_cnt++] = s.request;
+                }
+
+                free_data(s);
+                s = bot::stage{};
+        }
+
+        c.unlink_cnt += dev.bot_pipe.cancel(c.unlink + c.unlink_cnt);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void finish(_Inout_ device_ctx &dev, _In_ const cancelled &c)
+{
+        for (int i = 0; i < c.unlink_cnt; ++i) {
+                device::send_cmd_unlink(dev, c.unlink[i]);
+        }
+
+        for (int i = 0; i < c.request_cnt; ++i) {
+                complete(c.requests[i], STATUS_CANCELLED);
+        }
+}
+
+/*
+ * Complete the host's URB by RET_SUBMIT of the stage, device_ctx::bot_lock must be acquired.
+ * @return false if the transfer failed, the rest of the stages must be cancelled
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto fill(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ int stage)
+{
+        auto &s = dev.bot_stages[stage];
+        auto &ret = s.ret;
+        get_urb(request).UrbHeader.Status = ret.status ? to_windows_status(ret.status) : USBD_STATUS_SUCCESS;
+
+        UCHAR *buf{};
+        ULONG buf_len{};
+        ULONG len = 0;
+
+        if (s.data && NT_SUCCESS(UdecxUrbRetrieveBuffer(request, &buf, &buf_len))) {
+                len = min(ULONG(ret.actual_length), buf_len);
+                RtlCopyMemory(buf, s.data, len);
+        }
+
+        UdecxUrbSetBytesCompleted(request, len);
+
+        auto ok = !ret.status;
+        if (ok && len) {
+                dev.bot_ra.received(buf, len);
+        }
+
+        free_data(s);
+        s = bot::stage{};
+        dev.bot_pipe.release(stage);
+
+        return ok;
+}
+
+/*
+ * Reserve the slots for the bulk IN stages of CBW, device_ctx::bot_lock must be acquired.
+ * @return the number of stages to send
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto plan(_Inout_ device_ctx &dev, _In_ const bot::cbw &c, _Inout_ cancelled &cc)
+{
+        cancel_stages(dev, cc); // the host did not take all of them
+
+        auto &p = dev.bot_pipe;
+        auto n = p.plan(c);
+
+        for (int i = 0; i < n; ++i) {
+                p.sent(i, next_seqnum(dev, true));
+        }
+
+        return n;
+}
+
+/*
+ * Before CBW is sent, so the host's URB-s can't be submitted before them.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_stages(_Inout_ device_ctx &dev, _In_ const seqnum_t *seqnum, _In_ const ULONG *length, _In_ int cnt)
+{
+        auto endp = find_endpoint(dev, dev.bot_in);
+
+        for (int i = 0; i < cnt; ++i) {
+                if (auto st = endp ? device::send_ahead(dev, *endp, length[i], seqnum[i]) : STATUS_NOT_FOUND;
+                    NT_ERROR(st)) {
+                        Trace(TRACE_LEVEL_ERROR, "bulk in %#x, seqnum %u, %!STATUS!", dev.bot_in, seqnum[i], st);
+                        bot::cancel(dev);
+                        break;
+                }
+        }
+}
+
+/*
+ * @return true if CBW is completed locally
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto submit_cbw(_Inout_ device_ctx &dev, _Inout_ bot::cbw &c)
+{
+        using bot::readahead;
+
+        seqnum_t seqnum[bot::pipeline::max_stages];
+        ULONG length[bot::pipeline::max_stages];
+        int cnt = 0;
+
+        cancelled cc{};
+        {
+                wdf::Lock lck(dev.bot_lock);
+
+                switch (dev.bot_ra.command(c)) {
+                case readahead::local:
+                        return true;
+                case readahead::forward:
+                        if (dev.bot_pipelining) {
+                                cnt = plan(dev, c, cc);
+                        }
+                        break;
+                }
+
+                for (int i = 0; i < cnt; ++i) {
+                        seqnum[i] = dev.bot_pipe.seqnum(i);
+                        length[i] = dev.bot_pipe.length(i);
+                }
+        }
+
+        finish(dev, cc);
+
+        if (cnt) {
+                send_stages(dev, seqnum, length, cnt);
+        }
+
+        return false;
+}
+
+/*
+ * Bind bulk IN of the host to the stage that was sent ahead, device_ctx::bot_lock must be acquired.
+ * @param seqnum is set if the request was appended to device_ctx::requests
+ * @return false if the request must be sent as usual
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto bind(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request, _In_ ULONG length,
+        _Out_ NTSTATUS &status, _Out_ seqnum_t &seqnum, _Inout_ cancelled &cc)
+{
+        seqnum = 0;
+
+        auto &p = dev.bot_pipe;
+
+        auto i = p.bind(length);
+        if (i < 0) {
+                TraceDbg("TransferBufferLength %lu, cancelling the stages", length);
+                cancel_stages(dev, cc);
+                return false;
+        }
+
+        if (auto state = p.state(i); state == bot::pipeline::stage_received) {
+                if (!fill(dev, request, i)) {
+                        cancel_stages(dev, cc);
+                }
+                status = STATUS_SUCCESS;
+        } else if (state == bot::pipeline::stage_receiving) {
+                auto &req = *get_request_ctx(request); // is not zeroed, see complete
+                req.endpoint = endpoint;
+                req.seqnum = p.seqnum(i);
+
+                dev.bot_stages[i].request = request; // see bot::stage_received
+                status = STATUS_PENDING;
+        } else {
+                seqnum = p.seqnum(i);
+                device::append_request(dev, request, endpoint, seqnum);
+                p.release(i); // RET_SUBMIT will find the request, see bot::claim
+                status = STATUS_PENDING;
+        }
+
+        return true;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::bot::enable(_Inout_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf)
+{
+        if (!((dev.bot_cache_size || dev.bot_pipelining) &&
+              intf.Class == interface_class && intf.Protocol == interface_protocol)) {
+                return;
+        }
+
+        UCHAR in{};
+        UCHAR out{};
+
+        for (ULONG i = 0; i < intf.NumberOfPipes; ++i) {
+                if (auto &pipe = intf.Pipes[i]; pipe.PipeType == UsbdPipeTypeBulk) {
+                        (USB_ENDPOINT_DIRECTION_IN(pipe.EndpointAddress) ? in : out) = pipe.EndpointAddress;
+                }
+        }
+
+        if (!(in && out)) {
+                return;
+        }
+
+        auto cache = dev.bot_cache;
+
+        if (!cache && dev.bot_cache_size) {
+                cache = (UCHAR*)ExAllocatePoolUninitialized(NonPagedPoolNx, dev.bot_cache_size, pooltag);
+                if (!cache) {
+                        Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", dev.bot_cache_size);
+                }
+        }
+
+        cancelled cc{};
+        {
+                wdf::Lock lck(dev.bot_lock);
+
+                cancel_stages(dev, cc);
+
+                dev.bot_cache = cache;
+                dev.bot_in = in;
+                dev.bot_out = out;
+                dev.bot_ra.enable(cache ? dev.bot_cache_size : 0);
+        }
+        finish(dev, cc);
+
+        TraceDbg("interface %d.%d, bulk in %#x, out %#x, cache %lu bytes, pipelining %!bool!",
+                  intf.InterfaceNumber, intf.AlternateSetting, in, out, dev.bot_ra.capacity(), dev.bot_pipelining);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::bot::disable(_Inout_ device_ctx &dev)
+{
+        if (!dev.bot_in) {
+                return;
+        }
+
+        cancelled cc{};
+        {
+                wdf::Lock lck(dev.bot_lock);
+
+                cancel_stages(dev, cc);
+
+                dev.bot_in = 0;
+                dev.bot_out = 0;
+                dev.bot_ra.enable(0);
+        }
+        finish(dev, cc);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::bot::free(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (auto &ra = dev.bot_ra; ra.expanded()) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!UINT64! READ-s were enlarged, %!UINT64! were answered locally",
+                        ptr04x(get_handle(&dev)), ra.expanded(), ra.hits());
+        }
+
+        if (auto &p = dev.bot_pipe; p.commands()) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!UINT64! commands were pipelined, %!UINT64! URBs were bound",
+                        ptr04x(get_handle(&dev)), p.commands(), p.bound());
+        }
+
+        for (auto &s: dev.bot_stages) {
+                NT_ASSERT(!s.request);
+                free_data(s);
+        }
+
+        if (auto &cache = dev.bot_cache) {
+                ExFreePoolWithTag(cache, pooltag);
+                cache = nullptr;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::bot::invalidate(_Inout_ device_ctx &dev)
+{
+        if (dev.bot_in) {
+                wdf::Lock lck(dev.bot_lock);
+                dev.bot_ra.invalidate();
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::bot::cancel(_Inout_ device_ctx &dev)
+{
+        if (!dev.bot_pipelining) {
+                return;
+        }
+
+        cancelled cc{};
+        {
+                wdf::Lock lck(dev.bot_lock);
+                cancel_stages(dev, cc);
+        }
+        finish(dev, cc);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::bot::reset(_Inout_ device_ctx &dev, _In_ const endpoint_ctx &endp)
+{
+        if (!dev.bot_in) {
+                return;
+        }
+
+        auto addr = endp.descriptor.bEndpointAddress;
+        cancelled cc{};
+        {
+                wdf::Lock lck(dev.bot_lock);
+
+                if (addr == dev.bot_in || addr == dev.bot_out) {
+                        dev.bot_ra.reset();
+                        cancel_stages(dev, cc);
+                }
+        }
+        finish(dev, cc);
+}
+
+/*
+ * usbstor fills CBW for every command, so it is enlarged in the buffer of the host.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::bot::submit(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ const endpoint_ctx &endp,
+        _In_ WDFREQUEST request, _Inout_ URB &urb, _Inout_ ULONG &length, _Out_ NTSTATUS &status)
+{
+        get_request_ctx(request)->bot_expand = false; // is not zeroed
+        status = STATUS_SUCCESS;
+
+        if (!dev.bot_in || urb.UrbHeader.Function != URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER) {
+                return false;
+        }
+
+        UCHAR *buf{};
+        ULONG buf_len{};
+
+        if (UdecxUrbRetrieveBuffer(request, &buf, &buf_len)) { // no transfer buffer
+                return false;
+        }
+
+        auto addr = endp.descriptor.bEndpointAddress;
+
+        if (addr == dev.bot_out) {
+                return buf_len == sizeof(cbw) && submit_cbw(dev, *reinterpret_cast<cbw*>(buf));
+        } else if (addr != dev.bot_in) {
+                return false;
+        }
+
+        auto &ra = dev.bot_ra;
+        auto done = false;
+
+        seqnum_t seqnum{};
+        cancelled cc{};
+        {
+                wdf::Lock lck(dev.bot_lock);
+
+                switch (ra.next_in()) {
+                case readahead::in_forward:
+                        if (dev.bot_pipe.pending()) {
+                                done = bind(dev, endpoint, request, buf_len, status, seqnum, cc);
+                        }
+                        break;
+                case readahead::in_expand:
+                        length = ra.device_length();
+                        get_request_ctx(request)->bot_expand = true;
+                        break;
+                case readahead::in_local_data:
+                        if (UINT32 offset; auto len = ra.local_data(buf_len, offset)) {
+                                RtlCopyMemory(buf, dev.bot_cache + offset, len);
+                                UdecxUrbSetBytesCompleted(request, len);
+                                done = true;
+                        }
+                        break;
+                case readahead::in_local_status:
+                        if (buf_len >= sizeof(csw)) {
+                                ra.make_status(*reinterpret_cast<csw*>(buf));
+                                UdecxUrbSetBytesCompleted(request, sizeof(csw));
+                                done = true;
+                        } else {
+                                ra.reset(); // the host does not follow the protocol
+                        }
+                }
+        }
+
+        finish(dev, cc);
+
+        if (seqnum) { // as send_complete does
+                if (auto err = device::mark_request_cancelable(dev, seqnum)) {
+                        device::send_cmd_unlink_and_complete(get_handle(&dev), request, err);
+                }
+        }
+
+        return done;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::bot::expanded(_In_ WDFREQUEST request, _In_ const URB &urb)
+{
+        switch (urb.UrbHeader.Function) {
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER_USING_CHAINED_MDL: // see bulk_or_interrupt_transfer
+                return get_request_ctx(request)->bot_expand;
+        }
+
+        return false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::bot::data_received(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ ULONG actual_length, _In_ bool ok)
+{
+        UCHAR *buf{};
+        ULONG buf_len{};
+
+        if (auto err = UdecxUrbRetrieveBuffer(request, &buf, &buf_len)) {
+                Trace(TRACE_LEVEL_ERROR, "UdecxUrbRetrieveBuffer %!STATUS!", err);
+                return err;
+        }
+
+        ULONG len;
+        {
+                wdf::Lock lck(dev.bot_lock);
+
+                len = dev.bot_ra.data_received(buf_len, actual_length, ok);
+                RtlCopyMemory(buf, dev.bot_cache, len);
+        }
+
+        UdecxUrbSetBytesCompleted(request, len);
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::bot::received(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _Inout_opt_ void *TransferBuffer, _In_ ULONG length,
+        _In_ bool ok)
+{
+        if (!dev.bot_in) {
+                return;
+        }
+
+        auto addr = endpoint_address(request);
+        cancelled cc{};
+        {
+                wdf::Lock lck(dev.bot_lock);
+
+                if (!(addr && addr == dev.bot_in)) {
+                        //
+                } else if (!ok) {
+                        cancel_stages(dev, cc); // CSW will be requested after clearing the stall
+                } else if (length) {
+                        dev.bot_ra.received(TransferBuffer, length);
+                }
+        }
+        finish(dev, cc);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::bot::claim(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum, _Out_ WDFREQUEST &request)
+{
+        request = WDF_NO_HANDLE;
+
+        if (!dev.bot_pipelining) {
+                return false;
+        }
+
+        wdf::Lock lck(dev.bot_lock);
+        auto &p = dev.bot_pipe;
+
+        if (auto i = p.find(seqnum); i < 0) {
+                request = device::remove_request(dev, seqnum); // was bound after it had been searched
+        } else if (p.claim(i)) {
+                return true;
+        }
+
+        return false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::bot::stage_received(
+        _Inout_ device_ctx &dev, _In_ const header &hdr, _In_opt_ __drv_aliasesMem UCHAR *data, _In_ NTSTATUS status)
+{
+        WDFREQUEST request{};
+        cancelled cc{};
+        {
+                wdf::Lock lck(dev.bot_lock);
+
+                auto &p = dev.bot_pipe;
+
+                if (auto i = p.find(hdr.seqnum); i < 0) { // was cancelled
+                        if (data) {
+                                ExFreePoolWithTag(data, pooltag);
+                        }
+                } else {
+                        auto &s = dev.bot_stages[i];
+                        s.data = data;
+
+                        if (status) {
+                                cancel_stages(dev, cc); // the parked request is completed too
+                        } else {
+                                s.ret = hdr.ret_submit;
+                                p.received(i);
+
+                                if ((request = s.request) != WDF_NO_HANDLE && !fill(dev, request, i)) {
+                                        cancel_stages(dev, cc);
+                                }
+                        }
+                }
+        }
+
+        finish(dev, cc);
+
+        if (request) {
+                complete(request, STATUS_SUCCESS);
+        }
+}
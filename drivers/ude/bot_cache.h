@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbip\proto.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+        struct device_ctx;
+        struct endpoint_ctx;
+}
+
+/*
+ * Accelerators of Bulk-Only mass storage interface: read-ahead cache (see bot::readahead)
+ * and pipelining of the bulk IN stages of a command (see bot::pipeline).
+ * Both are opt-in and are set in the registry.
+ */
+namespace usbip::bot
+{
+
+/*
+ * Bulk IN CMD_SUBMIT that was sent ahead of the host's URB, its seqnum and state are in bot::pipeline.
+ */
+struct stage
+{
+        WDFREQUEST request; // of the host, waits for the payload that is being received
+        header_ret_submit ret;
+        UCHAR *data; // payload, NonPagedPoolNx
+};
+
+/*
+ * Enable accelerators if the interface is Bulk-Only mass storage.
+ * @see update_pipe_properties
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void enable(_Inout_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf);
+
+/*
+ * Another configuration is selected.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void disable(_Inout_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free(_Inout_ device_ctx &dev);
+
+/*
+ * The data of the cache can't be trusted anymore, but the current command is still tracked.
+ * @see clear_endpoint_stall
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void invalidate(_Inout_ device_ctx &dev);
+
+/*
+ * Unlink the stages that were sent ahead, complete the host's URB-s that wait for them.
+ * Stall, reset recovery, a new session, etc.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel(_Inout_ device_ctx &dev);
+
+/*
+ * The requests of the endpoint were cancelled.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void reset(_Inout_ device_ctx &dev, _In_ const endpoint_ctx &endp);
+
+/*
+ * Bulk transfer of the host. CBW can be enlarged and the bulk IN stages of the command can be sent ahead,
+ * bulk IN can be answered from the cache or bound to the stage that was sent ahead.
+ *
+ * @param length of the transfer buffer for CMD_SUBMIT, is changed for the data phase of enlarged READ
+ * @param status of URB function if the result is true
+ * @return false if URB must be sent as usual
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool submit(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ const endpoint_ctx &endp,
+        _In_ WDFREQUEST request, _Inout_ URB &urb, _Inout_ ULONG &length, _Out_ NTSTATUS &status);
+
+/*
+ * @return true if the payload of RET_SUBMIT must be received into device_ctx::bot_cache
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool expanded(_In_ WDFREQUEST request, _In_ const URB &urb);
+
+/*
+ * RET_SUBMIT for the data phase of enlarged READ, the data were received into device_ctx::bot_cache.
+ * @param actual_length of RET_SUBMIT
+ * @param ok the transfer did not fail
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS data_received(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ ULONG actual_length, _In_ bool ok);
+
+/*
+ * RET_SUBMIT for bulk IN that was forwarded as is, CSW can be changed.
+ * @param ok the transfer did not fail
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void received(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _Inout_opt_ void *TransferBuffer, _In_ ULONG length,
+        _In_ bool ok);
+
+/*
+ * RET_SUBMIT whose request is not found, it can be for a stage that was sent ahead.
+ * @param request is set if the host's URB was bound to the stage meanwhile
+ * @return true if the payload must be received and passed to stage_received
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool claim(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum, _Out_ WDFREQUEST &request);
+
+/*
+ * @param hdr RET_SUBMIT in host byte order
+ * @param data payload of ret_submit.actual_length bytes from NonPagedPoolNx, ownership is taken
+ * @param status of receiving of the payload
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void stage_received(
+        _Inout_ device_ctx &dev, _In_ const header &hdr, _In_opt_ __drv_aliasesMem UCHAR *data, _In_ NTSTATUS status);
+
+} // namespace usbip::bot
@@ -7,6 +7,8 @@
 #include "context.tmh"
 
 #include "driver.h"
+#include "dgram.h"
+#include "mux.h"
 
 #include <libdrv\strconv.h>
 #include <libdrv\wsk_cpp.h>
@@ -74,7 +76,17 @@ PAGED void usbip::free(_In_ device_ctx_ext *ext)
         PAGED_CODE();
 
         NT_ASSERT(ext);
-        free(ext->sock);
+
+        if (ext->mux) {
+                mux::release(ext->mux); // owns sock
+        } else {
+                mux::release(ext->shaper);
+                free(ext->sock);
+        }
+
+        free(ext->prev_sock);
+
+        dgram::free(ext->dgram);
 
         libdrv::FreeUnicodeString(ext->node_name, pooltag); // @see RtlFreeUnicodeString
         libdrv::FreeUnicodeString(ext->service_name, pooltag);
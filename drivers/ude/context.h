@@ -9,6 +9,10 @@
 #include <libdrv\wdf_cpp.h>
 
 #include <usbip\proto.h>
+#include <usbip\heartbeat.h>
+#include <usbip\bdp.h>
+#include <usbip\frame_clock.h>
+#include <usbip\bot.h>
 
 #include <wdfusb.h>
 #include <UdeCx.h>
@@ -16,6 +20,11 @@
 #include <initguid.h>
 #include <usbip\vhci.h>
 
+#include "bot_cache.h"
+#include "push.h"
+#include "stream.h"
+#include "sched.h"
+
 /*
  * Macro WDF_TYPE_NAME_TO_TYPE_INFO (see WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE)
  * makes impossible to declare context type with the same name in different namespaces.
@@ -40,6 +49,9 @@ constexpr auto is_valid_port(int port)
         return port > 0 && port <= TOTAL_PORTS;
 }
 
+struct resolver_cache;
+struct pool_ctx;
+
 /*
  * Context space for WDFDEVICE, Virtual Host Controller Interface.
  * The parent is WDFDRIVER.
@@ -56,6 +68,17 @@ struct vhci_ctx
 
         _KTHREAD *attach_thread;
         KEVENT attach_thread_stop;
+
+        LIST_ENTRY connections; // @see mux_ctx::entry
+        WDFWAITLOCK connections_lock;
+
+        resolver_cache *resolver; // @see resolver::init
+        WDFWAITLOCK resolver_lock;
+
+        pool_ctx *pool; // @see pool::init
+
+        vhci::ioctl::sched_policy *sched; // @see sched::init
+        WDFSPINLOCK sched_lock; // for sched and device_ctx::sched_*
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(vhci_ctx, get_vhci_ctx)
 
@@ -67,6 +90,8 @@ inline auto get_handle(_In_ vhci_ctx *ctx)
 
 struct wsk_context;
 struct device_ctx;
+struct dgram_ctx;
+struct mux_ctx;
 
 /*
  * Context extention for device_ctx. 
@@ -84,6 +109,12 @@ struct device_ctx_ext
 {
         device_ctx *ctx;
         wsk::SOCKET *sock;
+        dgram_ctx *dgram; // optional, see dgram::accept
+        mux_ctx *mux; // optional, sock is shared with other devices, see mux::accept
+        mux_ctx *shaper; // optional, sends on own sock are scheduled with other devices of the server, see mux::shape
+        wsk::SOCKET *prev_sock; // closed, replaced by session::resume, detach can still use it
+        bool isoc_uncompacted; // EXT_ISOC_UNCOMPACTED was accepted
+        bool interrupt_push; // EXT_INTERRUPT_PUSH
 
         // from ioctl::plugin_hardware
         // .Buffer-s are allocated in PagedPool, see create_device_ctx_ext
@@ -111,12 +142,88 @@ struct device_ctx
         UDECXUSBENDPOINT ep0; // default control pipe
         WDFSPINLOCK endpoint_list_lock; // for endpoint_ctx::entry
 
-        WDFSPINLOCK send_lock; // for WskSend on sock()
+        WDFSPINLOCK send_lock; // for WskSend on sock(), mux_ctx::lock is used instead if ext->mux
+
+        int mux_flow; // index in mux_ctx::devices, see mux::get_ctx
+        LONG mux_pending; // sends that are queued or in flight, see mux::send
 
         int port; // vhci_ctx.devices[port - 1]
         seqnum_t seqnum; // @see next_seqnum
 
         volatile bool unplugged; // initiated detach that may still be ongoing
+
+        UINT32 resume_timeout_ms; // zero if the session can't be resumed, see session::init
+        bool resuming; // under send_lock, sock() is being replaced by session::resume
+
+        WDFTIMER heartbeat_timer; // NULL if ext->mux
+        hb::monitor heartbeat;
+
+        bool sockbuf_enabled; // see sockbuf::init
+        bdp::estimator sockbuf; // is accessed by recv_thread only
+        LONG64 bytes_sent; // PDUs, see sockbuf::sent
+        UINT64 bytes_received; // is accessed by recv_thread only
+        WDFSPINLOCK admission_lock; // for the fields below and endpoint_ctx::inflight_*, held_cnt
+        struct {
+                ULONG max_urbs; // zero is unlimited
+                ULONG max_bytes;
+                ULONG max_endpoint_urbs;
+                ULONG max_endpoint_bytes;
+        } admission; // see admission::init
+        WDFQUEUE held_requests; // manual, URBs over the limits, NULL if there are no limits
+        ULONG inflight_urbs; // were admitted and are not completed yet
+        UINT64 inflight_bytes; // of their transfer buffers
+        ULONG held_cnt; // in held_requests
+        bool draining; // see admission::drain
+        bool redrain;
+
+        WDFSPINLOCK frame_lock; // for frame_clock, paced
+        frame::clock frame_clock; // synchronized by RET_SUBMIT of isochronous transfers
+        LIST_ENTRY paced; // wsk_context::mux_entry, sorted by wsk_context::send_at
+        KTIMER pace_timer;
+        KDPC pace_dpc; // see device::pace_dpc
+        UINT32 pace_lead_us; // CMD_SUBMIT with explicit StartFrame arrives that earlier, zero disables pacing
+
+        WDFSPINLOCK bot_lock; // for the fields below
+        bot::readahead bot_ra; // of Bulk-Only mass storage interface, see bot_cache.h
+        UCHAR bot_in; // bEndpointAddress, zero if there is no such interface
+        UCHAR bot_out;
+        UCHAR *bot_cache; // NonPagedPoolNx, allocated by bot::enable
+        ULONG bot_cache_size; // zero disables read-ahead
+        bool bot_pipelining;
+        bot::pipeline bot_pipe;
+        bot::stage bot_stages[bot::pipeline::max_stages];
+
+        bool suspend_passthrough; // see suspend.h
+        bool suspended; // under requests_lock as well as the fields below
+        bool wake_armed;
+        bool wake_signaled; // once per suspend
+        UINT64 suspended_at; // KeQueryInterruptTime
+        UINT64 suspended_time; // of the previous periods, 100-nanosecond units
+        ULONG wake_interface; // of SuperSpeed function that can wake, see function_suspend_and_wake
+        bool function_wake;
+
+        WDFSPINLOCK push_lock; // for push_subs
+        WDFQUEUE push_requests; // manual, URBs that wait for pushed reports, NULL if EXT_INTERRUPT_PUSH was not accepted
+        push::subscription push_subs[push::max_subscriptions];
+
+        ULONG stream_reads; // zero disables bulk IN streaming, see stream.h
+        WDFSPINLOCK stream_lock; // for streams
+        WDFQUEUE stream_requests; // manual, URBs that wait for streamed data, NULL if streaming is disabled
+        stream::state streams[stream::max_streams];
+
+        int sched_rule; // of the receive thread, -1 if there is no such rule, see sched::apply
+        LONG sched_priority; // zero keeps the default
+        KAFFINITY sched_affinity; // zero keeps the default
+        struct {
+                UCHAR cls;
+                UCHAR subclass;
+        } sched_intfs[sched::max_interfaces]; // of the selected configuration
+        int sched_intf_cnt;
+        LONG sched_gen; // is incremented if the receive thread must apply the fields above
+        LONG sched_applied; // sched_gen that was applied, is accessed by recv_thread only
+        KPRIORITY recv_default_priority; // is accessed by recv_thread only
+        KPRIORITY recv_priority; // current, see sched::update_thread
+
         KEVENT detach_completed;
 
         WDFWAITLOCK delete_lock; // serialize UdecxUsbDevicePlugOutAndDelete and UDECX_USB_DEVICE_STATE_CHANGE_CALLBACKS
@@ -127,6 +234,30 @@ struct device_ctx
         // statistics
         UINT64 sent_requests; // were sent successfully
         UINT64 cancelable_requests; // marked as
+        LONG64 unlink_bursts; // WskSend-s of batched CMD_UNLINK, see endpoint_purge, are updated concurrently
+        LONG64 unlinked_requests; // by these bursts
+        LONG max_unlink_burst;
+        ULONG resumed_sessions; // see session::resume
+        ULONG heartbeat_probes; // were sent
+        ULONG heartbeat_failures; // the connection was aborted because probes were not answered
+        ULONG sockbuf_changes; // SO_RCVBUF/SO_SNDBUF were set
+        ULONG max_inflight_urbs; // high-water marks of admission control
+        UINT64 max_inflight_bytes;
+        ULONG max_held;
+        UINT64 held_total; // requests that were held
+        ULONG paced_submits; // CMD_SUBMIT-s that were delayed to arrive just in time
+        LONG64 isoc_in_urbs; // are updated by TCP and datagram receive threads
+        LONG64 isoc_moved_bytes; // to restore the offsets of compacted isochronous IN data
+        ULONG suspends;
+        ULONG remote_wakes;
+        UINT64 parked_urbs; // interrupt IN URBs that were unlinked while suspended, under requests_lock
+        UINT64 pushed_reports; // see push::received
+        UINT64 stream_transfers; // streamed reads that were completed, under stream_lock as well as the fields below
+        UINT64 stream_bytes;
+        UINT64 stream_throttled; // reads that were held back because the ring was full
+        UINT64 completion_batches; // see batch::flush
+        UINT64 batched_urbs; // were completed by these batches
+        ULONG max_completion_batch;
 
         _KTHREAD *recv_thread;
 };        
@@ -155,6 +286,14 @@ struct endpoint_ctx
 
         USBD_PIPE_HANDLE PipeHandle;
         LIST_ENTRY entry; // list head if default control pipe, protected by device_ctx::endpoint_list_lock
+
+        usbip::header submit; // CMD_SUBMIT template in network byte order, see make_cmd_submit_template
+
+        ULONG inflight_urbs; // see admission.h, protected by device_ctx::admission_lock
+        UINT64 inflight_bytes;
+        ULONG held_cnt;
+
+        LONG transport; // dgram_transport of isochronous endpoint, is chosen by its first URB, see dgram::acquire
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(endpoint_ctx, get_endpoint_ctx)
 
@@ -174,6 +313,15 @@ struct request_ctx
         UDECXUSBENDPOINT endpoint;
         seqnum_t seqnum;
         bool cancelable;
+        bool dgram; // was sent over UDP, see dgram::send
+        UINT64 expire_at; // microseconds since boot, datagram request is completed as lost after that
+        UINT64 sent_at; // KeQueryInterruptTime, see sockbuf::received
+        bool admitted; // is counted by admission::admit
+        ULONG admitted_bytes;
+        bool asap; // isochronous transfer was sent with USBD_START_ISO_TRANSFER_ASAP, see frame::clock
+        bool bot_expand; // the data phase of enlarged READ, see bot::submit
+        seqnum_t unlink_seqnum; // of CMD_UNLINK if the request was parked, see suspend::enter
+        bool unlinked; // RET_UNLINK was received, the server dropped the request
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(request_ctx, get_request_ctx)
 
@@ -14,6 +14,19 @@
 #include "wsk_receive.h"
 #include "ioctl.h"
 #include "vhci.h"
+#include "dgram.h"
+#include "mux.h"
+#include "session.h"
+#include "heartbeat.h"
+#include "sockbuf.h"
+#include "admission.h"
+#include "bot_cache.h"
+#include "suspend.h"
+#include "push.h"
+#include "stream.h"
+#include "sched.h"
+#include "proto.h"
+#include "persistent.h"
 
 #include <libdrv/dbgcommon.h>
 #include <libdrv/wait_timeout.h>
@@ -76,6 +89,21 @@ PAGED void device_cleanup(_In_ WDFOBJECT Object)
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x, cancelable(%!UINT64!) / sent(%!UINT64!) requests",
                 ptr04x(device), dev.cancelable_requests, dev.sent_requests);
 
+        if (auto n = dev.unlink_bursts) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, unlinked %I64d requests by %I64d bursts, max burst %ld",
+                        ptr04x(device), dev.unlinked_requests, n, dev.max_unlink_burst);
+        }
+
+        if (auto n = dev.suspends) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, suspended %lu time(s) for %!UINT64! ms, "
+                        "%!UINT64! URB(s) parked, %lu remote wake(s)", 
+                        ptr04x(device), n, suspend::suspended_ms(dev), dev.parked_urbs, dev.remote_wakes);
+        }
+
+        bot::free(dev);
+        push::free(dev);
+        stream::free(dev);
+
         // all resources must be freed except for device_ctx_ext*
         NT_ASSERT(IsListEmpty(&dev.requests));
         NT_ASSERT(dev.unplugged);
@@ -174,8 +202,26 @@ void endpoint_purge(_In_ UDECXUSBENDPOINT endpoint)
 
         TraceDbg("dev %04x, endp %04x, queue %04x", ptr04x(endp.device), ptr04x(endpoint), ptr04x(endp.queue));
 
+        admission::purge(dev, endpoint); // completions of the requests below must not send held ones
+        device::flush_paced(dev, endpoint);
+        dgram::flush(dev, endpoint);
+        bot::reset(dev, endp);
+        push::reset(dev, endpoint);
+        stream::reset(dev, endpoint);
+
+        WDFREQUEST requests[device::max_unlink_burst];
+        ULONG cnt = 0;
+
         while (auto request = device::remove_request(dev, endpoint)) {
-                device::send_cmd_unlink_and_cancel(endp.device, request);
+                requests[cnt++] = request;
+                if (cnt == ARRAYSIZE(requests)) {
+                        device::send_cmd_unlink_and_cancel(endp.device, requests, cnt);
+                        cnt = 0;
+                }
+        }
+
+        if (cnt) {
+                device::send_cmd_unlink_and_cancel(endp.device, requests, cnt);
         }
 
         auto purge_complete = [] ([[maybe_unused]] auto queue, auto ctx) // EVT_WDF_IO_QUEUE_STATE
@@ -209,6 +255,8 @@ _IRQL_requires_same_
 NTSTATUS d0_entry(_In_ WDFDEVICE vhci, _In_ UDECXUSBDEVICE dev)
 {
         TraceDbg("vhci %04x, dev %04x", ptr04x(vhci), ptr04x(dev));
+
+        suspend::leave(*get_device_ctx(dev));
         return STATUS_SUCCESS;
 }
 
@@ -224,18 +272,24 @@ _IRQL_requires_same_
 NTSTATUS d0_exit(_In_ WDFDEVICE vhci, _In_ UDECXUSBDEVICE dev, _In_ UDECX_USB_DEVICE_WAKE_SETTING WakeSetting)
 {
         TraceDbg("vhci %04x, dev %04x, %!UDECX_USB_DEVICE_WAKE_SETTING!", ptr04x(vhci), ptr04x(dev), WakeSetting);
+
+        auto &ctx = *get_device_ctx(dev);
+        bool can_wake{};
         
         switch (WakeSetting) {
         case UdecxUsbDeviceWakeDisabled:
                 break;
         case UdecxUsbDeviceWakeEnabled:
-                NT_ASSERT(get_device_ctx(dev)->speed() < USB_SPEED_SUPER);
+                NT_ASSERT(ctx.speed() < USB_SPEED_SUPER);
+                can_wake = true;
                 break;
         case UdecxUsbDeviceWakeNotApplicable: // SuperSpeed device
-                NT_ASSERT(get_device_ctx(dev)->speed() >= USB_SPEED_SUPER);
+                NT_ASSERT(ctx.speed() >= USB_SPEED_SUPER);
+                can_wake = ctx.function_wake;
                 break;
         }
 
+        suspend::enter(ctx, can_wake);
         return STATUS_SUCCESS;
 }
 
@@ -254,14 +308,19 @@ NTSTATUS function_suspend_and_wake(
         TraceDbg("vhci %04x, dev %04x, Interface %lu, %!UDECX_USB_DEVICE_FUNCTION_POWER!", 
                   ptr04x(vhci), ptr04x(dev), Interface, FunctionPower);
 
-        NT_ASSERT(get_device_ctx(dev)->speed() >= USB_SPEED_SUPER);
+        auto &ctx = *get_device_ctx(dev);
+        NT_ASSERT(ctx.speed() >= USB_SPEED_SUPER);
 
         switch (FunctionPower) {
         case UdecxUsbDeviceFunctionNotSuspended:
-                break;
         case UdecxUsbDeviceFunctionSuspendedCannotWake:
+                if (ctx.wake_interface == Interface) {
+                        ctx.function_wake = false;
+                }
                 break;
         case UdecxUsbDeviceFunctionSuspendedCanWake:
+                ctx.wake_interface = Interface; // see suspend::completed
+                ctx.function_wake = true;
                 break;
         }
 
@@ -376,6 +435,8 @@ PAGED NTSTATUS endpoint_add(_In_ UDECXUSBDEVICE device, _In_ UDECX_USB_ENDPOINT_
                 dev.ep0 = endpoint;
         }
 
+        make_cmd_submit_template(endp.submit, dev, endp.descriptor); // endpoints are recreated on reconfiguration
+
         if (auto err = create_endpoint_queue(endp.queue, endpoint)) {
                 return err;
         }
@@ -561,6 +622,10 @@ PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
                 &dev.send_lock,
                 &dev.endpoint_list_lock,
                 &dev.requests_lock,
+                &dev.frame_lock,
+                &dev.bot_lock,
+                &dev.push_lock,
+                &dev.stream_lock,
         };
 
         for (auto i: v) {
@@ -576,6 +641,18 @@ PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
         InitializeListHead(&dev.requests);
         KeInitializeEvent(&dev.detach_completed, NotificationEvent, false);
 
+        InitializeListHead(&dev.paced);
+        KeInitializeTimer(&dev.pace_timer);
+        KeInitializeDpc(&dev.pace_dpc, device::pace_dpc, &dev);
+        dev.pace_lead_us = get_parameter(isoch_lead_time_value_name, 2*frame::us_per_frame);
+
+        const ULONG max_bot_cache = 16*1024*1024;
+        dev.bot_cache_size = min(get_parameter(bot_readahead_value_name, 0), max_bot_cache);
+        dev.bot_pipelining = get_parameter(bot_pipelining_value_name, 0);
+        dev.suspend_passthrough = get_parameter(suspend_passthrough_value_name, 0);
+        dev.stream_reads = min(get_parameter(bulk_stream_reads_value_name, 0), ULONG(stream::max_reads));
+        dev.sched_rule = -1;
+
         return STATUS_SUCCESS;
 }
 
@@ -624,12 +701,32 @@ PAGED auto detach(_In_ UDECXUSBDEVICE device)
         auto &dev = *get_device_ctx(device);
 	NT_ASSERT(dev.unplugged);
 
-        if (close_socket(dev.sock())) {
+        heartbeat::stop(dev);
+
+        device::flush_paced(dev); // defer() does not add after that
+        dgram::flush(dev); // dgram::send does not hold after that
+        KeCancelTimer(&dev.pace_timer);
+        KeFlushQueuedDpcs();
+
+        auto shared = dev.ext->mux;
+
+        if (shared || dev.ext->shaper) {
+                mux::detach(dev); // the last device closes a shared connection
+        }
+
+        if (shared) {
+                device_state_changed(dev, vhci::state::disconnected);
+        } else if (close_socket(dev.sock())) {
                 Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection closed", ptr04x(device));
                 device_state_changed(dev, vhci::state::disconnected);
         }
 
-        auto thread = recv_thread_join(device, dev);
+        dgram::close(dev);
+        auto thread = shared ? nullptr : recv_thread_join(device, dev);
+
+        bot::cancel(dev); // CMD_UNLINK-s are not sent
+        push::cancel(dev, STATUS_CANCELLED);
+        stream::cancel(dev, STATUS_CANCELLED);
 
         auto port = vhci::reclaim_roothub_port(device);
         if (port) {
@@ -706,7 +803,7 @@ PAGED auto wait_detach(_In_ UDECXUSBDEVICE device, _In_opt_ LARGE_INTEGER *timeo
 
 constexpr auto wait_detach_timeout()
 {
-        return make_timeout(30*wdm::second, wdm::period::relative);
+        return make_timeout(device::detach_timeout, wdm::period::relative);
 }
 
 } // namespace
@@ -747,6 +844,27 @@ PAGED NTSTATUS usbip::device::create(_Out_ UDECXUSBDEVICE &device, _In_ WDFDEVIC
                 return err;
         }
 
+        if (auto err = heartbeat::init(device, ctx)) {
+                return err;
+        }
+
+        if (auto err = admission::init(device, ctx)) {
+                return err;
+        }
+
+        if (auto err = push::init(device, ctx)) {
+                return err;
+        }
+
+        if (auto err = stream::init(device, ctx)) {
+                return err;
+        }
+
+        sched::apply(ctx);
+
+        sockbuf::init(ctx);
+
+        session::init(ctx);
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x", ptr04x(device));
         return STATUS_SUCCESS;
 }
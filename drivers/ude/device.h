@@ -6,6 +6,7 @@
 
 #include <libdrv\codeseg.h>
 #include <libdrv\wdf_cpp.h>
+#include <libdrv\wait_timeout.h>
 
 #include <usb.h>
 #include <wdfusb.h>
@@ -32,6 +33,8 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS async_detach_nowait(_In_ UDECXUSBDEVICE device);
 
+constexpr auto detach_timeout = 30*wdm::second; // for device_ctx::detach_completed
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS async_detach_and_wait(_In_ UDECXUSBDEVICE device);
@@ -14,6 +14,14 @@
 #include "proto.h"
 #include "network.h"
 #include "ioctl.h"
+#include "dgram.h"
+#include "mux.h"
+#include "sockbuf.h"
+#include "admission.h"
+#include "bot_cache.h"
+#include "push.h"
+#include "stream.h"
+#include "batch.h"
 
 #include "filter_request.h"
 #include <ude_filter\request.h>
@@ -27,6 +35,7 @@
 #include <libdrv\usb_util.h>
 #include <libdrv\dbgcommon.h>
 #include <libdrv\usbd_helper.h>
+#include <libdrv\usb_frame.h>
 
 namespace
 {
@@ -53,6 +62,12 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
         TraceWSK("req %04x -> wsk irp %04x, %!STATUS!, Information %Iu", 
                   ptr04x(request), ptr04x(wsk_irp), wsk.Status, wsk.Information);
 
+        if (ctx->is_dgram) {
+                dgram::release(dev);
+        } else if (NT_SUCCESS(wsk.Status)) {
+                sockbuf::sent(dev, wsk.Information);
+        }
+
         if (!request) {
                 // nothing to do
         } else if (NT_SUCCESS(wsk.Status)) {
@@ -67,20 +82,47 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
                 TraceDbg("req %04x not found, could not complete", ptr04x(request));
         }
 
-        if (wsk.Status == STATUS_FILE_FORCED_CLOSED && !dev.unplugged) {
+        if (wsk.Status == STATUS_FILE_FORCED_CLOSED && !(dev.unplugged || dev.resume_timeout_ms)) { // see session::resume
                 auto device = get_handle(&dev);
                 TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(device), wsk.Status);
                 device::async_detach_nowait(device);
         }
 
+        if (!ctx->is_dgram && mux::get_ctx(dev)) {
+                mux::sent(dev); // must be the last access to dev
+        }
+
         return StopCompletion;
 }
 
+/*
+ * ctx.hdr is in network byte order.
+ * @see get_total_size
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_total_size(_In_ const wsk_context &ctx)
+{
+        auto &hdr = ctx.hdr;
+        size_t len = sizeof(hdr);
+
+        if (hdr.command == RtlUlongByteSwap(CMD_SUBMIT) && is_transfer_dir_out(hdr)) {
+                len += RtlUlongByteSwap(hdr.cmd_submit.transfer_buffer_length);
+        }
+
+        if (ctx.is_isoc) {
+                len += number_of_packets(ctx)*sizeof(*ctx.isoc);
+        }
+
+        return len;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_ const URB *transfer_buffer)
 {
         NT_ASSERT(!ctx.mdl_buf);
+        static_assert(!direction::out); // is_transfer_dir_out does not depend on byte order
 
         if (transfer_buffer && is_transfer_dir_out(ctx.hdr)) { // TransferFlags can have wrong direction
                 if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, URB_BUF_LEN, IoReadAccess, *transfer_buffer)) {
@@ -91,22 +133,24 @@ auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_
 
         ctx.mdl_hdr.next(ctx.mdl_buf); // always replace tie from previous call
 
-        if (ctx.is_isoc) {
+        if (ctx.is_isoc) { // network byte order, see repack
                 NT_ASSERT(ctx.mdl_isoc);
-                byteswap(ctx.isoc, number_of_packets(ctx));
                 auto t = tail(ctx.mdl_hdr); // ctx.mdl_buf can be a chain
                 t->Next = ctx.mdl_isoc.get();
         }
 
         buf.Mdl = ctx.mdl_hdr.get();
         buf.Offset = 0;
-        buf.Length = get_total_size(ctx.hdr);
+        buf.Length = get_total_size(ctx);
 
         NT_ASSERT(verify(buf, ctx.is_isoc));
         return STATUS_SUCCESS;
 }
 
 /*
+ * Headers must be in network byte order. The completion handler will be called anyway,
+ * except if the session is being resumed, see device::cancel_send.
+ *
  * switch (wdf::Lock lck(...); auto st = send(...))
  * is not used due to unspecified evaluation order of init-statement and condition.
  * switch (init-statement; condition) {} can be treated as:
@@ -116,6 +160,80 @@ auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_
  *      switch (c) {}
  * }
  */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void transmit(_Inout_ device_ctx &dev, _Inout_ wsk_context_ptr &ctx, _In_ WSK_BUF &buf, _In_ bool udp)
+{
+        auto request = ctx->request; // can be WDF_NO_HANDLE, do not access after send
+
+        auto &c = *ctx; // dgram::send accesses it before WskSendTo only
+        auto wsk_irp = ctx->wsk_irp; // do not access ctx or wsk_irp after send
+        IoSetCompletionRoutine(wsk_irp, send_complete, ctx.release(), true, true, true);
+
+        NTSTATUS st;
+
+        if (udp) { // datagrams are atomic, send_lock is not required
+                st = dgram::send(dev, c, buf, wsk_irp);
+        } else if (mux::get_ctx(dev)) {
+                mux::send(dev, c, buf); // fair-queued with other devices of the server
+                st = STATUS_PENDING;
+        } else {
+                wdf::Lock lck(dev.send_lock); // EvtUsbEndpointPurge, EvtIoInternalDeviceControl on other queues
+
+                if (!dev.resuming) {
+                        st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp); // completion handler will be called anyway
+                } else { // resumption has started after the check in ::send or the PDU was paced, see defer
+                        lck.release();
+                        st = STATUS_RETRY;
+                        device::cancel_send(dev, &c, st); // the request can be completed by session::resume already
+                }
+        }
+        TraceWSK("req %04x -> wsk irp %04x, %Iu bytes%s, %!STATUS!", 
+                  ptr04x(request), ptr04x(wsk_irp), buf.Length, udp ? " (UDP)" : "", st);
+}
+
+/*
+ * CMD_SUBMIT is put in device_ctx::paced if it must be sent later than in a frame, see pace_dpc.
+ * The request is appended to device_ctx::requests when CMD_SUBMIT is sent, see send_paced,
+ * so it can't be completed by anyone while it is in device_ctx::paced.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto defer(_Inout_ device_ctx &dev, _Inout_ wsk_context_ptr &ctx, _In_ UDECXUSBENDPOINT endpoint, _In_ const WSK_BUF &buf)
+{
+        auto due = ctx->send_at;
+        auto now = libdrv::now_us();
+
+        if (due <= now + frame::us_per_frame) {
+                return false;
+        }
+
+        ctx->mux_buf = buf;
+        get_request_ctx(ctx->request)->endpoint = endpoint; // see flush_paced
+        auto entry = &ctx->mux_entry;
+
+        wdf::Lock lck(dev.frame_lock);
+        if (dev.unplugged) { // see detach
+                return false;
+        }
+
+        auto head = &dev.paced;
+        auto pos = head->Blink; // usually the latest
+
+        for ( ; pos != head && CONTAINING_RECORD(pos, wsk_context, mux_entry)->send_at > due; pos = pos->Blink);
+        InsertHeadList(pos, entry); // after pos
+
+        if (head->Flink == entry) {
+                auto timeout = make_timeout((due - now)*wdm::usec, wdm::period::relative);
+                KeSetTimer(&dev.pace_timer, timeout, &dev.pace_dpc);
+        }
+
+        ++dev.paced_submits;
+        ctx.release();
+
+        return true;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev,
@@ -126,29 +244,34 @@ auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_
         WSK_BUF buf{};
         if (auto err = prepare_wsk_buf(buf, *ctx, transfer_buffer)) {
                 return err;
-        } else {
+        } else if (WPP_LEVEL_FLAGS_ENABLED(TRACE_LEVEL_VERBOSE, FLAG_USBIP)) {
+                auto hdr = ctx->hdr;
+                byteswap_header(hdr, swap_dir::net2host);
+
                 char str[DBG_USBIP_HDR_BUFSZ];
                 TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "req %04x -> %Iu%s",
-                        ptr04x(request), buf.Length, dbg_usbip_hdr(str, sizeof(str), &ctx->hdr, log_setup));
+                        ptr04x(request), buf.Length, dbg_usbip_hdr(str, sizeof(str), &hdr, log_setup));
         }
 
-        if (request && endpoint) {
-                device::append_request(dev, *ctx, endpoint);
+        if (dev.resuming) { // the socket is being replaced, see session::resume
+                return STATUS_RETRY; // the caller completes the request
         }
 
-        byteswap_header(ctx->hdr, swap_dir::host2net);
+        bool udp{};
+        if (auto err = dgram::acquire(dev, endpoint, *ctx, buf, udp)) {
+                return err;
+        }
+        ctx->is_dgram = udp;
 
-        auto wsk_irp = ctx->wsk_irp; // do not access ctx or wsk_irp after send
-        IoSetCompletionRoutine(wsk_irp, send_complete, ctx.release(), true, true, true);
+        if (ctx->send_at && defer(dev, ctx, endpoint, buf)) {
+                return STATUS_PENDING;
+        }
 
-        NTSTATUS st;
-        {
-                wdf::Lock lck(dev.send_lock); // EvtUsbEndpointPurge, EvtIoInternalDeviceControl on other queues
-                st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp); // completion handler will be called anyway
+        if (request && endpoint) {
+                device::append_request(dev, *ctx, endpoint, udp);
         }
-        TraceWSK("req %04x -> wsk irp %04x, %Iu bytes, %!STATUS!", 
-                  ptr04x(request), ptr04x(wsk_irp), buf.Length, st);
 
+        transmit(dev, ctx, buf, udp);
         return STATUS_PENDING;
 }
 
@@ -238,12 +361,25 @@ auto bulk_or_interrupt_transfer(
                         r.TransferBufferLength, func);
         }
 
+        if (NTSTATUS st; push::submit(dev, endpoint, request, urb, st)) { // HID reports
+                return st;
+        }
+
+        if (NTSTATUS st; stream::submit(dev, endpoint, request, urb, st)) { // serial ports
+                return st;
+        }
+
+        auto length = r.TransferBufferLength;
+        if (NTSTATUS st; bot::submit(dev, endpoint, endp, request, urb, length, st)) { // Bulk-Only mass storage
+                return st;
+        }
+
         wsk_context_ptr ctx(&dev, request);
         if (!ctx) {
                 return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, r.TransferFlags, r.TransferBufferLength)) {
+        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp, r.TransferFlags, length)) {
                 return err;
         }
 
@@ -252,9 +388,10 @@ auto bulk_or_interrupt_transfer(
 
 /*
  * USBD_ISO_PACKET_DESCRIPTOR.Length is not used (zero) for USB_DIR_OUT transfer.
+ * The descriptors are built in network byte order.
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto repack(_In_ iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER &r)
+auto repack(_Out_ iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER &r)
 {
         ULONG length = 0;
 
@@ -264,11 +401,12 @@ auto repack(_In_ iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER &r)
                 auto next_offset = ++i < r.NumberOfPackets ? r.IsoPacket[i].Offset : r.TransferBufferLength;
 
                 if (next_offset >= offset && next_offset <= r.TransferBufferLength) {
-                        d->offset = offset;
-                        d->length = next_offset - offset;
+                        auto len = next_offset - offset;
+                        d->offset = RtlUlongByteSwap(offset);
+                        d->length = RtlUlongByteSwap(len);
                         d->actual_length = 0;
                         d->status = 0;
-                        length += d->length;
+                        length += len;
                 } else {
                         Trace(TRACE_LEVEL_ERROR, "[%lu] next_offset(%lu) >= offset(%lu) && next_offset <= r.TransferBufferLength(%lu)",
                                 i, next_offset, offset, r.TransferBufferLength);
@@ -281,7 +419,9 @@ auto repack(_In_ iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER &r)
 }
 
 /*
- * USBD_START_ISO_TRANSFER_ASAP is appended because URB_GET_CURRENT_FRAME_NUMBER is not implemented.
+ * StartFrame is the frame of the virtual clock, see libdrv::current_frame. It is translated into the frame
+ * of the server and CMD_SUBMIT is delayed to arrive just in time. USBD_START_ISO_TRANSFER_ASAP is appended
+ * until the clock is synchronized.
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
@@ -320,8 +460,26 @@ auto isoch_transfer(
                 return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, 
-                               r.TransferFlags | USBD_START_ISO_TRANSFER_ASAP, r.TransferBufferLength)) {
+        auto flags = r.TransferFlags;
+        auto start_frame = r.StartFrame;
+
+        if (!(flags & USBD_START_ISO_TRANSFER_ASAP)) {
+                wdf::Lock lck(dev.frame_lock);
+                auto &clock = dev.frame_clock;
+
+                if (!clock.synced()) {
+                        flags |= USBD_START_ISO_TRANSFER_ASAP;
+                } else {
+                        if (dev.pace_lead_us) {
+                                ctx->send_at = clock.send_at_us(start_frame, dev.pace_lead_us);
+                        }
+                        start_frame = clock.to_server(start_frame);
+                }
+        }
+
+        get_request_ctx(request)->asap = flags & USBD_START_ISO_TRANSFER_ASAP; // is not zeroed
+
+        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp, flags, r.TransferBufferLength)) {
                 return err;
         }
 
@@ -329,9 +487,9 @@ auto isoch_transfer(
                 return err;
         }
 
-        if (auto cmd = &ctx->hdr.cmd_submit) {
-                cmd->start_frame = r.StartFrame;
-                cmd->number_of_packets = r.NumberOfPackets;
+        if (auto cmd = &ctx->hdr.cmd_submit) { // network byte order
+                cmd->start_frame = RtlUlongByteSwap(start_frame);
+                cmd->number_of_packets = RtlUlongByteSwap(r.NumberOfPackets);
         }
 
         return send(endpoint, ctx, dev, false, &urb);
@@ -361,12 +519,6 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 auto usb_submit_urb(
         _In_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ endpoint_ctx &endp, _In_ WDFREQUEST request)
 {
-        if (get_request_ctx(request)) [[likely]] {
-                // NULL for some devices
-        } else if (auto err = allocate_request_ctx(request)) {
-                return err;
-        }
-
         auto &urb = get_urb(request);
         urb_function_t *handler{};
 
@@ -408,6 +560,10 @@ auto send_ep0_out(
                 return STATUS_INSUFFICIENT_RESOURCES;
         }
 
+        if (request) {
+                get_request_ctx(request)->admitted = false; // is not zeroed, see admission::release
+        }
+
         auto &ep0 = *get_endpoint_ctx(dev.ep0);
         const ULONG TransferFlags = USBD_DEFAULT_PIPE_TRANSFER | USBD_TRANSFER_DIRECTION_OUT;
 
@@ -424,6 +580,21 @@ auto send_ep0_out(
         return ::send(dev.ep0, ctx, dev, true);
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_paced(_Inout_ device_ctx &dev, _Inout_ LIST_ENTRY &head)
+{
+        while (!IsListEmpty(&head)) {
+                auto ctx = CONTAINING_RECORD(RemoveHeadList(&head), wsk_context, mux_entry);
+
+                auto endpoint = get_request_ctx(ctx->request)->endpoint; // see defer
+                device::append_request(dev, *ctx, endpoint, ctx->is_dgram); // sets sent_at for frame::clock::sample
+
+                wsk_context_ptr ptr(ctx, false);
+                transmit(dev, ptr, ctx->mux_buf, ctx->is_dgram);
+        }
+}
+
 } // namespace
 
 
@@ -451,18 +622,206 @@ void usbip::device::send_cmd_unlink_and_complete(_In_ UDECXUSBDEVICE device, _In
         auto &dev = *get_device_ctx(device);
         auto &req = *get_request_ctx(request);
 
-        TraceDbg("dev %04x, seqnum %u", ptr04x(device), req.seqnum);
+        send_cmd_unlink(dev, req.seqnum);
+        complete(request, status);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::send_cmd_unlink(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum, _In_ seqnum_t unlink_seqnum)
+{
+        auto device = get_handle(&dev);
+        TraceDbg("dev %04x, seqnum %u", ptr04x(device), seqnum);
 
         if (dev.unplugged) {
                 TraceDbg("Unplugged, do not send unlink");
         } else if (auto ctx = wsk_context_ptr(&dev, WDFREQUEST(WDF_NO_HANDLE))) {
-                set_cmd_unlink_usbip_header(ctx->hdr, dev, req.seqnum);
+                set_cmd_unlink_usbip_header(ctx->hdr, dev, seqnum);
+                if (unlink_seqnum) {
+                        ctx->hdr.seqnum = RtlUlongByteSwap(unlink_seqnum);
+                }
                 ::send(WDF_NO_HANDLE, ctx, dev, false); // ignore error
         } else {
-                Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(device), req.seqnum);
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(device), seqnum);
         }
+}
 
-        complete(request, status);
+/*
+ * The server queues it on the endpoint, the device NAKs bulk IN until it has the data.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::device::send_ahead(
+        _Inout_ device_ctx &dev, _In_ const endpoint_ctx &endp, _In_ ULONG length, _In_ seqnum_t seqnum,
+        _In_ bool subscription)
+{
+        NT_ASSERT(usb_endpoint_dir_in(endp.descriptor));
+
+        wsk_context_ptr ctx(&dev, WDFREQUEST(WDF_NO_HANDLE));
+        if (!ctx) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        const ULONG TransferFlags = USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK;
+
+        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp, TransferFlags, length)) {
+                return err;
+        }
+        ctx->hdr.seqnum = RtlUlongByteSwap(seqnum); // reserved by the caller
+
+        if (subscription) {
+                NT_ASSERT(usb_endpoint_type(endp.descriptor) == UsbdPipeTypeInterrupt);
+                auto n = RtlUlongByteSwap(static_cast<ULONG>(number_of_packets_subscription));
+                ctx->hdr.cmd_submit.number_of_packets = static_cast<INT32>(n);
+        }
+
+        return ::send(WDF_NO_HANDLE, ctx, dev, false);
+}
+
+/*
+ * CMD_UNLINK-s are sent by a single WskSend: the first header is wsk_context::hdr, the rest are placed
+ * into wsk_context::isoc buffer that is reused by the lookaside list, so a burst does not allocate anything
+ * in the steady state.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::send_cmd_unlink_and_cancel(
+        _In_ UDECXUSBDEVICE device, _In_reads_(cnt) WDFREQUEST *requests, _In_ ULONG cnt)
+{
+        NT_ASSERT(cnt && cnt <= max_unlink_burst);
+
+        auto &dev = *get_device_ctx(device);
+        TraceDbg("dev %04x, %lu request(s)", ptr04x(device), cnt);
+
+        static_assert(!(sizeof(header) % sizeof(*wsk_context::isoc)));
+        const ULONG hdr_packets = sizeof(header)/sizeof(*wsk_context::isoc);
+
+        if (dev.unplugged) {
+                TraceDbg("Unplugged, do not send unlink");
+        } else if (wsk_context_ptr ctx(&dev, WDFREQUEST(WDF_NO_HANDLE), (cnt - 1)*hdr_packets); !ctx) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, %lu request(s), wsk_context_ptr error", ptr04x(device), cnt);
+        } else {
+                auto extra = reinterpret_cast<header*>(ctx->isoc); // is not used if cnt == 1
+
+                for (ULONG i = 0; i < cnt; ++i) {
+                        auto &hdr = i ? extra[i - 1] : ctx->hdr;
+                        set_cmd_unlink_usbip_header(hdr, dev, get_request_ctx(requests[i])->seqnum);
+                }
+
+                ctx->is_isoc = false; // the buffer does not hold iso_packet_descriptor-s
+                ctx->mdl_hdr.next(cnt > 1 ? ctx->mdl_isoc.get() : nullptr);
+
+                WSK_BUF buf{ .Mdl = ctx->mdl_hdr.get(), .Length = cnt*sizeof(header) };
+                transmit(dev, ctx, buf, false);
+
+                InterlockedIncrement64(&dev.unlink_bursts);
+                InterlockedExchangeAdd64(&dev.unlinked_requests, cnt);
+
+                for (LONG max = ReadNoFence(&dev.max_unlink_burst), prev; max < LONG(cnt); max = prev) {
+                        if (prev = InterlockedCompareExchange(&dev.max_unlink_burst, cnt, max); prev == max) {
+                                break;
+                        }
+                }
+        }
+
+        if (cnt == 1) {
+                complete(*requests, STATUS_CANCELLED);
+                return;
+        }
+
+        completion_batch b{}; // endpoint purge cancels many requests at once
+        for (ULONG i = 0; i < cnt; ++i) {
+                batch::add(b, dev, requests[i], STATUS_CANCELLED);
+        }
+        batch::flush(b);
+}
+
+_Use_decl_annotations_
+void usbip::device::pace_dpc(KDPC*, void *context, void*, void*)
+{
+        auto &dev = *static_cast<device_ctx*>(context);
+
+        LIST_ENTRY due;
+        InitializeListHead(&due);
+        {
+                wdf::Lock lck(dev.frame_lock);
+                auto now = libdrv::now_us();
+
+                while (!IsListEmpty(&dev.paced)) {
+                        auto entry = dev.paced.Flink;
+
+                        if (auto t = CONTAINING_RECORD(entry, wsk_context, mux_entry)->send_at; t > now + frame::us_per_frame/2) {
+                                auto timeout = make_timeout((t - now)*wdm::usec, wdm::period::relative);
+                                KeSetTimer(&dev.pace_timer, timeout, &dev.pace_dpc);
+                                break;
+                        }
+
+                        RemoveEntryList(entry);
+                        InsertTailList(&due, entry);
+                }
+        }
+
+        send_paced(dev, due);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::cancel_send(_Inout_ device_ctx &dev, _In_ wsk_context *context, _In_ NTSTATUS status)
+{
+        wsk_context_ptr ctx(context, true); // IoSetCompletionRoutine was called
+
+        auto request = ctx->request;
+        TraceWSK("req %04x -> wsk irp %04x, %!STATUS!", ptr04x(request), ptr04x(ctx->wsk_irp), status);
+
+        if (request && device::remove_request(dev, request, false)) {
+                complete(request, status);
+        }
+}
+
+/*
+ * CMD_SUBMIT must precede CMD_UNLINK of the same seqnum, otherwise the server will not find it
+ * and the transfer buffer of the completed request will be sent later.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::flush_paced(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint)
+{
+        LIST_ENTRY paced;
+        InitializeListHead(&paced);
+        {
+                wdf::Lock lck(dev.frame_lock);
+                auto head = &dev.paced;
+
+                for (auto entry = head->Flink; entry != head; ) {
+                        auto ctx = CONTAINING_RECORD(entry, wsk_context, mux_entry);
+                        entry = entry->Flink;
+
+                        if (!endpoint || get_request_ctx(ctx->request)->endpoint == endpoint) {
+                                RemoveEntryList(&ctx->mux_entry);
+                                InsertTailList(&paced, &ctx->mux_entry);
+                        }
+                }
+        }
+
+        send_paced(dev, paced);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::device::send_heartbeat(_In_ UDECXUSBDEVICE device)
+{
+        auto &dev = *get_device_ctx(device);
+
+        wsk_context_ptr ctx(&dev, WDFREQUEST(WDF_NO_HANDLE));
+        if (!ctx) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        auto unused = next_seqnum(dev, false); // RET_UNLINK will not match any request
+        set_cmd_unlink_usbip_header(ctx->hdr, dev, unused);
+        ctx->is_probe = true;
+
+        return ::send(WDF_NO_HANDLE, ctx, dev, false);
 }
 
 _IRQL_requires_same_
@@ -597,13 +956,45 @@ void NTAPI usbip::device::internal_control(
 
         auto endpoint = get_endpoint(queue);
         auto &endp = *get_endpoint_ctx(endpoint);
-        
-        if (auto dev = get_device_ctx(endp.device); dev->unplugged) {
+        auto &dev = *get_device_ctx(endp.device);
+
+        if (dev.unplugged) {
+                UdecxUrbComplete(request, USBD_STATUS_DEVICE_GONE);
+                return;
+        }
+
+        if (get_request_ctx(request)) [[likely]] {
+                // NULL for some devices
+        } else if (auto err = allocate_request_ctx(request)) {
+                UdecxUrbCompleteWithNtStatus(request, err);
+                return;
+        }
+
+        switch (auto st = admission::admit(dev, endpoint, request)) {
+        case STATUS_SUCCESS:
+                submit_urb(dev, endpoint, request);
+                break;
+        case STATUS_PENDING: // is held
+                break;
+        default:
+                UdecxUrbCompleteWithNtStatus(request, st);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::submit_urb(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request)
+{
+        auto &endp = *get_endpoint_ctx(endpoint);
+
+        if (dev.unplugged) {
+                admission::release(request);
                 UdecxUrbComplete(request, USBD_STATUS_DEVICE_GONE);
-        } else if (auto st = usb_submit_urb(*dev, endpoint, endp, request); st != STATUS_PENDING) {
+        } else if (auto st = usb_submit_urb(dev, endpoint, endp, request); st != STATUS_PENDING) {
                 if (st) {
                         TraceDbg("%!STATUS!", st);
                 }
+                admission::release(request);
                 UdecxUrbCompleteWithNtStatus(request, st);
         }
 }
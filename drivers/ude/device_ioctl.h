@@ -10,6 +10,14 @@
 #include <wdfusb.h>
 #include <UdeCx.h>
 
+#include <usbip\proto.h>
+
+namespace usbip
+{
+        struct device_ctx;
+        struct endpoint_ctx;
+}
+
 namespace usbip::device
 {
 
@@ -24,6 +32,41 @@ inline void send_cmd_unlink_and_cancel(_In_ UDECXUSBDEVICE device, _In_ WDFREQUE
         send_cmd_unlink_and_complete(device, request, STATUS_CANCELLED);
 }
 
+/*
+ * @param unlink_seqnum of CMD_UNLINK if it is reserved by the caller, see next_seqnum
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_cmd_unlink(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum, _In_ seqnum_t unlink_seqnum = 0);
+
+/*
+ * CMD_SUBMIT of bulk or interrupt IN that is not bound to a request, see bot::submit, push::submit.
+ * @param seqnum is reserved by the caller, see next_seqnum
+ * @param subscription see EXT_INTERRUPT_PUSH
+ * @return STATUS_PENDING if it was sent
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_ahead(
+        _Inout_ device_ctx &dev, _In_ const endpoint_ctx &endp, _In_ ULONG length, _In_ seqnum_t seqnum,
+        _In_ bool subscription = false);
+
+enum { max_unlink_burst = 32 };
+
+/*
+ * CMD_UNLINK of a seqnum that is never used, the server replies with RET_UNLINK, see heartbeat.h.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_heartbeat(_In_ UDECXUSBDEVICE device);
+
+/*
+ * Batched version for EvtUsbEndpointPurge, CMD_UNLINK-s are sent by one WskSend.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_cmd_unlink_and_cancel(_In_ UDECXUSBDEVICE device, _In_reads_(cnt) WDFREQUEST *requests, _In_ ULONG cnt);
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 USB_DEFAULT_PIPE_SETUP_PACKET make_set_configuration(_In_ UCHAR ConfigurationValue);
@@ -59,6 +102,36 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS reset_port(_In_ UDECXUSBDEVICE device, _In_opt_ WDFREQUEST request);
 
+/*
+ * The context was not passed to WskSend and its completion handler will not be called,
+ * the request (if any) is completed with the status, see mux::detach.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_send(_Inout_ device_ctx &dev, _In_ wsk_context *ctx, _In_ NTSTATUS status);
+
+/*
+ * Sends CMD_SUBMIT-s of isochronous URBs that were delayed to arrive just in time, see frame::clock.
+ */
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void pace_dpc(_In_ KDPC *dpc, _In_opt_ void *context, _In_opt_ void *arg1, _In_opt_ void *arg2);
+
+/*
+ * Sends delayed CMD_SUBMIT-s of the endpoint or all of them if it is not set.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void flush_paced(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint = WDF_NO_HANDLE);
+
+/*
+ * Send URB that was admitted, see admission::admit. The request is completed if it can't be sent.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void submit_urb(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request);
+
 _Function_class_(EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
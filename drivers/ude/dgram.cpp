@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "dgram.h"
+#include "trace.h"
+#include "dgram.tmh"
+
+#include "context.h"
+#include "wsk_context.h"
+#include "wsk_receive.h"
+#include "request_list.h"
+#include "network.h"
+#include "driver.h"
+#include "ioctl.h"
+
+#include <libdrv\wsk_cpp.h>
+#include <libdrv\usbd_helper.h>
+#include <libdrv\usb_frame.h>
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto create_socket(_Out_ wsk::SOCKET* &sock, _In_ ADDRESS_FAMILY family, _Out_ USHORT &port)
+{
+        PAGED_CODE();
+        port = 0;
+
+        if (auto err = socket(sock, family, SOCK_DGRAM, IPPROTO_UDP, WSK_FLAG_DATAGRAM_SOCKET, nullptr, nullptr)) {
+                Trace(TRACE_LEVEL_ERROR, "socket %!STATUS!", err);
+                return err;
+        }
+
+        SOCKADDR_INET addr { // any address, ephemeral port
+                .si_family = family
+        };
+
+        if (auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&addr))) {
+                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = getlocaladdr(sock, reinterpret_cast<SOCKADDR*>(&addr))) {
+                Trace(TRACE_LEVEL_ERROR, "getlocaladdr %!STATUS!", err);
+                return err;
+        }
+
+        static_assert(offsetof(SOCKADDR_INET, Ipv4.sin_port) == offsetof(SOCKADDR_INET, Ipv6.sin6_port));
+        port = RtlUshortByteSwap(addr.Ipv4.sin_port);
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void discard(_Inout_ dgram_ctx* &dg)
+{
+        PAGED_CODE();
+
+        if (dg->sock) {
+                NT_VERIFY(NT_SUCCESS(wsk::close(dg->sock)));
+        }
+
+        dgram::free(dg);
+        dg = nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto send_dgram(_Inout_ device_ctx &dev, _Inout_ dgram_ctx &dg, _Inout_ wsk_context &ctx, _In_ const WSK_BUF &buf, 
+        _In_ IRP *irp)
+{
+        NT_ASSERT(buf.Mdl == ctx.mdl_hdr.get());
+
+        auto &h = ctx.dgram;
+        h.magic = RtlUlongByteSwap(dgram_magic);
+        h.devid = RtlUlongByteSwap(dev.devid());
+        h.seqnum = RtlUlongByteSwap(InterlockedIncrement(&dg.seqnum));
+
+        ctx.mdl_dgram.next(ctx.mdl_hdr.next()); // dgram_header and usbip_header are adjacent
+
+        WSK_BUF dbuf {
+                .Mdl = ctx.mdl_dgram.get(),
+                .Length = sizeof(ctx.dgram) + buf.Length
+        };
+
+        return send_to(dg.sock, &dbuf, reinterpret_cast<SOCKADDR*>(&dg.peer), irp);
+}
+
+/*
+ * Completion handlers of held contexts were set by transmit.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_held(_Inout_ device_ctx &dev, _Inout_ dgram_ctx &dg, _Inout_ LIST_ENTRY &head)
+{
+        while (!IsListEmpty(&head)) {
+                auto ctx = CONTAINING_RECORD(RemoveHeadList(&head), wsk_context, mux_entry);
+                send_dgram(dev, dg, *ctx, ctx->mux_buf, ctx->wsk_irp);
+        }
+}
+
+KDEFERRED_ROUTINE expire_dpc;
+
+_Use_decl_annotations_
+void expire_dpc(KDPC*, void *context, void*, void*)
+{
+        auto &dev = *static_cast<device_ctx*>(context);
+        auto now = libdrv::now_us();
+
+        while (auto request = device::remove_expired_request(dev, now)) {
+                InterlockedIncrement64(&dev.ext->dgram->expired_urbs);
+                dgram::complete_lost(dev, request);
+        }
+}
+
+} // namespace
+
+
+/*
+ * The extension is silently disabled on any error, isochronous transfers use TCP as usual.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::dgram::prepare(_Inout_ device_ctx_ext &ext, _Inout_ op_extensions_request &req)
+{
+        PAGED_CODE();
+        NT_ASSERT(!ext.dgram);
+
+        auto &dg = ext.dgram;
+        req.features &= ~EXT_ISOC_DATAGRAM;
+
+        dg = (dgram_ctx*)ExAllocatePoolZero(NonPagedPoolNx, sizeof(*dg), pooltag);
+        if (!dg) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate dgram_ctx");
+                return;
+        }
+
+        InitializeListHead(&dg->held);
+        KeInitializeTimer(&dg->expire_timer);
+
+        if (auto err = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &dg->lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+                discard(dg);
+        } else if (auto err = getremoteaddr(ext.sock, reinterpret_cast<SOCKADDR*>(&dg->peer))) {
+                Trace(TRACE_LEVEL_ERROR, "getremoteaddr %!STATUS!", err);
+                discard(dg);
+        } else if (create_socket(dg->sock, dg->peer.si_family, req.udp_port)) {
+                discard(dg);
+        } else {
+                req.features |= EXT_ISOC_DATAGRAM;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::dgram::accept(_Inout_ device_ctx_ext &ext, _In_ const op_extensions_reply &reply)
+{
+        PAGED_CODE();
+
+        auto &dg = ext.dgram;
+        if (!dg) {
+                return;
+        }
+
+        if (!(reply.features & EXT_ISOC_DATAGRAM && reply.udp_port)) {
+                discard(dg);
+                return;
+        }
+
+        dg->peer.Ipv4.sin_port = RtlUshortByteSwap(reply.udp_port); // the same offset for Ipv6.sin6_port
+
+        Trace(TRACE_LEVEL_INFORMATION, "%!USTR!:%!USTR!/%!USTR!, isochronous transfers use UDP, remote port %hu",
+                &ext.node_name, &ext.service_name, &ext.busid, reply.udp_port);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::dgram::recv_thread_start(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+
+        auto &dev = *get_device_ctx(device);
+        auto dg = dev.ext->dgram;
+
+        if (!dg) {
+                return STATUS_SUCCESS;
+        }
+
+        const auto access = THREAD_ALL_ACCESS;
+
+        HANDLE handle{};
+        if (auto err = PsCreateSystemThread(&handle, access, nullptr, nullptr, nullptr, dgram_recv_thread_function, device)) {
+                Trace(TRACE_LEVEL_ERROR, "PsCreateSystemThread %!STATUS!", err);
+                return err;
+        }
+
+        NT_VERIFY(NT_SUCCESS(ObReferenceObjectByHandle(handle, access, *PsThreadType, KernelMode,
+                                                       reinterpret_cast<PVOID*>(&dg->recv_thread), nullptr)));
+
+        NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
+
+        KeInitializeDpc(&dg->expire_dpc, expire_dpc, &dev);
+
+        auto period = dg->EXPIRE_PERIOD_MS;
+        auto due = make_timeout(period*wdm::msec, wdm::period::relative);
+        KeSetTimerEx(&dg->expire_timer, due, period, &dg->expire_dpc);
+
+        TraceDbg("dev %04x", ptr04x(device));
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Pending WskReceiveFrom is completed by WskCloseSocket, dgram_recv_thread_function exits.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::dgram::close(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto dg = dev.ext->dgram;
+        if (!dg) {
+                return;
+        }
+
+        KeCancelTimer(&dg->expire_timer);
+        KeFlushQueuedDpcs();
+
+        if (auto err = wsk::close(dg->sock)) {
+                Trace(TRACE_LEVEL_ERROR, "close %!STATUS!", err);
+        }
+
+        if (auto thread = (_KTHREAD*)InterlockedExchangePointer(reinterpret_cast<PVOID*>(&dg->recv_thread), nullptr)) {
+                NT_ASSERT(thread != KeGetCurrentThread());
+                NT_VERIFY(!KeWaitForSingleObject(thread, Executive, KernelMode, false, nullptr));
+                ObDereferenceObject(thread);
+        }
+
+        NT_ASSERT(IsListEmpty(&dg->held));
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, datagrams: sent %!UINT64!, received %!UINT64!, lost %!UINT64!, "
+                "rejected %!UINT64!; URBs: held %!UINT64!, lost %!UINT64!, expired %!UINT64!", ptr04x(get_handle(&dev)),
+                dg->sent_cnt, dg->received_cnt, dg->lost_cnt, dg->rejected_cnt, 
+                dg->held_cnt, dg->lost_urbs, dg->expired_urbs);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::dgram::free(_In_opt_ dgram_ctx *dg)
+{
+        PAGED_CODE();
+
+        if (dg) {
+                NT_ASSERT(!dg->recv_thread);
+                wsk::free(dg->sock);
+
+                if (dg->lock) {
+                        WdfObjectDelete(dg->lock);
+                }
+
+                ExFreePoolWithTag(dg, pooltag);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::dgram::acquire(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ const wsk_context &ctx, _In_ const WSK_BUF &buf,
+        _Out_ bool &udp)
+{
+        udp = false;
+
+        if (!(dev.ext->dgram && endpoint && ctx.is_isoc && ctx.request)) {
+                return STATUS_SUCCESS;
+        }
+
+        auto &endp = *get_endpoint_ctx(endpoint);
+        bool fits = buf.Length <= max_dgram_size - sizeof(dgram_header);
+
+        auto t = fits ? transport_udp : transport_tcp;
+        if (auto prev = InterlockedCompareExchange(&endp.transport, t, transport_none); prev != transport_none) {
+                t = static_cast<dgram_transport>(prev);
+        }
+
+        if (t == transport_tcp) {
+                return STATUS_SUCCESS;
+        } else if (!fits) {
+                Trace(TRACE_LEVEL_ERROR, "endp %04x, %lu bytes do not fit into a datagram", ptr04x(endpoint), buf.Length);
+                return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        udp = true;
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::dgram::release(_Inout_ device_ctx &dev)
+{
+        auto &dg = *dev.ext->dgram;
+        InterlockedIncrement64(&dg.sent_cnt);
+
+        wsk_context *ctx{};
+        {
+                wdf::Lock lck(dg.lock);
+                NT_ASSERT(dg.inflight > 0);
+
+                if (IsListEmpty(&dg.held)) {
+                        --dg.inflight;
+                        return;
+                }
+
+                ctx = CONTAINING_RECORD(RemoveHeadList(&dg.held), wsk_context, mux_entry); // takes the slot
+        }
+
+        send_dgram(dev, dg, *ctx, ctx->mux_buf, ctx->wsk_irp);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::dgram::send(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx, _In_ const WSK_BUF &buf, _In_ IRP *irp)
+{
+        auto &dg = *dev.ext->dgram;
+        NT_ASSERT(irp == ctx.wsk_irp);
+        {
+                wdf::Lock lck(dg.lock);
+
+                if (!(dg.inflight < dg.MAX_INFLIGHT && IsListEmpty(&dg.held)) && !dev.unplugged) { // see detach
+                        ctx.mux_buf = buf;
+                        InsertTailList(&dg.held, &ctx.mux_entry);
+                        ++dg.held_cnt;
+                        return STATUS_PENDING;
+                }
+
+                ++dg.inflight;
+        }
+
+        return send_dgram(dev, dg, ctx, buf, irp);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::dgram::flush(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint)
+{
+        auto dg = dev.ext->dgram;
+        if (!dg) {
+                return;
+        }
+
+        LIST_ENTRY held;
+        InitializeListHead(&held);
+        {
+                wdf::Lock lck(dg->lock);
+                auto head = &dg->held;
+
+                for (auto entry = head->Flink; entry != head; ) {
+                        auto ctx = CONTAINING_RECORD(entry, wsk_context, mux_entry);
+                        entry = entry->Flink;
+
+                        if (!endpoint || get_request_ctx(ctx->request)->endpoint == endpoint) {
+                                RemoveEntryList(&ctx->mux_entry);
+                                InsertTailList(&held, &ctx->mux_entry);
+                                ++dg->inflight; // can exceed MAX_INFLIGHT
+                        }
+                }
+        }
+
+        send_held(dev, *dg, held);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 usbip::dgram::expire_at(_In_ const wsk_context &ctx)
+{
+        auto duration = number_of_packets(ctx)*frame::us_per_frame; // the longest, full-speed
+        return libdrv::now_us() + duration + dgram_ctx::EXPIRE_MARGIN_US;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::dgram::complete_lost(_Inout_ device_ctx &dev, _In_ WDFREQUEST request)
+{
+        if (auto urb = try_get_urb(request); urb && is_isoch(*urb)) {
+                auto &r = urb->UrbIsochronousTransfer;
+
+                for (ULONG i = 0; i < r.NumberOfPackets; ++i) {
+                        auto &d = r.IsoPacket[i];
+                        d.Status = USBD_STATUS_ISO_NOT_ACCESSED_BY_HW;
+                        d.Length = 0;
+                }
+
+                r.ErrorCount = r.NumberOfPackets;
+                r.Hdr.Status = USBD_STATUS_ISOCH_REQUEST_FAILED;
+        }
+
+        InterlockedIncrement64(&dev.ext->dgram->lost_urbs);
+        complete(request, STATUS_UNSUCCESSFUL);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbip\proto_dgram.h>
+#include <usbip\proto_op.h>
+
+#include <wsk.h>
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace wsk
+{
+        struct SOCKET;
+}
+
+namespace usbip
+{
+
+struct device_ctx;
+struct device_ctx_ext;
+struct wsk_context;
+
+/*
+ * State of EXT_ISOC_DATAGRAM extension, see device_ctx_ext::dgram.
+ */
+struct dgram_ctx
+{
+        wsk::SOCKET *sock;
+        SOCKADDR_INET peer; // server's address for isochronous datagrams
+
+        LONG seqnum; // of the last sent datagram
+        dgram_sequence received; // is accessed by recv_thread only
+
+        WDFSPINLOCK lock; // for the members below
+        int inflight; // datagrams passed to WskSendTo and not completed yet
+        enum { MAX_INFLIGHT = 32 };
+        LIST_ENTRY held; // wsk_context::mux_entry, URBs that wait for a free slot in the order they were submitted
+        //
+
+        KTIMER expire_timer; // URBs whose RET_SUBMIT did not arrive in time, see request_ctx::expire_at
+        KDPC expire_dpc;
+        enum { EXPIRE_PERIOD_MS = 100 };
+        enum : UINT64 { EXPIRE_MARGIN_US = 500*1000 }; // round trip and queuing on the server
+
+        _KTHREAD *recv_thread;
+
+        // statistics
+        LONG64 sent_cnt;
+        UINT64 received_cnt;
+        UINT64 lost_cnt; // gaps in the sequence numbers of received datagrams
+        UINT64 rejected_cnt; // duplicate, late, malformed or not from the peer
+        LONG64 lost_urbs; // completed with USBD_STATUS_ISO_NOT_ACCESSED_BY_HW
+        LONG64 expired_urbs; // of them, RET_SUBMIT was not received before the deadline
+        UINT64 held_cnt; // URBs that waited for a free slot
+};
+
+/*
+ * Transport of an isochronous endpoint, see endpoint_ctx::transport.
+ */
+enum dgram_transport : LONG { transport_none, transport_tcp, transport_udp };
+
+} // namespace usbip
+
+
+namespace usbip::dgram
+{
+
+/*
+ * Create UDP socket and set op_extensions_request.udp_port.
+ * EXT_ISOC_DATAGRAM is cleared in op_extensions_request.features on error.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void prepare(_Inout_ device_ctx_ext &ext, _Inout_ op_extensions_request &req);
+
+/*
+ * Free device_ctx_ext::dgram if the server did not accept the extension.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void accept(_Inout_ device_ctx_ext &ext, _In_ const op_extensions_reply &reply);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS recv_thread_start(_In_ UDECXUSBDEVICE device);
+
+/*
+ * Close the socket, join recv_thread and stop the expiration of URBs.
+ * Held URBs must be sent before, see flush.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void close(_Inout_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free(_In_opt_ dgram_ctx *dg);
+
+/*
+ * All URBs of an isochronous endpoint use the same transport, it is chosen by the first URB.
+ * The server must receive CMD_SUBMIT-s of an endpoint in the order they were submitted,
+ * thus a datagram endpoint never falls back to TCP.
+ *
+ * @param udp true if the caller must send this URB by send() and call release() in the completion handler
+ * @return error if URB of a datagram endpoint does not fit into a datagram
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS acquire(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ const wsk_context &ctx, _In_ const WSK_BUF &buf,
+        _Out_ bool &udp);
+
+/*
+ * The slot of the completed datagram is passed to the first held URB.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release(_Inout_ device_ctx &dev);
+
+/*
+ * If MAX_INFLIGHT datagrams are in flight, the URB is held until a slot is released.
+ * Completion handler will be called anyway, do not access ctx after this call.
+ * @param buf is prepared for TCP stream, usbip_header must be in network byte order
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx, _In_ const WSK_BUF &buf, _In_ IRP *irp);
+
+/*
+ * Send held URBs of the endpoint regardless of MAX_INFLIGHT.
+ * CMD_SUBMIT must precede CMD_UNLINK of the same seqnum, see flush_paced.
+ * @param endpoint all endpoints if NULL
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void flush(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint = WDF_NO_HANDLE);
+
+/*
+ * @return deadline for RET_SUBMIT in microseconds since boot, see libdrv::now_us
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 expire_at(_In_ const wsk_context &ctx);
+
+/*
+ * RET_SUBMIT of the request was lost or did not arrive in time.
+ * Isochronous packets are completed with USBD_STATUS_ISO_NOT_ACCESSED_BY_HW.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_lost(_Inout_ device_ctx &dev, _In_ WDFREQUEST request);
+
+} // namespace usbip::dgram
@@ -8,6 +8,10 @@
 
 #include "endpoint_list.h"
 #include "device_ioctl.h"
+#include "bot_cache.h"
+#include "push.h"
+#include "stream.h"
+#include "sched.h"
 
 #include <ude_filter/request.h>
 
@@ -20,6 +24,9 @@ namespace
 
 using namespace usbip;
 
+/*
+ * Built-in priority boost, a rule of the scheduling policy can override it, see sched::select_interface.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 constexpr CCHAR get_priority_boost(_In_ int cls, _In_ int subclass, _In_ int proto)
@@ -69,6 +76,8 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void update_pipe_properties(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf)
 {
+        auto boost = sched::select_interface(dev, intf, get_priority_boost(intf.Class, intf.SubClass, intf.Protocol));
+
         for (ULONG i = 0; i < intf.NumberOfPipes; ++i) {
                 auto &pipe = intf.Pipes[i];
 
@@ -84,9 +93,7 @@ void update_pipe_properties(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFO
 
                 NT_ASSERT(usb_endpoint_type(endp->descriptor) == pipe.PipeType);
 
-                if (pipe.PipeType == UsbdPipeTypeControl) {
-                        //
-                } else if (auto boost = get_priority_boost(intf.Class, intf.SubClass, intf.Protocol)) {
+                if (pipe.PipeType != UsbdPipeTypeControl) {
                         endp->priority_boost = boost;
                 }
 
@@ -101,6 +108,10 @@ void update_pipe_properties(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFO
                 // endp->interface_number = intf.InterfaceNumber;
                 // endp->alternate_setting = intf.AlternateSetting;
         }
+
+        bot::enable(dev, intf);
+        push::enable(dev, intf);
+        stream::enable(dev, intf);
 }
 
 _IRQL_requires_same_
@@ -111,6 +122,10 @@ auto clear_endpoint_stall(
         if (auto endp = find_endpoint(dev, r.PipeHandle)) {
                 auto addr = endp->descriptor.bEndpointAddress;
                 pkt = device::make_clear_endpoint_stall(addr);
+                bot::invalidate(dev); // reset recovery
+                bot::cancel(dev);
+                push::reset(dev, get_endpoint(endp->queue));
+                stream::reset(dev, get_endpoint(endp->queue));
                 TraceDbg("PipeHandle %04x, bEndpointAddress %#x", ptr04x(r.PipeHandle), addr);
                 return STATUS_SUCCESS;
         }
@@ -132,6 +147,10 @@ auto select_configuration(
         }
 
         UCHAR cfg{}; // FIXME: can't pass -1 if unconfigured
+        bot::disable(dev);
+        push::disable(dev);
+        stream::disable(dev);
+        sched::clear_interfaces(dev);
 
         if (auto cd = r.ConfigurationDescriptor) { // null if unconfigured
                 cfg = cd->bConfigurationValue;
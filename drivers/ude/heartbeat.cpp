@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "heartbeat.h"
+#include "trace.h"
+#include "heartbeat.tmh"
+
+#include "context.h"
+#include "device_ioctl.h"
+#include "network.h"
+#include "persistent.h"
+
+namespace
+{
+
+using namespace usbip;
+
+inline auto now_ms() { return KeQueryInterruptTime()/wdm::msec; }
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto has_requests(_In_ device_ctx &dev)
+{
+        wdf::Lock lck(dev.requests_lock);
+        return !IsListEmpty(&dev.requests);
+}
+
+/*
+ * Abortive disconnect completes pending WskReceive, graceful one waits for the peer.
+ * The socket is closed by session::resume or detach.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void abort_connection(_In_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        SOCKET *sock{};
+        {
+                wdf::Lock lck(dev.send_lock);
+                if (!dev.resuming) {
+                        sock = dev.sock();
+                }
+        }
+
+        if (!sock) {
+                //
+        } else if (auto err = disconnect(sock, static_cast<WSK_BUF*>(nullptr), WSK_FLAG_ABORTIVE)) {
+                Trace(TRACE_LEVEL_ERROR, "disconnect %!STATUS!", err);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void start(_In_ const device_ctx &dev)
+{
+        if (auto timer = dev.heartbeat_timer; timer && dev.heartbeat.enabled() && !dev.unplugged) {
+                WdfTimerStart(timer, WDF_REL_TIMEOUT_IN_MS(dev.heartbeat.period_ms()));
+        }
+}
+
+_Function_class_(EVT_WDF_TIMER)
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void NTAPI timer_func(_In_ WDFTIMER timer)
+{
+        PAGED_CODE();
+
+        auto device = static_cast<UDECXUSBDEVICE>(WdfTimerGetParentObject(timer));
+        auto &dev = *get_device_ctx(device);
+        auto &m = dev.heartbeat;
+
+        if (dev.unplugged || dev.resuming) { // receive thread will call received() when it resumes
+                return start(dev);
+        }
+
+        switch (m.tick(now_ms(), has_requests(dev))) {
+        case hb::action::probe:
+                ++dev.heartbeat_probes;
+                if (auto err = device::send_heartbeat(device)) {
+                        Trace(TRACE_LEVEL_ERROR, "dev %04x, send_heartbeat %!STATUS!", ptr04x(device), err);
+                }
+                break;
+        case hb::action::dead:
+                ++dev.heartbeat_failures;
+                Trace(TRACE_LEVEL_WARNING, "dev %04x, %d probe(s) in a row were not answered in %lu ms, "
+                                           "aborting the connection", ptr04x(device), m.misses(), m.interval_ms());
+                abort_connection(dev);
+                break;
+        }
+
+        start(dev);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::heartbeat::init(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (dev.ext->mux) {
+                return STATUS_SUCCESS;
+        }
+
+        WDF_TIMER_CONFIG cfg;
+        WDF_TIMER_CONFIG_INIT(&cfg, timer_func);
+        cfg.AutomaticSerialization = false;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = device;
+        attr.ExecutionLevel = WdfExecutionLevelPassive; // for abort_connection
+
+        if (auto err = WdfTimerCreate(&cfg, &attr, &dev.heartbeat_timer)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfTimerCreate %!STATUS!", err);
+                return err;
+        }
+
+        auto interval_ms = get_parameter(heartbeat_interval_value_name, 0);
+        auto max_misses = get_parameter(heartbeat_misses_value_name, hb::default_max_misses);
+
+        set(dev, interval_ms, static_cast<int>(max_misses));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::heartbeat::set(_Inout_ device_ctx &dev, _In_ UINT32 interval_ms, _In_ int max_misses)
+{
+        auto &m = dev.heartbeat;
+        m.configure(interval_ms, max_misses);
+
+        TraceDbg("dev %04x, interval %lu ms, max misses %d", ptr04x(get_handle(&dev)), m.interval_ms(), m.max_misses());
+
+        received(dev);
+        start(dev);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::heartbeat::stop(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (auto timer = dev.heartbeat_timer) {
+                WdfTimerStop(timer, true);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::heartbeat::received(_Inout_ device_ctx &dev)
+{
+        dev.heartbeat.received(now_ms());
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+        struct device_ctx;
+}
+
+/*
+ * Application-level heartbeat, a dead server is detected much faster than by TCP keepalive.
+ * A probe is CMD_UNLINK of a seqnum that was never used, the server replies with RET_UNLINK.
+ * The connection is aborted if the probes are not answered, see usbip::hb::monitor.
+ * Devices that share a connection (mux_ctx) are not monitored.
+ */
+namespace usbip::heartbeat
+{
+
+/*
+ * Create the timer, the heartbeat is configured by heartbeat_interval_value_name, heartbeat_misses_value_name.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev);
+
+/*
+ * @param interval_ms zero disables the heartbeat
+ * @param max_misses the default is used if it is not positive
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set(_Inout_ device_ctx &dev, _In_ UINT32 interval_ms, _In_ int max_misses);
+
+/*
+ * Must be called before the device is deleted.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void stop(_Inout_ device_ctx &dev);
+
+/*
+ * A PDU was received from the server.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void received(_Inout_ device_ctx &dev);
+
+} // namespace usbip::heartbeat
@@ -0,0 +1,829 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "mux.h"
+#include "trace.h"
+#include "mux.tmh"
+
+#include "driver.h"
+#include "device.h"
+#include "device_ioctl.h"
+#include "endpoint_list.h"
+#include "network.h"
+#include "wsk_context.h"
+#include "wsk_receive.h"
+
+#include <libdrv\ch9.h>
+#include <libdrv\wsk_cpp.h>
+#include <libdrv\usbd_helper.h>
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+inline auto now_ms() { return KeQueryInterruptTime()/wdm::msec; }
+
+KDEFERRED_ROUTINE throttle_dpc;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_mux(_In_ LIST_ENTRY *entry)
+{
+        return *CONTAINING_RECORD(entry, mux_ctx, entry);
+}
+
+/*
+ * vhci_ctx::connections_lock must be acquired.
+ * @param shared false to find mux_ctx of the devices that have own connections, see mux::shape
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED mux_ctx* find(
+        _In_ vhci_ctx &vhci, _In_ const SOCKADDR_INET &peer, _In_ UINT32 session = 0, _In_ bool shared = true)
+{
+        PAGED_CODE();
+
+        for (auto head = &vhci.connections, entry = head->Flink; entry != head; entry = entry->Flink) {
+                auto &m = get_mux(entry);
+                if (!m.broken && bool(m.sock) == shared && same_peer(m.peer, peer) && 
+                    (!session || m.session == session)) {
+                        return &m;
+                }
+        }
+
+        return nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto create(_Out_ mux_ctx* &result, _In_ WDFDEVICE vhci, _In_ wsk::SOCKET *sock, _In_ const SOCKADDR_INET &peer)
+{
+        PAGED_CODE();
+
+        auto m = (mux_ctx*)ExAllocatePoolZero(NonPagedPoolNx, sizeof(mux_ctx), pooltag);
+        result = m;
+
+        if (!m) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate mux_ctx");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        m->vhci = vhci;
+        m->refs = 1;
+        m->sock = sock;
+        m->peer = peer;
+
+        InitializeListHead(&m->entry);
+
+        for (auto &v: m->queues) {
+                for (auto &q: v) {
+                        InitializeListHead(&q);
+                }
+        }
+
+        KeInitializeTimer(&m->throttle_timer);
+        KeInitializeDpc(&m->throttle_dpc, throttle_dpc, m);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = vhci;
+
+        if (auto err = WdfSpinLockCreate(&attr, &m->lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = WdfWaitLockCreate(&attr, &m->dispatch_lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWaitLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void destroy(_In_ mux_ctx *m)
+{
+        PAGED_CODE();
+
+        NT_ASSERT(!m->refs);
+        NT_ASSERT(!m->recv_thread);
+        NT_ASSERT(IsListEmpty(&m->entry));
+
+        KeCancelTimer(&m->throttle_timer);
+        KeFlushQueuedDpcs();
+
+        wsk::free(m->sock);
+
+        if (m->lock) {
+                WdfObjectDelete(m->lock);
+        }
+
+        if (m->dispatch_lock) {
+                WdfObjectDelete(m->dispatch_lock);
+        }
+
+        ExFreePoolWithTag(m, pooltag);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto recv_thread_start(_Inout_ mux_ctx &m)
+{
+        PAGED_CODE();
+        const auto access = THREAD_ALL_ACCESS;
+
+        HANDLE handle{};
+        if (auto err = PsCreateSystemThread(&handle, access, nullptr, nullptr, nullptr, mux_recv_thread_function, &m)) {
+                Trace(TRACE_LEVEL_ERROR, "PsCreateSystemThread %!STATUS!", err);
+                return err;
+        }
+
+        NT_VERIFY(NT_SUCCESS(ObReferenceObjectByHandle(handle, access, *PsThreadType, KernelMode,
+                                                       reinterpret_cast<PVOID*>(&m.recv_thread), nullptr)));
+
+        NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
+
+        TraceDbg("session %#x", m.session);
+        return STATUS_SUCCESS;
+}
+
+/*
+ * m.lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+wsk_context* dequeue(_Inout_ mux_ctx &m)
+{
+        auto head_size = [&m] (mux::pclass cls, int flow) -> UINT32
+        {
+                if (!m.sock && m.flow_inflight[flow] >= m.MAX_INFLIGHT) {
+                        return 0; // the flow is activated again by sent()
+                }
+
+                auto &q = m.queues[int(cls)][flow];
+                return IsListEmpty(&q) ? 0 : CONTAINING_RECORD(q.Flink, wsk_context, mux_entry)->mux_buf.Length;
+        };
+
+        auto d = m.sched.next(head_size, now_ms());
+        if (d.flow < 0) {
+                return nullptr;
+        }
+
+        auto entry = RemoveHeadList(&m.queues[int(d.cls)][d.flow]);
+        --m.queued;
+        ++m.flow_inflight[d.flow];
+
+        return CONTAINING_RECORD(entry, wsk_context, mux_entry);
+}
+
+/*
+ * For a send that was not passed to WskSend, see mux::sent.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel(_Inout_ device_ctx &dev, _In_ wsk_context &ctx, _In_ NTSTATUS status = STATUS_CANCELLED)
+{
+        device::cancel_send(dev, &ctx, status);
+
+        [[maybe_unused]] auto n = InterlockedDecrement(&dev.mux_pending);
+        NT_ASSERT(n >= 0);
+}
+
+/*
+ * m.lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void completed(_Inout_ mux_ctx &m, _In_ int flow)
+{
+        NT_ASSERT(m.inflight > 0);
+        --m.inflight;
+
+        if (m.flow_inflight[flow]-- == m.MAX_INFLIGHT && !m.sock) { // was deactivated by dequeue
+                for (int c = 0; c < mux::pclass_cnt; ++c) {
+                        if (!IsListEmpty(&m.queues[c][flow])) {
+                                m.sched.activate(flow, static_cast<mux::pclass>(c));
+                        }
+                }
+        }
+}
+
+/*
+ * For a send that was dequeued, but was not passed to WskSend.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unsent(_Inout_ mux_ctx &m, _Inout_ device_ctx &dev, _In_ wsk_context &ctx, _In_ NTSTATUS status)
+{
+        {
+                wdf::Lock lck(m.lock);
+                completed(m, dev.mux_flow);
+        }
+
+        cancel(dev, ctx, status); // must be the last access to dev
+}
+
+/*
+ * The limit of WskSend-s is per connection, a device that has own connection does not delay the others.
+ * m.lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+inline auto can_send(_In_ const mux_ctx &m)
+{
+        return !m.sock || m.inflight < m.MAX_INFLIGHT;
+}
+
+/*
+ * Only one thread calls WskSend at a time, the order of PDUs of each device is preserved
+ * and the lock is not held while WskSend is called. If WskSend completes inline, sent() sees
+ * that m.sending is set and just decrements m.inflight.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void pump(_Inout_ mux_ctx &m)
+{
+        while (true) {
+                wsk_context *ctx{};
+                {
+                        wdf::Lock lck(m.lock);
+                        NT_ASSERT(m.sending);
+
+                        if (can_send(m)) {
+                                ctx = dequeue(m);
+                        }
+
+                        if (!ctx) {
+                                if (can_send(m) && m.sched.throttled()) {
+                                        auto ms = m.sched.wait_ms();
+                                        auto due = make_timeout((ms ? ms : 1)*wdm::msec, wdm::period::relative);
+                                        KeSetTimer(&m.throttle_timer, due, &m.throttle_dpc);
+                                }
+                                m.sending = false;
+                                return;
+                        }
+
+                        ++m.inflight;
+                }
+
+                auto &dev = *ctx->dev;
+                auto wsk_irp = ctx->wsk_irp; // do not access ctx after send
+                auto len = ctx->mux_buf.Length;
+
+                NTSTATUS st;
+
+                if (m.sock) {
+                        st = send(m.sock, &ctx->mux_buf, WSK_FLAG_NODELAY, wsk_irp); // completion handler will be called anyway
+                } else if (wdf::Lock lck(dev.send_lock); !dev.resuming) { // own connection, see mux::shape
+                        st = send(dev.sock(), &ctx->mux_buf, WSK_FLAG_NODELAY, wsk_irp);
+                } else { // the socket is being replaced, see session::resume
+                        lck.release();
+                        st = STATUS_RETRY;
+                        unsent(m, dev, *ctx, st);
+                }
+
+                TraceWSK("wsk irp %04x, %Iu bytes, %!STATUS!", ptr04x(wsk_irp), len, st);
+        }
+}
+
+/*
+ * Start pump if there is something to send and it is not running.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void kick(_Inout_ mux_ctx &m)
+{
+        bool start{};
+        {
+                wdf::Lock lck(m.lock);
+
+                if (!m.sending && (m.sched.active_flows() || m.sched.throttled())) {
+                        m.sending = start = true;
+                }
+        }
+
+        if (start) {
+                pump(m);
+        }
+}
+
+_Use_decl_annotations_
+void throttle_dpc(KDPC*, void *context, void*, void*)
+{
+        auto &m = *static_cast<mux_ctx*>(context);
+        kick(m);
+}
+
+/*
+ * CMD_UNLINK is queued as bulk, so it can't overtake CMD_SUBMIT it refers to.
+ * A heartbeat probe does not refer to any, it must not be delayed by the token buckets.
+ * CMD_SUBMIT is classified by the endpoint in its header, it can be sent without a request, see send_ahead.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto classify(_In_ device_ctx &dev, _In_ const wsk_context &ctx)
+{
+        auto &hdr = ctx.hdr; // network byte order
+
+        if (ctx.is_probe) {
+                return mux::pclass::interactive;
+        } else if (hdr.command != RtlUlongByteSwap(CMD_SUBMIT)) {
+                return mux::pclass::bulk;
+        }
+
+        auto ep = static_cast<UINT8>(RtlUlongByteSwap(hdr.ep));
+        if (!ep) {
+                return mux::pclass::interactive; // EP0
+        }
+
+        const endpoint_ctx *endp{};
+
+        if (auto req = ctx.request ? get_request_ctx(ctx.request) : nullptr) {
+                endp = get_endpoint_ctx(req->endpoint); // the same endpoint, do not search
+        } else {
+                auto addr = is_transfer_dir_out(hdr) ? ep : static_cast<UINT8>(ep | USB_ENDPOINT_DIRECTION_MASK);
+                endp = find_endpoint(dev, addr);
+        }
+
+        if (!endp) {
+                return mux::pclass::bulk; // the endpoint was removed
+        }
+
+        switch (usb_endpoint_type(endp->descriptor)) {
+        case UsbdPipeTypeIsochronous:
+                return mux::pclass::isoch;
+        case UsbdPipeTypeBulk:
+                return mux::pclass::bulk;
+        default:
+                return mux::pclass::interactive;
+        }
+}
+
+/*
+ * Move queued PDUs of the device to the list, they will not be sent.
+ * m.lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void unqueue(_Inout_ mux_ctx &m, _In_ const device_ctx &dev, _Inout_ LIST_ENTRY &head)
+{
+        for (auto &v: m.queues) {
+                for (auto &q = v[dev.mux_flow]; !IsListEmpty(&q); --m.queued) {
+                        InsertTailList(&head, RemoveHeadList(&q));
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel(_Inout_ device_ctx &dev, _Inout_ LIST_ENTRY &head, _In_ NTSTATUS status)
+{
+        while (!IsListEmpty(&head)) {
+                auto ctx = CONTAINING_RECORD(RemoveHeadList(&head), wsk_context, mux_entry);
+                cancel(dev, *ctx, status);
+        }
+}
+
+/*
+ * Sends of the device that are in flight, their completion handlers access device_ctx.
+ * @param timeout_ms zero to wait until they are completed
+ * @return false if the timeout has expired
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto wait_sends(_In_ const device_ctx &dev, _In_ ULONG timeout_ms = 0)
+{
+        PAGED_CODE();
+        const ULONG period_ms = 10;
+
+        for (auto timeout = make_timeout(period_ms*wdm::millisecond, wdm::period::relative);
+             ReadNoFence(&dev.mux_pending); ) {
+                if (timeout_ms) {
+                        if (timeout_ms <= period_ms) {
+                                return false;
+                        }
+                        timeout_ms -= period_ms;
+                }
+                KeDelayExecutionThread(KernelMode, false, &timeout);
+        }
+
+        return true;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::mux::prepare(_In_ WDFDEVICE vhci, _In_ const device_ctx_ext &ext, _Inout_ op_extensions_request &req)
+{
+        PAGED_CODE();
+
+        SOCKADDR_INET peer{};
+        if (auto err = getremoteaddr(ext.sock, reinterpret_cast<SOCKADDR*>(&peer))) {
+                Trace(TRACE_LEVEL_ERROR, "getremoteaddr %!STATUS!", err);
+                req.features &= ~EXT_MULTIPLEX;
+                return;
+        }
+
+        auto &v = *get_vhci_ctx(vhci);
+        wdf::WaitLock lck(v.connections_lock);
+
+        if (auto m = find(v, peer)) {
+                req.session = m->session;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::mux::accept(
+        _In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext,
+        _In_ const op_extensions_request &req, _In_ const op_extensions_reply &reply)
+{
+        PAGED_CODE();
+        NT_ASSERT(!ext.mux);
+
+        if (!(reply.features & EXT_MULTIPLEX && reply.session)) {
+                return STATUS_SUCCESS;
+        }
+
+        SOCKADDR_INET peer{};
+        if (auto err = getremoteaddr(ext.sock, reinterpret_cast<SOCKADDR*>(&peer))) {
+                Trace(TRACE_LEVEL_ERROR, "getremoteaddr %!STATUS!", err);
+                return err;
+        }
+
+        auto &v = *get_vhci_ctx(vhci);
+        wdf::WaitLock lck(v.connections_lock);
+
+        if (reply.session != req.session) { // new session, this connection will be shared
+                mux_ctx *m{};
+                if (auto err = create(m, vhci, ext.sock, peer)) {
+                        if (m) {
+                                m->sock = nullptr; // is owned by ext
+                                m->refs = 0;
+                                destroy(m);
+                        }
+                        return err;
+                }
+
+                m->session = reply.session;
+                InsertTailList(&v.connections, &m->entry);
+
+                ext.mux = m;
+                Trace(TRACE_LEVEL_INFORMATION, "%!USTR!:%!USTR!/%!USTR!, new session %#x",
+                        &ext.node_name, &ext.service_name, &ext.busid, m->session);
+
+                return STATUS_SUCCESS;
+        }
+
+        auto m = find(v, peer, reply.session);
+        if (!m) { // the server moved the device to a connection that is closing
+                Trace(TRACE_LEVEL_ERROR, "session %#x not found", reply.session);
+                return USBIP_ERROR_PROTOCOL;
+        }
+
+        ++m->refs;
+
+        close_socket(ext.sock);
+        wsk::free(ext.sock);
+
+        ext.sock = m->sock;
+        ext.mux = m;
+
+        Trace(TRACE_LEVEL_INFORMATION, "%!USTR!:%!USTR!/%!USTR!, joined session %#x",
+                &ext.node_name, &ext.service_name, &ext.busid, m->session);
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::mux::start(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+
+        auto &dev = *get_device_ctx(device);
+        auto &m = *dev.ext->mux;
+
+        {
+                wdf::Lock lck(m.lock);
+                dev.mux_flow = m.devices.insert(dev.devid(), device);
+
+                if (dev.mux_flow != m.devices.npos) {
+                        m.sched.flow_bucket(dev.mux_flow).configure(0, 0, now_ms()); // unlimited
+                }
+        }
+
+        if (dev.mux_flow == m.devices.npos) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, devid %#x is already registered in session %#x",
+                        ptr04x(device), dev.devid(), m.session);
+                return USBIP_ERROR_ST_DEV_BUSY;
+        }
+
+        TraceDbg("dev %04x, session %#x, flow %d", ptr04x(device), m.session, dev.mux_flow);
+
+        auto &v = *get_vhci_ctx(m.vhci);
+        wdf::WaitLock lck(v.connections_lock);
+
+        return m.recv_thread ? STATUS_SUCCESS : recv_thread_start(m);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::mux::shape(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+
+        auto &dev = *get_device_ctx(device);
+        auto &ext = *dev.ext;
+        NT_ASSERT(!(ext.mux || ext.shaper));
+
+        SOCKADDR_INET peer{};
+        if (auto err = getremoteaddr(ext.sock, reinterpret_cast<SOCKADDR*>(&peer))) {
+                Trace(TRACE_LEVEL_ERROR, "getremoteaddr %!STATUS!", err);
+                return;
+        }
+
+        mux_ctx *m{};
+        {
+                auto &v = *get_vhci_ctx(dev.vhci);
+                wdf::WaitLock lck(v.connections_lock);
+
+                m = find(v, peer, 0, false);
+
+                if (m) {
+                        ++m->refs;
+                } else if (NT_SUCCESS(create(m, dev.vhci, nullptr, peer))) {
+                        InsertTailList(&v.connections, &m->entry);
+                } else {
+                        if (m) {
+                                m->refs = 0;
+                                destroy(m);
+                        }
+                        return;
+                }
+        }
+
+        {
+                wdf::Lock lck(m->lock);
+                dev.mux_flow = m->devices.insert(dev.devid(), device);
+
+                if (dev.mux_flow != m->devices.npos) {
+                        m->sched.flow_bucket(dev.mux_flow).configure(0, 0, now_ms()); // unlimited
+                }
+        }
+
+        if (dev.mux_flow == m->devices.npos) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, devid %#x is already registered", ptr04x(device), dev.devid());
+                release(m);
+                return;
+        }
+
+        ext.shaper = m;
+        TraceDbg("dev %04x, flow %d", ptr04x(device), dev.mux_flow);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::mux::detach(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto &m = *get_ctx(dev);
+        bool last{};
+
+        LIST_ENTRY unsent;
+        InitializeListHead(&unsent);
+        {
+                wdf::Lock lck(m.lock);
+                if (m.devices.get(dev.devid()) != get_handle(&dev)) {
+                        return; // is not registered, see start, shape
+                }
+
+                m.devices.erase(dev.devid());
+                last = m.devices.empty();
+
+                unqueue(m, dev, unsent); // the scheduler skips flows with empty queues
+                m.sched.flow_bucket(dev.mux_flow).configure(0, 0, now_ms());
+        }
+
+        cancel(dev, unsent, STATUS_CANCELLED);
+
+        {
+                wdf::WaitLock lck(m.dispatch_lock); // recv_thread does not process PDU of this device
+        }
+
+        if (!wait_sends(dev, m.SEND_TIMEOUT_MS)) { // the server does not read, WskSend-s are stuck
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, session %#x, sends are not completed in %lu ms, aborting connection",
+                        ptr04x(get_handle(&dev)), m.session, m.SEND_TIMEOUT_MS);
+
+                auto sock = m.sock; // recv_thread will detach all devices
+                if (!sock) {
+                        wdf::Lock lck(dev.send_lock);
+                        sock = dev.sock(); // own connection, it will be closed by the caller
+                }
+
+                if (auto err = disconnect(sock, nullptr, WSK_FLAG_ABORTIVE)) {
+                        Trace(TRACE_LEVEL_ERROR, "disconnect %!STATUS!", err);
+                }
+        }
+
+        if (!(last && m.sock)) {
+                wait_sends(dev);
+                return;
+        }
+
+        {
+                auto &v = *get_vhci_ctx(m.vhci);
+                wdf::WaitLock lck(v.connections_lock);
+
+                RemoveEntryList(&m.entry);
+                InitializeListHead(&m.entry);
+        }
+
+        if (close_socket(m.sock)) { // completes pending sends and receive
+                Trace(TRACE_LEVEL_INFORMATION, "session %#x, connection closed", m.session);
+        }
+
+        wait_sends(dev);
+
+        if (auto thread = (_KTHREAD*)InterlockedExchangePointer(reinterpret_cast<PVOID*>(&m.recv_thread), nullptr)) {
+                NT_ASSERT(thread != KeGetCurrentThread());
+                NT_VERIFY(!KeWaitForSingleObject(thread, Executive, KernelMode, false, nullptr));
+                ObDereferenceObject(thread);
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "session %#x, PDUs: sent %!UINT64!, received %!UINT64!, dropped %!UINT64!; "
+                "max queued %d", m.session, m.sent_cnt, m.received_cnt, m.dropped_cnt, m.max_queued);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::mux::release(_In_opt_ mux_ctx *m)
+{
+        PAGED_CODE();
+
+        if (!m) {
+                return;
+        }
+
+        bool last{};
+        {
+                auto &v = *get_vhci_ctx(m->vhci);
+                wdf::WaitLock lck(v.connections_lock);
+
+                if (!--m->refs) {
+                        RemoveEntryList(&m->entry); // if detach was not called
+                        InitializeListHead(&m->entry);
+                        last = true;
+                }
+        }
+
+        if (last) {
+                NT_ASSERT(m->devices.empty());
+                destroy(m);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::mux::send(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx, _In_ const WSK_BUF &buf)
+{
+        auto &m = *get_ctx(dev);
+
+        InterlockedIncrement(&dev.mux_pending);
+        ctx.mux_buf = buf;
+
+        auto cls = classify(dev, ctx); // before m.lock, find_endpoint acquires another lock
+
+        bool start{};
+        {
+                wdf::Lock lck(m.lock);
+
+                if (dev.resuming) { // see purge
+                        lck.release();
+                        cancel(dev, ctx, STATUS_RETRY);
+                        return;
+                } else if (m.devices.get(dev.devid()) != get_handle(&dev)) { // see detach
+                        lck.release();
+                        cancel(dev, ctx);
+                        return;
+                }
+
+                InsertTailList(&m.queues[int(cls)][dev.mux_flow], &ctx.mux_entry);
+                m.sched.activate(dev.mux_flow, cls);
+
+                if (++m.queued > m.max_queued) {
+                        m.max_queued = m.queued;
+                }
+
+                if (!m.sending) {
+                        m.sending = start = true;
+                }
+        }
+
+        if (start) {
+                pump(m);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::mux::purge(_Inout_ device_ctx &dev, _In_ NTSTATUS status)
+{
+        auto &m = *get_ctx(dev);
+
+        LIST_ENTRY unsent;
+        InitializeListHead(&unsent);
+        {
+                wdf::Lock lck(m.lock);
+                if (m.devices.get(dev.devid()) == get_handle(&dev)) {
+                        unqueue(m, dev, unsent);
+                }
+        }
+
+        TraceDbg("dev %04x, flow %d, %!STATUS!", ptr04x(get_handle(&dev)), dev.mux_flow, status);
+        cancel(dev, unsent, status);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::mux::sent(_Inout_ device_ctx &dev)
+{
+        auto &m = *get_ctx(dev);
+
+        bool start{};
+        {
+                wdf::Lock lck(m.lock);
+
+                completed(m, dev.mux_flow);
+                ++m.sent_cnt;
+
+                if (!m.sending && (m.sched.active_flows() || m.sched.throttled())) {
+                        m.sending = start = true;
+                }
+        }
+
+        if (start) {
+                pump(m);
+        }
+
+        [[maybe_unused]] auto n = InterlockedDecrement(&dev.mux_pending); // dev can be freed after that
+        NT_ASSERT(n >= 0);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::mux::set_rate(_Inout_ device_ctx &dev, _In_ UINT32 device_rate, _In_ UINT32 server_rate, _In_ UINT32 burst)
+{
+        auto &m = *get_ctx(dev);
+        {
+                wdf::Lock lck(m.lock);
+
+                auto now = now_ms();
+                m.sched.flow_bucket(dev.mux_flow).configure(device_rate, burst, now);
+                m.sched.link_bucket().configure(server_rate, burst, now);
+        }
+
+        TraceDbg("dev %04x, session %#x, flow %d, rate: device %lu, server %lu, burst %lu", 
+                  ptr04x(get_handle(&dev)), m.session, dev.mux_flow, device_rate, server_rate, burst);
+
+        kick(m);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UDECXUSBDEVICE usbip::mux::get_device(_In_ mux_ctx &m, _In_ UINT32 devid)
+{
+        wdf::Lock lck(m.lock);
+
+        auto device = m.devices.get(devid);
+        return device && !get_device_ctx(device)->unplugged ? device : WDF_NO_HANDLE;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::mux::detach_all(_Inout_ mux_ctx &m)
+{
+        PAGED_CODE();
+
+        {
+                auto &v = *get_vhci_ctx(m.vhci);
+                wdf::WaitLock lck(v.connections_lock); // see find
+                m.broken = true;
+        }
+
+        wdf::Lock lck(m.lock);
+
+        for (int i = 0; i < TOTAL_PORTS; ++i) {
+                if (auto device = m.devices[i]) {
+                        device::async_detach_nowait(device);
+                }
+        }
+}
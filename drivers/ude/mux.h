@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "context.h"
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbip\proto_op.h>
+#include <usbip\fair_queue.h>
+#include <usbip\shaper.h>
+
+#include <wsk.h>
+
+namespace usbip
+{
+
+/*
+ * Connection shared by the devices imported from the same host:port, see EXT_MULTIPLEX.
+ * One receive thread demultiplexes RET_SUBMIT/RET_UNLINK by header_basic.devid,
+ * sends of the devices are scheduled by priority classes, fair-queued (deficit round robin) inside a class
+ * and shaped by token buckets, see mux::set_rate.
+ *
+ * Devices that have own connections to the same host:port share a mux_ctx without a socket,
+ * only their sends are scheduled, see mux::shape.
+ *
+ * Must be allocated from nonpaged pool because of KTIMER, KDPC.
+ */
+struct mux_ctx
+{
+        LIST_ENTRY entry; // head is vhci_ctx::connections
+        WDFDEVICE vhci;
+
+        LONG refs; // device_ctx_ext-s that use this connection
+        UINT32 session; // assigned by the server
+        bool broken; // recv_thread has exited, new devices must not join
+
+        wsk::SOCKET *sock; // NULL if the devices have own connections
+        SOCKADDR_INET peer; // to find a connection for a new device
+
+        WDFSPINLOCK lock; // for the members below
+        mux::devid_table<UDECXUSBDEVICE, TOTAL_PORTS> devices;
+
+        LIST_ENTRY queues[mux::pclass_cnt][TOTAL_PORTS]; // wsk_context::mux_entry, [mux::pclass][device_ctx::mux_flow]
+        mux::scheduler<TOTAL_PORTS, 16*1024> sched;
+        int inflight; // WskSend-s that are not completed yet
+        int flow_inflight[TOTAL_PORTS]; // per device, is limited instead of inflight if sock is NULL
+        enum { MAX_INFLIGHT = 8 };
+        bool sending; // only one thread calls WskSend at a time, see pump
+        //
+
+        KTIMER throttle_timer; // pump when token buckets are refilled
+        KDPC throttle_dpc;
+
+        enum { SEND_TIMEOUT_MS = 5'000 }; // for WskSend-s of a device that is detaching, see detach
+
+        WDFWAITLOCK dispatch_lock; // is held by recv_thread while a PDU of a device is processed
+        _KTHREAD *recv_thread;
+
+        // statistics
+        UINT64 sent_cnt;
+        UINT64 received_cnt;
+        UINT64 dropped_cnt; // PDUs for unknown or unplugged devices
+        int max_queued; // of all devices
+        int queued;
+};
+
+} // namespace usbip
+
+
+namespace usbip::mux
+{
+
+/*
+ * Set op_extensions_request.session if there is a connection to the same server.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void prepare(_In_ WDFDEVICE vhci, _In_ const device_ctx_ext &ext, _Inout_ op_extensions_request &req);
+
+/*
+ * If the server accepted EXT_MULTIPLEX, the device joins existing connection (own socket is closed)
+ * or its connection becomes a shared one.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS accept(
+        _In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext,
+        _In_ const op_extensions_request &req, _In_ const op_extensions_reply &reply);
+
+/*
+ * Register the device for demultiplexing and start recv_thread if it is not running.
+ * It is called instead of device::recv_thread_start.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS start(_In_ UDECXUSBDEVICE device);
+
+/*
+ * Schedule sends of the device that has own connection together with the other devices of the same server.
+ * The device's sends are not shaped if it fails.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void shape(_In_ UDECXUSBDEVICE device);
+
+/*
+ * Unregister the device, cancel its queued sends and wait for ones in flight.
+ * The connection is aborted if they are not completed in SEND_TIMEOUT_MS, the last device closes a shared one.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void detach(_Inout_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void release(_In_opt_ mux_ctx *m);
+
+/*
+ * Completion handler will be called anyway or the send is cancelled if the device is detached,
+ * do not access ctx after this call.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx, _In_ const WSK_BUF &buf);
+
+/*
+ * Cancel queued sends of the device, their requests (if any) are completed with the status.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void purge(_Inout_ device_ctx &dev, _In_ NTSTATUS status);
+
+/*
+ * Must be called from the completion handler of send.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void sent(_Inout_ device_ctx &dev);
+
+/*
+ * Token buckets of the device and of its server, the rates are in bytes per second, zero is unlimited.
+ * Control and interrupt transfers are never throttled.
+ * @param burst bytes, zero for the default
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_rate(_Inout_ device_ctx &dev, _In_ UINT32 device_rate, _In_ UINT32 server_rate, _In_ UINT32 burst);
+
+/*
+ * @return registered device that is not unplugged
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UDECXUSBDEVICE get_device(_In_ mux_ctx &m, _In_ UINT32 devid);
+
+/*
+ * Is called by recv_thread on exit.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void detach_all(_Inout_ mux_ctx &m);
+
+/*
+ * @return the connection shared by the device or the scheduler of its own connection, NULL if there is none
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto get_ctx(_In_ const device_ctx &dev)
+{
+        auto &ext = *dev.ext;
+        return ext.mux ? ext.mux : ext.shaper;
+}
+
+} // namespace usbip::mux
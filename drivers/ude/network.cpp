@@ -24,9 +24,83 @@ constexpr auto make_priority( _In_ LOCK_OPERATION operation)
                 (operation == IoReadAccess ? MdlMappingNoWrite : 0UL);
 }
 
+/*
+ * TCP_NODELAY is not supported, see WSK_FLAG_NODELAY.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto set_options(_In_ wsk::SOCKET *sock)
+{
+        PAGED_CODE();
+
+        auto keepalive = [] (auto idle, auto cnt, auto intvl) constexpr { return idle + cnt*intvl; };
+
+        int idle = 0;
+        int cnt = 0;
+        int intvl = 0;
+
+        if (auto err = get_keepalive_opts(sock, &idle, &cnt, &intvl)) {
+                Trace(TRACE_LEVEL_ERROR, "get_keepalive_opts %!STATUS!", err);
+                return err;
+        }
+
+        Trace(TRACE_LEVEL_VERBOSE, "get keepalive: idle(%d sec) + cnt(%d)*intvl(%d sec) => %d sec", 
+                idle, cnt, intvl, keepalive(idle, cnt, intvl));
+
+        enum { IDLE = 30, CNT = 9, INTVL = 10 };
+
+        if (auto err = set_keepalive(sock, IDLE, CNT, INTVL)) {
+                Trace(TRACE_LEVEL_ERROR, "set_keepalive %!STATUS!", err);
+                return err;
+        }
+
+        bool optval{};
+        if (auto err = get_keepalive(sock, optval)) {
+                Trace(TRACE_LEVEL_ERROR, "get_keepalive %!STATUS!", err);
+                return err;
+        }
+
+        NT_VERIFY(!get_keepalive_opts(sock, &idle, &cnt, &intvl));
+
+        Trace(TRACE_LEVEL_VERBOSE, "set keepalive: idle(%d sec) + cnt(%d)*intvl(%d sec) => %d sec", 
+                idle, cnt, intvl, keepalive(idle, cnt, intvl));
+
+        bool ok = optval && keepalive(idle, cnt, intvl) == keepalive(IDLE, CNT, INTVL);
+        return ok ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
+
 } // namespace
 
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::create_socket(_Inout_ SOCKET* &sock, _In_ ADDRESS_FAMILY family)
+{
+        PAGED_CODE();
+        NT_ASSERT(!sock);
+
+        if (auto err = socket(sock, family, SOCK_STREAM, IPPROTO_TCP, WSK_FLAG_CONNECTION_SOCKET, nullptr, nullptr)) {
+                NT_ASSERT(!sock);
+                Trace(TRACE_LEVEL_ERROR, "socket %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = set_options(sock)) {
+                return err;
+        }
+
+        SOCKADDR_INET any { // see INADDR_ANY, IN6ADDR_ANY_INIT
+                .si_family = family
+        };
+
+        if (auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any))) {
+                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS usbip::send(_Inout_ SOCKET *sock, _In_ memory pool, _In_ void *data, _In_ ULONG len)
 {
@@ -183,3 +257,24 @@ PAGED bool usbip::close_socket(_In_ SOCKET *sock)
 
         return true;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::same_peer(_In_ const SOCKADDR_INET &a, _In_ const SOCKADDR_INET &b)
+{
+        if (a.si_family != b.si_family) {
+                return false;
+        }
+
+        switch (a.si_family) {
+        case AF_INET:
+                return a.Ipv4.sin_port == b.Ipv4.sin_port &&
+                       a.Ipv4.sin_addr.s_addr == b.Ipv4.sin_addr.s_addr;
+        case AF_INET6:
+                return a.Ipv6.sin6_port == b.Ipv6.sin6_port &&
+                       a.Ipv6.sin6_scope_id == b.Ipv6.sin6_scope_id &&
+                       RtlEqualMemory(&a.Ipv6.sin6_addr, &b.Ipv6.sin6_addr, sizeof(a.Ipv6.sin6_addr));
+        }
+
+        return false;
+}
@@ -23,6 +23,14 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED bool close_socket(_In_ SOCKET *sock);
 
+/*
+ * Create TCP socket with keepalive enabled and bind it to any local address.
+ * @param sock must be NULL, the caller must close and free it
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS create_socket(_Inout_ SOCKET* &sock, _In_ ADDRESS_FAMILY family);
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS send(_Inout_ SOCKET *sock, _In_ memory pool, _In_ void *data, _In_ ULONG len);
 
@@ -34,6 +42,13 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED USBIP_STATUS recv_op_common(_Inout_ SOCKET *sock, _In_ UINT16 expected_code);
 
+/*
+ * @return true if the addresses and the ports are equal
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool same_peer(_In_ const SOCKADDR_INET &a, _In_ const SOCKADDR_INET &b);
+
 enum : ULONG { URB_BUF_LEN = MAXULONG }; // set mdl_size to URB.TransferBufferLength
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
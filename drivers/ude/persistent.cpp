@@ -7,6 +7,8 @@
 #include "persistent.tmh"
 
 #include "context.h"
+#include "driver.h"
+#include "pool.h"
 
 #include <libdrv\strconv.h>
 #include <libdrv\wait_timeout.h>
@@ -21,7 +23,7 @@ using namespace usbip;
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto get_persistent_devices(_In_ WDFKEY key)
+PAGED auto get_multi_string(_In_ WDFKEY key, _In_ const wchar_t *name)
 {
         PAGED_CODE();
         ObjectDelete col;
@@ -39,7 +41,7 @@ PAGED auto get_persistent_devices(_In_ WDFKEY key)
         str_attr.ParentObject = col.get();
 
         UNICODE_STRING value_name;
-        RtlUnicodeStringInit(&value_name, persistent_devices_value_name);
+        RtlUnicodeStringInit(&value_name, name);
 
         if (auto err = WdfRegistryQueryMultiString(key, &value_name, &str_attr, col.get<WDFCOLLECTION>())) {
                 Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryMultiString('%!USTR!') %!STATUS!", &value_name, err);
@@ -49,6 +51,14 @@ PAGED auto get_persistent_devices(_In_ WDFKEY key)
         return col;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_persistent_devices(_In_ WDFKEY key)
+{
+        PAGED_CODE();
+        return get_multi_string(key, persistent_devices_value_name);
+}
+
 constexpr auto empty(_In_ const UNICODE_STRING &s)
 {
         return libdrv::empty(s) || !*s.Buffer;
@@ -111,31 +121,13 @@ PAGED auto make_target(_In_ WDFDEVICE vhci)
         return target;
 }
 
-constexpr auto get_delay(_In_ ULONG attempt, _In_ ULONG cnt)
+/*
+ * Retry state is kept per device, a dead server does not delay the others.
+ */
+constexpr auto get_delay(_In_ ULONG attempt)
 {
-        NT_ASSERT(cnt);
         enum { UNIT = 10, MAX_DELAY = 30*60 }; // seconds
-        return attempt > 1 ? min(UNIT*attempt/cnt, MAX_DELAY) : 0; // first two attempts without a delay
-}
-
-_IRQL_requires_same_
-_IRQL_requires_max_(APC_LEVEL)
-PAGED auto sleep(_Inout_ vhci_ctx &ctx, _In_ ULONG seconds)
-{
-        PAGED_CODE();
-        auto timeout = make_timeout(seconds*wdm::second, wdm::period::relative);
-
-        switch (auto st = KeWaitForSingleObject(&ctx.attach_thread_stop, Executive, KernelMode, false, &timeout)) {
-        case STATUS_SUCCESS:
-                TraceDbg("thread stop requested");
-                return false;
-        case STATUS_TIMEOUT:
-                break;
-        default:
-                Trace(TRACE_LEVEL_ERROR, "KeWaitForSingleObject %!STATUS!", st);
-        }
-
-        return true;
+        return attempt > 1 ? min(UNIT*attempt, MAX_DELAY) : 0; // first two attempts without a delay
 }
 
 /*
@@ -160,53 +152,263 @@ constexpr auto can_retry(_In_ NTSTATUS status)
         }
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
+{
+        PAGED_CODE();
+        
+        for (ULONG i = 0, cnt = WdfCollectionGetCount(col); i < cnt; ++i) {
+                auto item = (WDFSTRING)WdfCollectionGetItem(col, i);
+
+                UNICODE_STRING s{};
+                WdfStringGetUnicodeString(item, &s);
+                        
+                if (RtlEqualUnicodeString(&s, &str, true)) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
 /*
- * @return true - do not try to connect to this device again
+ * Refreshing allows to remove devices that constantly fail to attach.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto plugin_hardware(
-        _In_ const UNICODE_STRING &line, 
-        _In_ WDFIOTARGET target,
-        _Inout_ vhci::ioctl::plugin_hardware &req,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &input,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &output,
-        [[maybe_unused]] _In_ const ULONG outlen)
+PAGED auto is_persistent(_In_ WDFKEY key, _In_ const UNICODE_STRING &line)
 {
         PAGED_CODE();
 
-        if (auto err = parse_string(req, line)) {
-                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &line, err);
-                return true; // remove malformed string
+        auto col = get_persistent_devices(key);
+        return col && contains(col.get<WDFCOLLECTION>(), line);
+}
+
+struct attach_engine;
+
+/*
+ * A line of PersistentDevices.
+ */
+struct attach_entry
+{
+        UNICODE_STRING line; // host,service,busid; the buffer is owned by the collection
+        ULONG host_hash; // devices of the same host are attached one by one
+        ULONG attempt;
+        LONG64 due; // KeQueryInterruptTime of the next attempt
+        LONG64 started; // of the first attempt
+        enum { WAITING, INFLIGHT, DONE } state;
+};
+
+/*
+ * IOCTL_PLUGIN_HARDWARE that is sent to itself asynchronously.
+ */
+struct attach_slot
+{
+        attach_engine *engine;
+        WDFREQUEST request;
+        WDFMEMORY input;
+        WDFMEMORY output;
+        vhci::ioctl::plugin_hardware req;
+
+        attach_entry *entry; // null if the slot is free
+        NTSTATUS status;
+        volatile LONG completed;
+};
+
+/*
+ * Must be allocated from nonpaged pool, see plugin_complete.
+ */
+struct attach_engine
+{
+        KEVENT completed; // SynchronizationEvent, some slot is completed
+
+        enum { MAX_SLOTS = 8 }; // upper limit of attach_concurrency_value_name
+        attach_slot slots[MAX_SLOTS];
+        ULONG slot_cnt; // concurrency
+
+        attach_entry entries[ARRAYSIZE(vhci_ctx::devices)];
+        ULONG entry_cnt;
+
+        LONG64 t0; // KeQueryInterruptTime
+        ULONG attached;
+};
+
+constexpr auto outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(vhci::ioctl::plugin_hardware::port);
+
+inline auto to_msec(_In_ LONG64 interrupt_time)
+{
+        return static_cast<ULONG>(interrupt_time/wdm::msec);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto init(_Inout_ attach_slot &slot, _In_ attach_engine &engine, _In_ WDFIOTARGET target)
+{
+        PAGED_CODE();
+
+        slot.engine = &engine;
+        slot.req.size = sizeof(slot.req);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = target; // requests and memory objects are deleted with the target
+
+        if (auto err = WdfRequestCreate(&attr, target, &slot.request)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestCreate %!STATUS!", err);
+                return err;
+        }
+
+        attr.ParentObject = slot.request;
+
+        if (auto err = WdfMemoryCreatePreallocated(&attr, &slot.req, sizeof(slot.req), &slot.input)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreatePreallocated %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = WdfMemoryCreatePreallocated(&attr, &slot.req, outlen, &slot.output)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreatePreallocated %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Malformed lines are skipped.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void init_entries(_Inout_ attach_engine &engine, _In_ WDFCOLLECTION devices, _In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+
+        for (ULONG i = 0, cnt = WdfCollectionGetCount(devices); i < cnt && engine.entry_cnt < ARRAYSIZE(engine.entries); ++i) {
+
+                auto &e = engine.entries[engine.entry_cnt];
+                WdfStringGetUnicodeString((WDFSTRING)WdfCollectionGetItem(devices, i), &e.line);
+
+                UNICODE_STRING host;
+                UNICODE_STRING tail;
+                libdrv::split(host, tail, e.line, L',');
+
+                if (empty(host)) {
+                        Trace(TRACE_LEVEL_ERROR, "'%!USTR!' malformed", &e.line);
+                } else if (auto err = RtlHashUnicodeString(&host, true, HASH_STRING_ALGORITHM_DEFAULT, &e.host_hash)) {
+                        Trace(TRACE_LEVEL_ERROR, "RtlHashUnicodeString('%!USTR!') %!STATUS!", &host, err);
+                } else {
+                        ++engine.entry_cnt;
+
+                        UNICODE_STRING service;
+                        libdrv::split(service, tail, tail, L',');
+
+                        if (!empty(service)) {
+                                pool::remember(vhci, host, service, true); // keep connections to the server
+                        }
+                }
+        }
+}
+
+_Function_class_(EVT_WDF_REQUEST_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void plugin_complete(
+        _In_ WDFREQUEST, _In_ WDFIOTARGET, _In_ WDF_REQUEST_COMPLETION_PARAMS *params, _In_ WDFCONTEXT context)
+{
+        auto &slot = *static_cast<attach_slot*>(context);
+
+        slot.status = params->IoStatus.Status;
+        InterlockedExchange(&slot.completed, true);
+
+        KeSetEvent(&slot.engine->completed, IO_NO_INCREMENT, false);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void plugin_hardware(_Inout_ attach_slot &slot, _Inout_ attach_entry &e, _In_ WDFIOTARGET target)
+{
+        PAGED_CODE();
+        auto &req = slot.req;
+
+        if (auto err = parse_string(req, e.line)) {
+                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &e.line, err);
+                e.state = e.DONE; // remove malformed string
+                return;
         }
 
-        Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s", req.host, req.service, req.busid);
         req.port = 0;
 
-        if (ULONG_PTR BytesReturned; // send IOCTL to itself
-            auto err = WdfIoTargetSendIoctlSynchronously(target, WDF_NO_HANDLE, vhci::ioctl::PLUGIN_HARDWARE, 
-                                                         &input, &output, nullptr, &BytesReturned)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetSendIoctlSynchronously %!STATUS!", err);
-                return !can_retry(err);
+        WDF_REQUEST_REUSE_PARAMS params;
+        WDF_REQUEST_REUSE_PARAMS_INIT(&params, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+        NT_VERIFY(NT_SUCCESS(WdfRequestReuse(slot.request, &params)));
+
+        if (auto err = WdfIoTargetFormatRequestForIoctl(target, slot.request, vhci::ioctl::PLUGIN_HARDWARE, 
+                                                        slot.input, nullptr, slot.output, nullptr)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetFormatRequestForIoctl %!STATUS!", err);
+                e.state = e.DONE;
+                return;
+        }
+
+        WdfRequestSetCompletionRoutine(slot.request, plugin_complete, &slot);
+
+        if (!e.attempt) {
+                e.started = KeQueryInterruptTime();
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s, attempt #%lu, +%lu ms", 
+                req.host, req.service, req.busid, e.attempt, to_msec(KeQueryInterruptTime() - slot.engine->t0));
+
+        e.state = e.INFLIGHT;
+        slot.entry = &e;
+
+        if (!WdfRequestSend(slot.request, target, WDF_NO_SEND_OPTIONS)) { // completion routine will not be called
+                slot.status = WdfRequestGetStatus(slot.request);
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestSend %!STATUS!", slot.status);
+                InterlockedExchange(&slot.completed, true);
+                KeSetEvent(&slot.engine->completed, IO_NO_INCREMENT, false);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void on_completed(_Inout_ attach_slot &slot, _In_ bool stopping)
+{
+        PAGED_CODE();
+
+        auto &e = *slot.entry;
+        auto &engine = *slot.engine;
+
+        slot.entry = nullptr;
+        InterlockedExchange(&slot.completed, false);
+
+        auto now = KeQueryInterruptTime();
+        auto elapsed = to_msec(now - e.started);
+
+        if (auto st = slot.status; NT_SUCCESS(st)) {
+                ++engine.attached;
+                e.state = e.DONE;
+                Trace(TRACE_LEVEL_INFORMATION, "'%!USTR!' ready in %lu ms (+%lu ms), port %d, attempt #%lu", 
+                        &e.line, elapsed, to_msec(now - engine.t0), slot.req.port, e.attempt);
+        } else if (stopping || !can_retry(st)) {
+                e.state = e.DONE;
+                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' %!STATUS!, give up after %lu ms, attempt #%lu", 
+                        &e.line, st, elapsed, e.attempt);
         } else {
-                NT_ASSERT(BytesReturned == outlen);
-                return true;
+                auto secs = get_delay(++e.attempt);
+                e.due = now + secs*wdm::second;
+                e.state = e.WAITING;
+                TraceDbg("'%!USTR!' %!STATUS!, attempt #%lu in %lu sec.", &e.line, st, e.attempt, secs);
         }
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
+PAGED auto host_busy(_In_ const attach_engine &engine, _In_ ULONG host_hash)
 {
         PAGED_CODE();
-        
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(col); i < cnt; ++i) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(col, i);
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
-                        
-                if (RtlEqualUnicodeString(&s, &str, true)) {
+        for (ULONG i = 0; i < engine.slot_cnt; ++i) {
+                if (auto e = engine.slots[i].entry; e && e->host_hash == host_hash) {
                         return true;
                 }
         }
@@ -214,51 +416,149 @@ PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
         return false;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_free_slot(_In_ attach_engine &engine)
+{
+        PAGED_CODE();
+
+        for (ULONG i = 0; i < engine.slot_cnt; ++i) {
+                if (auto &s = engine.slots[i]; !s.entry) {
+                        return &s;
+                }
+        }
+
+        return static_cast<attach_slot*>(nullptr);
+}
+
 /*
- * Remove from collection A items absent in collection B.
+ * Start attempts that are due, at most one per host and slot_cnt in total.
+ * @param next_due is set to the earliest due time of waiting entries
+ * @return number of entries that are not done
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void intersection(_In_ WDFCOLLECTION a, _In_ WDFCOLLECTION b)
+PAGED ULONG start_due(_Inout_ attach_engine &engine, _In_ WDFKEY key, _In_ WDFIOTARGET target, _Out_ LONG64 &next_due)
 {
         PAGED_CODE();
 
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(a); i < cnt; ) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(a, i);
+        auto now = KeQueryInterruptTime();
+        next_due = MAXLONG64;
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
+        ULONG pending = 0;
 
-                if (contains(b, s)) {
-                        ++i;
+        for (ULONG i = 0; i < engine.entry_cnt; ++i) {
+                auto &e = engine.entries[i];
+
+                if (e.state != e.WAITING || e.due > now || host_busy(engine, e.host_hash)) {
+                        // 
+                } else if (auto slot = get_free_slot(engine); !slot) {
+                        //
+                } else if (e.attempt && !is_persistent(key, e.line)) {
+                        TraceDbg("exclude %!USTR!", &e.line);
+                        e.state = e.DONE;
                 } else {
-                        TraceDbg("exclude %!USTR!", &s);
-                        WdfCollectionRemoveItem(a, i);
-                        --cnt;
+                        plugin_hardware(*slot, e, target);
+                }
+
+                switch (e.state) {
+                case e.WAITING:
+                        next_due = min(next_due, e.due);
+                        [[fallthrough]];
+                case e.INFLIGHT:
+                        ++pending;
+                        break;
                 }
         }
+
+        return pending;
 }
 
 /*
- * Refreshing allows to remove devices that constantly fail to attach.
+ * @return false if attach_thread_stop is signaled
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED ULONG get_count(_In_ WDFCOLLECTION col, _In_ WDFKEY key, _In_ bool refresh)
+PAGED auto wait(_Inout_ vhci_ctx &ctx, _Inout_ attach_engine &engine, _In_ LONG64 next_due)
 {
         PAGED_CODE();
 
-        if (!refresh) {
-                //
-        } else if (auto newcol = get_persistent_devices(key)) {
-                intersection(col, newcol.get<WDFCOLLECTION>());
-        } else {
-                return 0;
+        void* objects[] { &ctx.attach_thread_stop, &engine.completed };
+        static_assert(ARRAYSIZE(objects) <= THREAD_WAIT_OBJECTS);
+
+        LARGE_INTEGER timeout;
+        if (next_due != MAXLONG64) {
+                auto now = KeQueryInterruptTime();
+                timeout = make_timeout(next_due > now ? next_due - now : 0, wdm::period::relative);
+        }
+
+        auto st = KeWaitForMultipleObjects(ARRAYSIZE(objects), objects, WaitAny, Executive, KernelMode, false, 
+                                           next_due == MAXLONG64 ? nullptr : &timeout, nullptr);
+        switch (st) {
+        case STATUS_WAIT_0:
+                TraceDbg("thread stop requested");
+                return false;
+        case STATUS_WAIT_1:
+        case STATUS_TIMEOUT:
+                break;
+        default:
+                Trace(TRACE_LEVEL_ERROR, "KeWaitForMultipleObjects %!STATUS!", st);
+        }
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void process_completed(_Inout_ attach_engine &engine, _In_ bool stopping)
+{
+        PAGED_CODE();
+
+        for (ULONG i = 0; i < engine.slot_cnt; ++i) {
+                if (auto &s = engine.slots[i]; s.entry && ReadAcquire(&s.completed)) {
+                        on_completed(s, stopping);
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto inflight(_In_ const attach_engine &engine)
+{
+        PAGED_CODE();
+        ULONG cnt = 0;
+
+        for (ULONG i = 0; i < engine.slot_cnt; ++i) {
+                cnt += static_cast<bool>(engine.slots[i].entry);
         }
 
-        return min(WdfCollectionGetCount(col), ARRAYSIZE(vhci_ctx::devices));
+        return cnt;
 }
 
+/*
+ * Cancel in-flight requests and wait for their completion, slots must not be freed before that.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void cancel_all(_Inout_ attach_engine &engine)
+{
+        PAGED_CODE();
+
+        for (ULONG i = 0; i < engine.slot_cnt; ++i) {
+                if (auto &s = engine.slots[i]; s.entry) {
+                        WdfRequestCancelSentRequest(s.request);
+                }
+        }
+
+        for (process_completed(engine, true); inflight(engine); process_completed(engine, true)) {
+                KeWaitForSingleObject(&engine.completed, Executive, KernelMode, false, nullptr);
+        }
+}
+
+/*
+ * Devices are attached in parallel with bounded concurrency, see attach_concurrency_value_name.
+ * The requests are sent to itself asynchronously.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
@@ -275,6 +575,13 @@ PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
                 return;
         }
 
+        unique_ptr buf(NonPagedPoolNx, sizeof(attach_engine)); // must outlive the target
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(attach_engine));
+                return;
+        }
+        auto engine = buf.get<attach_engine>();
+
         auto vhci = get_handle(&ctx);
 
         auto target = make_target(vhci);
@@ -282,45 +589,39 @@ PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
                 return;
         }
 
-        vhci::ioctl::plugin_hardware req{{ .size = sizeof(req) }};
+        KeInitializeEvent(&engine->completed, SynchronizationEvent, false);
+        engine->t0 = KeQueryInterruptTime();
 
-        WDF_MEMORY_DESCRIPTOR input;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&input, &req, sizeof(req));
+        engine->slot_cnt = get_parameter(attach_concurrency_value_name, 4);
+        engine->slot_cnt = max(1UL, min(engine->slot_cnt, ULONG(engine->MAX_SLOTS)));
+
+        for (ULONG i = 0; i < engine->slot_cnt; ++i) {
+                if (auto err = init(engine->slots[i], *engine, target.get<WDFIOTARGET>())) {
+                        engine->slot_cnt = i; // the rest are not initialized
+                        break;
+                }
+        }
 
-        constexpr auto outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(req.port);
+        init_entries(*engine, devices.get<WDFCOLLECTION>(), vhci);
+        TraceDbg("%lu device(s), concurrency %lu", engine->entry_cnt, engine->slot_cnt);
 
-        WDF_MEMORY_DESCRIPTOR output;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&output, &req, outlen);
+        for (bool stop = !engine->slot_cnt; !stop; ) {
 
-        for (ULONG attempt = 0; true; ++attempt) {
+                process_completed(*engine, false);
 
-                auto cnt = get_count(devices.get<WDFCOLLECTION>(), key.get(), attempt);
-                if (!cnt) {
+                LONG64 next_due;
+                if (!start_due(*engine, key.get(), target.get<WDFIOTARGET>(), next_due)) {
                         break;
                 }
 
-                if (auto secs = get_delay(attempt, cnt)) {
-                        TraceDbg("attempt #%lu, %lu device(s), sleep %lu sec.", attempt, cnt, secs);
-                        if (!sleep(ctx, secs)) {
-                                break;
-                        }
-                }
-
-                for (ULONG i = 0; i < cnt && sleep(ctx, 0); ) {
-                        UNICODE_STRING str{};
-                        if (auto s = (WDFSTRING)WdfCollectionGetItem(devices.get<WDFCOLLECTION>(), i)) {
-                                WdfStringGetUnicodeString(s, &str);
-                        }
-
-                        if (plugin_hardware(str, target.get<WDFIOTARGET>(), req, input, output, outlen)) {
-                                TraceDbg("exclude %!USTR!", &str);
-                                WdfCollectionRemoveItem(devices.get<WDFCOLLECTION>(), i);
-                                --cnt;
-                        } else {
-                                ++i;
-                        }
+                if (!wait(ctx, *engine, next_due)) {
+                        cancel_all(*engine);
+                        stop = true;
                 }
         }
+
+        Trace(TRACE_LEVEL_INFORMATION, "%lu of %lu device(s) attached, %lu ms", 
+                engine->attached, engine->entry_cnt, to_msec(KeQueryInterruptTime() - engine->t0));
 }
 
 /*
@@ -418,3 +719,62 @@ PAGED NTSTATUS usbip::open_parameters_key(_Out_ Registry &key, _In_ ACCESS_MASK
         key.reset(k);
         return st;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG usbip::get_parameter(_In_ const wchar_t *value_name, _In_ ULONG defval)
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return defval;
+        }
+
+        UNICODE_STRING val_name;
+        RtlUnicodeStringInit(&val_name, value_name);
+
+        ULONG val{};
+        if (auto err = WdfRegistryQueryULong(key.get(), &val_name, &val)) {
+                TraceDbg("WdfRegistryQueryULong(%!USTR!) %!STATUS!, default %lu", &val_name, err, defval);
+                return defval;
+        }
+
+        TraceDbg("%!USTR! = %lu", &val_name, val);
+        return val;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::extensions_allowed(_In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return false;
+        }
+
+        auto col = get_multi_string(key.get(), protocol_extensions_hosts_value_name);
+        if (!col) {
+                return false;
+        }
+
+        for (ULONG i = 0, cnt = WdfCollectionGetCount(col.get<WDFCOLLECTION>()); i < cnt; ++i) {
+                auto item = (WDFSTRING)WdfCollectionGetItem(col.get<WDFCOLLECTION>(), i);
+
+                UNICODE_STRING s{};
+                WdfStringGetUnicodeString(item, &s);
+
+                UNICODE_STRING host;
+                UNICODE_STRING port;
+                libdrv::split(host, port, s, L',');
+
+                if (RtlEqualUnicodeString(&host, &node, true) && 
+                    (empty(port) || RtlEqualUnicodeString(&port, &service, false))) {
+                        return true;
+                }
+        }
+
+        return false;
+}
@@ -17,6 +17,21 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS open_parameters_key(_Out_ Registry &key, _In_ ACCESS_MASK DesiredAccess);
 
+/*
+ * @return defval if the value is absent or is not REG_DWORD
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG get_parameter(_In_ const wchar_t *value_name, _In_ ULONG defval);
+
+/*
+ * Stock servers do not know OP_REQ_EXTENSIONS, it is sent only to the servers that are listed explicitly.
+ * @return true if the server is listed in protocol_extensions_hosts_value_name as "host" or "host,service"
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool extensions_allowed(_In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service);
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS copy(
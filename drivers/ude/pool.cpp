@@ -0,0 +1,612 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "pool.h"
+#include "trace.h"
+#include "pool.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "persistent.h"
+#include "resolver.h"
+
+#include <usbip\proto_op.h>
+
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum : UINT32 {
+        PERIOD_MS = 5*1000, // of expiration checks
+        CONNECT_TIMEOUT_MS = 10*1000, // and of getaddrinfo
+        RETRY_MS = 30*1000, // after failed refill
+};
+
+/*
+ * Synchronous WSK operation of pool_thread or of pool::connect.
+ */
+struct sync_op
+{
+        WDFDEVICE vhci;
+        IRP *irp; // is reused
+        KEVENT *stop; // optional, cancels the operation if signaled
+        UINT32 timeout_ms; // of getaddrinfo and of each connection attempt
+};
+
+inline auto now_ms()
+{
+        return static_cast<UINT64>(KeQueryInterruptTime()/wdm::msec);
+}
+
+inline auto& get_pool(_In_ WDFDEVICE vhci)
+{
+        return *get_vhci_ctx(vhci)->pool;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void drop(_Inout_ SOCKET* &sock)
+{
+        PAGED_CODE();
+
+        if (sock) {
+                close_socket(sock);
+                free(sock);
+        }
+}
+
+/*
+ * ctx.lock must be held.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto find(_In_ pool_ctx &ctx, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+
+        for (auto &h: ctx.hosts) {
+                if (h.used && RtlEqualUnicodeString(&h.node, &node, true) &&
+                              RtlEqualUnicodeString(&h.service, &service, false)) {
+                        return &h;
+                }
+        }
+
+        return static_cast<pool_ctx::host*>(nullptr);
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS irp_complete(_In_ DEVICE_OBJECT*, _In_ IRP*, _In_reads_(_Inexpressible_("varies")) void *context)
+{
+        KeSetEvent(static_cast<KEVENT*>(context), IO_NO_INCREMENT, false);
+        return StopCompletion;
+}
+
+/*
+ * WskConnect and WskGetAddressInfo do not have a timeout that can be set,
+ * the IRP is cancelled on timeout or if pool_thread must exit.
+ * @see irp_cls::wait_for_completion
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto wait(_In_ const sync_op &op, _Inout_ KEVENT &completed, _In_ NTSTATUS st)
+{
+        PAGED_CODE();
+
+        if (st != STATUS_PENDING) {
+                return st;
+        }
+
+        void* objects[] { &completed, op.stop };
+        auto timeout = make_timeout(op.timeout_ms*wdm::msec, wdm::period::relative);
+
+        if (KeWaitForMultipleObjects(op.stop ? 2 : 1, objects, WaitAny, Executive, KernelMode, false,
+                                     &timeout, nullptr) != STATUS_WAIT_0) {
+                IoCancelIrp(op.irp);
+                KeWaitForSingleObject(&completed, Executive, KernelMode, false, nullptr);
+        }
+
+        return op.irp->IoStatus.Status;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS resolve(
+        _In_ const sync_op &op, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _Out_writes_to_(resolver::MAX_ADDRESSES, cnt) SOCKADDR_INET *addrs, _Out_ int &cnt)
+{
+        PAGED_CODE();
+
+        if (NTSTATUS st; resolver::find(op.vhci, node, service, st, addrs, cnt)) {
+                return st;
+        }
+
+        ADDRINFOEXW hints {
+                .ai_flags = AI_NUMERICSERV,
+                .ai_family = AF_UNSPEC,
+                .ai_socktype = SOCK_STREAM,
+                .ai_protocol = IPPROTO_TCP
+        };
+
+        KEVENT completed;
+        KeInitializeEvent(&completed, NotificationEvent, false);
+
+        IoReuseIrp(op.irp, STATUS_UNSUCCESSFUL);
+        IoSetCompletionRoutine(op.irp, irp_complete, &completed, true, true, true);
+
+        ADDRINFOEXW *list{};
+        auto st = wsk::getaddrinfo(list, const_cast<UNICODE_STRING*>(&node), const_cast<UNICODE_STRING*>(&service), 
+                                   &hints, op.irp);
+        st = wait(op, completed, st);
+
+        resolver::store(op.vhci, node, service, st, list);
+
+        cnt = NT_SUCCESS(st) ? resolver::copy(addrs, list) : 0;
+        wsk::free(list);
+
+        return st;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS connect(_In_ const sync_op &op, _Out_ SOCKET* &sock, _In_ const SOCKADDR_INET &addr)
+{
+        PAGED_CODE();
+        sock = nullptr;
+
+        if (auto err = create_socket(sock, addr.si_family)) {
+                drop(sock);
+                return err;
+        }
+
+        KEVENT completed;
+        KeInitializeEvent(&completed, NotificationEvent, false);
+
+        IoReuseIrp(op.irp, STATUS_UNSUCCESSFUL);
+        IoSetCompletionRoutine(op.irp, irp_complete, &completed, true, true, true);
+
+        auto sa = reinterpret_cast<SOCKADDR*>(const_cast<SOCKADDR_INET*>(&addr));
+        auto st = wsk::connect(sock, sa, op.irp);
+        st = wait(op, completed, st);
+
+        if (!NT_SUCCESS(st)) {
+                drop(sock);
+        }
+
+        return st;
+}
+
+/*
+ * usbipd closes a connection after OP_REP_DEVLIST, so the probe uses own connection.
+ * @see <linux>/tools/usb/usbip/src/usbipd.c, recv_request_devlist
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS probe(_Inout_ SOCKET* &sock)
+{
+        PAGED_CODE();
+
+        op_common req{ USBIP_VERSION, OP_REQ_DEVLIST, ST_OK };
+        byteswap(req);
+
+        auto st = send(sock, memory::stack, &req, sizeof(req));
+        if (NT_SUCCESS(st)) {
+                st = recv_op_common(sock, OP_REP_DEVLIST);
+        }
+
+        drop(sock);
+        return st;
+}
+
+/*
+ * The addresses are tried in the order of the resolver, the first one that has passed the probe is used.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS refill(_Inout_ pool_ctx &ctx, _In_ const sync_op &op, _Inout_ pool_ctx::host &h)
+{
+        PAGED_CODE();
+
+        SOCKADDR_INET addrs[resolver::MAX_ADDRESSES];
+        int cnt = 0;
+
+        if (auto err = resolve(op, h.node, h.service, addrs, cnt)) {
+                return err;
+        }
+
+        NTSTATUS st = STATUS_HOST_UNREACHABLE;
+        int i = 0;
+
+        for ( ; i < cnt; ++i) {
+                if (SOCKET *sock{}; !(st = connect(op, sock, addrs[i])) && !(st = probe(sock))) {
+                        break;
+                }
+        }
+
+        if (i == cnt) {
+                return st;
+        }
+
+        for (bool full = false; !full; ) { // only this thread adds sockets
+                SOCKET *sock{};
+                if (auto err = connect(op, sock, addrs[i])) {
+                        return err;
+                }
+
+                wdf::WaitLock lck(ctx.lock);
+
+                h.socks[h.cnt++] = { .sock = sock, .since = now_ms() };
+                full = h.cnt == ctx.size;
+        }
+
+        TraceDbg("%!USTR!:%!USTR!, %d socket(s)", &h.node, &h.service, ctx.size);
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Close the connections that are older than idle timeout and forget idle hosts.
+ * Connections are not checked otherwise, an old one can be closed by the server or a middlebox.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void expire(_Inout_ pool_ctx &ctx, _In_ bool all)
+{
+        PAGED_CODE();
+
+        SOCKET *expired[pool_ctx::MAX_HOSTS*pool_ctx::MAX_SOCKETS];
+        int cnt = 0;
+
+        {
+                wdf::WaitLock lck(ctx.lock);
+                auto now = now_ms();
+
+                for (auto &h: ctx.hosts) {
+                        if (!h.used) {
+                                continue;
+                        }
+
+                        auto forget = all || (!h.persistent && now - h.last_used >= ctx.idle_timeout_ms);
+                        int j = 0;
+
+                        for (int i = 0; i < h.cnt; ++i) {
+                                if (auto &s = h.socks[i]; forget || now - s.since >= ctx.idle_timeout_ms) {
+                                        expired[cnt++] = s.sock;
+                                } else {
+                                        h.socks[j++] = s;
+                                }
+                        }
+
+                        h.cnt = j;
+
+                        if (forget) {
+                                TraceDbg("forget %!USTR!:%!USTR!", &h.node, &h.service);
+                                h.used = false;
+                        }
+                }
+        }
+
+        for (int i = 0; i < cnt; ++i) {
+                drop(expired[i]);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void refill_all(_Inout_ pool_ctx &ctx, _In_ const sync_op &op)
+{
+        PAGED_CODE();
+
+        for (auto &h: ctx.hosts) {
+
+                if (KeReadStateEvent(&ctx.stop)) {
+                        break;
+                }
+
+                bool due;
+                {
+                        wdf::WaitLock lck(ctx.lock);
+                        due = h.used && h.cnt < ctx.size && now_ms() >= h.retry_at;
+                }
+
+                if (!due) { // only this thread clears h.used, node and service can be read without the lock
+                        continue;
+                } else if (auto err = refill(ctx, op, h)) {
+                        Trace(TRACE_LEVEL_ERROR, "%!USTR!:%!USTR! %!STATUS!", &h.node, &h.service, err);
+                        h.retry_at = now_ms() + RETRY_MS;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void pool_thread(_In_ void *context)
+{
+        PAGED_CODE();
+        KeSetPriorityThread(KeGetCurrentThread(), LOW_PRIORITY + 1);
+
+        auto &ctx = *static_cast<pool_ctx*>(context);
+
+        sync_op op { 
+                .vhci = ctx.vhci, 
+                .irp = IoAllocateIrp(1, false), 
+                .stop = &ctx.stop, 
+                .timeout_ms = CONNECT_TIMEOUT_MS 
+        };
+
+        if (!op.irp) {
+                Trace(TRACE_LEVEL_ERROR, "IoAllocateIrp -> NULL");
+        }
+
+        void* objects[] { &ctx.stop, &ctx.wakeup };
+        auto timeout = make_timeout(PERIOD_MS*wdm::msec, wdm::period::relative);
+
+        for (auto st = STATUS_TIMEOUT; op.irp && st != STATUS_WAIT_0; ) {
+                expire(ctx, false);
+                refill_all(ctx, op);
+
+                st = KeWaitForMultipleObjects(ARRAYSIZE(objects), objects, WaitAny, Executive, KernelMode, false,
+                                              &timeout, nullptr);
+        }
+
+        expire(ctx, true);
+
+        if (op.irp) {
+                IoFreeIrp(op.irp);
+        }
+
+        TraceDbg("exit");
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::pool::init(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+        auto &vctx = *get_vhci_ctx(vhci);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = vhci;
+
+        WDFMEMORY mem{};
+        if (auto err = WdfMemoryCreate(&attr, NonPagedPoolNx, pooltag, sizeof(*vctx.pool), &mem,
+                                       reinterpret_cast<PVOID*>(&vctx.pool))) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate %!STATUS!", err);
+                return err;
+        }
+
+        auto &ctx = *vctx.pool;
+        RtlZeroMemory(&ctx, sizeof(ctx));
+
+        if (auto err = WdfWaitLockCreate(&attr, &ctx.lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWaitLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        ctx.vhci = vhci;
+
+        ctx.size = min(get_parameter(connection_pool_size_value_name, 0), ULONG(ctx.MAX_SOCKETS));
+
+        auto timeout = min(get_parameter(connection_pool_idle_timeout_value_name, 5*60), 24*60*60UL); // seconds
+        ctx.idle_timeout_ms = max(1000*timeout, 2UL*PERIOD_MS);
+
+        KeInitializeEvent(&ctx.stop, NotificationEvent, false);
+        KeInitializeEvent(&ctx.wakeup, SynchronizationEvent, false);
+
+        TraceDbg("size %d, idle timeout %lu ms", ctx.size, ctx.idle_timeout_ms);
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::pool::start(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+
+        auto &ctx = get_pool(vhci);
+        if (!ctx.size) {
+                return;
+        }
+
+        const auto access = THREAD_ALL_ACCESS;
+        auto fdo = WdfDeviceWdmGetDeviceObject(vhci);
+
+        if (HANDLE handle;
+            auto err = IoCreateSystemThread(fdo, &handle, access, nullptr, nullptr, nullptr, pool_thread, &ctx)) {
+                Trace(TRACE_LEVEL_ERROR, "IoCreateSystemThread %!STATUS!", err);
+        } else {
+                PVOID thread;
+                NT_VERIFY(NT_SUCCESS(ObReferenceObjectByHandle(handle, access, *PsThreadType, KernelMode,
+                                                               &thread, nullptr)));
+
+                NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
+                ctx.thread = static_cast<_KTHREAD*>(thread);
+                TraceDbg("thread launched");
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::pool::stop(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+
+        auto &ctx = get_pool(vhci);
+        if (!ctx.thread) {
+                return;
+        }
+
+        KeSetEvent(&ctx.stop, IO_NO_INCREMENT, false);
+
+        if (auto err = KeWaitForSingleObject(ctx.thread, Executive, KernelMode, false, nullptr)) {
+                Trace(TRACE_LEVEL_ERROR, "KeWaitForSingleObject %!STATUS!", err);
+        } else {
+                TraceDbg("joined");
+        }
+
+        ObDereferenceObject(ctx.thread);
+        ctx.thread = nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::pool::remember(
+        _In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _In_ bool persistent)
+{
+        PAGED_CODE();
+
+        auto &ctx = get_pool(vhci);
+        if (!ctx.thread) {
+                return;
+        }
+
+        wdf::WaitLock lck(ctx.lock);
+
+        if (auto h = find(ctx, node, service)) {
+                h->last_used = now_ms();
+                h->persistent |= persistent;
+                return;
+        }
+
+        if (node.Length > sizeof(pool_ctx::host::node_buf) || service.Length > sizeof(pool_ctx::host::service_buf)) {
+                return;
+        }
+
+        for (auto &h: ctx.hosts) {
+                if (h.used) {
+                        continue;
+                }
+
+                RtlInitEmptyUnicodeString(&h.node, h.node_buf, sizeof(h.node_buf));
+                RtlInitEmptyUnicodeString(&h.service, h.service_buf, sizeof(h.service_buf));
+
+                RtlCopyUnicodeString(&h.node, &node);
+                RtlCopyUnicodeString(&h.service, &service);
+
+                h.persistent = persistent;
+                h.last_used = now_ms();
+                h.retry_at = 0;
+                h.cnt = 0;
+                h.used = true;
+
+                lck.release();
+                KeSetEvent(&ctx.wakeup, IO_NO_INCREMENT, false);
+
+                TraceDbg("%!USTR!:%!USTR!, persistent %d", &node, &service, persistent);
+                return;
+        }
+
+        Trace(TRACE_LEVEL_ERROR, "%!USTR!:%!USTR!, no free slots", &node, &service);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto usbip::pool::take(
+        _In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service) -> SOCKET*
+{
+        PAGED_CODE();
+
+        auto &ctx = get_pool(vhci);
+        if (!ctx.thread) {
+                return nullptr;
+        }
+
+        SOCKET *sock{};
+        {
+                wdf::WaitLock lck(ctx.lock);
+
+                if (auto h = find(ctx, node, service)) {
+                        h->last_used = now_ms();
+                        if (h->cnt) {
+                                sock = h->socks[--h->cnt].sock; // the most recent one
+                        }
+                }
+
+                ++(sock ? ctx.hits : ctx.misses);
+        }
+
+        if (sock) {
+                KeSetEvent(&ctx.wakeup, IO_NO_INCREMENT, false); // refill
+        }
+
+        TraceDbg("%!USTR!:%!USTR! -> sock %04x", &node, &service, ptr04x(sock));
+        return sock;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::pool::connect(
+        _Out_ SOCKET* &sock, _In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _In_ UINT32 timeout_ms)
+{
+        PAGED_CODE();
+
+        if (sock = take(vhci, node, service); sock) {
+                return STATUS_SUCCESS;
+        }
+
+        sync_op op { 
+                .vhci = vhci, 
+                .irp = IoAllocateIrp(1, false), 
+                .timeout_ms = timeout_ms 
+        };
+
+        if (!op.irp) {
+                Trace(TRACE_LEVEL_ERROR, "IoAllocateIrp -> NULL");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        SOCKADDR_INET addrs[resolver::MAX_ADDRESSES];
+        int cnt = 0;
+
+        auto st = resolve(op, node, service, addrs, cnt);
+
+        if (NT_SUCCESS(st)) {
+                st = STATUS_HOST_UNREACHABLE;
+
+                for (int i = 0; i < cnt; ++i) {
+                        if (st = connect(op, sock, addrs[i]); NT_SUCCESS(st)) {
+                                break;
+                        }
+                }
+        }
+
+        IoFreeIrp(op.irp);
+        return st;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::pool::query(_In_ WDFDEVICE vhci, _Inout_ vhci::ioctl::connection_pool &r)
+{
+        PAGED_CODE();
+
+        auto &ctx = get_pool(vhci);
+        wdf::WaitLock lck(ctx.lock);
+
+        r.pool_size = ctx.size;
+        r.hosts = 0;
+        r.sockets = 0;
+
+        for (auto &h: ctx.hosts) {
+                if (h.used) {
+                        ++r.hosts;
+                        r.sockets += h.cnt;
+                }
+        }
+
+        r.hits = ctx.hits;
+        r.misses = ctx.misses;
+
+        TraceDbg("pool_size %d, hosts %d, sockets %d, hits %I64u, misses %I64u",
+                  r.pool_size, r.hosts, r.sockets, r.hits, r.misses);
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "network.h"
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbip\resolver_cache.h>
+#include <usbip\vhci.h>
+
+namespace usbip
+{
+
+/*
+ * Connections to the servers that devices were attached from, see PLUGIN_HARDWARE.
+ * They are established in advance by pool_thread, so an attach skips name resolution and TCP handshake.
+ * The pool is disabled if connection_pool_size_value_name is zero.
+ *
+ * Must be allocated from nonpaged pool because of KEVENT-s.
+ */
+struct pool_ctx
+{
+        enum { MAX_HOSTS = 16, MAX_SOCKETS = 4 }; // upper limit of connection_pool_size_value_name
+
+        struct pooled_socket
+        {
+                SOCKET *sock;
+                UINT64 since; // time in ms when connection was established
+        };
+
+        struct host
+        {
+                bool used; // the slot is occupied, node and service are not changed until it is freed
+                bool persistent; // is not forgotten if it is idle, see persistent_devices_value_name
+
+                UINT64 last_used; // time in ms, see pool::remember, pool::take
+                UINT64 retry_at; // time in ms, refill has failed
+
+                UNICODE_STRING node; // .Buffer points to node_buf
+                UNICODE_STRING service;
+                wchar_t node_buf[dns::max_key_len];
+                wchar_t service_buf[NI_MAXSERV];
+
+                int cnt; // of socks
+                pooled_socket socks[MAX_SOCKETS];
+        };
+
+        WDFDEVICE vhci;
+        int size; // sockets per host
+        UINT32 idle_timeout_ms;
+
+        WDFWAITLOCK lock; // for the members below
+        host hosts[MAX_HOSTS];
+        UINT64 hits;
+        UINT64 misses;
+        //
+
+        _KTHREAD *thread;
+        KEVENT stop; // NotificationEvent
+        KEVENT wakeup; // SynchronizationEvent, a host was added or a socket was taken
+};
+
+} // namespace usbip
+
+
+namespace usbip::pool
+{
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_In_ WDFDEVICE vhci);
+
+/*
+ * Launch pool_thread if the pool is enabled.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void start(_In_ WDFDEVICE vhci);
+
+/*
+ * Stop pool_thread and close pooled connections.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void stop(_In_ WDFDEVICE vhci);
+
+/*
+ * Keep connections to the server ready for the next attach.
+ * @param persistent the host is not forgotten if it is idle
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void remember(
+        _In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _In_ bool persistent);
+
+/*
+ * @return connected socket or NULL, the caller owns it
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED SOCKET* take(_In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service);
+
+/*
+ * Take a connection from the pool or connect synchronously to the first address that accepts a connection.
+ * @param timeout_ms of name resolution and of each connection attempt
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS connect(
+        _Out_ SOCKET* &sock, _In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _In_ UINT32 timeout_ms);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void query(_In_ WDFDEVICE vhci, _Inout_ vhci::ioctl::connection_pool &r);
+
+} // namespace usbip::pool
@@ -9,6 +9,7 @@
 #include "context.h"
 
 #include <libdrv\ch9.h>
+#include <libdrv\pdu.h>
 #include <libdrv\usbd_helper.h>
 
 namespace
@@ -44,6 +45,8 @@ auto fix_transfer_flags(_In_ ULONG TransferFlags, _In_ bool dir_out)
  * 
  * Default control pipe is bidirectional, direction in setup packet must be used instead of descriptor.
  * FIXME: are there exist non-default unidirectional control pipes?
+ *
+ * Is used for control transfers only, other transfers use the template, see make_cmd_submit_template.
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS usbip::set_cmd_submit_usbip_header(
@@ -77,6 +80,60 @@ NTSTATUS usbip::set_cmd_submit_usbip_header(
 		RtlZeroMemory(r->setup, sizeof(r->setup));
 	}
 
+	byteswap_header(hdr, swap_dir::host2net);
+	return STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::make_cmd_submit_template(
+	_Out_ header &hdr, _In_ const device_ctx &dev, _In_ const USB_ENDPOINT_DESCRIPTOR &epd)
+{
+	RtlZeroMemory(&hdr, sizeof(hdr)); // setup, seqnum, transfer_flags, transfer_buffer_length, start_frame
+
+	hdr.command = CMD_SUBMIT;
+	hdr.devid = dev.devid();
+	hdr.direction = usb_endpoint_dir_out(epd) ? direction::out : direction::in;
+	hdr.ep = usb_endpoint_num(epd);
+
+	if (auto r = &hdr.cmd_submit) {
+		r->number_of_packets = number_of_packets_non_isoch;
+		r->interval = epd.bInterval;
+	}
+
+	byteswap_header(hdr, swap_dir::host2net);
+}
+
+/*
+ * Copy the template and patch the fields that depend on URB.
+ * Direction of the endpoint is always used, see fix_transfer_flags.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::set_cmd_submit_usbip_header(
+	_Out_ header &hdr, _Inout_ device_ctx &dev, _In_ const endpoint_ctx &endp,
+	_In_ ULONG TransferFlags, _In_ ULONG TransferBufferLength)
+{
+	auto &epd = endp.descriptor;
+
+	if (TransferFlags & USBD_DEFAULT_PIPE_TRANSFER) {
+		Trace(TRACE_LEVEL_ERROR, "TransferFlags(USBD_DEFAULT_PIPE_TRANSFER) for bEndpointAddress(%#x)", 
+			                  epd.bEndpointAddress);
+
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	NT_ASSERT(usb_endpoint_type(epd) != UsbdPipeTypeControl);
+	auto dir_out = usb_endpoint_dir_out(epd);
+
+	TransferFlags = fix_transfer_flags(TransferFlags, dir_out);
+
+	hdr = endp.submit;
+	hdr.seqnum = RtlUlongByteSwap(next_seqnum(dev, !dir_out));
+
+	if (auto r = &hdr.cmd_submit) {
+		r->transfer_flags = RtlUlongByteSwap(to_linux_flags(TransferFlags, !dir_out));
+		r->transfer_buffer_length = RtlUlongByteSwap(TransferBufferLength);
+	}
+
 	return STATUS_SUCCESS;
 }
 
@@ -92,4 +149,6 @@ void usbip::set_cmd_unlink_usbip_header(
 
 	NT_ASSERT(is_valid_seqnum(seqnum_unlink));
 	hdr.cmd_unlink.seqnum = seqnum_unlink;
+
+	byteswap_header(hdr, swap_dir::host2net);
 }
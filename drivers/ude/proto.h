@@ -13,6 +13,7 @@ namespace usbip
 {
 
 struct device_ctx;
+struct endpoint_ctx;
 
 class setup_dir
 {
@@ -47,11 +48,29 @@ static_assert(!!setup_dir::out());
 static_assert(*setup_dir::out());
 
 
+/*
+ * The headers are built in network byte order.
+ */
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS set_cmd_submit_usbip_header(
 	_Out_ usbip::header &hdr, _Inout_ device_ctx &dev, _In_ const _USB_ENDPOINT_DESCRIPTOR &epd,
 	_In_ ULONG TransferFlags, _In_ ULONG TransferBufferLength = 0, _In_ setup_dir setup_dir_out = setup_dir());
 
+/*
+ * The fields of CMD_SUBMIT that are constant for an endpoint, see endpoint_ctx::submit.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void make_cmd_submit_template(_Out_ usbip::header &hdr, _In_ const device_ctx &dev, _In_ const _USB_ENDPOINT_DESCRIPTOR &epd);
+
+/*
+ * For bulk, interrupt and isochronous endpoints.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS set_cmd_submit_usbip_header(
+	_Out_ usbip::header &hdr, _Inout_ device_ctx &dev, _In_ const endpoint_ctx &endp,
+	_In_ ULONG TransferFlags, _In_ ULONG TransferBufferLength);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void set_cmd_unlink_usbip_header(_Out_ usbip::header &hdr, _Inout_ device_ctx &dev, _In_ seqnum_t seqnum_unlink);
 
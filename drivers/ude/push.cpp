@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "push.h"
+#include "trace.h"
+#include "push.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "ioctl.h"
+#include "device_ioctl.h"
+#include "endpoint_list.h"
+#include "wsk_receive.h"
+#include "suspend.h"
+
+#include <libdrv\ch9.h>
+#include <libdrv\usbd_helper.h>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * device_ctx::push_lock must be acquired.
+ * @param endpoint a free slot if NULL
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+push::subscription* find(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint)
+{
+        for (auto &s: dev.push_subs) {
+                if (s.endpoint == endpoint) {
+                        return &s;
+                }
+        }
+
+        return nullptr;
+}
+
+/*
+ * device_ctx::push_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+push::subscription* find(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        NT_ASSERT(seqnum);
+
+        for (auto &s: dev.push_subs) {
+                if (s.seqnum == seqnum) {
+                        return &s;
+                }
+        }
+
+        return nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_ring(_Inout_ push::subscription &s)
+{
+        if (auto &buf = s.ring_buf) {
+                ExFreePoolWithTag(buf, pooltag);
+                buf = nullptr;
+        }
+
+        s.ring = report_ring{};
+}
+
+/*
+ * @param endpoint any endpoint if NULL
+ * @return the oldest URB of the endpoint that waits for a report
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST retrieve(_In_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint)
+{
+        WDFREQUEST result{};
+        WDFREQUEST prev{};
+
+        for (WDFREQUEST found{};
+             !result && NT_SUCCESS(WdfIoQueueFindRequest(dev.push_requests, prev, WDF_NO_HANDLE, nullptr, &found)); ) {
+
+                if (prev) {
+                        WdfObjectDereference(prev);
+                }
+                prev = found;
+
+                if (endpoint && get_request_ctx(found)->endpoint != endpoint) {
+                        // continue;
+                } else if (!NT_SUCCESS(WdfIoQueueRetrieveFoundRequest(dev.push_requests, found, &result))) {
+                        WdfObjectDereference(prev); // cancelled, is not in the queue, start over
+                        prev = WDF_NO_HANDLE;
+                }
+        }
+
+        if (prev) {
+                WdfObjectDereference(prev);
+        }
+
+        return result;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_waiting(_In_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint, _In_ NTSTATUS status)
+{
+        while (auto request = retrieve(dev, endpoint)) {
+                complete(request, status);
+        }
+}
+
+/*
+ * A report that is longer than the buffer of URB is truncated.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void fill(_In_ WDFREQUEST request, _In_opt_ const UCHAR *data, _In_ ULONG len)
+{
+        UCHAR *buf{};
+        ULONG buf_len{};
+
+        if (!(data && NT_SUCCESS(UdecxUrbRetrieveBuffer(request, &buf, &buf_len)))) {
+                len = 0;
+        } else if (len > buf_len) {
+                len = buf_len;
+        }
+
+        if (len) {
+                RtlCopyMemory(buf, data, len);
+        }
+
+        get_urb(request).UrbHeader.Status = USBD_STATUS_SUCCESS;
+        UdecxUrbSetBytesCompleted(request, len);
+}
+
+/*
+ * End the subscriptions of the endpoint or all of them if it is not set.
+ * @param unlink send CMD_UNLINK-s
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void end(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint, _In_ bool unlink, _In_ bool release)
+{
+        seqnum_t unlinks[push::max_subscriptions];
+        int cnt = 0;
+        {
+                wdf::Lock lck(dev.push_lock);
+
+                for (auto &s: dev.push_subs) {
+                        if (!s.endpoint || (endpoint && s.endpoint != endpoint)) {
+                                continue;
+                        }
+
+                        if (unlink && s.seqnum) {
+                                unlinks[cnt++] = s.seqnum;
+                        }
+                        s.seqnum = 0;
+                        s.ring.clear();
+
+                        if (release) {
+                                free_ring(s);
+                                s.endpoint = WDF_NO_HANDLE;
+                        }
+                }
+        }
+
+        for (int i = 0; i < cnt; ++i) {
+                device::send_cmd_unlink(dev, unlinks[i]);
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::push::init(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (!dev.ext->interrupt_push) {
+                return STATUS_SUCCESS;
+        }
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = device;
+
+        WDF_IO_QUEUE_CONFIG cfg;
+        WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchManual);
+        cfg.PowerManaged = WdfFalse;
+
+        cfg.EvtIoCanceledOnQueue = [] (auto, auto request) // EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE
+        {
+                TraceDbg("req %04x", ptr04x(request));
+                complete(request, STATUS_CANCELLED);
+        };
+
+        if (auto err = WdfIoQueueCreate(dev.vhci, &cfg, &attr, &dev.push_requests)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoQueueCreate %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::push::free(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (!dev.push_requests) {
+                return;
+        }
+
+        UINT64 pushed = 0;
+        UINT64 dropped = 0;
+
+        for (auto &s: dev.push_subs) {
+                pushed += s.ring.pushed();
+                dropped += s.ring.dropped();
+                free_ring(s);
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!UINT64! report(s) pushed, %!UINT64! buffered, %!UINT64! dropped",
+                ptr04x(get_handle(&dev)), dev.pushed_reports, pushed, dropped);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::push::enable(_Inout_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf)
+{
+        if (!(dev.push_requests && intf.Class == USB_DEVICE_CLASS_HUMAN_INTERFACE)) {
+                return;
+        }
+
+        for (ULONG i = 0; i < intf.NumberOfPipes; ++i) {
+
+                auto &pipe = intf.Pipes[i];
+                if (!(pipe.PipeType == UsbdPipeTypeInterrupt && USB_ENDPOINT_DIRECTION_IN(pipe.EndpointAddress))) {
+                        continue;
+                }
+
+                auto endp = find_endpoint(dev, pipe.EndpointAddress);
+                if (!endp) {
+                        continue;
+                }
+
+                auto endpoint = get_endpoint(endp->queue);
+                bool ok{};
+                {
+                        wdf::Lock lck(dev.push_lock);
+
+                        if (find(dev, endpoint)) {
+                                ok = true;
+                        } else if (auto s = find(dev, UDECXUSBENDPOINT{}); !s) {
+                                //
+                        } else if (auto buf = (UCHAR*)ExAllocatePoolUninitialized(NonPagedPoolNx,
+                                                report_ring::max_slots*max_report_size, pooltag)) {
+                                s->endpoint = endpoint;
+                                s->ring_buf = buf;
+                                ok = true;
+                        }
+                }
+
+                TraceDbg("interface %d.%d, EndpointAddress %#x, endp %04x, subscription %d",
+                          intf.InterfaceNumber, intf.AlternateSetting, pipe.EndpointAddress, ptr04x(endpoint), ok);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::push::disable(_Inout_ device_ctx &dev)
+{
+        if (dev.push_requests) {
+                end(dev, WDF_NO_HANDLE, true, true);
+                complete_waiting(dev, WDF_NO_HANDLE, STATUS_CANCELLED);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::push::reset(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint)
+{
+        if (dev.push_requests) {
+                end(dev, endpoint, true, false);
+                complete_waiting(dev, endpoint, STATUS_CANCELLED);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::push::cancel(_Inout_ device_ctx &dev, _In_ NTSTATUS status)
+{
+        if (dev.push_requests) {
+                end(dev, WDF_NO_HANDLE, false, false);
+                complete_waiting(dev, WDF_NO_HANDLE, status);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::push::submit(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request, _Inout_ URB &urb,
+        _Out_ NTSTATUS &status)
+{
+        status = STATUS_SUCCESS;
+
+        if (!dev.push_requests) {
+                return false;
+        }
+
+        auto &endp = *get_endpoint_ctx(endpoint);
+        auto length = urb.UrbBulkOrInterruptTransfer.TransferBufferLength;
+
+        if (!(usb_endpoint_type(endp.descriptor) == UsbdPipeTypeInterrupt && usb_endpoint_dir_in(endp.descriptor) &&
+              length && length <= max_report_size)) {
+                return false;
+        }
+
+        seqnum_t seqnum{};
+        {
+                wdf::Lock lck(dev.push_lock);
+
+                auto s = find(dev, endpoint);
+                if (!s) {
+                        return false;
+                }
+
+                if (!s->ring.empty()) {
+                        UINT32 len{};
+                        auto data = s->ring.front(len);
+                        fill(request, data, len);
+                        s->ring.pop();
+                        return true; // submit_urb completes it
+                }
+
+                if (auto err = WdfRequestForwardToIoQueue(request, dev.push_requests)) {
+                        Trace(TRACE_LEVEL_ERROR, "req %04x, WdfRequestForwardToIoQueue %!STATUS!", ptr04x(request), err);
+                        status = err;
+                        return true;
+                }
+
+                if (!s->seqnum) {
+                        s->seqnum = seqnum = next_seqnum(dev, true);
+                        s->ring.init(s->ring_buf, length, report_ring::max_slots);
+                }
+        }
+
+        status = STATUS_PENDING;
+
+        if (seqnum) {
+                if (auto st = device::send_ahead(dev, endp, length, seqnum, true); st != STATUS_PENDING) {
+                        Trace(TRACE_LEVEL_ERROR, "endp %04x, subscription %!STATUS!", ptr04x(endpoint), st);
+                        end(dev, endpoint, false, false);
+                        complete_waiting(dev, endpoint, st); // including this one
+                } else {
+                        TraceDbg("endp %04x, seqnum %u, subscribed for %lu bytes", ptr04x(endpoint), seqnum, length);
+                }
+        }
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::push::claim(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        if (!dev.push_requests) {
+                return false;
+        }
+
+        wdf::Lock lck(dev.push_lock);
+        return find(dev, seqnum);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::push::received(_Inout_ device_ctx &dev, _In_ const header &hdr, _In_opt_ const UCHAR *data, _In_ NTSTATUS status)
+{
+        auto &ret = hdr.ret_submit;
+        UINT32 len = !status && ret.actual_length > 0 ? ret.actual_length : 0;
+
+        WDFREQUEST request{};
+        {
+                wdf::Lock lck(dev.push_lock);
+
+                auto s = find(dev, hdr.seqnum);
+                if (!s) {
+                        return; // has ended meanwhile
+                }
+
+                if (status || ret.status) {
+                        s->seqnum = 0; // the server has ended it, the next URB subscribes again
+                } else {
+                        ++dev.pushed_reports;
+                }
+
+                request = retrieve(dev, s->endpoint);
+
+                if (request || status || ret.status) {
+                        //
+                } else if (auto slot = s->ring.push(len)) {
+                        RtlCopyMemory(slot, data, len);
+                }
+        }
+
+        if (!request) {
+                return;
+        }
+
+        if (status) {
+                complete(request, status);
+                return;
+        }
+
+        if (ret.status) {
+                get_urb(request).UrbHeader.Status = to_windows_status(ret.status);
+                UdecxUrbSetBytesCompleted(request, 0);
+        } else {
+                fill(request, data, len);
+        }
+
+        suspend::completed(dev, request);
+        complete(request, STATUS_SUCCESS);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbip\proto.h>
+#include <usbip\report_ring.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+        struct device_ctx;
+}
+
+/*
+ * Reports of HID interrupt IN endpoints are pushed by the server, see EXT_INTERRUPT_PUSH.
+ * The first URB of an endpoint sends the subscription, URB-s wait in device_ctx::push_requests (manual queue).
+ * A pushed report completes the oldest waiting URB of the endpoint or is put into the ring of the subscription.
+ */
+namespace usbip::push
+{
+
+enum { max_subscriptions = 4 }; // HID interfaces of a device
+enum : ULONG { max_report_size = 1024 }; // max packet size of high-speed interrupt endpoint
+
+struct subscription
+{
+        UDECXUSBENDPOINT endpoint; // NULL if the slot is free
+        seqnum_t seqnum; // of CMD_SUBMIT, zero if it was not sent or it has ended
+        report_ring ring; // reports that arrived while no URB was waiting
+        UCHAR *ring_buf; // NonPagedPoolNx
+};
+
+/*
+ * Create the manual queue if EXT_INTERRUPT_PUSH was accepted.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free(_Inout_ device_ctx &dev);
+
+/*
+ * Interrupt IN endpoints of HID interface will be subscribed.
+ * @see update_pipe_properties
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void enable(_Inout_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf);
+
+/*
+ * Another configuration is selected, end all subscriptions.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void disable(_Inout_ device_ctx &dev);
+
+/*
+ * End the subscription of the endpoint, complete its waiting URB-s.
+ * @see endpoint_purge, clear_endpoint_stall
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void reset(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint);
+
+/*
+ * The server has forgotten the subscriptions, CMD_UNLINK-s are not sent. Waiting URB-s are completed with status.
+ * @see session::resume
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel(_Inout_ device_ctx &dev, _In_ NTSTATUS status);
+
+/*
+ * @param status of URB function if the result is true
+ * @return false if URB must be sent as usual
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool submit(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request, _Inout_ URB &urb,
+        _Out_ NTSTATUS &status);
+
+/*
+ * @return true if RET_SUBMIT is a pushed report, its payload must be received and passed to received
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool claim(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum);
+
+/*
+ * @param hdr RET_SUBMIT in host byte order
+ * @param data payload of ret_submit.actual_length bytes
+ * @param status of receiving of the payload
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void received(_Inout_ device_ctx &dev, _In_ const header &hdr, _In_opt_ const UCHAR *data, _In_ NTSTATUS status);
+
+} // namespace usbip::push
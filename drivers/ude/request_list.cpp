@@ -9,6 +9,7 @@
 #include "context.h"
 #include "wsk_context.h"
 #include "device_ioctl.h"
+#include "dgram.h"
 
 namespace
 {
@@ -26,6 +27,8 @@ auto matches(_In_ WDFREQUEST request, _In_ const request_ctx &req, _In_ const de
                 return crit.request == request;
         case crit.ENDPOINT:
                 return crit.endpoint == req.endpoint;
+        case crit.DEVICE:
+                return true; // dev.requests
         }
 
         Trace(TRACE_LEVEL_ERROR, "Invalid union member selector %d", crit.what);
@@ -46,22 +49,72 @@ void cancel_request(_In_ WDFREQUEST request)
         device::send_cmd_unlink_and_cancel(device, request);
 }
 
+/*
+ * @return the first datagram request that satisfies the predicate
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto remove_dgram_request(_In_ device_ctx &dev, _In_ const auto &pred)
+{
+        wdf::Lock lck(dev.requests_lock);
+
+        for (auto head = &dev.requests, entry = head->Flink; entry != head; entry = entry->Flink) {
+
+                auto req = CONTAINING_RECORD(entry, request_ctx, entry);
+
+                if (!(req->dgram && pred(*req))) {
+                        continue;
+                }
+
+                RemoveEntryList(entry);
+                auto request = get_handle(req);
+
+                if (!req->cancelable) {
+                        // not required
+                } else if (auto ret = WdfRequestUnmarkCancelable(request); ret == STATUS_CANCELLED) {
+                        TraceDbg("%04x, unmark cancelable %!STATUS!", ptr04x(request), ret);
+                        continue; // EvtRequestCancel will complete it
+                }
+
+                return request;
+        }
+
+        return WDFREQUEST(WDF_NO_HANDLE);
+}
+
 } // namespace
 
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void usbip::device::append_request(_Inout_ device_ctx &dev, _In_ const wsk_context &wsk, _In_ UDECXUSBENDPOINT endpoint)
+void usbip::device::append_request(
+        _Inout_ device_ctx &dev, _In_ const wsk_context &wsk, _In_ UDECXUSBENDPOINT endpoint, _In_ bool udp)
 {
-        auto &req = *get_request_ctx(wsk.request); // is not zeroed
+        auto seqnum = RtlUlongByteSwap(wsk.hdr.seqnum); // network byte order
+        append_request(dev, wsk.request, endpoint, seqnum, udp ? dgram::expire_at(wsk) : 0);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::append_request(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ UDECXUSBENDPOINT endpoint, 
+        _In_ seqnum_t seqnum, _In_ UINT64 expire_at)
+{
+        auto &req = *get_request_ctx(request); // is not zeroed
         req.cancelable = false;
+        req.dgram = expire_at != 0;
+        req.expire_at = expire_at;
+        req.sent_at = KeQueryInterruptTime();
 
         NT_ASSERT(endpoint);
         req.endpoint = endpoint;
 
-        req.seqnum = wsk.hdr.seqnum;
+        req.seqnum = seqnum;
         NT_ASSERT(is_valid_seqnum(req.seqnum));
 
+        req.unlink_seqnum = 0;
+        req.unlinked = false;
+
         wdf::Lock lck(dev.requests_lock);
         InsertTailList(&dev.requests, &req.entry);
 }
@@ -137,3 +190,25 @@ WDFREQUEST usbip::device::remove_request(
 
         return WDF_NO_HANDLE;
 }
+
+/*
+ * Datagrams are never retransmitted. If RET_SUBMIT for seqnum is received over UDP,
+ * the server will never complete datagram requests of the same endpoint that were submitted earlier.
+ * seqnum grows monotonically, the difference is signed to handle wraparound.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST usbip::device::remove_lost_request(_In_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ seqnum_t seqnum)
+{
+        return remove_dgram_request(dev, [endpoint, seqnum] (auto &req)
+        {
+                return req.endpoint == endpoint && static_cast<LONG>(req.seqnum - seqnum) < 0;
+        });
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST usbip::device::remove_expired_request(_In_ device_ctx &dev, _In_ UINT64 now_us)
+{
+        return remove_dgram_request(dev, [now_us] (auto &req) { return req.expire_at <= now_us; });
+}
@@ -24,6 +24,7 @@ struct request_search
 {
         request_search(_In_ WDFREQUEST req) : request(req), what(REQUEST) {}
         request_search(_In_ UDECXUSBENDPOINT endp) : endpoint(endp), what(ENDPOINT) {}
+        request_search(_In_ UDECXUSBDEVICE dev) : device(dev), what(DEVICE) {} // any request of the device
 
         request_search(_In_ seqnum_t n) : 
                 request(reinterpret_cast<WDFREQUEST>(static_cast<uintptr_t>(n))), // for operator bool correctness
@@ -32,22 +33,34 @@ struct request_search
         explicit operator bool() const { return request; }; // largest in union
         auto operator !() const { return !request; }
 
-        auto multimatch() const { return what == ENDPOINT; }
+        auto multimatch() const { return what == ENDPOINT || what == DEVICE; }
 
         union {
                 WDFREQUEST request{};
                 UDECXUSBENDPOINT endpoint;
+                UDECXUSBDEVICE device;
                 seqnum_t seqnum;
         };
 
-        enum what_t { SEQNUM, REQUEST, ENDPOINT };
+        enum what_t { SEQNUM, REQUEST, ENDPOINT, DEVICE };
         what_t what; // union's member selector
 };
 
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void append_request(_Inout_ device_ctx &dev, _In_ const wsk_context &wsk, _In_ UDECXUSBENDPOINT endpoint);
+void append_request(
+        _Inout_ device_ctx &dev, _In_ const wsk_context &wsk, _In_ UDECXUSBENDPOINT endpoint, _In_ bool udp = false);
+
+/*
+ * The request waits for RET_SUBMIT of CMD_SUBMIT that was sent without it, see bot::submit.
+ * @param expire_at non-zero for a datagram request, see dgram::expire_at
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void append_request(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ UDECXUSBENDPOINT endpoint, 
+        _In_ seqnum_t seqnum, _In_ UINT64 expire_at = 0);
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -57,4 +70,15 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 WDFREQUEST remove_request(_In_ device_ctx &dev, _In_ const request_search &crit, _In_ bool unmark_cancelable = true);
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST remove_lost_request(_In_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ seqnum_t seqnum);
+
+/*
+ * @return datagram request whose RET_SUBMIT did not arrive before request_ctx::expire_at
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST remove_expired_request(_In_ device_ctx &dev, _In_ UINT64 now_us);
+
 } // namespace usbip::device
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "resolver.h"
+#include "trace.h"
+#include "resolver.tmh"
+
+#include "context.h"
+#include "driver.h"
+
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+inline auto now_ms()
+{
+        return static_cast<UINT64>(KeQueryInterruptTime()/wdm::msec);
+}
+
+inline auto length(_In_ const UNICODE_STRING &s)
+{
+        return static_cast<int>(s.Length/sizeof(*s.Buffer));
+}
+
+/*
+ * It makes no sense to cache a failure that will not happen next time.
+ */
+constexpr auto is_transient(_In_ NTSTATUS st)
+{
+        return st == STATUS_CANCELLED || st == STATUS_INSUFFICIENT_RESOURCES || st == STATUS_NO_MEMORY;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::resolver::init(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+        auto &ctx = *get_vhci_ctx(vhci);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = vhci;
+
+        if (auto err = WdfWaitLockCreate(&attr, &ctx.resolver_lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWaitLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        WDFMEMORY mem{};
+        if (auto err = WdfMemoryCreate(&attr, PagedPool, pooltag, sizeof(*ctx.resolver), &mem, 
+                                       reinterpret_cast<PVOID*>(&ctx.resolver))) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate %!STATUS!", err);
+                return err;
+        }
+
+        RtlZeroMemory(ctx.resolver, sizeof(*ctx.resolver)); // valid empty state
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::resolver::find(
+        _In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _Out_ NTSTATUS &status, _Out_writes_to_(MAX_ADDRESSES, cnt) SOCKADDR_INET *addrs, _Out_ int &cnt)
+{
+        PAGED_CODE();
+
+        auto &ctx = *get_vhci_ctx(vhci);
+        wdf::WaitLock lck(ctx.resolver_lock);
+
+        auto e = ctx.resolver->find(node.Buffer, length(node), service.Buffer, length(service), now_ms());
+        if (!e) {
+                status = STATUS_SUCCESS;
+                cnt = 0;
+                return false;
+        }
+
+        status = e->error;
+        cnt = e->cnt;
+
+        for (int i = 0; i < cnt; ++i) {
+                addrs[i] = e->addrs[i];
+        }
+
+        TraceDbg("%!USTR!:%!USTR! -> %!STATUS!, %d address(es)", &node, &service, status, cnt);
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::resolver::store(
+        _In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _In_ NTSTATUS status, _In_opt_ const ADDRINFOEXW *list)
+{
+        PAGED_CODE();
+
+        if (is_transient(status) || (NT_SUCCESS(status) && !list)) {
+                return;
+        }
+
+        auto &ctx = *get_vhci_ctx(vhci);
+        wdf::WaitLock lck(ctx.resolver_lock);
+
+        if (auto e = ctx.resolver->insert(node.Buffer, length(node), service.Buffer, length(service),
+                                          NT_SUCCESS(status) ? 0 : status, now_ms())) {
+                e->cnt = copy(e->addrs, NT_SUCCESS(status) ? list : nullptr);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+int usbip::resolver::copy(_Out_writes_to_(MAX_ADDRESSES, return) SOCKADDR_INET *addrs, _In_opt_ const ADDRINFOEXW *list)
+{
+        int cnt = 0;
+
+        for (auto ai = list; ai && cnt < MAX_ADDRESSES; ai = ai->ai_next) {
+                if (ai->ai_addrlen <= sizeof(*addrs)) {
+                        auto &a = addrs[cnt++];
+                        RtlZeroMemory(&a, sizeof(a));
+                        RtlCopyMemory(&a, ai->ai_addr, ai->ai_addrlen);
+                }
+        }
+
+        return cnt;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::resolver::query(_In_ WDFDEVICE vhci, _Inout_ vhci::ioctl::resolver_cache &r)
+{
+        PAGED_CODE();
+
+        auto &ctx = *get_vhci_ctx(vhci);
+        wdf::WaitLock lck(ctx.resolver_lock);
+
+        auto &cache = *ctx.resolver;
+        auto &c = cache.get_counters();
+
+        r.entries = cache.size(now_ms());
+        r.hits = c.hits;
+        r.negative_hits = c.negative_hits;
+        r.misses = c.misses;
+        r.evictions = c.evictions;
+
+        if (r.flush) {
+                cache.flush();
+        }
+
+        TraceDbg("entries %d, hits %I64u, negative_hits %I64u, misses %I64u, evictions %I64u, flush %d",
+                  r.entries, r.hits, r.negative_hits, r.misses, r.evictions, r.flush);
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbip\resolver_cache.h>
+#include <usbip\vhci.h>
+
+#include <wsk.h>
+
+namespace usbip
+{
+
+/*
+ * Devices of the same server are usually attached one after another (persistent devices,
+ * re-attach after a network failure), so its name is resolved once, see PLUGIN_HARDWARE.
+ */
+struct resolver_cache : dns::cache<wchar_t, SOCKADDR_INET, 32> {};
+
+} // namespace usbip
+
+
+namespace usbip::resolver
+{
+
+enum { MAX_ADDRESSES = dns::max_addresses };
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_In_ WDFDEVICE vhci);
+
+/*
+ * @param status STATUS_SUCCESS or the cached error of getaddrinfo
+ * @param cnt of addrs, zero for a negative entry
+ * @return false if the cache does not have an entry
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool find(
+        _In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _Out_ NTSTATUS &status, _Out_writes_to_(MAX_ADDRESSES, cnt) SOCKADDR_INET *addrs, _Out_ int &cnt);
+
+/*
+ * Save the result of getaddrinfo. Transient errors are not cached.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void store(
+        _In_ WDFDEVICE vhci, _In_ const UNICODE_STRING &node, _In_ const UNICODE_STRING &service,
+        _In_ NTSTATUS status, _In_opt_ const ADDRINFOEXW *list);
+
+/*
+ * @return the number of addresses copied
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+int copy(_Out_writes_to_(MAX_ADDRESSES, return) SOCKADDR_INET *addrs, _In_opt_ const ADDRINFOEXW *list);
+
+/*
+ * Fill the counters and flush the cache if requested.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void query(_In_ WDFDEVICE vhci, _Inout_ vhci::ioctl::resolver_cache &r);
+
+} // namespace usbip::resolver
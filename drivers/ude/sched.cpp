@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "sched.h"
+#include "trace.h"
+#include "sched.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "persistent.h"
+#include "vhci.h"
+
+#include <usbip\consts.h>
+
+namespace
+{
+
+using namespace usbip;
+using vhci::ioctl::sched_rule;
+using vhci::ioctl::sched_policy;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+constexpr auto is_valid(_In_ const sched_rule &r)
+{
+        return r.cls >= -1 && r.cls <= UCHAR(~0) &&
+               r.subclass >= -1 && r.subclass <= UCHAR(~0) &&
+               r.priority >= 0 && r.priority <= LOW_REALTIME_PRIORITY && // higher ones starve the system threads
+               r.priority_boost <= MAXCHAR;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+constexpr auto is_valid(_In_ const sched_policy &p)
+{
+        if (!(p.cnt >= 0 && p.cnt <= p.max_rules)) {
+                return false;
+        }
+
+        for (int i = 0; i < p.cnt; ++i) {
+                if (!is_valid(p.rules[i])) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto matches(_In_ const sched_rule &r, _In_ const device_ctx &dev)
+{
+        auto &d = dev.ext->dev;
+        return (!r.vendor || r.vendor == d.vendor) && (!r.product || r.product == d.product);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto matches(_In_ const sched_rule &r, _In_ const device_ctx &dev, _In_ int cls, _In_ int subclass)
+{
+        return matches(r, dev) && (r.cls < 0 || r.cls == cls) && (r.subclass < 0 || r.subclass == subclass);
+}
+
+/*
+ * A rule for the receive thread matches the device or one of its selected interfaces.
+ * vhci_ctx::sched_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void find_thread_rule(_In_ const sched_policy &p, _Inout_ device_ctx &dev)
+{
+        int found = -1;
+
+        for (int i = 0; i < p.cnt && found < 0; ++i) {
+
+                auto &r = p.rules[i];
+                if (!(r.priority || r.affinity)) {
+                        continue;
+                }
+
+                if (r.cls < 0 && r.subclass < 0) {
+                        if (matches(r, dev)) {
+                                found = i;
+                        }
+                        continue;
+                }
+
+                for (int j = 0; j < dev.sched_intf_cnt; ++j) {
+                        if (auto &intf = dev.sched_intfs[j]; matches(r, dev, intf.cls, intf.subclass)) {
+                                found = i;
+                                break;
+                        }
+                }
+        }
+
+        auto priority = found < 0 ? 0 : p.rules[found].priority;
+        auto affinity = found < 0 ? 0 : KAFFINITY(p.rules[found].affinity);
+
+        if (found != dev.sched_rule || priority != dev.sched_priority || affinity != dev.sched_affinity) {
+                dev.sched_rule = found;
+                dev.sched_priority = priority;
+                dev.sched_affinity = affinity;
+                InterlockedIncrement(&dev.sched_gen); // see update_thread
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto load(_Out_ sched_policy &p)
+{
+        PAGED_CODE();
+
+        RtlZeroMemory(&p, sizeof(p));
+        p.size = sizeof(p);
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return err;
+        }
+
+        UNICODE_STRING val_name;
+        RtlUnicodeStringInit(&val_name, sched_policy_value_name);
+
+        ULONG actual{};
+        auto type = REG_NONE;
+
+        if (auto err = WdfRegistryQueryValue(key.get(), &val_name, sizeof(p.rules), p.rules, &actual, &type)) {
+                TraceDbg("WdfRegistryQueryValue(%!USTR!) %!STATUS!", &val_name, err);
+                return err;
+        }
+
+        if (type != REG_BINARY || actual % sizeof(*p.rules)) {
+                Trace(TRACE_LEVEL_ERROR, "%!USTR!: type %lu, length %lu", &val_name, type, actual);
+                RtlZeroMemory(p.rules, sizeof(p.rules));
+                return STATUS_INVALID_CONFIG_VALUE;
+        }
+
+        p.cnt = actual/sizeof(*p.rules);
+
+        if (!is_valid(p)) {
+                Trace(TRACE_LEVEL_ERROR, "%!USTR!: invalid rule", &val_name);
+                RtlZeroMemory(p.rules, sizeof(p.rules));
+                p.cnt = 0;
+                return STATUS_INVALID_CONFIG_VALUE;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto save(_In_ const sched_policy &p)
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (auto err = open_parameters_key(key, KEY_SET_VALUE)) {
+                return err;
+        }
+
+        UNICODE_STRING val_name;
+        RtlUnicodeStringInit(&val_name, sched_policy_value_name);
+
+        auto length = ULONG(p.cnt*sizeof(*p.rules));
+
+        auto st = WdfRegistryAssignValue(key.get(), &val_name, REG_BINARY, length, const_cast<sched_rule*>(p.rules));
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRegistryAssignValue(%!USTR!) %!STATUS!, length %lu", &val_name, st, length);
+        }
+        return st;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::sched::init(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+        auto &ctx = *get_vhci_ctx(vhci);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = vhci;
+
+        if (auto err = WdfSpinLockCreate(&attr, &ctx.sched_lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        WDFMEMORY mem{};
+        if (auto err = WdfMemoryCreate(&attr, NonPagedPoolNx, pooltag, sizeof(*ctx.sched), &mem,
+                                       reinterpret_cast<PVOID*>(&ctx.sched))) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate %!STATUS!", err);
+                return err;
+        }
+
+        load(*ctx.sched); // an empty policy if it fails
+        TraceDbg("%d rule(s)", ctx.sched->cnt);
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::sched::set_policy(_In_ WDFDEVICE vhci, _In_ const vhci::ioctl::sched_policy &policy)
+{
+        PAGED_CODE();
+
+        if (!is_valid(policy)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        if (auto err = save(policy)) {
+                return err;
+        }
+
+        auto &ctx = *get_vhci_ctx(vhci);
+        {
+                wdf::Lock lck(ctx.sched_lock);
+
+                RtlCopyMemory(ctx.sched, &policy, sizeof(policy));
+                ctx.sched->size = sizeof(*ctx.sched);
+        }
+
+        TraceDbg("%d rule(s)", policy.cnt);
+
+        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
+                if (auto dev = vhci::get_device(vhci, port)) {
+                        apply(*get_device_ctx(dev.get()));
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::sched::get_policy(_In_ WDFDEVICE vhci, _Out_ vhci::ioctl::sched_policy &policy)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+
+        wdf::Lock lck(ctx.sched_lock);
+        RtlCopyMemory(&policy, ctx.sched, sizeof(policy));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::sched::apply(_Inout_ device_ctx &dev)
+{
+        auto &ctx = *get_vhci_ctx(dev.vhci);
+
+        wdf::Lock lck(ctx.sched_lock);
+        find_thread_rule(*ctx.sched, dev);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+CCHAR usbip::sched::select_interface(
+        _Inout_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf, _In_ CCHAR boost)
+{
+        auto &ctx = *get_vhci_ctx(dev.vhci);
+        auto &p = *ctx.sched;
+
+        wdf::Lock lck(ctx.sched_lock);
+
+        if (dev.sched_intf_cnt < max_interfaces) {
+                auto &i = dev.sched_intfs[dev.sched_intf_cnt++];
+                i.cls = intf.Class;
+                i.subclass = intf.SubClass;
+        }
+
+        find_thread_rule(p, dev);
+
+        for (int i = 0; i < p.cnt; ++i) {
+                if (auto &r = p.rules[i]; r.priority_boost >= 0 && matches(r, dev, intf.Class, intf.SubClass)) {
+                        return static_cast<CCHAR>(r.priority_boost);
+                }
+        }
+
+        return boost;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::sched::clear_interfaces(_Inout_ device_ctx &dev)
+{
+        auto &ctx = *get_vhci_ctx(dev.vhci);
+
+        wdf::Lock lck(ctx.sched_lock);
+
+        dev.sched_intf_cnt = 0;
+        find_thread_rule(*ctx.sched, dev);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::sched::update_thread(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto gen = ReadNoFence(&dev.sched_gen);
+        if (gen == dev.sched_applied) {
+                return;
+        }
+
+        LONG priority{};
+        KAFFINITY affinity{};
+        {
+                auto &ctx = *get_vhci_ctx(dev.vhci);
+                wdf::Lock lck(ctx.sched_lock);
+
+                priority = dev.sched_priority;
+                affinity = dev.sched_affinity;
+                dev.sched_applied = dev.sched_gen;
+        }
+
+        auto thread = KeGetCurrentThread();
+
+        if (!priority) {
+                priority = dev.recv_default_priority;
+        }
+        KeSetPriorityThread(thread, priority);
+        dev.recv_priority = priority;
+
+        auto active = KeQueryActiveProcessors();
+        if (!(affinity &= active)) {
+                affinity = active; // is not restricted
+        }
+        KeSetSystemAffinityThreadEx(affinity);
+
+        TraceDbg("dev %04x, priority %ld, affinity %#Ix", ptr04x(get_handle(&dev)), priority, affinity);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+int usbip::sched::get_rule(_In_ device_ctx &dev, _Out_ KAFFINITY &affinity)
+{
+        auto &ctx = *get_vhci_ctx(dev.vhci);
+        wdf::Lock lck(ctx.sched_lock);
+
+        affinity = dev.sched_affinity;
+        return dev.sched_rule;
+}
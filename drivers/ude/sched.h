@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbip\vhci.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+        struct device_ctx;
+}
+
+/*
+ * Scheduling policy of imported devices: priority and affinity of the receive thread,
+ * priority boost of completed URBs. Rules are matched by VID:PID and interface class,
+ * they are loaded from sched_policy_value_name and can be replaced by SET_SCHED_POLICY.
+ *
+ * The receive thread applies its policy itself, see update_thread.
+ * Devices that share the connection (EXT_MULTIPLEX) have no receive thread of their own,
+ * only priority boost is applied to them.
+ */
+namespace usbip::sched
+{
+
+enum { max_interfaces = 8 }; // of the selected configuration, see select_interface
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_In_ WDFDEVICE vhci);
+
+/*
+ * Save the policy and apply it to plugged devices.
+ * Priority boost of endpoints is changed when their interface is selected next time.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS set_policy(_In_ WDFDEVICE vhci, _In_ const vhci::ioctl::sched_policy &policy);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_policy(_In_ WDFDEVICE vhci, _Out_ vhci::ioctl::sched_policy &policy);
+
+/*
+ * Find the rule for the receive thread of the device.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void apply(_Inout_ device_ctx &dev);
+
+/*
+ * The interface is remembered, a rule for its class can apply to the receive thread.
+ * @param boost built-in priority boost for the interface
+ * @return priority boost for completed URBs of the interface
+ * @see update_pipe_properties
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+CCHAR select_interface(_Inout_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf, _In_ CCHAR boost);
+
+/*
+ * Another configuration is selected, forget its interfaces.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void clear_interfaces(_Inout_ device_ctx &dev);
+
+/*
+ * Set priority and affinity of the current thread if the policy was changed.
+ * Must be called by the receive thread of the device only.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void update_thread(_Inout_ device_ctx &dev);
+
+/*
+ * @return index of the rule of the receive thread, -1 if there is no such rule
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+int get_rule(_In_ device_ctx &dev, _Out_ KAFFINITY &affinity);
+
+} // namespace usbip::sched
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "session.h"
+#include "trace.h"
+#include "session.tmh"
+
+#include "context.h"
+#include "network.h"
+#include "mux.h"
+#include "request_list.h"
+#include "persistent.h"
+#include "vhci.h"
+#include "vhci_ioctl.h"
+#include "wsk_receive.h"
+#include "pool.h"
+#include "sockbuf.h"
+#include "bot_cache.h"
+#include "push.h"
+#include "stream.h"
+
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum : UINT32 {
+        ATTEMPT_TIMEOUT_MS = 3*1000, // of name resolution and of each connection attempt
+        RETRY_MS = 1000, // after failed attempt
+};
+
+inline auto now_ms() { return KeQueryInterruptTime()/wdm::msec; }
+
+/*
+ * The server has not seen USBIP_RET_SUBMIT-s of the old session, so they are lost.
+ * URBs are not resubmitted on the new socket, the class drivers just see that they failed.
+ * Whether the I/O is retried depends on a class driver, an application can get an error.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void fail_requests(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        int cnt = 0;
+
+        for (WDFREQUEST request; (request = device::remove_request(dev, device)) != WDF_NO_HANDLE; ++cnt) {
+                complete(request, STATUS_RETRY);
+        }
+
+        TraceDbg("dev %04x, %d request(s) completed", ptr04x(device), cnt);
+        bot::cancel(dev);
+        push::cancel(dev, STATUS_RETRY);
+        stream::cancel(dev, STATUS_RETRY);
+}
+
+/*
+ * @return STATUS_SUCCESS if the server has exported the same device on the new connection
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS import(_Inout_ SOCKET *sock, _In_ const device_ctx &dev)
+{
+        PAGED_CODE();
+
+        op_import_reply reply;
+        if (auto err = vhci::import(sock, dev.ext->busid, reply)) {
+                return err;
+        }
+
+        auto &udev = reply.udev;
+        auto devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum));
+
+        if (devid != dev.devid() || udev.speed != static_cast<UINT32>(dev.speed()) || 
+            udev.idVendor != dev.ext->dev.vendor || udev.idProduct != dev.ext->dev.product) {
+                Trace(TRACE_LEVEL_ERROR, "%!USTR!: another device is exported, devid %#x -> %#x, %04x:%04x", 
+                        &dev.ext->busid, dev.devid(), devid, udev.idVendor, udev.idProduct);
+                return USBIP_ERROR_ST_DEV_ERR;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * @return STATUS_SUCCESS if sock is ready for USBIP_CMD_*, 
+ *         STATUS_RETRY if another attempt can succeed
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS reconnect(_Out_ SOCKET* &sock, _In_ const device_ctx &dev, _In_ UINT32 timeout_ms)
+{
+        PAGED_CODE();
+
+        auto &ext = *dev.ext;
+
+        if (auto err = pool::connect(sock, dev.vhci, ext.node_name, ext.service_name, timeout_ms)) {
+                TraceDbg("%!USTR!:%!USTR!, %!STATUS!", &ext.node_name, &ext.service_name, err);
+                return STATUS_RETRY;
+        }
+
+        switch (auto st = import(sock, dev)) {
+        case STATUS_SUCCESS:
+                return st;
+        case USBIP_ERROR_ST_DEV_ERR:
+        case USBIP_ERROR_ST_NODEV:
+                close_socket(sock);
+                free(sock);
+                return st;
+        default:
+                close_socket(sock);
+                free(sock);
+                return STATUS_RETRY; // the server is not ready yet
+        }
+}
+
+/*
+ * The previous socket can still be used by detach that has read sock() before the swap.
+ * If dev.unplugged is false after the swap, detach will read the new socket, so the previous one can be freed
+ * at the next resumption.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto swap_socket(_Inout_ device_ctx &dev, _In_ SOCKET *sock)
+{
+        PAGED_CODE();
+
+        auto &ext = *dev.ext;
+        SOCKET *prev{};
+        {
+                wdf::Lock lck(dev.send_lock);
+
+                prev = ext.prev_sock;
+                ext.prev_sock = ext.sock;
+
+                ext.sock = sock;
+                dev.resuming = false;
+        }
+
+        free(prev);
+
+        KeMemoryBarrier();
+        return !dev.unplugged;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::session::init(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto &ext = *dev.ext;
+
+        if (!(ext.mux || ext.dgram)) {
+                dev.resume_timeout_ms = get_parameter(session_resume_timeout_value_name, 0)*1000;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::session::resume(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+
+        auto &dev = *get_device_ctx(device);
+        auto &ext = *dev.ext;
+
+        if (!dev.resume_timeout_ms) {
+                return false;
+        }
+
+        {
+                wdf::Lock lck(dev.send_lock);
+                dev.resuming = true;
+        }
+
+        close_socket(ext.sock); // can be closed already
+
+        if (ext.shaper) {
+                mux::purge(dev, STATUS_RETRY); // must not be sent on the new socket
+        }
+        fail_requests(device, dev);
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!USTR!:%!USTR!/%!USTR!, connection lost, resuming during %lu ms", 
+                ptr04x(device), &ext.node_name, &ext.service_name, &ext.busid, dev.resume_timeout_ms);
+
+        vhci::device_state_changed(dev, vhci::state::connecting);
+
+        auto deadline = now_ms() + dev.resume_timeout_ms;
+        auto st = STATUS_RETRY;
+
+        for (UINT64 now; st == STATUS_RETRY && !dev.unplugged && (now = now_ms()) < deadline; ) {
+
+                SOCKET *sock{};
+                auto timeout_ms = static_cast<UINT32>(min(deadline - now, ATTEMPT_TIMEOUT_MS));
+
+                if (st = reconnect(sock, dev, timeout_ms); !st) {
+                        if (swap_socket(dev, sock)) {
+                                break;
+                        }
+                        close_socket(sock); // detach could have closed the previous socket
+                        return false;
+                } else if (st == STATUS_RETRY) {
+                        auto timeout = make_timeout(RETRY_MS*wdm::msec, wdm::period::relative);
+                        KeDelayExecutionThread(KernelMode, false, &timeout);
+                }
+        }
+
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, %!USTR!:%!USTR!/%!USTR!, could not resume, %!STATUS!", 
+                        ptr04x(device), &ext.node_name, &ext.service_name, &ext.busid, st);
+                return false;
+        }
+
+        ++dev.resumed_sessions;
+        sockbuf::apply(dev);
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!USTR!:%!USTR!/%!USTR!, session resumed", 
+                ptr04x(device), &ext.node_name, &ext.service_name, &ext.busid);
+
+        vhci::device_state_changed(dev, vhci::state::connected);
+        vhci::device_state_changed(dev, vhci::state::plugged);
+
+        return true;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+        struct device_ctx;
+}
+
+/*
+ * Resumption of a session after a transient loss of the connection to a server.
+ * The device stays plugged during the grace period, see session_resume_timeout_value_name.
+ * URBs that were sent and that are submitted meanwhile are completed with STATUS_RETRY,
+ * they are not resubmitted after the socket is replaced.
+ * Sessions that use protocol extensions are not resumed because the server's state can't be restored.
+ */
+namespace usbip::session
+{
+
+/*
+ * Set device_ctx::resume_timeout_ms.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void init(_Inout_ device_ctx &dev);
+
+/*
+ * Reconnect to the server and import the same busid on a new socket.
+ * Must be called by recv_thread only, after the connection was lost.
+ * @return true if the device can receive on sock() again, false if it must be detached
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool resume(_In_ UDECXUSBDEVICE device);
+
+} // namespace usbip::session
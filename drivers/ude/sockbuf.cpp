@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "sockbuf.h"
+#include "trace.h"
+#include "sockbuf.tmh"
+
+#include "context.h"
+#include "wsk_context.h"
+#include "network.h"
+#include "persistent.h"
+
+#include <libdrv\ch9.h>
+#include <libdrv\pdu.h>
+
+namespace
+{
+
+using namespace usbip;
+
+inline auto now_ms() { return KeQueryInterruptTime()/wdm::msec; }
+
+/*
+ * @return time in microseconds since the request was sent, zero if it is not a control transfer
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto control_rtt(_In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+        auto &endp = *get_endpoint_ctx(req.endpoint);
+
+        if (usb_endpoint_type(endp.descriptor) != UsbdPipeTypeControl) {
+                return 0UL;
+        }
+
+        auto elapsed = (KeQueryInterruptTime() - req.sent_at)/10; // 100-nanosecond units
+        return static_cast<ULONG>(elapsed ? elapsed : 1);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::sockbuf::init(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto max_bytes = get_parameter(socket_buffer_max_value_name, 0);
+        dev.sockbuf_enabled = max_bytes && !dev.ext->mux;
+
+        if (dev.sockbuf_enabled) {
+                auto min_bytes = get_parameter(socket_buffer_min_value_name, bdp::default_min_bytes);
+                auto factor = get_parameter(socket_buffer_factor_value_name, bdp::default_factor);
+
+                dev.sockbuf.init(min_bytes, max_bytes, factor, now_ms());
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::sockbuf::sent(_Inout_ device_ctx &dev, _In_ SIZE_T bytes)
+{
+        InterlockedExchangeAdd64(&dev.bytes_sent, bytes);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::sockbuf::received(_Inout_ device_ctx &dev, _In_ const wsk_context &ctx)
+{
+        PAGED_CODE();
+
+        dev.bytes_received += get_total_size(ctx.hdr);
+
+        if (!dev.sockbuf_enabled) {
+                return;
+        }
+
+        auto &e = dev.sockbuf;
+
+        if (auto request = ctx.request; !request) {
+                //
+        } else if (auto rtt = control_rtt(request)) {
+                e.rtt(rtt);
+        }
+
+        if (e.update(now_ms(), dev.bytes_received, dev.bytes_sent)) {
+                TraceDbg("dev %04x, srtt %lu us, rate rx %!UINT64!, tx %!UINT64! B/s -> rcvbuf %lu, sndbuf %lu", 
+                          ptr04x(get_handle(&dev)), e.srtt_us(), e.rx_rate(), e.tx_rate(), e.rcvbuf(), e.sndbuf());
+
+                ++dev.sockbuf_changes;
+                apply(dev);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::sockbuf::apply(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto &e = dev.sockbuf;
+
+        if (!(dev.sockbuf_enabled && e.rcvbuf())) {
+                //
+        } else if (auto err = set_buffer_sizes(dev.sock(), int(e.rcvbuf()), int(e.sndbuf()))) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, set_buffer_sizes(rcvbuf %lu, sndbuf %lu) %!STATUS!", 
+                        ptr04x(get_handle(&dev)), e.rcvbuf(), e.sndbuf(), err);
+        }
+}
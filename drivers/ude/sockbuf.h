@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+namespace usbip
+{
+        struct device_ctx;
+        struct wsk_context;
+}
+
+/*
+ * Adaptive SO_RCVBUF/SO_SNDBUF of the connection of a device, see usbip::bdp::estimator.
+ * RTT is measured by control transfers, throughput by PDUs that were received and sent.
+ * It is disabled if socket_buffer_max_value_name is zero or the connection is shared (mux_ctx).
+ */
+namespace usbip::sockbuf
+{
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void init(_Inout_ device_ctx &dev);
+
+/*
+ * A PDU was sent successfully.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void sent(_Inout_ device_ctx &dev, _In_ SIZE_T bytes);
+
+/*
+ * Must be called by recv_thread for each PDU after its payload was received.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void received(_Inout_ device_ctx &dev, _In_ const wsk_context &ctx);
+
+/*
+ * Set the current sizes on sock(), for example after it was replaced by session::resume.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void apply(_Inout_ device_ctx &dev);
+
+} // namespace usbip::sockbuf
@@ -0,0 +1,557 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "stream.h"
+#include "trace.h"
+#include "stream.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "ioctl.h"
+#include "device_ioctl.h"
+#include "endpoint_list.h"
+#include "wsk_receive.h"
+
+#include <libdrv\ch9.h>
+#include <libdrv\usbd_helper.h>
+#include <libdrv\dbgcommon.h>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * Vendor specific interfaces of these devices are serial ports, zero product matches any.
+ */
+const struct {
+        UINT16 vendor;
+        UINT16 product;
+} serial_bridges[] {
+        { 0x0403, 0 }, // FTDI
+        { 0x10C4, 0 }, // Silicon Labs CP210x
+        { 0x067B, 0 }, // Prolific PL2303
+        { 0x1A86, 0 }, // WCH CH34x
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto is_serial(_In_ const device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf)
+{
+        switch (intf.Class) {
+        case USB_DEVICE_CLASS_CDC_DATA:
+                return true;
+        case USB_DEVICE_CLASS_VENDOR_SPECIFIC:
+                for (auto &d = dev.ext->dev; auto &b: serial_bridges) {
+                        if (b.vendor == d.vendor && (!b.product || b.product == d.product)) {
+                                return true;
+                        }
+                }
+        }
+
+        return false;
+}
+
+/*
+ * device_ctx::stream_lock must be acquired.
+ * @param endpoint a free slot if NULL
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+stream::state* find(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint)
+{
+        for (auto &s: dev.streams) {
+                if (s.endpoint == endpoint) {
+                        return &s;
+                }
+        }
+
+        return nullptr;
+}
+
+/*
+ * device_ctx::stream_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+stream::state* find(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        NT_ASSERT(seqnum);
+
+        for (auto &s: dev.streams) {
+                for (int i = 0; i < s.inflight; ++i) {
+                        if (s.reads[i] == seqnum) {
+                                return &s;
+                        }
+                }
+        }
+
+        return nullptr;
+}
+
+/*
+ * @return false if the read is not outstanding
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+bool remove_read(_Inout_ stream::state &s, _In_ seqnum_t seqnum)
+{
+        for (int i = 0; i < s.inflight; ++i) {
+                if (s.reads[i] == seqnum) {
+                        RtlMoveMemory(s.reads + i, s.reads + i + 1, (--s.inflight - i)*sizeof(*s.reads));
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/*
+ * Reserve seqnums of the reads that the ring has room for.
+ * device_ctx::stream_lock must be acquired.
+ *
+ * @return number of reads to send
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+int refill(_Inout_ device_ctx &dev, _Inout_ stream::state &s, _Out_writes_(stream::max_reads) seqnum_t *seqnums)
+{
+        int cnt = 0;
+
+        if (!s.read_size || s.error) {
+                return cnt;
+        }
+
+        while (s.inflight < int(dev.stream_reads)) {
+                if (s.inflight + s.ring.size() >= report_ring::max_slots) {
+                        ++dev.stream_throttled; // backpressure, the data was not consumed yet
+                        break;
+                }
+
+                seqnums[cnt++] = s.reads[s.inflight++] = next_seqnum(dev, true);
+        }
+
+        return cnt;
+}
+
+/*
+ * @param seqnums were reserved by refill
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_reads(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ ULONG read_size,
+        _In_reads_(cnt) const seqnum_t *seqnums, _In_ int cnt)
+{
+        auto &endp = *get_endpoint_ctx(endpoint);
+
+        for (int i = 0; i < cnt; ++i) {
+                if (auto st = device::send_ahead(dev, endp, read_size, seqnums[i]); st != STATUS_PENDING) {
+                        Trace(TRACE_LEVEL_ERROR, "endp %04x, seqnum %u, %!STATUS!", ptr04x(endpoint), seqnums[i], st);
+
+                        wdf::Lock lck(dev.stream_lock);
+                        if (auto s = find(dev, endpoint)) {
+                                remove_read(*s, seqnums[i]); // the stream continues if other reads were sent
+                        }
+                }
+        }
+}
+
+/*
+ * @param endpoint any endpoint if NULL
+ * @return the oldest URB of the endpoint that waits for data
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST retrieve(_In_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint)
+{
+        WDFREQUEST result{};
+        WDFREQUEST prev{};
+
+        for (WDFREQUEST found{};
+             !result && NT_SUCCESS(WdfIoQueueFindRequest(dev.stream_requests, prev, WDF_NO_HANDLE, nullptr, &found)); ) {
+
+                if (prev) {
+                        WdfObjectDereference(prev);
+                }
+                prev = found;
+
+                if (endpoint && get_request_ctx(found)->endpoint != endpoint) {
+                        // continue;
+                } else if (!NT_SUCCESS(WdfIoQueueRetrieveFoundRequest(dev.stream_requests, found, &result))) {
+                        WdfObjectDereference(prev); // cancelled, is not in the queue, start over
+                        prev = WDF_NO_HANDLE;
+                }
+        }
+
+        if (prev) {
+                WdfObjectDereference(prev);
+        }
+
+        return result;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_waiting(_In_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint, _In_ NTSTATUS status)
+{
+        while (auto request = retrieve(dev, endpoint)) {
+                complete(request, status);
+        }
+}
+
+/*
+ * Complete URB by the front transfer or the error that stopped the stream.
+ * device_ctx::stream_lock must be acquired, the ring must not be empty or the error must be set.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void take(_Inout_ stream::state &s, _In_ WDFREQUEST request)
+{
+        auto &urb = get_urb(request);
+
+        if (s.ring.empty()) {
+                NT_ASSERT(s.error);
+                urb.UrbHeader.Status = s.error;
+                UdecxUrbSetBytesCompleted(request, 0);
+                s.error = USBD_STATUS_SUCCESS;
+                s.read_size = 0; // the next URB starts the stream again
+                return;
+        }
+
+        UINT32 len{};
+        auto data = s.ring.front(len);
+
+        UCHAR *buf{};
+        ULONG buf_len{};
+        ULONG cnt{};
+
+        if (NT_SUCCESS(UdecxUrbRetrieveBuffer(request, &buf, &buf_len))) {
+                cnt = min(buf_len, len - s.offset);
+                RtlCopyMemory(buf, data + s.offset, cnt);
+        }
+
+        s.offset += cnt;
+        if (s.offset == len || !cnt) {
+                s.ring.pop();
+                s.offset = 0;
+        }
+
+        urb.UrbHeader.Status = USBD_STATUS_SUCCESS;
+        UdecxUrbSetBytesCompleted(request, cnt);
+}
+
+/*
+ * Complete waiting URB-s of the stream while there is data for them, then send the reads the ring has room for.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void deliver(_Inout_ device_ctx &dev, _Inout_ stream::state &s)
+{
+        UDECXUSBENDPOINT endpoint{};
+        ULONG read_size{};
+
+        seqnum_t seqnums[stream::max_reads];
+        int cnt = 0;
+
+        for (WDFREQUEST request{}; ; complete(request, STATUS_SUCCESS)) {
+                wdf::Lock lck(dev.stream_lock);
+
+                if (!(s.ring.empty() && !s.error) && (request = retrieve(dev, s.endpoint)) != WDF_NO_HANDLE) {
+                        take(s, request);
+                        continue;
+                }
+
+                endpoint = s.endpoint;
+                read_size = s.read_size;
+                cnt = refill(dev, s, seqnums);
+                break;
+        }
+
+        if (cnt) {
+                send_reads(dev, endpoint, read_size, seqnums, cnt);
+        }
+}
+
+/*
+ * Stop the streams of the endpoint or all of them if it is not set.
+ * @param unlink send CMD_UNLINK-s for outstanding reads
+ * @param release free the slots
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void stop(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint, _In_ bool unlink, _In_ bool release)
+{
+        seqnum_t unlinks[stream::max_streams*stream::max_reads];
+        int cnt = 0;
+        {
+                wdf::Lock lck(dev.stream_lock);
+
+                for (auto &s: dev.streams) {
+                        if (!s.endpoint || (endpoint && s.endpoint != endpoint)) {
+                                continue;
+                        }
+
+                        for (int i = 0; unlink && i < s.inflight; ++i) {
+                                unlinks[cnt++] = s.reads[i];
+                        }
+
+                        s.inflight = 0;
+                        s.read_size = 0;
+                        s.error = USBD_STATUS_SUCCESS;
+                        s.ring.clear();
+                        s.offset = 0;
+
+                        if (release) {
+                                if (auto &buf = s.ring_buf) {
+                                        ExFreePoolWithTag(buf, pooltag);
+                                        buf = nullptr;
+                                }
+                                s.ring = report_ring{};
+                                s.endpoint = WDF_NO_HANDLE;
+                        }
+                }
+        }
+
+        for (int i = 0; i < cnt; ++i) {
+                device::send_cmd_unlink(dev, unlinks[i]);
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::stream::init(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (!dev.stream_reads) {
+                return STATUS_SUCCESS;
+        }
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = device;
+
+        WDF_IO_QUEUE_CONFIG cfg;
+        WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchManual);
+        cfg.PowerManaged = WdfFalse;
+
+        cfg.EvtIoCanceledOnQueue = [] (auto, auto request) // EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE
+        {
+                TraceDbg("req %04x", ptr04x(request));
+                complete(request, STATUS_CANCELLED);
+        };
+
+        if (auto err = WdfIoQueueCreate(dev.vhci, &cfg, &attr, &dev.stream_requests)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoQueueCreate %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::stream::free(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (!dev.stream_requests) {
+                return;
+        }
+
+        stop(dev, WDF_NO_HANDLE, false, true);
+
+        if (auto n = dev.stream_transfers) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!UINT64! streamed transfer(s), %!UINT64! bytes, "
+                        "%!UINT64! refill(s) held back", ptr04x(get_handle(&dev)), n, dev.stream_bytes, dev.stream_throttled);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::stream::enable(_Inout_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf)
+{
+        if (!(dev.stream_requests && is_serial(dev, intf))) {
+                return;
+        }
+
+        for (ULONG i = 0; i < intf.NumberOfPipes; ++i) {
+
+                auto &pipe = intf.Pipes[i];
+                if (!(pipe.PipeType == UsbdPipeTypeBulk && USB_ENDPOINT_DIRECTION_IN(pipe.EndpointAddress))) {
+                        continue;
+                }
+
+                auto endp = find_endpoint(dev, pipe.EndpointAddress);
+                if (!endp) {
+                        continue;
+                }
+
+                auto endpoint = get_endpoint(endp->queue);
+                bool ok{};
+                {
+                        wdf::Lock lck(dev.stream_lock);
+
+                        if (find(dev, endpoint)) {
+                                ok = true;
+                        } else if (auto s = find(dev, UDECXUSBENDPOINT{})) {
+                                s->endpoint = endpoint;
+                                ok = true;
+                        }
+                }
+
+                TraceDbg("interface %d.%d, %#x/%#x/%#x, EndpointAddress %#x, endp %04x, stream %d",
+                          intf.InterfaceNumber, intf.AlternateSetting, intf.Class, intf.SubClass, intf.Protocol,
+                          pipe.EndpointAddress, ptr04x(endpoint), ok);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::stream::disable(_Inout_ device_ctx &dev)
+{
+        if (dev.stream_requests) {
+                stop(dev, WDF_NO_HANDLE, true, true);
+                complete_waiting(dev, WDF_NO_HANDLE, STATUS_CANCELLED);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::stream::reset(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint)
+{
+        if (dev.stream_requests) {
+                stop(dev, endpoint, true, false);
+                complete_waiting(dev, endpoint, STATUS_CANCELLED);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::stream::cancel(_Inout_ device_ctx &dev, _In_ NTSTATUS status)
+{
+        if (dev.stream_requests) {
+                stop(dev, WDF_NO_HANDLE, false, false);
+                complete_waiting(dev, WDF_NO_HANDLE, status);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::stream::submit(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request, _Inout_ URB &urb,
+        _Out_ NTSTATUS &status)
+{
+        status = STATUS_SUCCESS;
+
+        auto length = urb.UrbBulkOrInterruptTransfer.TransferBufferLength;
+        if (!(dev.stream_requests && length)) {
+                return false;
+        }
+
+        stream::state *s{};
+        {
+                wdf::Lock lck(dev.stream_lock);
+
+                s = find(dev, endpoint);
+                if (!s) {
+                        return false;
+                }
+
+                if (s->read_size) {
+                        //
+                } else if (auto read_size = min(length, max_read_size);
+                           s->ring_buf && s->ring.slot_size() >= read_size) {
+                        s->read_size = read_size;
+                        s->ring.init(s->ring_buf, read_size, report_ring::max_slots);
+                } else if (auto buf = (UCHAR*)ExAllocatePoolUninitialized(NonPagedPoolNx,
+                                        report_ring::max_slots*read_size, pooltag)) {
+                        if (s->ring_buf) {
+                                ExFreePoolWithTag(s->ring_buf, pooltag);
+                        }
+                        s->ring_buf = buf;
+                        s->read_size = read_size;
+                        s->ring.init(buf, read_size, report_ring::max_slots);
+                } else {
+                        return false;
+                }
+
+                if (!(s->ring.empty() && !s->error)) {
+                        take(*s, request);
+                        return true; // submit_urb completes it
+                }
+
+                if (auto err = WdfRequestForwardToIoQueue(request, dev.stream_requests)) {
+                        Trace(TRACE_LEVEL_ERROR, "req %04x, WdfRequestForwardToIoQueue %!STATUS!", ptr04x(request), err);
+                        status = err;
+                        return true;
+                }
+        }
+
+        status = STATUS_PENDING;
+        deliver(dev, *s); // the data could arrive meanwhile, sends the reads
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::stream::claim(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        if (!dev.stream_requests) {
+                return false;
+        }
+
+        wdf::Lock lck(dev.stream_lock);
+        return find(dev, seqnum);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::stream::received(_Inout_ device_ctx &dev, _In_ const header &hdr, _In_opt_ const UCHAR *data, _In_ NTSTATUS status)
+{
+        auto &ret = hdr.ret_submit;
+        UINT32 len = !status && ret.actual_length > 0 ? ret.actual_length : 0;
+
+        seqnum_t unlinks[max_reads];
+        int cnt = 0;
+
+        stream::state *s{};
+        {
+                wdf::Lock lck(dev.stream_lock);
+
+                s = find(dev, hdr.seqnum);
+                if (!s || !remove_read(*s, hdr.seqnum)) {
+                        return; // has been stopped meanwhile
+                }
+
+                ++dev.stream_transfers;
+
+                if (status || ret.status) {
+                        s->error = status ? USBD_STATUS_DEVICE_GONE : to_windows_status(ret.status);
+
+                        for (int i = 0; i < s->inflight; ++i) { // the stream stops
+                                unlinks[cnt++] = s->reads[i];
+                        }
+                        s->inflight = 0;
+
+                        TraceDbg("endp %04x, seqnum %u, %!STATUS!, %s", ptr04x(s->endpoint), hdr.seqnum, status,
+                                  get_usbd_status(s->error));
+
+                } else if (auto slot = s->ring.push(len)) {
+                        RtlCopyMemory(slot, data, len);
+                        dev.stream_bytes += len;
+                }
+        }
+
+        for (int i = 0; i < cnt; ++i) {
+                device::send_cmd_unlink(dev, unlinks[i]);
+        }
+
+        deliver(dev, *s);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbip\proto.h>
+#include <usbip\report_ring.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+        struct device_ctx;
+}
+
+/*
+ * Bulk IN streaming of serial interfaces (CDC Data, USB-serial bridges), it is enabled by bulk_stream_reads_value_name.
+ *
+ * Serial drivers issue many small bulk IN reads, every read costs a round trip.
+ * The first URB of a streamed endpoint starts the stream: up to device_ctx::stream_reads CMD_SUBMIT-s
+ * that are not bound to URBs are kept on the server. Their data is put into the ring of the endpoint
+ * and URBs are completed from it without a round trip, each URB gets the data of one transfer at most,
+ * so the boundaries of transfers are preserved. A read is sent again only if the ring has room for its data.
+ */
+namespace usbip::stream
+{
+
+enum { max_streams = 2 }; // bulk IN endpoints of a device
+enum { max_reads = 4 }; // outstanding CMD_SUBMIT-s of a stream, less than report_ring::max_slots
+enum : ULONG { max_read_size = 16*1024 };
+
+struct state
+{
+        UDECXUSBENDPOINT endpoint; // NULL if the slot is free
+        ULONG read_size; // TransferBufferLength of the first URB, zero if the stream was not started
+        seqnum_t reads[max_reads]; // outstanding CMD_SUBMIT-s in the order they were sent
+        int inflight; // in reads
+        USBD_STATUS error; // of the transfer that stopped the stream, it is reported after the data in the ring
+        report_ring ring; // transfers that were not consumed yet
+        UINT32 offset; // consumed bytes of the front transfer, URB can be shorter than read_size
+        UCHAR *ring_buf; // NonPagedPoolNx
+};
+
+/*
+ * Create the manual queue if streaming is enabled.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free(_Inout_ device_ctx &dev);
+
+/*
+ * Bulk IN endpoints of CDC Data interface or vendor specific interface of a known USB-serial bridge will be streamed.
+ * @see update_pipe_properties
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void enable(_Inout_ device_ctx &dev, _In_ const USBD_INTERFACE_INFORMATION &intf);
+
+/*
+ * Another configuration is selected, stop all streams.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void disable(_Inout_ device_ctx &dev);
+
+/*
+ * Stop the stream of the endpoint and discard its data, complete its waiting URB-s.
+ * @see endpoint_purge, clear_endpoint_stall
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void reset(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint);
+
+/*
+ * The server has forgotten the reads, CMD_UNLINK-s are not sent. Waiting URB-s are completed with status.
+ * @see session::resume
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel(_Inout_ device_ctx &dev, _In_ NTSTATUS status);
+
+/*
+ * @param status of URB function if the result is true
+ * @return false if URB must be sent as usual
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool submit(
+        _Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request, _Inout_ URB &urb,
+        _Out_ NTSTATUS &status);
+
+/*
+ * @return true if RET_SUBMIT is a streamed read, its payload must be received and passed to received
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool claim(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum);
+
+/*
+ * @param hdr RET_SUBMIT in host byte order
+ * @param data payload of ret_submit.actual_length bytes
+ * @param status of receiving of the payload
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void received(_Inout_ device_ctx &dev, _In_ const header &hdr, _In_opt_ const UCHAR *data, _In_ NTSTATUS status);
+
+} // namespace usbip::stream
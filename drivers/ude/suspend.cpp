@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "suspend.h"
+#include "trace.h"
+#include "suspend.tmh"
+
+#include "context.h"
+#include "device_ioctl.h"
+#include "request_list.h"
+
+#include <libdrv/wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { max_batch = device::max_unlink_burst };
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto is_interrupt_in(_In_ UDECXUSBENDPOINT endpoint)
+{
+        auto &d = get_endpoint_ctx(endpoint)->descriptor;
+        return usb_endpoint_type(d) == UsbdPipeTypeInterrupt && usb_endpoint_dir_in(d);
+}
+
+/*
+ * Mark interrupt IN requests as parked, CMD_UNLINK-s must be sent for them.
+ * device_ctx::requests_lock must be acquired.
+ *
+ * @param can_wake the first request of each endpoint is not parked
+ * @return number of parked requests, max_batch if there can be more
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto park(
+        _Inout_ device_ctx &dev, _In_ bool can_wake,
+        _Out_writes_(max_batch) seqnum_t *seqnums, _Out_writes_(max_batch) seqnum_t *unlinks)
+{
+        UDECXUSBENDPOINT kept[32]; // endpoints of the device
+        int kept_cnt = 0;
+
+        auto keep = [can_wake, &kept, &kept_cnt] (auto endpoint)
+        {
+                if (!can_wake) {
+                        return false;
+                }
+
+                for (int i = 0; i < kept_cnt; ++i) {
+                        if (kept[i] == endpoint) {
+                                return false;
+                        }
+                }
+
+                if (kept_cnt != ARRAYSIZE(kept)) {
+                        kept[kept_cnt++] = endpoint;
+                }
+                return true;
+        };
+
+        ULONG cnt = 0;
+
+        for (auto head = &dev.requests, entry = head->Flink; entry != head && cnt < max_batch; entry = entry->Flink) {
+
+                auto req = CONTAINING_RECORD(entry, request_ctx, entry);
+
+                if (req->unlink_seqnum || !is_interrupt_in(req->endpoint) || keep(req->endpoint)) {
+                        continue;
+                }
+
+                req->unlink_seqnum = next_seqnum(dev, false); // RET_UNLINK will have it
+                req->unlinked = false;
+                ++dev.parked_urbs;
+
+                seqnums[cnt] = req->seqnum;
+                unlinks[cnt++] = req->unlink_seqnum;
+        }
+
+        return cnt;
+}
+
+/*
+ * Parked requests that were dropped by the server.
+ * device_ctx::requests_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto collect(_In_ const device_ctx &dev, _Out_writes_(max_batch) seqnum_t *seqnums)
+{
+        ULONG cnt = 0;
+
+        for (auto head = &dev.requests, entry = head->Flink; entry != head && cnt < max_batch; entry = entry->Flink) {
+                if (auto req = CONTAINING_RECORD(entry, request_ctx, entry); req->unlink_seqnum && req->unlinked) {
+                        seqnums[cnt++] = req->seqnum;
+                }
+        }
+
+        return cnt;
+}
+
+/*
+ * The request is sent with a new seqnum. It is still admitted, see admission::admit.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void resubmit(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        if (auto request = device::remove_request(dev, seqnum)) {
+                auto endpoint = get_request_ctx(request)->endpoint;
+                device::submit_urb(dev, endpoint, request);
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::suspend::enter(_Inout_ device_ctx &dev, _In_ bool can_wake)
+{
+        if (!dev.suspend_passthrough) {
+                return;
+        }
+
+        {
+                wdf::Lock lck(dev.requests_lock);
+
+                if (dev.suspended) {
+                        return;
+                }
+
+                dev.suspended = true;
+                dev.suspended_at = KeQueryInterruptTime();
+                dev.wake_armed = can_wake;
+                dev.wake_signaled = false;
+                ++dev.suspends;
+        }
+
+        seqnum_t seqnums[max_batch];
+        seqnum_t unlinks[max_batch];
+        ULONG total = 0;
+
+        for (ULONG cnt = max_batch; cnt == max_batch; total += cnt) {
+                {
+                        wdf::Lock lck(dev.requests_lock);
+                        cnt = dev.suspended ? park(dev, can_wake, seqnums, unlinks) : 0;
+                }
+
+                for (ULONG i = 0; i < cnt; ++i) {
+                        device::send_cmd_unlink(dev, seqnums[i], unlinks[i]);
+                }
+        }
+
+        TraceDbg("dev %04x, can wake %d, %lu URB(s) parked", ptr04x(get_handle(&dev)), can_wake, total);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::suspend::leave(_Inout_ device_ctx &dev)
+{
+        if (!dev.suspend_passthrough) {
+                return;
+        }
+
+        {
+                wdf::Lock lck(dev.requests_lock);
+
+                if (!dev.suspended) {
+                        return;
+                }
+
+                dev.suspended = false;
+                dev.suspended_time += KeQueryInterruptTime() - dev.suspended_at;
+        }
+
+        seqnum_t seqnums[max_batch];
+        ULONG total = 0;
+
+        for (ULONG cnt = max_batch; cnt == max_batch; total += cnt) {
+                {
+                        wdf::Lock lck(dev.requests_lock);
+                        cnt = collect(dev, seqnums);
+                }
+
+                for (ULONG i = 0; i < cnt; ++i) {
+                        resubmit(dev, seqnums[i]);
+                }
+        }
+
+        TraceDbg("dev %04x, %lu URB(s) resubmitted", ptr04x(get_handle(&dev)), total); // others wait for RET_UNLINK
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::suspend::unlinked(_Inout_ device_ctx &dev, _In_ seqnum_t unlink_seqnum)
+{
+        if (!dev.suspend_passthrough) {
+                return;
+        }
+
+        seqnum_t seqnum{};
+        {
+                wdf::Lock lck(dev.requests_lock);
+
+                for (auto head = &dev.requests, entry = head->Flink; entry != head; entry = entry->Flink) {
+
+                        auto req = CONTAINING_RECORD(entry, request_ctx, entry);
+                        if (req->unlink_seqnum != unlink_seqnum) {
+                                continue;
+                        }
+
+                        if (dev.suspended) {
+                                req->unlinked = true; // see leave
+                        } else {
+                                seqnum = req->seqnum;
+                        }
+                        break;
+                }
+        }
+
+        if (seqnum) {
+                resubmit(dev, seqnum);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::suspend::completed(_Inout_ device_ctx &dev, _In_ WDFREQUEST request)
+{
+        if (!dev.suspended || !is_interrupt_in(get_request_ctx(request)->endpoint)) {
+                return;
+        }
+
+        bool signal{};
+        {
+                wdf::Lock lck(dev.requests_lock);
+
+                if (dev.suspended && dev.wake_armed && !dev.wake_signaled) {
+                        dev.wake_signaled = true;
+                        ++dev.remote_wakes;
+                        signal = true;
+                }
+        }
+
+        if (!signal) {
+                return;
+        }
+
+        auto device = get_handle(&dev);
+
+        if (auto err = dev.speed() < USB_SPEED_SUPER ? UdecxUsbDeviceSignalWake(device) :
+                                                       UdecxUsbDeviceSignalFunctionWake(device, dev.wake_interface)) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, signal wake %!STATUS!", ptr04x(device), err);
+        } else {
+                TraceDbg("dev %04x, remote wake", ptr04x(device));
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 usbip::suspend::suspended_ms(_In_ device_ctx &dev)
+{
+        wdf::Lock lck(dev.requests_lock);
+
+        auto t = dev.suspended_time;
+        if (dev.suspended) {
+                t += KeQueryInterruptTime() - dev.suspended_at;
+        }
+
+        return t/wdm::msec;
+}
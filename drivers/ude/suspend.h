@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbip\proto.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+        struct device_ctx;
+}
+
+/*
+ * Selective suspend passthrough, it is enabled by suspend_passthrough_value_name.
+ *
+ * USB/IP has no command to suspend a remote device, the best thing is to stop the traffic.
+ * While the link is in low power, outstanding interrupt IN URBs are parked: CMD_UNLINK-s are sent,
+ * but the requests stay in device_ctx::requests, so purge, cancellation and a new session handle them as usual.
+ * If remote wake is armed, the first URB of each interrupt IN endpoint stays on the server,
+ * its completion signals the wake. The server's host controller keeps polling these endpoints,
+ * but a pending URB does not cause network traffic until it completes.
+ * Parked URBs are submitted again when the link returns to D0.
+ */
+namespace usbip::suspend
+{
+
+/*
+ * @param can_wake remote wake is armed
+ * @see EVT_UDECX_USB_DEVICE_D0_EXIT
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void enter(_Inout_ device_ctx &dev, _In_ bool can_wake);
+
+/*
+ * @see EVT_UDECX_USB_DEVICE_D0_ENTRY
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void leave(_Inout_ device_ctx &dev);
+
+/*
+ * RET_UNLINK was received. If it confirms that the server dropped a parked URB, the URB is submitted again
+ * unless the device is still suspended.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unlinked(_Inout_ device_ctx &dev, _In_ seqnum_t unlink_seqnum);
+
+/*
+ * RET_SUBMIT for the request is received, signal remote wake if the device is suspended.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void completed(_Inout_ device_ctx &dev, _In_ WDFREQUEST request);
+
+/*
+ * @return time spent in suspend including the current period, in milliseconds
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 suspended_ms(_In_ device_ctx &dev);
+
+} // namespace usbip::suspend
@@ -9,6 +9,9 @@
 #include "device.h"
 #include "vhci_ioctl.h"
 #include "persistent.h"
+#include "resolver.h"
+#include "pool.h"
+#include "sched.h"
 
 #include <ntstrsafe.h>
 
@@ -65,6 +68,7 @@ PAGED void vhci_cleanup(_In_ WDFOBJECT object)
         TraceDbg("vhci %04x", ptr04x(vhci));
 
         attach_thread_join(vhci);
+        pool::stop(vhci);
 }
 
 _Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
@@ -120,12 +124,18 @@ PAGED auto init_context(_In_ WDFDEVICE vhci)
                 return err;
         }
 
+        if (auto err = WdfWaitLockCreate(&attr, &ctx.connections_lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWaitLockCreate %!STATUS!", err);
+                return err;
+        }
+
         if (auto err = create_read_queue(ctx.reads, attr, vhci)) {
                 return err;
         }
 
         KeInitializeEvent(&ctx.attach_thread_stop, NotificationEvent, false);
         InitializeListHead(&ctx.fileobjects);
+        InitializeListHead(&ctx.connections);
 
         return STATUS_SUCCESS;
 }
@@ -448,8 +458,8 @@ PAGED auto create_vhci(_Out_ WDFDEVICE &vhci, _In_ WDFDEVICE_INIT *init)
                 return err;
         }
 
-        init_func_t* const functions[] { init_context, configure, create_interfaces, 
-                                         add_usbdevice_emulation, vhci::create_queues };
+        init_func_t* const functions[] { init_context, resolver::init, pool::init, sched::init, configure, 
+                                         create_interfaces, add_usbdevice_emulation, vhci::create_queues };
 
         for (auto f: functions) {
                 if (auto err = f(vhci)) {
@@ -576,6 +586,7 @@ PAGED auto get_detach_function(_In_ vhci::detach_call how)
         case async_wait:
                 f = device::async_detach_and_wait;
                 break;
+        case async_wait_all: // see detach_all_and_wait
         case async_nowait:
                 f = device::async_detach_nowait;
                 break;
@@ -588,6 +599,57 @@ PAGED auto get_detach_function(_In_ vhci::detach_call how)
         return f;
 }
 
+/*
+ * The total time is the time of the slowest device rather than the sum of them.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void detach_all_and_wait(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+
+        wdf::ObjectRef devices[ARRAYSIZE(vhci_ctx::devices)];
+        int ports[ARRAYSIZE(devices)];
+        int cnt = 0;
+
+        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
+                if (auto dev = vhci::get_device(vhci, port); auto hdev = dev.get<UDECXUSBDEVICE>()) {
+                        if (NT_SUCCESS(device::async_detach_nowait(hdev))) {
+                                ports[cnt] = port;
+                                devices[cnt++].swap(dev);
+                        }
+                }
+        }
+
+        auto start = KeQueryInterruptTime();
+        auto deadline = start + device::detach_timeout;
+        int laggards = 0;
+
+        for (int i = 0; i < cnt; ++i) {
+                auto device = devices[i].get<UDECXUSBDEVICE>();
+                auto &dev = *get_device_ctx(device);
+
+                auto now = KeQueryInterruptTime();
+                auto timeout = make_timeout(deadline > now ? deadline - now : 0, wdm::period::relative);
+
+                switch (auto st = KeWaitForSingleObject(&dev.detach_completed, Executive, KernelMode, false, &timeout)) {
+                case STATUS_SUCCESS:
+                        break;
+                case STATUS_TIMEOUT:
+                        ++laggards;
+                        Trace(TRACE_LEVEL_ERROR, "dev %04x, port %d, %!USTR!:%!USTR!/%!USTR! is not detached in %I64d ms",
+                                ptr04x(device), ports[i], &dev.ext->node_name, &dev.ext->service_name, &dev.ext->busid,
+                                device::detach_timeout/wdm::msec);
+                        break;
+                default:
+                        Trace(TRACE_LEVEL_ERROR, "dev %04x, KeWaitForSingleObject %!STATUS!", ptr04x(device), st);
+                }
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "%d device(s) detached in %I64u ms, %d not completed", 
+                cnt - laggards, (KeQueryInterruptTime() - start)/wdm::msec, laggards);
+}
+
 } // namespace
 
 
@@ -684,6 +746,12 @@ PAGED void usbip::vhci::detach_all_devices(_In_ WDFDEVICE vhci, _In_ detach_call
         PAGED_CODE();
 
         TraceDbg("%04x", ptr04x(vhci));
+
+        if (how == detach_call::async_wait_all) {
+                detach_all_and_wait(vhci);
+                return;
+        }
+
         auto detach = get_detach_function(how);
 
         for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
@@ -791,6 +859,8 @@ PAGED NTSTATUS usbip::DeviceAdd(_In_ WDFDRIVER, _Inout_ WDFDEVICE_INIT *init)
 
         Trace(TRACE_LEVEL_INFORMATION, "vhci %04x", ptr04x(vhci));
         
+        pool::start(vhci);
+
         if (auto ctx = get_vhci_ctx(vhci)) {
                 plugin_persistent_devices(ctx);
         }
@@ -32,7 +32,10 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 wdf::ObjectRef get_device(_In_ WDFDEVICE vhci, _In_ int port);
 
-enum class detach_call { async_wait, async_nowait, direct };
+/*
+ * async_wait_all starts all detaches concurrently and waits for them with one overall timeout.
+ */
+enum class detach_call { async_wait, async_wait_all, async_nowait, direct };
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -12,12 +12,21 @@
 #include "network.h"
 #include "ioctl.h"
 #include "persistent.h"
+#include "dgram.h"
+#include "mux.h"
+#include "resolver.h"
+#include "pool.h"
+#include "heartbeat.h"
+#include "suspend.h"
+#include "sched.h"
 
 #include <usbip\proto_op.h>
+#include <usbip\happy_eyeballs.h>
 
 #include <libdrv\dbgcommon.h>
 #include <libdrv\strconv.h>
 #include <libdrv\irp.h>
+#include <libdrv\wait_timeout.h>
 
 #include <ntstrsafe.h>
 #include <usbuser.h>
@@ -30,8 +39,25 @@ using namespace usbip;
 static_assert(sizeof(vhci::imported_device_location::service) == NI_MAXSERV);
 static_assert(sizeof(vhci::imported_device_location::host) == NI_MAXHOST);
 
-enum { ARG_INFO, ARG_FUNCTION, ARG_AI }; // the fourth parameter is used by WSK subsystem
+enum { ARG_INFO, ARG_FUNCTION, ARG_WORKITEM }; // the fourth parameter is used by WSK subsystem
 
+struct connect_attempt
+{
+        WDFWORKITEM wi;
+        const SOCKADDR_INET *addr; // workitem_ctx::addrs
+
+        wsk::SOCKET *sock;
+        IRP *irp; // for WskConnect, the request's IRP is not used because attempts run in parallel
+
+        bool cancelled; // IoCancelIrp was called
+        bool completed; // guarded by workitem_ctx::lock
+};
+
+/*
+ * complete() is a state machine: getaddrinfo (if resolver cache misses), then connection racing (RFC 8305), then import.
+ * Name resolution and racing are skipped if a connection is taken from the pool.
+ * While racing, it can be enqueued concurrently by attempt_complete, timer_dpc and cancel_race.
+ */
 struct workitem_ctx
 {
         WDFDEVICE vhci;
@@ -39,19 +65,54 @@ struct workitem_ctx
 
         device_ctx_ext *ext;
         ADDRINFOEXW *addrinfo; // list head
+
+        enum { MAX_ATTEMPTS = resolver::MAX_ADDRESSES };
+        SOCKADDR_INET addrs[MAX_ATTEMPTS]; // from addrinfo or resolver cache
+        int addr_cnt;
+        bool resolved; // addrs are from resolver cache, getaddrinfo is not called
+        bool pooled; // ext->sock is taken from the pool, see pool::take
+
+        he::race<MAX_ATTEMPTS> race;
+        connect_attempt attempts[MAX_ATTEMPTS];
+
+        NTSTATUS status; // of the last failed attempt, of the request if finished
+        bool racing; // the request is cancelable
+        bool finished; // the request will be completed by the last call of complete()
+
+        KTIMER timer; // connection attempt delay
+        KDPC timer_dpc;
+
+        WDFSPINLOCK lock; // for the members below
+        bool queued; // complete() will be called again
+        bool cancelled; // see cancel_race
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(workitem_ctx, get_workitem_ctx)
 
+enum : UINT32 {
+        EXTENSIONS_TIMEOUT_MS = 3*1000, // to wait for OP_REP_EXTENSIONS
+        REIMPORT_ATTEMPTS = 3, // the server releases the device asynchronously after the connection was aborted
+        REIMPORT_DELAY_MS = 500,
+};
+
+/*
+ * Aborts the connection if OP_REP_EXTENSIONS has not arrived in time.
+ */
+struct reply_timer_ctx
+{
+        wsk::SOCKET *sock;
+        bool expired;
+};
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(reply_timer_ctx, get_reply_timer_ctx)
+
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
-PAGED auto set_args(_In_ WDFREQUEST request, _In_ const char *function, _In_opt_ const ADDRINFOEXW *ai = nullptr)
+PAGED auto set_args(_In_ WDFREQUEST request, _In_ const char *function)
 {
         PAGED_CODE();
         auto irp = WdfRequestWdmGetIrp(request);
 
         libdrv::argv<ARG_INFO>(irp) = reinterpret_cast<void*>(WdfRequestGetInformation(request)); // backup
         libdrv::argv<ARG_FUNCTION>(irp) = const_cast<char*>(function);
-        libdrv::argv<ARG_AI>(irp) = const_cast<ADDRINFOEXW*>(ai);
 
         return irp;
 }
@@ -75,7 +136,7 @@ PAGED void log(_In_ const usbip_usb_device &d)
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto send_req_import(_In_ device_ctx_ext &ext)
+PAGED auto send_req_import(_In_ SOCKET *sock, _In_ const UNICODE_STRING &busid)
 {
         PAGED_CODE();
 
@@ -86,40 +147,41 @@ PAGED auto send_req_import(_In_ device_ctx_ext &ext)
 
         static_assert(sizeof(req) == sizeof(req.hdr) + sizeof(req.body)); // packed
 
-        if (auto &busid = req.body.busid; auto err = libdrv::unicode_to_utf8(busid, sizeof(busid), ext.busid)) {
-                Trace(TRACE_LEVEL_ERROR, "unicode_to_utf8('%!USTR!') %!STATUS!", &ext.busid, err);
+        if (auto &s = req.body.busid; auto err = libdrv::unicode_to_utf8(s, sizeof(s), busid)) {
+                Trace(TRACE_LEVEL_ERROR, "unicode_to_utf8('%!USTR!') %!STATUS!", &busid, err);
                 return err;
         }
 
         byteswap(req.hdr);
         byteswap(req.body);
 
-        return send(ext.sock, memory::stack, &req, sizeof(req));
+        return send(sock, memory::stack, &req, sizeof(req));
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS recv_rep_import(_In_ device_ctx_ext &ext, _In_ memory pool, _Out_ op_import_reply &reply)
+PAGED NTSTATUS recv_rep_import(
+        _In_ SOCKET *sock, _In_ const UNICODE_STRING &busid, _In_ memory pool, _Out_ op_import_reply &reply)
 {
         PAGED_CODE();
         RtlZeroMemory(&reply, sizeof(reply));
 
-        if (auto err = recv_op_common(ext.sock, OP_REP_IMPORT)) {
+        if (auto err = recv_op_common(sock, OP_REP_IMPORT)) {
                 return err;
         }
 
-        if (auto err = recv(ext.sock, pool, &reply, sizeof(reply))) {
+        if (auto err = recv(sock, pool, &reply, sizeof(reply))) {
                 Trace(TRACE_LEVEL_ERROR, "Receive op_import_reply %!STATUS!", err);
                 return err;
         }
         byteswap(reply);
 
-        if (char busid[sizeof(reply.udev.busid)];
-            auto err = libdrv::unicode_to_utf8(busid, sizeof(busid), ext.busid)) {
-                Trace(TRACE_LEVEL_ERROR, "unicode_to_utf8('%!USTR!') %!STATUS!", &ext.busid, err);
+        if (char s[sizeof(reply.udev.busid)];
+            auto err = libdrv::unicode_to_utf8(s, sizeof(s), busid)) {
+                Trace(TRACE_LEVEL_ERROR, "unicode_to_utf8('%!USTR!') %!STATUS!", &busid, err);
                 return err;
-        } else if (strncmp(reply.udev.busid, busid, sizeof(busid))) {
-                Trace(TRACE_LEVEL_ERROR, "Received busid '%s' != '%s'", reply.udev.busid, busid);
+        } else if (strncmp(reply.udev.busid, s, sizeof(s))) {
+                Trace(TRACE_LEVEL_ERROR, "Received busid '%s' != '%s'", reply.udev.busid, s);
                 return USBIP_ERROR_PROTOCOL;
         }
 
@@ -128,17 +190,213 @@ PAGED NTSTATUS recv_rep_import(_In_ device_ctx_ext &ext, _In_ memory pool, _Out_
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
+PAGED auto send_req_extensions(_In_ device_ctx_ext &ext, _In_ const op_extensions_request &body)
 {
         PAGED_CODE();
 
-        if (auto err = send_req_import(ext)) {
-                Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_IMPORT %!STATUS!", err);
+        struct {
+                op_common hdr{ USBIP_VERSION, OP_REQ_EXTENSIONS, ST_OK };
+                op_extensions_request body;
+        } req{ .body = body };
+
+        static_assert(sizeof(req) == sizeof(req.hdr) + sizeof(req.body)); // packed
+
+        byteswap(req.hdr);
+        byteswap(req.body);
+
+        return send(ext.sock, memory::stack, &req, sizeof(req));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto recv_rep_extensions(_In_ device_ctx_ext &ext, _Out_ op_extensions_reply &reply)
+{
+        PAGED_CODE();
+        RtlZeroMemory(&reply, sizeof(reply));
+
+        if (auto err = recv_op_common(ext.sock, OP_REP_EXTENSIONS)) {
+                return err;
+        }
+
+        if (auto err = recv(ext.sock, memory::stack, &reply, sizeof(reply))) {
+                Trace(TRACE_LEVEL_ERROR, "Receive op_extensions_reply %!STATUS!", err);
+                return err;
+        }
+
+        byteswap(reply);
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Abortive disconnect completes pending WskReceive.
+ */
+_Function_class_(EVT_WDF_TIMER)
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void NTAPI reply_timeout(_In_ WDFTIMER timer)
+{
+        PAGED_CODE();
+
+        auto &ctx = *get_reply_timer_ctx(timer);
+        ctx.expired = true;
+
+        if (auto err = disconnect(ctx.sock, static_cast<WSK_BUF*>(nullptr), WSK_FLAG_ABORTIVE)) {
+                Trace(TRACE_LEVEL_ERROR, "disconnect %!STATUS!", err);
+        }
+}
+
+/*
+ * A server that does not know OP_REQ_EXTENSIONS reads it as a part of usbip_header and never answers.
+ * @return STATUS_IO_TIMEOUT if the reply has not arrived in EXTENSIONS_TIMEOUT_MS, the connection is aborted
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto recv_rep_extensions(_In_ WDFDEVICE vhci, _In_ device_ctx_ext &ext, _Out_ op_extensions_reply &reply)
+{
+        PAGED_CODE();
+
+        WDF_TIMER_CONFIG cfg;
+        WDF_TIMER_CONFIG_INIT(&cfg, reply_timeout);
+        cfg.AutomaticSerialization = false;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, reply_timer_ctx);
+        attr.ParentObject = vhci;
+        attr.ExecutionLevel = WdfExecutionLevelPassive; // for disconnect
+
+        ObjectDelete timer;
+        if (WDFTIMER t{}; auto err = WdfTimerCreate(&cfg, &attr, &t)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfTimerCreate %!STATUS!", err);
+                return err;
+        } else {
+                timer.reset(t);
+        }
+
+        auto &ctx = *get_reply_timer_ctx(timer.get());
+        ctx.sock = ext.sock;
+
+        WdfTimerStart(timer.get<WDFTIMER>(), WDF_REL_TIMEOUT_IN_MS(EXTENSIONS_TIMEOUT_MS));
+        auto st = recv_rep_extensions(ext, reply);
+        WdfTimerStop(timer.get<WDFTIMER>(), true);
+
+        return ctx.expired ? STATUS_IO_TIMEOUT : st; // the socket is disconnected even if the reply has arrived
+}
+
+/*
+ * Must be called right after OP_REP_IMPORT.
+ * Does nothing if the server is not listed in the registry, see protocol_extensions_hosts_value_name,
+ * or if the extensions are not enabled, see protocol_extensions_value_name.
+ * An error is returned if the TCP stream is in unknown state, the connection must be dropped.
+ * @return STATUS_IO_TIMEOUT if the server has not answered, the connection is aborted
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto negotiate_extensions(_In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        if (!extensions_allowed(ext.node_name, ext.service_name)) {
+                return STATUS_SUCCESS;
+        }
+
+        op_extensions_request req {
+                .features = get_parameter(protocol_extensions_value_name, 0) & 
+                            (EXT_ISOC_DATAGRAM | EXT_MULTIPLEX | EXT_ISOC_UNCOMPACTED | EXT_INTERRUPT_PUSH)
+        };
+
+        if (req.features & EXT_ISOC_DATAGRAM) {
+                dgram::prepare(ext, req);
+        }
+
+        if (req.features & EXT_MULTIPLEX) {
+                mux::prepare(vhci, ext, req);
+        }
+
+        if (!req.features) {
+                return STATUS_SUCCESS;
+        }
+
+        if (auto err = send_req_extensions(ext, req)) {
+                Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_EXTENSIONS %!STATUS!", err);
+                return err;
+        }
+
+        op_extensions_reply reply;
+        if (auto err = recv_rep_extensions(vhci, ext, reply)) {
+                dgram::accept(ext, op_extensions_reply{}); // discards the datagram socket
                 return err;
         }
 
+        TraceDbg("features %#x, udp port %hu, session %#x -> features %#x, udp port %hu, session %#x",
+                  req.features, req.udp_port, req.session, reply.features, reply.udp_port, reply.session);
+
+        reply.features &= req.features;
+        dgram::accept(ext, reply);
+
+        ext.isoc_uncompacted = reply.features & EXT_ISOC_UNCOMPACTED;
+        ext.interrupt_push = reply.features & EXT_INTERRUPT_PUSH;
+
+        return mux::accept(vhci, ext, req, reply);
+}
+
+/*
+ * Plain USB/IP on a new connection after the server has not answered OP_REQ_EXTENSIONS.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS reimport(_In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto &d = ext.dev;
+        NTSTATUS st{};
+
+        for (UINT32 i = 0; i < REIMPORT_ATTEMPTS; ++i) {
+
+                if (i) {
+                        auto timeout = make_timeout(REIMPORT_DELAY_MS*wdm::msec, wdm::period::relative);
+                        KeDelayExecutionThread(KernelMode, false, &timeout);
+                }
+
+                if (ext.sock) {
+                        close_socket(ext.sock);
+                        free(ext.sock);
+                }
+
+                if (st = pool::connect(ext.sock, vhci, ext.node_name, ext.service_name, EXTENSIONS_TIMEOUT_MS); st) {
+                        return st;
+                }
+
+                op_import_reply reply;
+                if (st = vhci::import(ext.sock, ext.busid, reply); st == USBIP_ERROR_ST_DEV_BUSY) {
+                        continue;
+                } else if (st) {
+                        return st;
+                }
+
+                auto &udev = reply.udev;
+                auto devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum));
+
+                if (devid != d.devid || udev.idVendor != d.vendor || udev.idProduct != d.product) {
+                        Trace(TRACE_LEVEL_ERROR, "%!USTR!: another device is exported, devid %#x -> %#x, %04x:%04x",
+                                &ext.busid, d.devid, devid, udev.idVendor, udev.idProduct);
+                        return USBIP_ERROR_ST_DEV_ERR;
+                }
+
+                return STATUS_SUCCESS;
+        }
+
+        return st;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto import_remote_device(_In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
         op_import_reply reply;
-        if (auto err = recv_rep_import(ext, memory::stack, reply)) {
+        if (auto err = vhci::import(ext.sock, ext.busid, reply)) {
                 return err;
         }
  
@@ -152,7 +410,15 @@ PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
                 d->product = udev.idProduct;
         }
 
-        return STATUS_SUCCESS;
+        auto st = negotiate_extensions(vhci, ext);
+        if (st != STATUS_IO_TIMEOUT) {
+                return st;
+        }
+
+        Trace(TRACE_LEVEL_WARNING, "%!USTR!:%!USTR! has not answered OP_REQ_EXTENSIONS in %lu ms, "
+                                   "importing without extensions", &ext.node_name, &ext.service_name, EXTENSIONS_TIMEOUT_MS);
+
+        return reimport(vhci, ext);
 }
 
 _IRQL_requires_same_
@@ -191,56 +457,27 @@ PAGED auto start_device(_Out_ int &port, _In_ UDECXUSBDEVICE device)
 {
         PAGED_CODE();
 
-        if (auto err = plugin(port, device)) {
-                return err;
-        }
-
-        return device::recv_thread_start(device);
-}
-
-/*
- * TCP_NODELAY is not supported, see WSK_FLAG_NODELAY.
- */
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto set_options(_In_ wsk::SOCKET *sock)
-{
-        PAGED_CODE();
-
-        auto keepalive = [] (auto idle, auto cnt, auto intvl) constexpr { return idle + cnt*intvl; };
-
-        int idle = 0;
-        int cnt = 0;
-        int intvl = 0;
+        auto &dev = *get_device_ctx(device);
 
-        if (auto err = get_keepalive_opts(sock, &idle, &cnt, &intvl)) {
-                Trace(TRACE_LEVEL_ERROR, "get_keepalive_opts %!STATUS!", err);
-                return err;
+        if (dev.ext->mux) { // sends are scheduled from the first URB
+                if (auto err = mux::start(device)) {
+                        return err;
+                }
+        } else {
+                mux::shape(device);
         }
 
-        Trace(TRACE_LEVEL_VERBOSE, "get keepalive: idle(%d sec) + cnt(%d)*intvl(%d sec) => %d sec", 
-                idle, cnt, intvl, keepalive(idle, cnt, intvl));
-
-        enum { IDLE = 30, CNT = 9, INTVL = 10 };
-
-        if (auto err = set_keepalive(sock, IDLE, CNT, INTVL)) {
-                Trace(TRACE_LEVEL_ERROR, "set_keepalive %!STATUS!", err);
+        if (auto err = plugin(port, device)) {
                 return err;
         }
 
-        bool optval{};
-        if (auto err = get_keepalive(sock, optval)) {
-                Trace(TRACE_LEVEL_ERROR, "get_keepalive %!STATUS!", err);
-                return err;
+        if (!dev.ext->mux) {
+                if (auto err = device::recv_thread_start(device)) {
+                        return err;
+                }
         }
 
-        NT_VERIFY(!get_keepalive_opts(sock, &idle, &cnt, &intvl));
-
-        Trace(TRACE_LEVEL_VERBOSE, "set keepalive: idle(%d sec) + cnt(%d)*intvl(%d sec) => %d sec", 
-                idle, cnt, intvl, keepalive(idle, cnt, intvl));
-
-        bool ok = optval && keepalive(idle, cnt, intvl) == keepalive(IDLE, CNT, INTVL);
-        return ok ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+        return dgram::recv_thread_start(device);
 }
 
 _IRQL_requires_same_
@@ -256,7 +493,7 @@ PAGED auto connected(_In_ WDFREQUEST request, _Inout_ device_ctx_ext* &ext)
         auto vhci = get_vhci(request);
         device_state_changed(vhci, *ext, 0, vhci::state::connected);
 
-        if (auto err = import_remote_device(*ext)) {
+        if (auto err = import_remote_device(vhci, *ext)) {
                 return err;
         }
 
@@ -267,6 +504,9 @@ PAGED auto connected(_In_ WDFREQUEST request, _Inout_ device_ctx_ext* &ext)
         ext = nullptr; // now dev owns it
 
         if (auto err = start_device(r->port, dev)) {
+                if (auto &ctx = *get_device_ctx(dev); mux::get_ctx(ctx)) {
+                        mux::detach(ctx);
+                }
                 WdfObjectDelete(dev); // UdecxUsbDevicePlugIn failed or was not called
                 return err;
         }
@@ -297,87 +537,352 @@ NTSTATUS irp_complete(
         return StopCompletion;
 }
 
+/*
+ * ctx.lock must be held.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void wakeup(_In_ WDFWORKITEM wi, _Inout_ workitem_ctx &ctx)
+{
+        if (!ctx.queued) {
+                ctx.queued = true;
+                WdfWorkItemEnqueue(wi);
+        }
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS attempt_complete(
+        _In_ DEVICE_OBJECT*, _In_ IRP*, _In_reads_(_Inexpressible_("varies")) void *context)
+{
+        auto &a = *static_cast<connect_attempt*>(context);
+        auto &ctx = *get_workitem_ctx(a.wi);
+
+        wdf::Lock lck(ctx.lock);
+
+        a.completed = true;
+        wakeup(a.wi, ctx);
+
+        return StopCompletion; // the IRP is freed by on_race
+}
+
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void timer_dpc(_In_ KDPC*, _In_opt_ void *context, _In_opt_ void*, _In_opt_ void*)
+{
+        auto wi = static_cast<WDFWORKITEM>(context);
+        auto &ctx = *get_workitem_ctx(wi);
+
+        wdf::Lock lck(ctx.lock);
+        wakeup(wi, ctx);
+}
+
+/*
+ * complete() can't finish until ctx.cancelled is set, so the workitem is alive.
+ */
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_race(_In_ WDFREQUEST request)
+{
+        auto wi = libdrv::argv<WDFWORKITEM, ARG_WORKITEM>(WdfRequestWdmGetIrp(request));
+        auto &ctx = *get_workitem_ctx(wi);
+
+        TraceDbg("req %04x", ptr04x(request));
+
+        wdf::Lock lck(ctx.lock);
+
+        ctx.cancelled = true;
+        wakeup(wi, ctx);
+}
+
+inline auto now_ms()
+{
+        return static_cast<UINT64>(KeQueryInterruptTime()/wdm::msec);
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto create_socket(_Inout_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW &ai)
+PAGED void close_attempt(_Inout_ connect_attempt &a)
 {
         PAGED_CODE();
-        NT_ASSERT(!sock);
 
-        if (auto err = socket(sock, static_cast<ADDRESS_FAMILY>(ai.ai_family), 
-                                static_cast<USHORT>(ai.ai_socktype), ai.ai_protocol, 
-                                WSK_FLAG_CONNECTION_SOCKET, nullptr, nullptr)) {
-                NT_ASSERT(!sock);
-                Trace(TRACE_LEVEL_ERROR, "socket %!STATUS!", err);
-                return err;
+        if (a.sock) {
+                NT_VERIFY(NT_SUCCESS(close(a.sock)));
+                free(a.sock);
         }
+}
 
-        if (auto err = set_options(sock)) {
+/*
+ * @return STATUS_PENDING if WskConnect was called
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS start_attempt(_In_ WDFWORKITEM wi, _Inout_ connect_attempt &a)
+{
+        PAGED_CODE();
+        auto &sa = *a.addr;
+
+        if (sa.si_family == AF_INET) {
+                auto &v4 = sa.Ipv4;
+                TraceDbg("%!IPADDR!", v4.sin_addr.s_addr);
+        } else {
+                auto &v6 = sa.Ipv6;
+                TraceDbg("%!BIN!", WppBinary(&v6.sin6_addr, sizeof(v6.sin6_addr)));
+        }
+
+        if (auto err = create_socket(a.sock, sa.si_family)) {
                 return err;
         }
 
-        SOCKADDR_INET any { // see INADDR_ANY, IN6ADDR_ANY_INIT
-                .si_family = static_cast<ADDRESS_FAMILY>(ai.ai_family)
-        };
+        a.irp = IoAllocateIrp(1, false);
+        if (!a.irp) {
+                Trace(TRACE_LEVEL_ERROR, "IoAllocateIrp -> NULL");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        a.wi = wi;
+        IoSetCompletionRoutine(a.irp, attempt_complete, &a, true, true, true);
+
+        auto addr = reinterpret_cast<SOCKADDR*>(const_cast<SOCKADDR_INET*>(&sa));
+        auto st = connect(a.sock, addr, a.irp); // completion handler will be called anyway
+        TraceDbg("%!STATUS!", st);
+
+        return STATUS_PENDING;
+}
+
+/*
+ * Attempts that are not completed yet are cancelled, they will be harvested by on_race.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void cancel_attempts(_Inout_ workitem_ctx &ctx)
+{
+        PAGED_CODE();
+
+        for (auto &a: ctx.attempts) {
+                if (a.irp && !a.cancelled) {
+                        a.cancelled = true;
+                        IoCancelIrp(a.irp);
+                }
+        }
+}
+
+/*
+ * An attempt that has completed successfully wins if there is no winner yet.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void harvest(_Inout_ workitem_ctx &ctx, _In_ int idx)
+{
+        PAGED_CODE();
+        auto &a = ctx.attempts[idx];
 
-        if (auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any))) {
-                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
+        auto st = a.irp->IoStatus.Status;
+        TraceDbg("attempt[%d] %!STATUS!", idx, st);
+
+        IoFreeIrp(a.irp);
+        a.irp = nullptr;
+
+        if (!NT_SUCCESS(st)) {
+                ctx.status = st;
+                ctx.race.failed(now_ms());
+        } else if (ctx.race.succeeded(idx)) {
+                NT_ASSERT(!ctx.ext->sock);
+                ctx.ext->sock = a.sock;
+                a.sock = nullptr;
+                return;
+        }
+
+        close_attempt(a);
+}
+
+/*
+ * The request must not be cancelable when it is completed.
+ * @return STATUS_PENDING if cancel_race will call complete()
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto finish_race(_In_ WDFREQUEST request, _Inout_ workitem_ctx &ctx, _In_ bool cancelled, _In_ NTSTATUS st)
+{
+        PAGED_CODE();
+
+        KeCancelTimer(&ctx.timer);
+        KeFlushQueuedDpcs(); // timer_dpc can be running
+
+        if (!cancelled && WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED) {
+                return STATUS_PENDING;
+        }
+
+        if (cancelled) {
+                st = STATUS_CANCELLED;
+        } else if (NT_SUCCESS(st)) {
+                st = connected(request, ctx.ext);
+                NT_ASSERT(st != STATUS_PENDING);
+        }
+
+        return st;
+}
+
+/*
+ * Harvest completed attempts, start the ones that are due, cancel the rest if there is a winner.
+ * @return STATUS_PENDING if complete() must be called again
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS on_race(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ workitem_ctx &ctx)
+{
+        PAGED_CODE();
+
+        auto &race = ctx.race;
+        bool completed[workitem_ctx::MAX_ATTEMPTS]{};
+        bool cancelled;
+
+        {
+                wdf::Lock lck(ctx.lock);
+                cancelled = ctx.cancelled;
+
+                for (int i = 0; i < race.size(); ++i) {
+                        auto &a = ctx.attempts[i];
+                        completed[i] = a.irp && a.completed;
+                }
+        }
+
+        for (int i = 0; i < race.size(); ++i) {
+                if (completed[i]) {
+                        harvest(ctx, i);
+                }
+        }
+
+        if (cancelled || race.winner() != race.npos) {
+                cancel_attempts(ctx);
+                return race.inflight() ? STATUS_PENDING : finish_race(request, ctx, cancelled, STATUS_SUCCESS);
+        }
+
+        for (int i; (i = race.next(now_ms())) != race.npos; ) {
+                auto &a = ctx.attempts[i];
+
+                if (auto st = start_attempt(wi, a); st != STATUS_PENDING) {
+                        ctx.status = st;
+                        close_attempt(a);
+                        race.failed(now_ms());
+                }
+        }
+
+        if (race.exhausted()) {
+                return finish_race(request, ctx, false, ctx.status);
+        }
+
+        if (auto ms = race.wait_ms(now_ms()); ms != race.infinite) {
+                auto due = make_timeout(ms*wdm::msec, wdm::period::relative);
+                KeSetTimer(&ctx.timer, due, &ctx.timer_dpc);
+        }
+
+        return STATUS_PENDING;
+}
+
+/*
+ * Addresses are tried in the order of RFC 8305 with the connection attempt delay,
+ * the first established connection wins. A slow or blackholed address family delays
+ * the attach by the attempt delay instead of the TCP connect timeout.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS start_race(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ workitem_ctx &ctx)
+{
+        PAGED_CODE();
+
+        int families[workitem_ctx::MAX_ATTEMPTS];
+
+        for (int i = 0; i < ctx.addr_cnt; ++i) {
+                ctx.attempts[i].addr = &ctx.addrs[i];
+                families[i] = ctx.addrs[i].si_family;
+        }
+
+        ctx.race.init(families, ctx.addr_cnt);
+        ctx.status = STATUS_HOST_UNREACHABLE;
+
+        libdrv::argv<ARG_WORKITEM>(WdfRequestWdmGetIrp(request)) = wi; // for cancel_race
+
+        if (auto err = WdfRequestMarkCancelableEx(request, cancel_race)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestMarkCancelableEx %!STATUS!", err);
                 return err;
         }
 
-        return STATUS_SUCCESS;
+        ctx.racing = true;
+        return on_race(request, wi, ctx);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void getaddrinfo(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ workitem_ctx &ctx)
+{
+        PAGED_CODE();
+        auto &ext = *ctx.ext;
+
+        ADDRINFOEXW hints {
+                .ai_flags = AI_NUMERICSERV,
+                .ai_family = AF_UNSPEC,
+                .ai_socktype = SOCK_STREAM,
+                .ai_protocol = IPPROTO_TCP // zero isn't work
+        };
+
+        auto irp = set_args(request, __func__);
+        IoSetCompletionRoutine(irp, irp_complete, wi, true, true, true);
+                         
+        NT_ASSERT(!ctx.addrinfo);
+        auto st = wsk::getaddrinfo(ctx.addrinfo, &ext.node_name, &ext.service_name, &hints, irp);
+        TraceDbg("%!STATUS!", st);
 }
 
+/*
+ * @return STATUS_SUCCESS if ctx.addrs are from resolver cache, STATUS_PENDING if getaddrinfo is called
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto connect(
-        _In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW &ai)
+PAGED NTSTATUS resolve(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ workitem_ctx &ctx)
 {
         PAGED_CODE();
+        auto &ext = *ctx.ext;
 
-        if (auto &sa = *reinterpret_cast<SOCKADDR_INET*>(ai.ai_addr); sa.si_family == AF_INET) {
-                auto &v4 = sa.Ipv4;
-                TraceDbg("%!IPADDR!", v4.sin_addr.s_addr);
-        } else {
-                auto &v6 = sa.Ipv6;
-                TraceDbg("%!BIN!", WppBinary(&v6.sin6_addr, sizeof(v6.sin6_addr)));
-        }
+        NTSTATUS st;
 
-        if (auto err = create_socket(sock, ai)) {
-                return err;
+        if (!resolver::find(ctx.vhci, ext.node_name, ext.service_name, st, ctx.addrs, ctx.addr_cnt)) {
+                getaddrinfo(request, wi, ctx); // completion handler will be called anyway
+                return STATUS_PENDING;
         }
 
-        auto irp = set_args(request, __func__, &ai);
-        IoSetCompletionRoutine(irp, irp_complete, wi, true, true, true);
-
-        auto st = connect(sock, ai.ai_addr, irp); // completion handler will be called anyway
-        TraceDbg("%!STATUS!", st);
-
-        return STATUS_PENDING;
+        ctx.resolved = NT_SUCCESS(st);
+        return st; // an error if the entry is negative
 }
 
+/*
+ * A pooled connection could be closed by the server while it was idle.
+ * If it fails before the device was created, the usual way of connection is used.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto on_connect(
-        _In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ device_ctx_ext* &ext, _In_ const ADDRINFOEXW &ai)
+PAGED NTSTATUS on_pooled(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ workitem_ctx &ctx)
 {
         PAGED_CODE();
+        ctx.pooled = false;
 
-        auto st = WdfRequestGetStatus(request);
+        auto st = connected(request, ctx.ext);
+        if (NT_SUCCESS(st) || !ctx.ext || ctx.ext->mux || ctx.ext->dgram) {
+                return st;
+        }
 
-        if (NT_SUCCESS(st)) {
-                st = connected(request, ext);
-                NT_ASSERT(st != STATUS_PENDING);
-        } else {
-                NT_VERIFY(NT_SUCCESS(close(ext->sock)));
-                free(ext->sock);
+        auto &ext = *ctx.ext;
+        Trace(TRACE_LEVEL_INFORMATION, "%!USTR!:%!USTR! pooled connection %!STATUS!, reconnect", 
+                                        &ext.node_name, &ext.service_name, st);
 
-                if (st != STATUS_CANCELLED && ai.ai_next) {
-                        st = connect(request, wi, ext->sock, *ai.ai_next);
-                }
-        }
+        close_socket(ext.sock);
+        free(ext.sock);
 
-        return st;
+        st = resolve(request, wi, ctx);
+        return st == STATUS_SUCCESS ? start_race(request, wi, ctx) : st;
 }
 
 _Function_class_(EVT_WDF_WORKITEM)
@@ -387,21 +892,50 @@ PAGED void NTAPI complete(_In_ WDFWORKITEM wi)
 {
         PAGED_CODE();
         auto &ctx = *get_workitem_ctx(wi);
-
         auto request = ctx.request;
-        auto irp = WdfRequestWdmGetIrp(request);
 
-        WdfRequestSetInformation(request, libdrv::argvi<ULONG_PTR, ARG_INFO>(irp)); // restore
-        auto function = libdrv::argv<const char*, ARG_FUNCTION>(irp);
+        {
+                wdf::Lock lck(ctx.lock);
+                ctx.queued = false;
+        }
+
+        NTSTATUS st;
+
+        if (ctx.finished) {
+                st = ctx.status;
+        } else if (ctx.racing) {
+                st = on_race(request, wi, ctx);
+        } else if (ctx.pooled) {
+                st = on_pooled(request, wi, ctx);
+        } else if (ctx.resolved) {
+                st = start_race(request, wi, ctx);
+        } else { // on_addrinfo
+                auto irp = WdfRequestWdmGetIrp(request);
+
+                WdfRequestSetInformation(request, libdrv::argvi<ULONG_PTR, ARG_INFO>(irp)); // restore
+                auto function = libdrv::argv<const char*, ARG_FUNCTION>(irp);
+
+                st = WdfRequestGetStatus(request);
+                TraceDbg("%s %!STATUS!", function, st);
+
+                auto &ext = *ctx.ext;
+                resolver::store(ctx.vhci, ext.node_name, ext.service_name, st, ctx.addrinfo);
+
+                if (NT_SUCCESS(st)) {
+                        NT_ASSERT(ctx.addrinfo);
+                        ctx.addr_cnt = resolver::copy(ctx.addrs, ctx.addrinfo);
+                        st = start_race(request, wi, ctx);
+                }
+        }
 
-        auto st = WdfRequestGetStatus(request);
-        TraceDbg("%s %!STATUS!", function, st);
+        if (st != STATUS_PENDING && ctx.racing) {
+                ctx.finished = true;
+                ctx.status = st;
 
-        if (auto ai = libdrv::argv<ADDRINFOEXW*, ARG_AI>(irp)) {
-                st = on_connect(request, wi, ctx.ext, *ai);
-        } else if (NT_SUCCESS(st)) { // on_addrinfo
-                NT_ASSERT(ctx.addrinfo);
-                st = connect(request, wi, ctx.ext->sock, *ctx.addrinfo);
+                wdf::Lock lck(ctx.lock);
+                if (ctx.queued) { // the last call will complete the request
+                        st = STATUS_PENDING;
+                }
         }
 
         if (st != STATUS_PENDING) {
@@ -427,6 +961,11 @@ PAGED void workitem_cleanup(_In_ WDFOBJECT obj)
         TraceDbg("request %04x, addrinfo %04x, device_ctx_ext %04x", 
                   ptr04x(ctx.request), ptr04x(ctx.addrinfo), ptr04x(ctx.ext));
 
+        for (auto &a: ctx.attempts) {
+                NT_ASSERT(!a.irp);
+                close_attempt(a);
+        }
+
         wsk::free(ctx.addrinfo);
         ctx.addrinfo = nullptr;
 
@@ -458,28 +997,6 @@ PAGED auto create_workitem(_Out_ WDFWORKITEM &wi, _In_ WDFOBJECT parent)
         return WdfWorkItemCreate(&cfg, &attr, &wi);
 }
 
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED void getaddrinfo(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ workitem_ctx &ctx)
-{
-        PAGED_CODE();
-        auto &ext = *ctx.ext;
-
-        ADDRINFOEXW hints {
-                .ai_flags = AI_NUMERICSERV,
-                .ai_family = AF_UNSPEC,
-                .ai_socktype = SOCK_STREAM,
-                .ai_protocol = IPPROTO_TCP // zero isn't work
-        };
-
-        auto irp = set_args(request, __func__);
-        IoSetCompletionRoutine(irp, irp_complete, wi, true, true, true);
-                         
-        NT_ASSERT(!ctx.addrinfo);
-        auto st = wsk::getaddrinfo(ctx.addrinfo, &ext.node_name, &ext.service_name, &hints, irp);
-        TraceDbg("%!STATUS!", st);
-}
-
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto plugin_hardware( _In_ WDFREQUEST request, _In_ const vhci::ioctl::plugin_hardware &r)
@@ -499,14 +1016,39 @@ PAGED auto plugin_hardware( _In_ WDFREQUEST request, _In_ const vhci::ioctl::plu
         ctx.vhci = vhci;
         ctx.request = request;
 
+        KeInitializeTimer(&ctx.timer);
+        KeInitializeDpc(&ctx.timer_dpc, timer_dpc, wi);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = wi;
+
+        if (auto err = WdfSpinLockCreate(&attr, &ctx.lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+                WdfObjectDelete(wi);
+                return err;
+        }
+
         if (auto err = create_device_ctx_ext(ctx.ext, r)) {
                 WdfObjectDelete(wi);
                 return err;
         }
 
-        device_state_changed(vhci, *ctx.ext, 0, vhci::state::connecting);
+        auto &ext = *ctx.ext;
+        device_state_changed(vhci, ext, 0, vhci::state::connecting);
+
+        pool::remember(vhci, ext.node_name, ext.service_name, false);
+
+        if (ext.sock = pool::take(vhci, ext.node_name, ext.service_name); ext.sock) {
+                ctx.pooled = true;
+                WdfWorkItemEnqueue(wi);
+        } else if (auto st = resolve(request, wi, ctx); st == STATUS_SUCCESS) {
+                WdfWorkItemEnqueue(wi);
+        } else if (st != STATUS_PENDING) {
+                WdfObjectDelete(wi); // negative entry
+                return st;
+        }
 
-        getaddrinfo(request, wi, ctx); // completion handler will be called anyway
         return STATUS_PENDING;
 }
 
@@ -563,7 +1105,7 @@ PAGED NTSTATUS plugout_hardware(_In_ WDFREQUEST request)
         auto st = STATUS_SUCCESS;
 
         if (auto vhci = get_vhci(request); r->port <= 0) {
-                detach_all_devices(vhci, vhci::detach_call::async_wait); // detach_call::direct can't be used here
+                detach_all_devices(vhci, vhci::detach_call::async_wait_all); // detach_call::direct can't be used here
         } else if (!is_valid_port(r->port)) {
                 st = STATUS_INVALID_PARAMETER;
         } else if (auto dev = vhci::get_device(vhci, r->port)) {
@@ -685,6 +1227,317 @@ PAGED auto get_persistent(_In_ WDFREQUEST request)
         return st;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS resolver_cache(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::resolver_cache *r{};
+
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), nullptr)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "resolver_cache.size %lu != sizeof(resolver_cache) %Iu", 
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        }
+
+        resolver::query(get_vhci(request), *r);
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS connection_pool(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::connection_pool *r{};
+
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), nullptr)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "connection_pool.size %lu != sizeof(connection_pool) %Iu", 
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        }
+
+        pool::query(get_vhci(request), *r);
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS set_heartbeat(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        vhci::ioctl::set_heartbeat *r{};
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveInputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "set_heartbeat.size %lu != sizeof(set_heartbeat) %Iu",
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        } else if (r->port > 0 && !is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        TraceDbg("port %d, interval %lu ms, max misses %d", r->port, r->interval_ms, r->max_misses);
+
+        auto vhci = get_vhci(request);
+        auto st = r->port > 0 ? STATUS_DEVICE_NOT_CONNECTED : STATUS_SUCCESS;
+
+        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
+                if (r->port > 0 && port != r->port) {
+                        //
+                } else if (auto dev = vhci::get_device(vhci, port)) {
+                        if (auto ctx = get_device_ctx(dev.get()); ctx->heartbeat_timer) {
+                                heartbeat::set(*ctx, r->interval_ms, r->max_misses);
+                                st = STATUS_SUCCESS;
+                        } else if (r->port > 0) {
+                                st = STATUS_NOT_SUPPORTED; // shares the connection, see mux_ctx
+                        }
+                }
+        }
+
+        return st;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS set_bandwidth_limit(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        vhci::ioctl::set_bandwidth_limit *r{};
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveInputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "set_bandwidth_limit.size %lu != sizeof(set_bandwidth_limit) %Iu",
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        } else if (r->port > 0 && !is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        TraceDbg("port %d, rate: device %lu, server %lu, burst %lu", 
+                  r->port, r->device_rate, r->server_rate, r->burst);
+
+        auto vhci = get_vhci(request);
+        auto st = r->port > 0 ? STATUS_DEVICE_NOT_CONNECTED : STATUS_SUCCESS;
+
+        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
+                if (r->port > 0 && port != r->port) {
+                        //
+                } else if (auto dev = vhci::get_device(vhci, port)) {
+                        if (auto ctx = get_device_ctx(dev.get()); mux::get_ctx(*ctx)) {
+                                mux::set_rate(*ctx, r->device_rate, r->server_rate, r->burst);
+                                st = STATUS_SUCCESS;
+                        } else if (r->port > 0) {
+                                st = STATUS_NOT_SUPPORTED; // sends are not queued, see mux::shape
+                        }
+                }
+        }
+
+        return st;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS set_sched_policy(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        vhci::ioctl::sched_policy *r{};
+
+        if (size_t length; 
+            auto err = WdfRequestRetrieveInputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "sched_policy.size %lu != sizeof(sched_policy) %Iu", r->size, sizeof(*r));
+                return USBIP_ERROR_ABI;
+        }
+
+        return sched::set_policy(get_vhci(request), *r);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS get_sched_policy(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::sched_policy *r{};
+
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), nullptr)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "sched_policy.size %lu != sizeof(sched_policy) %Iu", r->size, sizeof(*r));
+                return USBIP_ERROR_ABI;
+        }
+
+        sched::get_policy(get_vhci(request), *r);
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS get_device_stats(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::device_stats *r{};
+
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), nullptr)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "device_stats.size %lu != sizeof(device_stats) %Iu", r->size, sizeof(*r));
+                return USBIP_ERROR_ABI;
+        } else if (!is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        auto dev = vhci::get_device(get_vhci(request), r->port);
+        if (!dev) {
+                return STATUS_DEVICE_NOT_CONNECTED;
+        }
+
+        auto &ctx = *get_device_ctx(dev.get());
+        auto &e = ctx.sockbuf;
+
+        auto port = r->port;
+        RtlZeroMemory(r, sizeof(*r)); // OUT members can be garbage
+
+        r->size = sizeof(*r);
+        r->port = port;
+
+        r->sent_requests = ctx.sent_requests;
+        r->bytes_sent = ctx.bytes_sent;
+        r->bytes_received = ctx.bytes_received;
+
+        if (ctx.sockbuf_enabled) {
+                r->srtt_us = e.srtt_us();
+                r->rx_rate = e.rx_rate();
+                r->tx_rate = e.tx_rate();
+                r->rx_bdp = e.rx_bdp();
+                r->tx_bdp = e.tx_bdp();
+                r->rcvbuf = e.rcvbuf();
+                r->sndbuf = e.sndbuf();
+        }
+        r->sockbuf_changes = ctx.sockbuf_changes;
+
+        r->resumed_sessions = ctx.resumed_sessions;
+        r->heartbeat_probes = ctx.heartbeat_probes;
+        r->heartbeat_failures = ctx.heartbeat_failures;
+
+        r->unlink_bursts = ctx.unlink_bursts;
+        r->unlinked_requests = ctx.unlinked_requests;
+        r->max_unlink_burst = ctx.max_unlink_burst;
+
+        {
+                wdf::Lock lck(ctx.admission_lock);
+
+                r->inflight_urbs = ctx.inflight_urbs;
+                r->inflight_bytes = ctx.inflight_bytes;
+                r->held_urbs = ctx.held_cnt;
+                r->max_inflight_urbs = ctx.max_inflight_urbs;
+                r->max_inflight_bytes = ctx.max_inflight_bytes;
+                r->max_held_urbs = ctx.max_held;
+                r->held_total = ctx.held_total;
+        }
+
+        r->isoc_in_urbs = ctx.isoc_in_urbs;
+        r->isoc_moved_bytes = ctx.isoc_moved_bytes;
+        r->isoc_uncompacted = ctx.ext->isoc_uncompacted;
+
+        r->suspends = ctx.suspends;
+        r->remote_wakes = ctx.remote_wakes;
+        r->suspended_ms = suspend::suspended_ms(ctx);
+        r->parked_urbs = ctx.parked_urbs;
+
+        r->interrupt_push = ctx.ext->interrupt_push;
+        {
+                wdf::Lock lck(ctx.push_lock);
+
+                r->pushed_reports = ctx.pushed_reports;
+                for (auto &s: ctx.push_subs) {
+                        r->buffered_reports += s.ring.pushed();
+                        r->dropped_reports += s.ring.dropped();
+                }
+        }
+
+        {
+                wdf::Lock lck(ctx.stream_lock);
+
+                r->stream_transfers = ctx.stream_transfers;
+                r->stream_bytes = ctx.stream_bytes;
+                r->stream_throttled = ctx.stream_throttled;
+        }
+
+        r->completion_batches = ctx.completion_batches;
+        r->batched_urbs = ctx.batched_urbs;
+        r->max_completion_batch = ctx.max_completion_batch;
+
+        KAFFINITY affinity{};
+        r->sched_rule = sched::get_rule(ctx, affinity);
+        r->recv_affinity = affinity;
+        r->recv_priority = ctx.recv_priority;
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
+} // namespace
+
+
+/*
+ * @see <linux>/tools/usb/usbip/src/usbipd.c, recv_request_import
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::vhci::import(_In_ SOCKET *sock, _In_ const UNICODE_STRING &busid, _Out_ op_import_reply &reply)
+{
+        PAGED_CODE();
+
+        if (auto err = send_req_import(sock, busid)) {
+                Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_IMPORT %!STATUS!", err);
+                RtlZeroMemory(&reply, sizeof(reply));
+                return err;
+        }
+
+        return recv_rep_import(sock, busid, memory::stack, reply);
+}
+
+
+namespace
+{
+
 /*
  * IRP_MJ_DEVICE_CONTROL
  * 
@@ -763,6 +1616,20 @@ PAGED decltype(get_persistent) *get_parallel_handler(_In_ ULONG IoControlCode)
                 return set_persistent;
         case vhci::ioctl::GET_PERSISTENT:
                 return get_persistent;
+        case vhci::ioctl::RESOLVER_CACHE:
+                return resolver_cache;
+        case vhci::ioctl::CONNECTION_POOL:
+                return connection_pool;
+        case vhci::ioctl::SET_HEARTBEAT:
+                return set_heartbeat;
+        case vhci::ioctl::GET_DEVICE_STATS:
+                return get_device_stats;
+        case vhci::ioctl::SET_BANDWIDTH_LIMIT:
+                return set_bandwidth_limit;
+        case vhci::ioctl::SET_SCHED_POLICY:
+                return set_sched_policy;
+        case vhci::ioctl::GET_SCHED_POLICY:
+                return get_sched_policy;
         default:
                 return nullptr;
         }
@@ -4,9 +4,13 @@
 
 #pragma once
 
+#include "network.h"
+
 #include <libdrv/codeseg.h>
 #include <libdrv/wdf_cpp.h>
 
+#include <usbip/proto_op.h>
+
 namespace usbip::vhci
 {
 
@@ -14,4 +18,12 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS create_queues(_In_ WDFDEVICE vhci);
 
+/*
+ * Send OP_REQ_IMPORT and receive OP_REP_IMPORT.
+ * @param sock connected socket, USBIP_CMD_* can be sent on success
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS import(_In_ SOCKET *sock, _In_ const UNICODE_STRING &busid, _Out_ op_import_reply &reply);
+
 } // namespace usbip::vhci
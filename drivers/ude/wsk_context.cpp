@@ -27,6 +27,7 @@ void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_L
         TraceWSK("%04x, isoc[%Iu]", ptr04x(ctx), ctx->isoc_alloc_cnt);
 
         ctx->mdl_hdr.reset();
+        ctx->mdl_dgram.reset();
         ctx->mdl_buf.reset();
         ctx->mdl_isoc.reset();
 
@@ -62,6 +63,14 @@ void *allocate_function_ex(_In_ POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _
                 return nullptr;
         }
 
+        ctx->mdl_dgram = Mdl(&ctx->dgram, sizeof(ctx->dgram) + sizeof(ctx->hdr));
+
+        if (auto err = ctx->mdl_dgram.prepare_nonpaged()) {
+                Trace(TRACE_LEVEL_ERROR, "mdl_dgram %!STATUS!", err);
+                free_function_ex(ctx, list);
+                return nullptr;
+        }
+
         ctx->wsk_irp = IoAllocateIrp(1, false);
         if (!ctx->wsk_irp) {
                 Trace(TRACE_LEVEL_ERROR, "IoAllocateIrp -> NULL");
@@ -130,21 +139,23 @@ void usbip::delete_wsk_context_list()
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto usbip::alloc_wsk_context(
-        _In_ device_ctx *dev, _In_opt_ WDFREQUEST request, _In_ ULONG NumberOfPackets) -> wsk_context*
+        _In_opt_ device_ctx *dev, _In_opt_ WDFREQUEST request, _In_ ULONG NumberOfPackets) -> wsk_context*
 {
-        NT_ASSERT(dev);
-
         auto ctx = ::alloc_wsk_context(NumberOfPackets);
         if (ctx) {
                 ctx->dev = dev;
                 ctx->request = request;
+                ctx->batch = nullptr;
+                ctx->is_dgram = false;
+                ctx->is_probe = false;
+                ctx->send_at = 0;
         }
 
         return ctx;
 }
 
 /*
- * alloc_wsk_context sets dev, request, is_isoc. It's safe do not clear them.
+ * alloc_wsk_context sets dev, request, batch, is_dgram, send_at, is_isoc. It's safe do not clear them.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -6,28 +6,39 @@
 
 #include <libdrv/wdf_cpp.h>
 
-#include <usbip\proto.h>
+#include <usbip\proto_dgram.h>
 #include <libdrv\mdl_cpp.h>
 
 namespace usbip
 {
 
 struct device_ctx;
+struct completion_batch;
 
 struct wsk_context
 {
-        device_ctx *dev; // UDECXUSBDEVICE can be obtained from WDFREQUEST, but it is optional
+        device_ctx *dev; // UDECXUSBDEVICE can be obtained from WDFREQUEST, but it is optional, null in mux_recv_loop
 
         // transient data
 
         WDFREQUEST request; // can be WDF_NO_HANDLE
+        completion_batch *batch; // of the receive loop, see batch::add
         Mdl mdl_buf; // describes URB_FROM_IRP()->TransferBuffer(MDL)
+        bool is_dgram; // was sent by dgram::send
+        bool is_probe; // of heartbeat, it must not wait for tokens
+
+        LIST_ENTRY mux_entry; // head is mux_ctx::queues[] or device_ctx::paced
+        WSK_BUF mux_buf; // see mux::send, device::pace_dpc
+        UINT64 send_at; // microseconds since boot, zero is now
 
         // preallocated data
 
         IRP *wsk_irp;
 
         Mdl mdl_hdr;
+        Mdl mdl_dgram; // describes dgram and hdr
+
+        dgram_header dgram; // must precede hdr
         usbip::header hdr;
 
         Mdl mdl_isoc;
@@ -37,6 +48,9 @@ struct wsk_context
 };
 
 
+static_assert(offsetof(wsk_context, hdr) == offsetof(wsk_context, dgram) + sizeof(wsk_context::dgram));
+
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS init_wsk_context_list(_In_ ULONG tag);
@@ -48,7 +62,7 @@ void delete_wsk_context_list();
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-wsk_context *alloc_wsk_context(_In_ device_ctx *dev, _In_opt_ WDFREQUEST request, _In_ ULONG NumberOfPackets = 0);
+wsk_context *alloc_wsk_context(_In_opt_ device_ctx *dev, _In_opt_ WDFREQUEST request, _In_ ULONG NumberOfPackets = 0);
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
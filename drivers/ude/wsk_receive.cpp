@@ -13,8 +13,21 @@
 #include "network.h"
 #include "driver.h"
 #include "ioctl.h"
+#include "dgram.h"
+#include "mux.h"
+#include "session.h"
+#include "heartbeat.h"
+#include "sockbuf.h"
+#include "admission.h"
+#include "bot_cache.h"
+#include "suspend.h"
+#include "push.h"
+#include "stream.h"
+#include "sched.h"
+#include "batch.h"
 
 #include <libdrv\usbd_helper.h>
+#include <libdrv\usb_frame.h>
 #include <libdrv\dbgcommon.h>
 #include <libdrv\usbdsc.h>
 #include <libdrv\irp.h>
@@ -166,13 +179,17 @@ PAGED void fix_full_speed_endpoint_interval(_In_ USB_CONFIGURATION_DESCRIPTOR *c
  * See:
  * <linux>/drivers/usb/usbip/stub_tx.c, stub_send_ret_submit
  * <linux>/drivers/usb/usbip/usbip_common.c, usbip_pad_iso
+ *
+ * If EXT_ISOC_UNCOMPACTED is accepted, the packets are already at their offsets and length is the span.
+ * @param moved bytes that were moved to restore the offsets
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer, _In_ ULONG length, 
-	_In_ const iso_packet_descriptor *src)
+	_In_ const iso_packet_descriptor *src, _In_ bool uncompacted, _Out_ ULONG &moved)
 {
 	PAGED_CODE();
+	moved = 0;
 
 	NT_ASSERT(length <= r.TransferBufferLength);
 	auto dir_out = !buffer;
@@ -203,6 +220,16 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 			return STATUS_INVALID_PARAMETER;
 		}
 
+		if (uncompacted) {
+			if (dd->Offset + sd->actual_length > length) {
+				Trace(TRACE_LEVEL_ERROR, "dst.Offset(%lu) + src.actual_length(%u) > actual_length(%lu)",
+					dd->Offset, sd->actual_length, length);
+				return STATUS_INVALID_PARAMETER;
+			}
+			dd->Length = sd->actual_length;
+			continue;
+		}
+
 		if (length >= sd->actual_length) {
 			length -= sd->actual_length;
 		} else {
@@ -223,12 +250,13 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 
 		if (dd->Offset > length) {
 			RtlMoveMemory(buffer + dd->Offset, buffer + length, sd->actual_length);
+			moved += sd->actual_length;
 		}
 
 		dd->Length = sd->actual_length;
 	}
 
-	if (length && !dir_out) {
+	if (length && !(dir_out || uncompacted)) {
 		Trace(TRACE_LEVEL_ERROR, "SUM(actual_length) != actual_length, delta is %lu", length);
 		return STATUS_INVALID_PARAMETER; 
 	}
@@ -236,6 +264,45 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 	return STATUS_SUCCESS;
 }
 
+/*
+ * The transfer started when CMD_SUBMIT arrived if it was sent with USBD_START_ISO_TRANSFER_ASAP.
+ * Otherwise it was scheduled by the virtual frame clock and does not tell the one-way delay.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void sample_frame_clock(
+	_Inout_ device_ctx &dev, _In_ const wsk_context &ctx, _In_ const header_ret_submit &ret, _In_ UINT64 now_us)
+{
+	auto &req = *get_request_ctx(ctx.request);
+	if (!req.asap || ret.status) {
+		return;
+	}
+
+	auto &endp = *get_endpoint_ctx(req.endpoint);
+
+	auto interval = endp.descriptor.bInterval;
+	UINT32 period_us = dev.speed() >= USB_SPEED_HIGH ? 125 : frame::us_per_frame;
+
+	if (interval) {
+		period_us <<= min(interval, 16) - 1;
+	}
+
+	auto duration_us = number_of_packets(ctx)*period_us;
+	auto sent_us = req.sent_at/wdm::usec;
+
+	wdf::Lock lck(dev.frame_lock);
+	dev.frame_clock.sample(sent_us, now_us, static_cast<UINT32>(duration_us), ret.start_frame);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG to_local_frame(_In_ device_ctx &dev, _In_ ULONG server_frame)
+{
+	wdf::Lock lck(dev.frame_lock);
+	auto &clock = dev.frame_clock;
+	return clock.synced() ? clock.to_local(server_frame, libdrv::current_frame()) : server_frame;
+}
+
 /*
  * Layout: transfer buffer(IN only), usbip_iso_packet_descriptor[].
  */
@@ -245,6 +312,9 @@ PAGED auto isoch_transfer(_In_ wsk_context &ctx, _In_ const header_ret_submit &r
 {
 	PAGED_CODE();
 	auto cnt = ret.number_of_packets;
+	auto &dev = *ctx.dev;
+
+	sample_frame_clock(dev, ctx, ret, libdrv::now_us());
 
 	auto &r = urb.UrbIsochronousTransfer;
 	r.ErrorCount = ret.error_count;
@@ -253,8 +323,8 @@ PAGED auto isoch_transfer(_In_ wsk_context &ctx, _In_ const header_ret_submit &r
 		r.Hdr.Status = USBD_STATUS_ISOCH_REQUEST_FAILED;
 	}
 
-	if (r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
-		r.StartFrame = ret.start_frame;
+	if (r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) { // the client's frame otherwise
+		r.StartFrame = to_local_frame(dev, ret.start_frame);
 	}
 
 	if (cnt >= 0 && ULONG(cnt) == r.NumberOfPackets) {
@@ -275,7 +345,15 @@ PAGED auto isoch_transfer(_In_ wsk_context &ctx, _In_ const header_ret_submit &r
 		}
 	}
 
-	return fill_isoc_data(r, buffer, ret.actual_length, ctx.isoc);
+	ULONG moved;
+	auto st = fill_isoc_data(r, buffer, ret.actual_length, ctx.isoc, dev.ext->isoc_uncompacted, moved);
+
+	if (buffer) {
+		InterlockedIncrement64(&dev.isoc_in_urbs); // TCP and datagram receive threads
+		InterlockedExchangeAdd64(&dev.isoc_moved_bytes, moved);
+	}
+
+	return st;
 }
 
 _IRQL_requires_same_
@@ -354,6 +432,11 @@ PAGED auto ret_submit_urb(_Inout_ wsk_context &ctx, _In_ const header_ret_submit
 		return isoch_transfer(ctx, ret, urb);
 	}
 
+	if (bot::expanded(ctx.request, urb)) {
+		auto actual = ret.actual_length > 0 ? ULONG(ret.actual_length) : 0;
+		return bot::data_received(*ctx.dev, ctx.request, actual, !ret.status);
+	}
+
 	UCHAR *TransferBuffer{};
 	ULONG TransferBufferLength{};
 
@@ -372,6 +455,8 @@ PAGED auto ret_submit_urb(_Inout_ wsk_context &ctx, _In_ const header_ret_submit
 		post_process_transfer_buffer(*ctx.dev, urb, TransferBuffer);
 	}
 
+	bot::received(*ctx.dev, ctx.request, TransferBuffer, NT_SUCCESS(st) ? TransferBufferLength : 0, !ret.status);
+
 	return st;
 }
 
@@ -410,6 +495,35 @@ PAGED auto make_mdl_chain(_In_ wsk_context &ctx)
 	return head;
 }
 
+/*
+ * The data phase of enlarged READ is received into the read-ahead cache, see bot::data_received.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto prepare_bot_cache_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _In_ int actual_length)
+{
+	PAGED_CODE();
+
+	mdl = nullptr;
+	auto &dev = *ctx.dev;
+
+	if (!(actual_length > 0 && ULONG(actual_length) <= dev.bot_cache_size && is_transfer_dir_in(ctx.hdr))) {
+		Trace(TRACE_LEVEL_ERROR, "actual_length(%d), cache %lu, %!usbip_dir!", 
+			                  actual_length, dev.bot_cache_size, ctx.hdr.direction);
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	ctx.mdl_buf = Mdl(dev.bot_cache, ULONG(actual_length));
+
+	if (auto err = ctx.mdl_buf.prepare_nonpaged()) {
+		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
+		return err;
+	}
+
+	mdl = ctx.mdl_buf.get();
+	return STATUS_SUCCESS;
+}
+
 /*
  * If response from a server has data (actual_length > 0), URB function MUST copy it to URB
  * even if UrbHeader.Status != USBD_STATUS_SUCCESS.
@@ -435,6 +549,10 @@ PAGED auto prepare_wsk_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _Inout_ UR
 		return err;
 	}
 
+	if (!ctx.is_isoc && bot::expanded(ctx.request, urb)) {
+		return prepare_bot_cache_mdl(mdl, ctx, ret.actual_length);
+	}
+
 	UCHAR *TransferBuffer{};
 	ULONG TransferBufferLength{};
 
@@ -474,15 +592,13 @@ PAGED auto prepare_wsk_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _Inout_ UR
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto receive(_Inout_ wsk_context &ctx, _Inout_ WSK_BUF &buf)
+PAGED auto receive(_In_ wsk::SOCKET *sock, _Inout_ wsk_context &ctx, _Inout_ WSK_BUF &buf)
 {
 	PAGED_CODE();
-
-	auto &dev = *ctx.dev;
 	NT_ASSERT(verify(buf, ctx.is_isoc));
 
 	SIZE_T actual{};
-	auto st = receive(dev.sock(), &buf, WSK_FLAG_WAITALL, &actual);
+	auto st = receive(sock, &buf, WSK_FLAG_WAITALL, &actual, batch::on_pending, ctx.batch); // flush before waiting
 
 	TraceWSK("req %04x, %!STATUS!, %Iu byte(s)", ptr04x(ctx.request), st, actual);
 
@@ -494,7 +610,15 @@ PAGED auto receive(_Inout_ wsk_context &ctx, _Inout_ WSK_BUF &buf)
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
+PAGED auto receive(_Inout_ wsk_context &ctx, _Inout_ WSK_BUF &buf)
+{
+	PAGED_CODE();
+	return receive(ctx.dev->sock(), ctx, buf);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto drain_payload(_In_ wsk::SOCKET *sock, _Inout_ wsk_context &ctx, _In_ size_t length)
 {
 	PAGED_CODE();
 
@@ -517,6 +641,41 @@ PAGED auto drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
 		return err;
 	}
 
+	WSK_BUF buf{ .Mdl = ctx.mdl_buf.get(), .Length = length };
+	return receive(sock, ctx, buf);
+}
+
+/*
+ * RET_SUBMIT has no URB to receive the payload into:
+ * bulk IN stage arrived before the host's URB, see bot::claim, a report was pushed, see push::claim,
+ * or a streamed read has completed, see stream::claim.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto recv_detached(_Inout_ wsk_context &ctx, _Out_ unique_ptr &data, _In_ size_t length)
+{
+	PAGED_CODE();
+
+	if (auto &ret = get_ret_submit(ctx); !(ret.actual_length > 0 && size_t(ret.actual_length) == length)) {
+		Trace(TRACE_LEVEL_ERROR, "payload %Iu, actual_length(%d)", length, ret.actual_length);
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	data = unique_ptr(libdrv::uninitialized, NonPagedPoolNx, length);
+	if (!data) {
+		Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", length);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ctx.mdl_buf = Mdl(data.get(), ULONG(length));
+
+	if (auto err = ctx.mdl_buf.prepare_nonpaged()) {
+		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
+		return err;
+	}
+
+	ctx.is_isoc = false;
+
 	WSK_BUF buf{ .Mdl = ctx.mdl_buf.get(), .Length = length };
 	return receive(ctx, buf);
 }
@@ -603,7 +762,7 @@ PAGED auto validate_header(_Inout_ header &hdr)
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto recv_usbip_header(_Inout_ wsk_context &ctx)
+PAGED auto recv_usbip_header(_In_ wsk::SOCKET *sock, _Inout_ wsk_context &ctx)
 {
 	PAGED_CODE();
 
@@ -612,61 +771,359 @@ PAGED auto recv_usbip_header(_Inout_ wsk_context &ctx)
 
 	WSK_BUF buf{ .Mdl = ctx.mdl_hdr.get(), .Length = sizeof(ctx.hdr) };
 
-	if (auto err = receive(ctx, buf)) {
+	if (auto err = receive(sock, ctx, buf)) {
 		return err;
 	}
 
 	return validate_header(ctx.hdr) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto dispatch(_Inout_ wsk_context &ctx)
+{
+	PAGED_CODE();
+
+	auto &dev = *ctx.dev;
+	NTSTATUS status{};
+
+	NT_ASSERT(!ctx.request); // must be completed and zeroed on every loop
+	ctx.request = ret_command(ctx);
+
+	if (ctx.hdr.command == RET_UNLINK) {
+		suspend::unlinked(dev, ctx.hdr.seqnum);
+	}
+
+	auto ahead = !ctx.request && ctx.hdr.command == RET_SUBMIT && bot::claim(dev, ctx.hdr.seqnum, ctx.request);
+	auto pushed = !(ctx.request || ahead) && ctx.hdr.command == RET_SUBMIT && push::claim(dev, ctx.hdr.seqnum);
+	auto streamed = !(ctx.request || ahead || pushed) && ctx.hdr.command == RET_SUBMIT &&
+			stream::claim(dev, ctx.hdr.seqnum);
+	unique_ptr data; // for the stage that was sent ahead, the pushed report or the streamed read
+
+	if (auto sz = get_payload_size(ctx.hdr); !sz) {
+		//
+	} else if (dev.unplugged) {
+		status = STATUS_CANCELLED; // do not receive payload
+	} else if (ctx.request) {
+		status = recv_payload(ctx, sz);
+	} else if (ahead || pushed || streamed) {
+		status = recv_detached(ctx, data, sz);
+	} else {
+		status = drain_payload(dev.sock(), ctx, sz);
+	}
+
+	if (!status) {
+		sockbuf::received(dev, ctx);
+	}
+
+	if ((ahead || pushed || streamed) && ctx.batch) {
+		batch::flush(*ctx.batch); // URBs of the endpoint that were finished earlier must be completed first
+	}
+
+	if (ahead) {
+		bot::stage_received(dev, ctx.hdr, static_cast<UCHAR*>(data.release()), status);
+	} else if (pushed) {
+		push::received(dev, ctx.hdr, static_cast<UCHAR*>(data.get()), status);
+	} else if (streamed) {
+		stream::received(dev, ctx.hdr, static_cast<UCHAR*>(data.get()), status);
+	}
+
+	if (auto &req = ctx.request) {
+		auto st = status ? status : ret_submit(ctx);
+		suspend::completed(dev, req);
+
+		if (ctx.batch) {
+			batch::add(*ctx.batch, dev, req, st);
+			req = WDF_NO_HANDLE;
+		} else {
+			complete_and_set_null(req, st);
+		}
+	}
+
+	return status;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void recv_loop(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx)
 {
 	PAGED_CODE();
 
-	for (NTSTATUS status{}; !(status || dev.unplugged || recv_usbip_header(ctx)); ) {
+	heartbeat::received(dev); // the connection can be new, see session::resume
+	sched::update_thread(dev);
+
+	completion_batch batch{};
+	ctx.batch = &batch;
+
+	for (NTSTATUS status{}; !(status || dev.unplugged || recv_usbip_header(dev.sock(), ctx)); ) {
+		heartbeat::received(dev);
+		sched::update_thread(dev);
+		status = dispatch(ctx);
+	}
+
+	batch::flush(batch);
+	ctx.batch = nullptr;
+}
+
+/*
+ * PDUs of a device are processed under mux_ctx::dispatch_lock, see mux::detach.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto mux_recv_loop(_Inout_ mux_ctx &m, _Inout_ wsk_context &ctx)
+{
+	PAGED_CODE();
+	NTSTATUS status{};
+
+	while (!status && !(status = recv_usbip_header(m.sock, ctx))) {
 
-		NT_ASSERT(!ctx.request); // must be completed and zeroed on every loop
-		ctx.request = ret_command(ctx);
+		wdf::WaitLock lck(m.dispatch_lock);
+		++m.received_cnt;
 
-		if (auto sz = get_payload_size(ctx.hdr); !sz) {
-			//
-		} else if (dev.unplugged) {
-			status = STATUS_CANCELLED; // do not receive payload
+		if (auto device = mux::get_device(m, ctx.hdr.devid)) {
+			ctx.dev = get_device_ctx(device);
+			status = dispatch(ctx);
+			ctx.dev = nullptr;
 		} else {
-			auto f = ctx.request ? recv_payload : drain_payload;
-			status = f(ctx, sz);
+			TraceDbg("session %#x, unknown devid %#x, seqnum %u", m.session, ctx.hdr.devid, ctx.hdr.seqnum);
+			++m.dropped_cnt;
+
+			if (auto sz = get_payload_size(ctx.hdr)) {
+				status = drain_payload(m.sock, ctx, sz);
+			}
 		}
+	}
 
-		if (auto &req = ctx.request) {
-			auto st = status ? status : ret_submit(ctx);
-			complete_and_set_null(req, st);
+	return status;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void complete_lost(_Inout_ device_ctx &dev, _In_ WDFREQUEST request)
+{
+	PAGED_CODE();
+	auto &req = *get_request_ctx(request);
+
+	while (auto lost = device::remove_lost_request(dev, req.endpoint, req.seqnum)) {
+		dgram::complete_lost(dev, lost);
+	}
+}
+
+/*
+ * Payload layout is the same as in TCP stream: transfer buffer(IN only), usbip_iso_packet_descriptor[].
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto ret_submit_dgram(_Inout_ wsk_context &ctx, _In_ const UCHAR *payload, _In_ size_t length)
+{
+	PAGED_CODE();
+
+	auto urb = try_get_urb(ctx.request);
+	if (!(urb && is_isoch(*urb))) {
+		Trace(TRACE_LEVEL_ERROR, "req %04x, isochronous URB expected", ptr04x(ctx.request));
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	auto &ret = get_ret_submit(ctx);
+
+	if (auto err = prepare_isoc(ctx, ret.number_of_packets)) {
+		return err;
+	}
+
+	size_t data_len = is_transfer_dir_in(ctx.hdr) ? ret.actual_length : 0;
+	auto isoc_len = number_of_packets(ctx)*sizeof(*ctx.isoc);
+
+	if (ret.actual_length < 0 || length != data_len + isoc_len) {
+		Trace(TRACE_LEVEL_ERROR, "payload %Iu != transfer buffer %Iu + isoc %Iu", length, data_len, isoc_len);
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+
+	if (data_len) {
+		UCHAR *buf{};
+		ULONG buf_len{};
+
+		if (auto err = UdecxUrbRetrieveBuffer(ctx.request, &buf, &buf_len)) {
+			Trace(TRACE_LEVEL_ERROR, "UdecxUrbRetrieveBuffer %!STATUS!", err);
+			return err;
+		}
+
+		if (auto err = check(buf_len, ret.actual_length)) {
+			return err;
+		}
+
+		RtlCopyMemory(buf, payload, data_len);
+	}
+
+	RtlCopyMemory(ctx.isoc, payload + data_len, isoc_len);
+	return ret_submit_urb(ctx, ret, *urb);
+}
+
+/*
+ * RET_SUBMIT can be received over UDP only for a request that was sent over UDP.
+ * If the request is not found, it was unlinked or completed as lost.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto recv_dgram(_Inout_ device_ctx &dev, _Inout_ dgram_ctx &dg, _Inout_ wsk_context &ctx, 
+	_In_ const UCHAR *data, _In_ size_t length)
+{
+	PAGED_CODE();
+
+	auto &dh = *reinterpret_cast<const dgram_header*>(data);
+	const auto hdr_len = sizeof(dh) + sizeof(ctx.hdr);
+
+	if (!(length >= hdr_len && RtlUlongByteSwap(dh.magic) == dgram_magic && RtlUlongByteSwap(dh.devid) == dev.devid())) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	UINT32 lost{};
+	if (dg.received.update(RtlUlongByteSwap(dh.seqnum), lost) != dgram_sequence::accept) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	dg.lost_cnt += lost;
+
+	RtlCopyMemory(&ctx.hdr, data + sizeof(dh), sizeof(ctx.hdr));
+
+	if (!(validate_header(ctx.hdr) && ctx.hdr.command == RET_SUBMIT && get_payload_size(ctx.hdr) == length - hdr_len)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	++dg.received_cnt;
+
+	NT_ASSERT(!ctx.request);
+	ctx.request = ret_command(ctx);
+
+	if (auto &req = ctx.request) {
+		complete_lost(dev, req);
+		auto st = ret_submit_dgram(ctx, data + hdr_len, length - hdr_len);
+		complete_and_set_null(req, st);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto dgram_recv_loop(_Inout_ device_ctx &dev, _Inout_ dgram_ctx &dg, _Inout_ wsk_context &ctx)
+{
+	PAGED_CODE();
+
+	unique_ptr buf(libdrv::uninitialized, NonPagedPoolNx, max_dgram_size);
+	if (!buf) {
+		Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", max_dgram_size);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Mdl mdl(buf.get(), max_dgram_size);
+	if (auto err = mdl.prepare_nonpaged()) {
+		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
+		return err;
+	}
+
+	auto data = static_cast<const UCHAR*>(buf.get());
+
+	while (!dev.unplugged) {
+		WSK_BUF wb{ .Mdl = mdl.get(), .Length = max_dgram_size };
+		SOCKADDR_INET from{};
+		SIZE_T actual{};
+
+		if (auto err = receive_from(dg.sock, &wb, reinterpret_cast<SOCKADDR*>(&from), actual)) {
+			return err;
+		}
+
+		if (!same_peer(from, dg.peer)) { // the socket is not connected, anyone can send to its port
+			TraceWSK("dev %04x, datagram of %Iu bytes from unknown peer rejected", ptr04x(get_handle(&dev)), actual);
+			++dg.rejected_cnt;
+			continue;
+		}
+
+		heartbeat::received(dev);
+
+		if (auto err = recv_dgram(dev, dg, ctx, data, actual)) {
+			TraceWSK("dev %04x, datagram of %Iu bytes rejected", ptr04x(get_handle(&dev)), actual);
+			++dg.rejected_cnt;
 		}
 	}
+
+	return STATUS_CANCELLED;
 }
 
 } // namespace
 
 
+/*
+ * Datagrams are received by a dedicated thread, TCP stream must not be stalled by them.
+ * The device is detached if the socket fails while the device is plugged.
+ */
 _IRQL_requires_same_
 _Function_class_(KSTART_ROUTINE)
-PAGED void usbip::recv_thread_function(_In_ void *context)
+PAGED void usbip::dgram_recv_thread_function(_In_ void *context)
 {
 	PAGED_CODE();
 
 	auto device = static_cast<UDECXUSBDEVICE>(context);
 	TraceDbg("dev %04x", ptr04x(device));
 
-	//KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
 	auto dev = get_device_ctx(device);
+	auto st = STATUS_INSUFFICIENT_RESOURCES;
 
 	if (auto ctx = alloc_wsk_context(dev, WDF_NO_HANDLE)) {
-		recv_loop(*dev, *ctx);
+		st = dgram_recv_loop(*dev, *dev->ext->dgram, *ctx);
+		NT_ASSERT(!ctx->request);
+		free(ctx, true);
+	}
+
+	if (!dev->unplugged) {
+		TraceDbg("dev %04x, %!STATUS!, detaching", ptr04x(device), st);
+		device::async_detach_nowait(device);
+	}
+
+	TraceDbg("dev %04x, exited", ptr04x(device));
+}
+
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void usbip::mux_recv_thread_function(_In_ void *context)
+{
+	PAGED_CODE();
+
+	auto &m = *static_cast<mux_ctx*>(context);
+	TraceDbg("session %#x", m.session);
+
+	auto st = STATUS_INSUFFICIENT_RESOURCES;
+
+	if (auto ctx = alloc_wsk_context(nullptr, WDF_NO_HANDLE)) {
+		st = mux_recv_loop(m, *ctx);
 		NT_ASSERT(!ctx->request);
 		free(ctx, true);
 	}
 
+	TraceDbg("session %#x, %!STATUS!, detaching all devices", m.session, st);
+	mux::detach_all(m);
+
+	TraceDbg("session %#x, exited", m.session);
+}
+
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void usbip::recv_thread_function(_In_ void *context)
+{
+	PAGED_CODE();
+
+	auto device = static_cast<UDECXUSBDEVICE>(context);
+	TraceDbg("dev %04x", ptr04x(device));
+
+	auto dev = get_device_ctx(device);
+	dev->recv_priority = dev->recv_default_priority = KeQueryPriorityThread(KeGetCurrentThread()); // see sched::update_thread
+
+	if (auto ctx = alloc_wsk_context(dev, WDF_NO_HANDLE)) {
+		do {
+			recv_loop(*dev, *ctx);
+			NT_ASSERT(!ctx->request);
+		} while (!dev->unplugged && session::resume(device));
+		free(ctx, true);
+	}
+
 	if (!dev->unplugged) {
 		TraceDbg("dev %04x, detaching", ptr04x(device));
 		device::detach(device);
@@ -699,6 +1156,8 @@ void usbip::complete(_In_ WDFREQUEST request, _In_ NTSTATUS status)
 		return;
 	}
 
+	admission::release(request); // held requests can be sent before this one is completed
+
 	auto &urb = *libdrv::urb_from_irp(irp);
 	auto &urb_st = urb.UrbHeader.Status;
 
@@ -16,6 +16,7 @@
 #include <libdrv\ioctl.h>
 #include <libdrv\select.h>
 #include <libdrv\urb_ptr.h>
+#include <libdrv\usb_frame.h>
 
 namespace
 {
@@ -218,10 +219,33 @@ NTSTATUS irp_completed(_In_ DEVICE_OBJECT*, _In_ IRP *irp, _In_reads_opt_(_Inexp
 	return ContinueCompletion;
 }
 
+/*
+ * UDE does not implement URB_FUNCTION_GET_CURRENT_FRAME_NUMBER, the frame clock is virtual.
+ * usbip2_ude uses the same clock to translate StartFrame of isochronous transfers.
+ * @return nullptr if IRP is not such request
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_current_frame_number_urb(_In_ IRP *irp) -> _URB_GET_CURRENT_FRAME_NUMBER*
+{
+	if (!libdrv::has_urb(irp)) {
+		return nullptr;
+	}
+
+	auto urb = libdrv::urb_from_irp(irp);
+	return urb->UrbHeader.Function == URB_FUNCTION_GET_CURRENT_FRAME_NUMBER ? &urb->UrbGetCurrentFrameNumber : nullptr;
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _IRQL_requires_same_
 auto pre_process_irp(_In_ filter_ext &fltr, _In_ IRP *irp, _Inout_ libdrv::RemoveLockGuard &lck)
 {
+	if (auto r = get_current_frame_number_urb(irp)) {
+		r->FrameNumber = libdrv::current_frame();
+		r->Hdr.Status = USBD_STATUS_SUCCESS;
+		return CompleteRequest(irp, STATUS_SUCCESS);
+	}
+
 	IoCopyCurrentIrpStackLocationToNext(irp);
 
 	if (auto err = IoSetCompletionRoutineEx(fltr.target, irp, irp_completed, &fltr, true, true, true)) {
@@ -6,6 +6,8 @@
 #include "trace.h"
 #include "query_interface.tmh"
 
+#include <libdrv\usb_frame.h>
+
 #include <usb.h>
 #include <usbbusif.h>
 
@@ -14,6 +16,7 @@ namespace
 
 /*
  * @return the current 32-bit USB frame number
+ * @see libdrv::current_frame
  */
 _Function_class_(PUSB_BUSIFFN_QUERY_BUS_TIME)
 _IRQL_requires_same_
@@ -23,8 +26,7 @@ _Must_inspect_result_ NTSTATUS USB_BUSIFFN QueryBusTime(
 	_Out_opt_ ULONG *CurrentUsbFrame)
 {
 	if (CurrentUsbFrame) {
-		static ULONG dummy;
-		*CurrentUsbFrame = ++dummy; // zero is OK too
+		*CurrentUsbFrame = libdrv::current_frame();
 		// TraceDbg("%lu", *CurrentUsbFrame); // too often
 	}
 
@@ -42,15 +44,15 @@ _Function_class_(PUSB_BUSIFFN_QUERY_BUS_TIME_EX)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Must_inspect_result_ NTSTATUS USB_BUSIFFN QueryBusTimeEx(
-	_In_opt_ PVOID BusContext,
+	_In_opt_ PVOID,
 	_Out_opt_ PULONG HighSpeedFrameCounter)
 {
-	auto st = QueryBusTime(BusContext, HighSpeedFrameCounter);
-	if (NT_SUCCESS(st) && HighSpeedFrameCounter) {
-		*HighSpeedFrameCounter <<= 3;
+	if (HighSpeedFrameCounter) {
+		*HighSpeedFrameCounter = libdrv::current_microframe();
 		// TraceDbg("%lu", **HighSpeedFrameCounter); // too often
 	}
-	return st;
+
+	return STATUS_SUCCESS;
 }
 
 } // namespace
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+
+/*
+ * Socket buffer sizing from the measured bandwidth-delay product.
+ * RTT samples are round trips of control transfers, the rates come from the byte counters of the connection.
+ * The receive thread applies SO_RCVBUF/SO_SNDBUF when update() returns true, see sockbuf.cpp.
+ */
+
+namespace usbip::bdp
+{
+
+enum : UINT32 {
+	default_factor = 2, // buffer = factor*BDP
+	default_min_bytes = 64*1024,
+	rate_window_ms = 250, // throughput is sampled not more often
+};
+
+/*
+ * init() must be called first, the limits and the start of the first rate window are set there.
+ */
+class estimator
+{
+public:
+	constexpr void init(_In_ UINT32 min_bytes, _In_ UINT32 max_bytes, _In_ UINT32 factor, _In_ UINT64 now_ms)
+	{
+		m_min = min_bytes;
+		m_max = max_bytes > min_bytes ? max_bytes : min_bytes;
+		m_factor = factor ? factor : default_factor;
+
+		m_srtt_us = 0;
+		m_rx_rate = m_tx_rate = 0;
+
+		m_window_start = now_ms;
+		m_rx_start = m_tx_start = 0;
+
+		m_rcvbuf = m_sndbuf = 0; // not set
+	}
+
+	/*
+	 * RFC 6298, 2. The Basic Algorithm, alpha = 1/8.
+	 */
+	constexpr void rtt(_In_ UINT32 sample_us)
+	{
+		m_srtt_us = m_srtt_us ? m_srtt_us - m_srtt_us/8 + sample_us/8 : sample_us;
+	}
+
+	/*
+	 * @param rx, tx total bytes received and sent, the counters must not decrease
+	 * @return true if rcvbuf() or sndbuf() has changed and must be applied
+	 */
+	constexpr bool update(_In_ UINT64 now_ms, _In_ UINT64 rx, _In_ UINT64 tx)
+	{
+		auto elapsed = now_ms - m_window_start;
+		if (elapsed < rate_window_ms) {
+			return false;
+		}
+
+		m_rx_rate = average(m_rx_rate, (rx - m_rx_start)*1000/elapsed);
+		m_tx_rate = average(m_tx_rate, (tx - m_tx_start)*1000/elapsed);
+
+		m_window_start = now_ms;
+		m_rx_start = rx;
+		m_tx_start = tx;
+
+		if (!m_srtt_us) {
+			return false;
+		}
+
+		auto rcv = adjust(m_rcvbuf, target(m_rx_rate));
+		auto snd = adjust(m_sndbuf, target(m_tx_rate));
+
+		bool changed = rcv != m_rcvbuf || snd != m_sndbuf;
+
+		m_rcvbuf = rcv;
+		m_sndbuf = snd;
+
+		return changed;
+	}
+
+	constexpr auto srtt_us() const { return m_srtt_us; }
+	constexpr auto rx_rate() const { return m_rx_rate; } // bytes per second
+	constexpr auto tx_rate() const { return m_tx_rate; }
+
+	/*
+	 * @return bytes in flight that are required to saturate the link
+	 */
+	constexpr UINT64 rx_bdp() const { return m_rx_rate*m_srtt_us/1'000'000; }
+	constexpr UINT64 tx_bdp() const { return m_tx_rate*m_srtt_us/1'000'000; }
+
+	constexpr auto rcvbuf() const { return m_rcvbuf; } // zero if it is not set yet
+	constexpr auto sndbuf() const { return m_sndbuf; }
+
+private:
+	UINT32 m_min;
+	UINT32 m_max;
+	UINT32 m_factor;
+
+	UINT32 m_srtt_us;
+	UINT64 m_rx_rate;
+	UINT64 m_tx_rate;
+
+	UINT64 m_window_start; // time in ms
+	UINT64 m_rx_start; // bytes at m_window_start
+	UINT64 m_tx_start;
+
+	UINT32 m_rcvbuf;
+	UINT32 m_sndbuf;
+
+	/*
+	 * EWMA with alpha = 1/4, but an increase of the rate is taken immediately.
+	 */
+	static constexpr UINT64 average(_In_ UINT64 avg, _In_ UINT64 sample)
+	{
+		return sample > avg ? sample : avg - avg/4 + sample/4;
+	}
+
+	constexpr UINT32 target(_In_ UINT64 rate) const
+	{
+		auto sz = m_factor*rate*m_srtt_us/1'000'000;
+		return sz < m_min ? m_min : sz > m_max ? m_max : static_cast<UINT32>(sz);
+	}
+
+	/*
+	 * Hysteresis: grow if the target exceeds the current size by a quarter, shrink if it is less than a half.
+	 */
+	static constexpr UINT32 adjust(_In_ UINT32 cur, _In_ UINT32 target)
+	{
+		if (!cur || target > cur + cur/4 || target < cur/2) {
+			return target;
+		}
+		return cur;
+	}
+};
+
+} // namespace usbip::bdp
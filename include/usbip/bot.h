@@ -0,0 +1,657 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+
+/*
+ * USB Mass Storage Class Bulk-Only Transport (BOT), interface class 0x08, protocol 0x50.
+ * Every SCSI command is CBW (bulk OUT), optional data (bulk IN or OUT) and CSW (bulk IN).
+ * drivers/ude/bot_cache.cpp feeds the bulk transfers of such interface into the classes below.
+ */
+
+namespace usbip::bot
+{
+
+enum : UINT8 {
+	interface_class = 0x08, // USB_DEVICE_CLASS_STORAGE
+	interface_protocol = 0x50,
+};
+
+enum : UINT32 {
+	cbw_signature = 0x43425355, // "USBC", little-endian
+	csw_signature = 0x53425355, // "USBS"
+};
+
+enum : UINT8 { cbw_flag_in = 0x80 }; // bmCBWFlags, data-in from the device
+
+enum : UINT8 { csw_passed, csw_failed, csw_phase_error }; // bCSWStatus
+
+#include <PSHPACK1.H>
+
+struct cbw
+{
+	UINT32 signature;
+	UINT32 tag;
+	UINT32 data_length; // dCBWDataTransferLength
+	UINT8 flags;
+	UINT8 lun;
+	UINT8 cb_length;
+	UINT8 cb[16];
+};
+
+struct csw
+{
+	UINT32 signature;
+	UINT32 tag;
+	UINT32 residue; // dCSWDataResidue
+	UINT8 status;
+};
+
+#include <POPPACK.H>
+
+static_assert(sizeof(cbw) == 31);
+static_assert(sizeof(csw) == 13);
+
+namespace scsi
+{
+
+enum : UINT8 {
+	TEST_UNIT_READY = 0x00,
+	REQUEST_SENSE = 0x03,
+	READ_6 = 0x08,
+	INQUIRY = 0x12,
+	MODE_SENSE_6 = 0x1A,
+	PREVENT_ALLOW_MEDIUM_REMOVAL = 0x1E,
+	READ_FORMAT_CAPACITIES = 0x23,
+	READ_CAPACITY_10 = 0x25,
+	READ_10 = 0x28,
+	READ_TOC = 0x43,
+	GET_CONFIGURATION = 0x46,
+	GET_EVENT_STATUS_NOTIFICATION = 0x4A,
+	MODE_SENSE_10 = 0x5A,
+	READ_16 = 0x88,
+	SERVICE_ACTION_IN_16 = 0x9E, // READ CAPACITY(16)
+	READ_12 = 0xA8,
+};
+
+enum : UINT8 { READ_CAPACITY_16 = 0x10 }; // service action of SERVICE_ACTION_IN_16
+
+/*
+ * The command does not change the medium and its data.
+ */
+constexpr auto is_harmless(_In_ UINT8 opcode)
+{
+	switch (opcode) {
+	case TEST_UNIT_READY:
+	case REQUEST_SENSE:
+	case INQUIRY:
+	case MODE_SENSE_6:
+	case MODE_SENSE_10:
+	case PREVENT_ALLOW_MEDIUM_REMOVAL:
+	case READ_FORMAT_CAPACITIES:
+	case READ_CAPACITY_10:
+	case SERVICE_ACTION_IN_16:
+	case READ_TOC:
+	case GET_CONFIGURATION:
+	case GET_EVENT_STATUS_NOTIFICATION:
+		return true;
+	}
+
+	return false;
+}
+
+constexpr UINT32 get_be(_In_ const UINT8 *p, _In_ int len)
+{
+	UINT32 v = 0;
+	for (int i = 0; i < len; ++i) {
+		v = v << 8 | p[i];
+	}
+	return v;
+}
+
+constexpr void set_be(_Out_ UINT8 *p, _In_ int len, _In_ UINT32 v)
+{
+	for (int i = len - 1; i >= 0; --i, v >>= 8) {
+		p[i] = static_cast<UINT8>(v);
+	}
+}
+
+struct read_cmd
+{
+	UINT64 lba;
+	UINT32 blocks;
+	UINT32 max_blocks; // that can be set in CDB, zero if it can't be changed
+};
+
+/*
+ * @return false if CBW is not READ(6/10/12/16)
+ */
+constexpr bool parse_read(_In_ const cbw &c, _Out_ read_cmd &r)
+{
+	r = {};
+	auto cb = c.cb;
+
+	switch (cb[0]) {
+	case READ_6:
+		r.lba = (cb[1] & 0x1FU) << 16 | get_be(cb + 2, 2);
+		r.blocks = cb[4] ? cb[4] : 256;
+		return c.cb_length >= 6;
+	case READ_10:
+		r.lba = get_be(cb + 2, 4);
+		r.blocks = get_be(cb + 7, 2);
+		r.max_blocks = 0xFFFF;
+		return c.cb_length >= 10;
+	case READ_12:
+		r.lba = get_be(cb + 2, 4);
+		r.blocks = get_be(cb + 6, 4);
+		r.max_blocks = 0xFFFF'FFFF;
+		return c.cb_length >= 12;
+	case READ_16:
+		r.lba = UINT64(get_be(cb + 2, 4)) << 32 | get_be(cb + 6, 4);
+		r.blocks = get_be(cb + 10, 4);
+		r.max_blocks = 0xFFFF'FFFF;
+		return c.cb_length >= 16;
+	}
+
+	return false;
+}
+
+/*
+ * For READ(10/12/16) only, see read_cmd::max_blocks.
+ */
+constexpr void set_read_blocks(_Inout_ cbw &c, _In_ UINT32 blocks)
+{
+	switch (auto cb = c.cb; cb[0]) {
+	case READ_10:
+		set_be(cb + 7, 2, blocks);
+		break;
+	case READ_12:
+		set_be(cb + 6, 4, blocks);
+		break;
+	case READ_16:
+		set_be(cb + 10, 4, blocks);
+		break;
+	}
+}
+
+} // namespace scsi
+
+
+/*
+ * Read-ahead cache of a BOT device.
+ *
+ * If READ starts where the previous one ended, its CBW is enlarged to fill the cache,
+ * the device sends the data of the host and the next blocks in the same data phase.
+ * The following READ-s that are in the cache are answered locally: CBW is completed without sending,
+ * the data are copied from the cache and CSW is synthesized. This saves three round-trips per command.
+ *
+ * The cache is a single range of blocks of one LUN. It is invalidated by any command that can change
+ * the medium (WRITE and everything that is not known), by any failed command and by reset.
+ *
+ * The cache buffer is owned by the caller, this class tells the offsets in it.
+ * device_ctx::bot_ra is zeroed with the context and is disabled until bot::enable allocates device_ctx::bot_cache.
+ */
+class readahead
+{
+public:
+	enum action_t { forward, expand, local }; // for CBW
+
+	// for bulk IN of the host
+	enum in_action_t {
+		in_forward, // as is
+		in_expand, // the first URB of the data phase of enlarged READ, see device_length
+		in_local_data, // see local_data
+		in_local_status, // see make_status
+	};
+
+	constexpr auto enabled() const { return m_capacity != 0; }
+	constexpr auto capacity() const { return m_capacity; }
+
+	constexpr void enable(_In_ UINT32 capacity)
+	{
+		*this = readahead();
+		m_capacity = capacity;
+	}
+
+	constexpr auto cached_blocks() const { return m_blocks; }
+	constexpr auto block_size() const { return m_block_size; }
+
+	constexpr void invalidate() { m_blocks = 0; }
+
+	/*
+	 * Reset recovery, endpoint purge, etc.
+	 */
+	constexpr void reset()
+	{
+		invalidate();
+		m_cmd = {};
+		m_next_valid = false;
+	}
+
+	/*
+	 * @param c CBW of the host, it is changed if the result is expand
+	 */
+	constexpr action_t command(_Inout_ cbw &c)
+	{
+		m_cmd = {}; // the previous one is completed or aborted
+
+		if (!(enabled() && c.signature == cbw_signature)) {
+			return forward;
+		}
+
+		m_cmd.tag = c.tag;
+		m_cmd.tracked = true;
+
+		if (auto op = c.cb[0]; op == scsi::READ_CAPACITY_10) {
+			m_cmd.read_capacity = 10;
+		} else if (op == scsi::SERVICE_ACTION_IN_16 && (c.cb[1] & 0x1F) == scsi::READ_CAPACITY_16) {
+			m_cmd.read_capacity = 16;
+		}
+		m_cmd.lun = c.lun;
+
+		scsi::read_cmd rd;
+		if (!scsi::parse_read(c, rd)) {
+			if (!scsi::is_harmless(c.cb[0])) {
+				invalidate();
+			}
+			m_next_valid = false;
+			return forward;
+		}
+
+		auto bs = block_size(c, rd);
+		if (!bs) {
+			m_next_valid = false;
+			return forward;
+		}
+
+		auto sequential = m_next_valid && rd.lba == m_next && c.lun == m_next_lun && bs == m_next_block_size;
+
+		m_next = rd.lba + rd.blocks;
+		m_next_lun = c.lun;
+		m_next_block_size = bs;
+		m_next_valid = true;
+
+		if (m_blocks && c.lun == m_lun && bs == m_block_size &&
+		    rd.lba >= m_lba && rd.lba + rd.blocks <= m_lba + m_blocks) {
+			m_cmd.act = local;
+			m_cmd.base = static_cast<UINT32>(rd.lba - m_lba)*bs;
+			m_cmd.host_len = c.data_length;
+			m_cmd.available = c.data_length;
+			m_cmd.phase_data = true;
+			++m_hits;
+			return local;
+		}
+
+		if (!(sequential && rd.max_blocks && m_last_valid && c.lun == m_last_lun && bs == m_last_block_size &&
+		      rd.lba <= m_last_lba)) { // do not read beyond the end of the medium
+			return forward;
+		}
+
+		auto total = m_capacity/bs;
+		if (total > rd.max_blocks) {
+			total = rd.max_blocks;
+		}
+		if (auto left = m_last_lba - rd.lba + 1; total > left) {
+			total = static_cast<UINT32>(left);
+		}
+
+		if (total <= rd.blocks) {
+			return forward;
+		}
+
+		m_blocks = 0; // the buffer will be overwritten
+		m_lba = rd.lba;
+		m_lun = c.lun;
+		m_block_size = bs;
+
+		m_cmd.act = expand;
+		m_cmd.host_len = c.data_length;
+		m_cmd.extra = (total - rd.blocks)*bs;
+		m_cmd.phase_data = true;
+
+		scsi::set_read_blocks(c, total);
+		c.data_length += m_cmd.extra;
+
+		++m_expanded;
+		return expand;
+	}
+
+	constexpr in_action_t next_in() const
+	{
+		if (m_cmd.act == expand) {
+			return !m_cmd.phase_data ? in_forward : m_cmd.device_done ? in_local_data : in_expand;
+		} else if (m_cmd.act == local) {
+			return m_cmd.phase_data ? in_local_data : in_local_status;
+		}
+		return in_forward;
+	}
+
+	/*
+	 * Length of the first URB of the data phase of enlarged READ, the data are received into the cache.
+	 */
+	constexpr UINT32 device_length() const { return m_cmd.host_len + m_cmd.extra; }
+
+	/*
+	 * For in_expand, the data were received into the cache from its start.
+	 * @param ok the transfer did not fail
+	 * @return bytes to copy from the cache into the URB
+	 */
+	constexpr UINT32 data_received(_In_ UINT32 urb_length, _In_ UINT32 actual, _In_ bool ok)
+	{
+		m_cmd.device_done = true;
+		m_cmd.received = actual;
+		m_cmd.available = actual < m_cmd.host_len ? actual : m_cmd.host_len;
+
+		auto len = urb_length < m_cmd.available ? urb_length : m_cmd.available;
+		m_cmd.host_done = len;
+
+		if (!ok || m_cmd.host_done == m_cmd.available) {
+			m_cmd.phase_data = false;
+		}
+
+		return len;
+	}
+
+	/*
+	 * For in_local_data.
+	 * @param offset in the cache
+	 * @return bytes to copy from the cache into the URB
+	 */
+	constexpr UINT32 local_data(_In_ UINT32 urb_length, _Out_ UINT32 &offset)
+	{
+		offset = m_cmd.base + m_cmd.host_done;
+
+		auto avail = m_cmd.available - m_cmd.host_done;
+		auto len = urb_length < avail ? urb_length : avail;
+
+		m_cmd.host_done += len;
+		if (m_cmd.host_done == m_cmd.available) {
+			m_cmd.phase_data = false;
+		}
+
+		return len;
+	}
+
+	/*
+	 * For in_local_status.
+	 */
+	constexpr void make_status(_Out_ csw &s)
+	{
+		s.signature = csw_signature;
+		s.tag = m_cmd.tag;
+		s.residue = m_cmd.host_len - m_cmd.host_done;
+		s.status = csw_passed;
+
+		m_cmd = {};
+	}
+
+	/*
+	 * Bulk IN of the host that was forwarded (in_forward) is completed.
+	 * READ CAPACITY tells the last block of the medium, CSW completes the command.
+	 */
+	void received(_Inout_updates_bytes_(len) void *buf, _In_ UINT32 len)
+	{
+		if (len == sizeof(csw)) {
+			status(*static_cast<csw*>(buf));
+		} else if (m_cmd.read_capacity) {
+			read_capacity(static_cast<const UINT8*>(buf), len);
+		}
+	}
+
+	/*
+	 * CSW of the device, it is changed if READ was enlarged.
+	 */
+	constexpr void status(_Inout_ csw &s)
+	{
+		if (!(m_cmd.tracked && s.signature == csw_signature && s.tag == m_cmd.tag)) {
+			return;
+		}
+
+		if (m_cmd.act == expand) {
+			if (s.status == csw_passed && !s.residue && m_cmd.received == device_length()) {
+				m_blocks = m_cmd.received/m_block_size;
+			} else {
+				invalidate();
+				m_next_valid = false;
+			}
+			s.residue = m_cmd.host_len - m_cmd.host_done; // as the host sees it
+		} else if (s.status != csw_passed) {
+			invalidate();
+			m_next_valid = false;
+			m_last_valid = false; // the medium could be changed, the host reads the capacity again
+		}
+
+		m_cmd = {};
+	}
+
+	constexpr auto hits() const { return m_hits; }
+	constexpr auto expanded() const { return m_expanded; }
+
+private:
+	struct command_t
+	{
+		UINT32 tag;
+		bool tracked; // tag is valid
+		action_t act;
+
+		UINT8 read_capacity; // 10 or 16 if READ CAPACITY(10/16)
+		UINT8 lun;
+
+		bool phase_data; // the next bulk IN is for data
+		bool device_done; // the data phase of the device is completed, expand only
+
+		UINT32 base; // offset in the cache, local only
+		UINT32 host_len; // dCBWDataTransferLength of the host
+		UINT32 extra; // read-ahead bytes after host_len, expand only
+		UINT32 received; // from the device, expand only
+		UINT32 available; // for the host
+		UINT32 host_done; // given to the host
+	};
+
+	UINT32 m_capacity; // bytes
+
+	UINT64 m_lba; // of the first cached block
+	UINT32 m_blocks; // cached
+	UINT32 m_block_size;
+	UINT8 m_lun;
+
+	UINT64 m_last_lba; // of the medium, from READ CAPACITY
+	UINT32 m_last_block_size;
+	UINT8 m_last_lun;
+	bool m_last_valid;
+
+	UINT64 m_next; // the block after the previous READ
+	UINT32 m_next_block_size;
+	UINT8 m_next_lun;
+	bool m_next_valid;
+
+	command_t m_cmd;
+
+	UINT64 m_hits;
+	UINT64 m_expanded;
+
+	constexpr void read_capacity(_In_ const UINT8 *p, _In_ UINT32 len)
+	{
+		UINT64 last{};
+		UINT32 bs{};
+
+		if (m_cmd.read_capacity == 10 && len >= 8) {
+			last = scsi::get_be(p, 4);
+			bs = scsi::get_be(p + 4, 4);
+			if (last == 0xFFFF'FFFF) { // READ CAPACITY(16) is required
+				return;
+			}
+		} else if (m_cmd.read_capacity == 16 && len >= 12) {
+			last = UINT64(scsi::get_be(p, 4)) << 32 | scsi::get_be(p + 4, 4);
+			bs = scsi::get_be(p + 8, 4);
+		} else {
+			return;
+		}
+
+		m_last_lba = last;
+		m_last_block_size = bs;
+		m_last_lun = m_cmd.lun;
+		m_last_valid = true;
+	}
+
+	static constexpr UINT32 block_size(_In_ const cbw &c, _In_ const scsi::read_cmd &rd)
+	{
+		if (!(c.flags & cbw_flag_in && rd.blocks && c.data_length && !(c.data_length % rd.blocks))) {
+			return 0;
+		}
+
+		auto bs = c.data_length/rd.blocks;
+		return bs >= 512 && !(bs & (bs - 1)) ? bs : 0;
+	}
+};
+
+
+/*
+ * Bulk IN stages of a command that are submitted together with its CBW.
+ *
+ * The host submits the data stage only after CBW is completed and CSW only after the data stage,
+ * so every command costs three round-trips. The stages are predictable from CBW: data-in
+ * of dCBWDataTransferLength if any, then CSW. They are submitted right away, the device
+ * NAKs bulk IN until it executes CBW. The host's URB-s are bound to them in the same order.
+ *
+ * RET_SUBMIT of a stage can arrive before the host's URB is bound to it, see claim and received.
+ * If it arrives later, the URB has taken the seqnum of the stage and RET_SUBMIT completes it as usual.
+ * A mismatch, a failed stage, clear stall, purge, etc. cancel all the stages,
+ * the ones whose RET_SUBMIT has not arrived yet must be unlinked.
+ *
+ * device_ctx::bot_pipe is zeroed with the context and has no stages, bot_cache.cpp plans them
+ * for every CBW if device_ctx::bot_pipelining is set; the payloads are kept in device_ctx::bot_stages.
+ */
+class pipeline
+{
+public:
+	enum { max_stages = 2 }; // data-in and CSW
+
+	enum state_t : UINT8 {
+		stage_free,
+		stage_sent, // RET_SUBMIT has not arrived
+		stage_receiving, // the payload of RET_SUBMIT is being received
+		stage_received, // waits for the host's URB
+	};
+
+	/*
+	 * The stages of the previous command must be cancelled.
+	 * @return the number of bulk IN stages to submit ahead, see length() and sent()
+	 */
+	constexpr int plan(_In_ const cbw &c)
+	{
+		m_cnt = m_pos = 0;
+
+		if (c.signature != cbw_signature) {
+			return 0;
+		}
+
+		if (c.data_length && c.flags & cbw_flag_in) {
+			m_length[m_cnt++] = c.data_length;
+		}
+		m_length[m_cnt++] = sizeof(csw);
+
+		++m_commands;
+		return m_cnt;
+	}
+
+	constexpr auto length(_In_ int stage) const { return m_length[stage]; }
+
+	constexpr void sent(_In_ int stage, _In_ UINT32 seqnum)
+	{
+		m_seqnum[stage] = seqnum;
+		m_state[stage] = stage_sent;
+	}
+
+	constexpr auto pending() const { return m_pos < m_cnt; }
+
+	constexpr auto state(_In_ int stage) const { return m_state[stage]; }
+	constexpr auto seqnum(_In_ int stage) const { return m_seqnum[stage]; }
+
+	/*
+	 * @return the stage or -1
+	 */
+	constexpr int find(_In_ UINT32 seqnum) const
+	{
+		for (int i = 0; i < max_stages; ++i) {
+			if (m_state[i] != stage_free && m_seqnum[i] == seqnum) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	/*
+	 * RET_SUBMIT of the stage arrived before the host's URB was bound to it.
+	 * @return true if its payload must be received, then received() or cancel() must be called
+	 */
+	constexpr bool claim(_In_ int stage)
+	{
+		if (m_state[stage] != stage_sent) {
+			return false;
+		}
+
+		m_state[stage] = stage_receiving;
+		return true;
+	}
+
+	constexpr void received(_In_ int stage) { m_state[stage] = stage_received; }
+
+	/*
+	 * @param length of bulk IN URB of the host
+	 * @return the stage this URB is bound to, -1 if it does not match, all stages must be cancelled.
+	 *         If the stage is sent, the URB takes its seqnum and the stage must be released,
+	 *         if it is received, the URB is completed from its RET_SUBMIT, otherwise it waits for it.
+	 */
+	constexpr int bind(_In_ UINT32 length)
+	{
+		if (pending() && m_length[m_pos] == length) {
+			++m_bound;
+			return m_pos++;
+		}
+		return -1;
+	}
+
+	constexpr void release(_In_ int stage)
+	{
+		m_state[stage] = stage_free;
+		m_seqnum[stage] = 0;
+	}
+
+	/*
+	 * @param unlink seqnums of the stages whose RET_SUBMIT has not arrived
+	 * @return the number of seqnums in unlink
+	 */
+	constexpr int cancel(_Out_writes_(max_stages) UINT32 *unlink)
+	{
+		int cnt = 0;
+
+		for (int i = 0; i < max_stages; ++i) {
+			if (m_state[i] == stage_sent) {
+				unlink[cnt++] = m_seqnum[i];
+			}
+			release(i);
+		}
+
+		m_cnt = m_pos = 0;
+		return cnt;
+	}
+
+	constexpr auto commands() const { return m_commands; }
+	constexpr auto bound() const { return m_bound; }
+
+private:
+	UINT32 m_length[max_stages];
+	UINT32 m_seqnum[max_stages];
+	state_t m_state[max_stages];
+	int m_cnt;
+	int m_pos; // the next stage to bind
+
+	UINT64 m_commands;
+	UINT64 m_bound;
+};
+
+} // namespace usbip::bot
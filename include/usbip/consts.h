@@ -10,6 +10,27 @@ namespace usbip
 constexpr auto &tcp_port = "3240";
 constexpr auto &driver_filename = L"usbip2_ude"; // used by filter driver
 constexpr auto &persistent_devices_value_name = L"PersistentDevices";
+constexpr auto &protocol_extensions_value_name = L"ProtocolExtensions"; // REG_DWORD, mask of extension_t
+constexpr auto &protocol_extensions_hosts_value_name = L"ProtocolExtensionsHosts"; // REG_MULTI_SZ, "host[,service]" of servers that support them
+constexpr auto &attach_concurrency_value_name = L"AttachConcurrency"; // REG_DWORD, persistent devices attached in parallel
+constexpr auto &connection_pool_size_value_name = L"ConnectionPoolSize"; // REG_DWORD, connections per server, zero disables
+constexpr auto &connection_pool_idle_timeout_value_name = L"ConnectionPoolIdleTimeout"; // REG_DWORD, seconds
+constexpr auto &session_resume_timeout_value_name = L"SessionResumeTimeout"; // REG_DWORD, seconds, zero disables
+constexpr auto &heartbeat_interval_value_name = L"HeartbeatInterval"; // REG_DWORD, milliseconds, zero disables
+constexpr auto &heartbeat_misses_value_name = L"HeartbeatMisses"; // REG_DWORD, unanswered probes in a row
+constexpr auto &socket_buffer_max_value_name = L"SocketBufferMax"; // REG_DWORD, bytes, zero disables adaptive sizing
+constexpr auto &socket_buffer_min_value_name = L"SocketBufferMin"; // REG_DWORD, bytes
+constexpr auto &socket_buffer_factor_value_name = L"SocketBufferFactor"; // REG_DWORD, buffer = factor*BDP
+constexpr auto &max_device_urbs_value_name = L"MaxDeviceUrbs"; // REG_DWORD, outstanding URBs of a device, zero is unlimited
+constexpr auto &max_device_bytes_value_name = L"MaxDeviceBytes"; // REG_DWORD, their transfer buffers, zero is unlimited
+constexpr auto &max_endpoint_urbs_value_name = L"MaxEndpointUrbs"; // REG_DWORD, outstanding URBs of an endpoint
+constexpr auto &max_endpoint_bytes_value_name = L"MaxEndpointBytes"; // REG_DWORD
+constexpr auto &isoch_lead_time_value_name = L"IsochLeadTime"; // REG_DWORD, microseconds, zero disables pacing of CMD_SUBMIT
+constexpr auto &bot_readahead_value_name = L"BotReadAhead"; // REG_DWORD, bytes of read-ahead cache of mass storage device, zero disables
+constexpr auto &bot_pipelining_value_name = L"BotPipelining"; // REG_DWORD, send bulk IN stages of mass storage command with its CBW
+constexpr auto &suspend_passthrough_value_name = L"SuspendPassthrough"; // REG_DWORD, unlink interrupt IN URBs while device is suspended
+constexpr auto &bulk_stream_reads_value_name = L"BulkStreamReads"; // REG_DWORD, outstanding bulk IN reads of serial interface, zero disables
+constexpr auto &sched_policy_value_name = L"SchedulingPolicy"; // REG_BINARY, array of vhci::ioctl::sched_rule
 
 enum op_status_t // op_common.status
 {
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+
+/*
+ * Building blocks for EXT_MULTIPLEX: demultiplexing of PDUs by devid and fair scheduling of sends
+ * of the devices that share one connection. drivers/ude/mux.cpp keeps them in mux_ctx
+ * and accesses them under mux_ctx::lock, recv_thread looks up devices by devid.
+ */
+
+namespace usbip::mux
+{
+
+/*
+ * Maps header_basic.devid to a value, the index of a slot is used as a flow number for drr.
+ * N is small (number of hub ports), a linear search takes tens of nanoseconds per received PDU
+ * which is negligible compared to WskReceive, see tests/bench/mux_bench.cpp.
+ */
+template<typename T, int N>
+class devid_table
+{
+public:
+	enum { npos = -1 };
+
+	constexpr int find(_In_ UINT32 devid) const
+	{
+		for (int i = 0; i < N; ++i) {
+			if (m_devid[i] == devid && m_value[i]) {
+				return i;
+			}
+		}
+		return npos;
+	}
+
+	constexpr auto get(_In_ UINT32 devid) const
+	{
+		auto i = find(devid);
+		return i == npos ? T{} : m_value[i];
+	}
+
+	constexpr auto operator[](_In_ int i) const { return m_value[i]; }
+
+	/*
+	 * @return slot index or npos if the table is full or devid is already present
+	 */
+	constexpr int insert(_In_ UINT32 devid, _In_ T value)
+	{
+		if (!value || find(devid) != npos) {
+			return npos;
+		}
+
+		for (int i = 0; i < N; ++i) {
+			if (!m_value[i]) {
+				m_devid[i] = devid;
+				m_value[i] = value;
+				++m_size;
+				return i;
+			}
+		}
+
+		return npos;
+	}
+
+	constexpr int erase(_In_ UINT32 devid)
+	{
+		auto i = find(devid);
+		if (i != npos) {
+			m_devid[i] = 0;
+			m_value[i] = T{};
+			--m_size;
+		}
+		return i;
+	}
+
+	constexpr auto size() const { return m_size; }
+	constexpr auto empty() const { return !m_size; }
+
+private:
+	UINT32 m_devid[N];
+	T m_value[N];
+	int m_size;
+};
+
+/*
+ * Deficit round robin over N flows, see M. Shreedhar, G. Varghese, "Efficient Fair Queuing using Deficit Round Robin".
+ * A flow may send Quantum bytes per round, a flow with large PDUs accumulates a deficit
+ * and does not starve flows with small ones. O(1) per decision if PDUs are smaller than Quantum.
+ *
+ * A zeroed object has no active flows, mux_ctx is allocated from zeroed pool.
+ */
+template<int N, UINT32 Quantum>
+class drr
+{
+public:
+	/*
+	 * Must be called when a flow gets pending items, the repeated calls are ignored.
+	 */
+	constexpr void activate(_In_ int flow)
+	{
+		if (!m_active[flow]) {
+			m_active[flow] = true;
+			m_deficit[flow] = 0;
+			m_ring[(m_first + m_count++) % N] = static_cast<UINT8>(flow);
+		}
+	}
+
+	/*
+	 * @param head_size returns the size of the first pending item of a flow, zero if the flow is empty
+	 * @return the flow whose first item must be sent next, -1 if there are no pending items
+	 */
+	template<typename F>
+	constexpr int next(_In_ const F &head_size)
+	{
+		while (m_count) {
+			auto flow = m_ring[m_first];
+
+			if (UINT32 sz = head_size(flow); !sz) { // became empty
+				m_active[flow] = false;
+				pop();
+			} else if (m_deficit[flow] >= sz) {
+				m_deficit[flow] -= sz;
+				return flow;
+			} else {
+				m_deficit[flow] += Quantum;
+				pop();
+				m_ring[(m_first + m_count++) % N] = flow; // to the end of the round
+			}
+		}
+
+		return -1;
+	}
+
+	constexpr auto active_flows() const { return m_count; }
+
+private:
+	static_assert(N > 0 && N <= 256);
+
+	UINT32 m_deficit[N];
+	bool m_active[N];
+
+	UINT8 m_ring[N]; // active flows
+	int m_first;
+	int m_count;
+
+	constexpr void pop()
+	{
+		m_first = (m_first + 1) % N;
+		--m_count;
+	}
+};
+
+} // namespace usbip::mux
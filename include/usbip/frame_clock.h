@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+
+/*
+ * Virtual USB frame clock of an imported device, synchronized with the frame counter of the server.
+ * The time comes from libdrv/usb_frame.h, wsk_receive.cpp feeds the samples and translates start_frame
+ * of RET_SUBMIT, device_ioctl.cpp translates StartFrame of CMD_SUBMIT and paces the sends.
+ */
+
+namespace usbip::frame
+{
+
+enum : UINT32 {
+	us_per_frame = 1000, // full-speed frame, URB_GET_CURRENT_FRAME_NUMBER and StartFrame use them
+	min_modulus = 1024, // Linux HCDs return the frame number modulo the size of the periodic schedule
+};
+
+/*
+ * The local frame clock is the time since boot in milliseconds,
+ * the same for all devices and for the filter driver.
+ */
+constexpr auto local_frame(_In_ UINT64 now_us) { return static_cast<UINT32>(now_us/us_per_frame); }
+
+/*
+ * @return signed difference a - b of two frame numbers modulo mod
+ */
+constexpr INT32 frame_diff(_In_ UINT32 a, _In_ UINT32 b, _In_ UINT32 mod)
+{
+	auto d = (a - b) & (mod - 1);
+	return d < mod/2 ? static_cast<INT32>(d) : static_cast<INT32>(d) - static_cast<INT32>(mod);
+}
+
+/*
+ * A sample is start_frame of RET_SUBMIT for an isochronous URB. The server started the transfer
+ * when CMD_SUBMIT arrived, i.e. at sent + one-way delay. The one-way delay is estimated as a half
+ * of the round-trip time without the duration of the transfer itself (Cristian's algorithm).
+ * Like NTP clock filter, the sample with minimal RTT among the recent ones is used,
+ * it has the smallest queuing delay and thus the smallest error.
+ *
+ * The modulus of the server's counter is unknown, it is the next power of two above the largest
+ * start_frame that was seen. If it grows, the previous samples are discarded.
+ *
+ * device_ctx::frame_clock is zeroed with the context and stays unsynchronized until RET_SUBMIT
+ * of the first isochronous URB, such URBs are sent with USBD_START_ISO_TRANSFER_ASAP meanwhile.
+ * Is protected by device_ctx::frame_lock.
+ */
+class clock
+{
+public:
+	enum { window = 8 }; // samples
+
+	constexpr auto synced() const { return m_cnt != 0; }
+	constexpr auto modulus() const { return m_modulus ? m_modulus : min_modulus; }
+
+	constexpr auto offset() const { return m_offset; } // server = local + offset (mod modulus)
+	constexpr auto rtt_us() const { return m_rtt_us; } // of the selected sample
+	constexpr auto samples() const { return m_samples_total; }
+
+	/*
+	 * @param sent_us local time when CMD_SUBMIT was sent
+	 * @param received_us local time when RET_SUBMIT was received
+	 * @param duration_us of the transfer on the bus, number_of_packets*interval
+	 * @param server_frame start_frame of RET_SUBMIT
+	 */
+	constexpr void sample(_In_ UINT64 sent_us, _In_ UINT64 received_us, _In_ UINT32 duration_us, _In_ UINT32 server_frame)
+	{
+		if (received_us < sent_us) {
+			return;
+		}
+
+		if (auto mod = modulus(); server_frame >= mod) {
+			while (server_frame >= mod && mod < max_modulus) {
+				mod <<= 1;
+			}
+			m_modulus = mod;
+			m_cnt = m_pos = 0; // offsets modulo the previous modulus are wrong
+		}
+
+		auto rtt = received_us - sent_us;
+		rtt = rtt > duration_us ? rtt - duration_us : 0;
+		if (rtt > max_rtt_us) {
+			rtt = max_rtt_us;
+		}
+
+		auto arrived = local_frame(sent_us + rtt/2);
+		auto &s = m_samples[m_pos];
+
+		s.rtt_us = static_cast<UINT32>(rtt);
+		s.offset = (server_frame - arrived) & (modulus() - 1);
+
+		m_pos = (m_pos + 1) % window;
+		if (m_cnt < window) {
+			++m_cnt;
+		}
+		++m_samples_total;
+
+		select();
+	}
+
+	constexpr UINT32 to_server(_In_ UINT32 local) const
+	{
+		return (local + m_offset) & (modulus() - 1);
+	}
+
+	/*
+	 * @param near_local local frame that is close to the result, for example the current frame
+	 */
+	constexpr UINT32 to_local(_In_ UINT32 server_frame, _In_ UINT32 near_local) const
+	{
+		return near_local + frame_diff(server_frame, to_server(near_local), modulus());
+	}
+
+	/*
+	 * @return local time when CMD_SUBMIT must be sent to arrive margin_us before the start of the frame
+	 */
+	constexpr UINT64 send_at_us(_In_ UINT32 local, _In_ UINT32 margin_us) const
+	{
+		auto start = UINT64(local)*us_per_frame;
+		auto lead = UINT64(m_rtt_us/2) + margin_us;
+		return start > lead ? start - lead : 0;
+	}
+
+private:
+	enum : UINT32 {
+		max_modulus = 1UL << 31,
+		max_rtt_us = 10'000'000,
+	};
+
+	struct sample_t
+	{
+		UINT32 rtt_us;
+		UINT32 offset;
+	};
+
+	sample_t m_samples[window];
+	int m_cnt;
+	int m_pos;
+
+	UINT32 m_modulus;
+	UINT32 m_offset;
+	UINT32 m_rtt_us;
+	UINT64 m_samples_total;
+
+	constexpr void select()
+	{
+		auto best = &m_samples[0];
+
+		for (int i = 1; i < m_cnt; ++i) {
+			if (m_samples[i].rtt_us < best->rtt_us) {
+				best = &m_samples[i];
+			}
+		}
+
+		m_offset = best->offset;
+		m_rtt_us = best->rtt_us;
+	}
+};
+
+} // namespace usbip::frame
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+
+/*
+ * Connection racing policy of RFC 8305 "Happy Eyeballs Version 2: Better Connectivity Using Concurrency".
+ * libusbip races non-blocking sockets with WSAWaitForMultipleEvents, the driver races WskConnect IRPs
+ * from a workitem. Both own the sockets and the timers, the policy only decides which address to connect to and when.
+ */
+
+namespace usbip::he
+{
+
+/*
+ * RFC 8305, 5. Connection Attempt Delay.
+ */
+enum : UINT32 {
+	connection_attempt_delay_ms = 250, // recommended value
+	min_connection_attempt_delay_ms = 100,
+	max_connection_attempt_delay_ms = 2000,
+};
+
+/*
+ * Attempts are started one by one, the next one is started after the attempt delay expires
+ * or immediately if no attempts are in progress (all started ones have failed).
+ * The first successful attempt wins, the caller must cancel the rest.
+ *
+ * init() must be called first, it computes the order of the attempts.
+ */
+template<int N>
+class race
+{
+public:
+	enum { npos = -1 };
+	static constexpr UINT32 infinite = ~0U;
+
+	/*
+	 * @param families address families in the order of the resolver
+	 * @param cnt the number of addresses, the rest is ignored if it is greater than N
+	 */
+	constexpr void init(_In_ const int *families, _In_ int cnt, _In_ UINT32 delay_ms = connection_attempt_delay_ms)
+	{
+		m_cnt = cnt < N ? cnt : N;
+
+		m_delay = delay_ms < min_connection_attempt_delay_ms ? min_connection_attempt_delay_ms :
+			  delay_ms > max_connection_attempt_delay_ms ? max_connection_attempt_delay_ms : delay_ms;
+
+		m_next_start = 0;
+		m_started = 0;
+		m_inflight = 0;
+		m_winner = npos;
+
+		interleave(families);
+	}
+
+	/*
+	 * @return index of the address to connect to now, npos if it is too early or nothing is left
+	 */
+	constexpr int next(_In_ UINT64 now_ms)
+	{
+		if (m_winner != npos || m_started == m_cnt || now_ms < m_next_start) {
+			return npos;
+		}
+
+		++m_inflight;
+		m_next_start = now_ms + m_delay;
+
+		return m_order[m_started++];
+	}
+
+	/*
+	 * @return milliseconds until next() will return an index, infinite if it will not
+	 */
+	constexpr UINT32 wait_ms(_In_ UINT64 now_ms) const
+	{
+		if (m_winner != npos || m_started == m_cnt) {
+			return infinite;
+		}
+
+		return now_ms < m_next_start ? static_cast<UINT32>(m_next_start - now_ms) : 0;
+	}
+
+	/*
+	 * An attempt returned by next() has failed.
+	 */
+	constexpr void failed(_In_ UINT64 now_ms)
+	{
+		if (!--m_inflight) {
+			m_next_start = now_ms; // there is nothing to wait for
+		}
+	}
+
+	/*
+	 * An attempt returned by next() has succeeded.
+	 * @return false if another attempt has already won, the caller must close this connection
+	 */
+	constexpr bool succeeded(_In_ int idx)
+	{
+		--m_inflight;
+
+		if (m_winner == npos) {
+			m_winner = idx;
+			return true;
+		}
+
+		return false;
+	}
+
+	constexpr auto winner() const { return m_winner; }
+	constexpr auto inflight() const { return m_inflight; }
+	constexpr auto size() const { return m_cnt; }
+
+	/*
+	 * @return true if all attempts have failed
+	 */
+	constexpr auto exhausted() const { return m_winner == npos && m_started == m_cnt && !m_inflight; }
+
+private:
+	static_assert(N > 0);
+
+	int m_order[N]; // indices of addresses in the order of attempts
+	int m_cnt;
+
+	UINT64 m_next_start;
+	UINT32 m_delay;
+
+	int m_started;
+	int m_inflight;
+	int m_winner;
+
+	/*
+	 * RFC 8305, 4. Sorting Addresses.
+	 * The preferred family is the family of the first address, "First Address Family Count" is one.
+	 * The order of the addresses of the same family is preserved.
+	 */
+	constexpr void interleave(_In_ const int *families)
+	{
+		int preferred[N];
+		int other[N];
+		int p_cnt = 0;
+		int o_cnt = 0;
+
+		for (int i = 0; i < m_cnt; ++i) {
+			if (families[i] == families[0]) {
+				preferred[p_cnt++] = i;
+			} else {
+				other[o_cnt++] = i;
+			}
+		}
+
+		for (int i = 0, p = 0, o = 0; i < m_cnt; ++i) {
+			if (o == o_cnt || (p < p_cnt && !(i % 2))) {
+				m_order[i] = preferred[p++];
+			} else {
+				m_order[i] = other[o++];
+			}
+		}
+	}
+};
+
+} // namespace usbip::he
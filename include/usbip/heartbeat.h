@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+
+/*
+ * Detection of a dead peer by the application-level heartbeat.
+ * The driver calls tick() from a timer every period_ms() and sends the probes,
+ * the receive thread calls received() for every PDU.
+ */
+
+namespace usbip::hb
+{
+
+enum : UINT32 {
+	min_interval_ms = 100,
+	min_period_ms = 50, // of tick() calls
+};
+
+enum { default_max_misses = 3 };
+
+enum class action { none, probe, dead };
+
+/*
+ * A probe is sent if nothing has been received during the interval while requests are outstanding.
+ * Any received PDU is a reply, the peer is dead if max_misses probes in a row were not answered.
+ * The dead peer is detected in (max_misses + 1)*interval_ms + period_ms() at most.
+ *
+ * A zeroed monitor is disabled until configure() sets the interval, device_ctx is zeroed on creation.
+ */
+class monitor
+{
+public:
+	/*
+	 * @param interval_ms zero disables the heartbeat
+	 */
+	constexpr void configure(_In_ UINT32 interval_ms, _In_ int max_misses)
+	{
+		m_interval = interval_ms && interval_ms < min_interval_ms ? min_interval_ms : interval_ms;
+		m_max_misses = max_misses > 0 ? max_misses : default_max_misses;
+	}
+
+	constexpr auto enabled() const { return m_interval != 0; }
+	constexpr auto interval_ms() const { return m_interval; }
+	constexpr auto max_misses() const { return m_max_misses; }
+
+	/*
+	 * @return how often tick() must be called
+	 */
+	constexpr UINT32 period_ms() const
+	{
+		auto half = m_interval/2;
+		return half > min_period_ms ? half : min_period_ms;
+	}
+
+	/*
+	 * Something was received from the peer.
+	 */
+	constexpr void received(_In_ UINT64 now_ms) { m_last_recv = now_ms; }
+
+	/*
+	 * @param outstanding requests are waiting for a reply
+	 * @return action::probe if the caller must send a probe now
+	 */
+	constexpr action tick(_In_ UINT64 now_ms, _In_ bool outstanding)
+	{
+		if (!m_interval) {
+			return action::none;
+		}
+
+		if (m_last_recv >= m_last_probe) { // the last probe was answered
+			m_misses = 0;
+		} else if (now_ms - m_last_probe < m_interval) {
+			return action::none;
+		} else if (++m_misses >= m_max_misses) {
+			return action::dead;
+		} else {
+			m_last_probe = now_ms;
+			return action::probe;
+		}
+
+		if (!outstanding || now_ms - m_last_recv < m_interval) {
+			return action::none;
+		}
+
+		m_last_probe = now_ms;
+		return action::probe;
+	}
+
+	constexpr auto misses() const { return m_misses; }
+
+private:
+	UINT32 m_interval;
+	int m_max_misses;
+
+	UINT64 m_last_recv; // time in ms
+	UINT64 m_last_probe;
+	int m_misses; // probes in a row that were not answered
+};
+
+} // namespace usbip::hb
@@ -26,6 +26,7 @@ enum request_type
 enum direction { out, in }; // transfer direction like USB_DIR_IN, USB_DIR_OUT
 enum { max_iso_packets = 1024 };
 enum { number_of_packets_non_isoch = -1 }; // see protocol for USBIP_CMD_SUBMIT/USBIP_RET_SUBMIT
+enum { number_of_packets_subscription = -2 }; // CMD_SUBMIT only, see EXT_INTERRUPT_PUSH
 
 constexpr auto is_valid_number_of_packets(int number_of_packets)
 {
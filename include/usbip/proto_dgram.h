@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "proto.h"
+
+/*
+ * Datagram transport for isochronous endpoints, see EXT_ISOC_DATAGRAM.
+ * This is not a part of the Linux USB/IP protocol.
+ *
+ * Each datagram carries exactly one CMD_SUBMIT or RET_SUBMIT:
+ * dgram_header, usbip_header, [transfer_buffer], [usbip_iso_packet_descriptor...]
+ * The layout after dgram_header is the same as in TCP stream, all fields are in network byte order.
+ *
+ * Lost datagrams are never retransmitted. A peer does not wait for them,
+ * the URB whose RET_SUBMIT was lost or did not arrive in time is completed with per-packet USBD_STATUS_ISO_* errors.
+ * Control, bulk, interrupt transfers and CMD_UNLINK/RET_UNLINK always use TCP.
+ */
+
+namespace usbip
+{
+
+#include <PSHPACK1.H>
+
+struct dgram_header
+{
+	UINT32 magic; // dgram_magic
+	UINT32 devid; // the same as header_basic.devid
+	UINT32 seqnum; // per-socket datagram sequence number, it is not related to header_basic.seqnum
+};
+
+#include <POPPACK.H>
+
+enum : UINT32 { dgram_magic = 0x55495044 }; // "UIPD"
+
+/*
+ * Maximum UDP payload for IPv4, IPv6 allows the same size without jumbograms.
+ * An endpoint whose first URB is larger uses TCP, CMD_SUBMIT-s of an endpoint never mix transports.
+ */
+enum : ULONG { max_dgram_size = 65507 };
+
+/*
+ * Tracks the datagram sequence numbers of a peer.
+ * Duplicates and late (reordered) datagrams are rejected, gaps are accounted as lost.
+ * Wraparound of UINT32 is handled by signed difference.
+ */
+class dgram_sequence
+{
+public:
+	enum result { accept, duplicate, late };
+
+	constexpr auto update(_In_ UINT32 seqnum, _Out_ UINT32 &lost)
+	{
+		lost = 0;
+
+		if (!m_started) {
+			m_started = true;
+		} else if (auto delta = static_cast<INT32>(seqnum - m_next); delta > 0) {
+			lost = static_cast<UINT32>(delta);
+		} else if (delta == -1) {
+			return duplicate;
+		} else if (delta < 0) {
+			return late;
+		}
+
+		m_next = seqnum + 1;
+		return accept;
+	}
+
+	constexpr auto next() const { return m_next; }
+
+private:
+	UINT32 m_next{};
+	bool m_started{};
+};
+
+} // namespace usbip
@@ -84,6 +84,27 @@ struct op_devlist_reply_extra
         // followed by usbip_usb_interface uinf[]
 };
 
+/*
+ * Extensions are not a part of the Linux USB/IP protocol.
+ * OP_REQ_EXTENSIONS can be sent right after OP_REP_IMPORT only if the server is known to support it,
+ * usbipd will treat it as a start of usbip_header and drop the connection.
+ */
+struct op_extensions_request
+{
+        UINT32 features; // mask of extension_t that the client wants to use
+        UINT16 udp_port; // client's port for EXT_ISOC_DATAGRAM
+        UINT16 _reserved;
+        UINT32 session; // EXT_MULTIPLEX, session of existing connection to join or zero to start new one
+};
+
+struct op_extensions_reply
+{
+        UINT32 features; // subset of op_extensions_request.features accepted by the server
+        UINT16 udp_port; // server's port for EXT_ISOC_DATAGRAM
+        UINT16 _reserved;
+        UINT32 session; // EXT_MULTIPLEX, the session this device belongs to
+};
+
 #include <POPPACK.H>
 
 
@@ -101,8 +122,38 @@ enum : UINT16 // op_common.code
         OP_DEVLIST = 5,
         OP_REQ_DEVLIST = OP_REQUEST | OP_DEVLIST,
         OP_REP_DEVLIST = OP_REPLY | OP_DEVLIST,
+
+        // negotiate optional extensions after OP_REP_IMPORT, see op_extensions_request
+        OP_EXTENSIONS = 0x7F,
+        OP_REQ_EXTENSIONS = OP_REQUEST | OP_EXTENSIONS,
+        OP_REP_EXTENSIONS = OP_REPLY | OP_EXTENSIONS,
+};
+
+enum extension_t : UINT32 // op_extensions_request.features
+{
+        EXT_ISOC_DATAGRAM = 1 << 0, // isochronous CMD_SUBMIT/RET_SUBMIT are sent over UDP, see proto_dgram.h
+        EXT_MULTIPLEX = 1 << 1, // devices of the same server share one connection, PDUs are demultiplexed by devid
+        EXT_ISOC_UNCOMPACTED = 1 << 2, // isochronous IN data of RET_SUBMIT keeps the offsets of the packets, see below
+        EXT_INTERRUPT_PUSH = 1 << 3, // the server pushes the reports of interrupt IN endpoint, see below
 };
 
+/*
+ * EXT_ISOC_UNCOMPACTED
+ * The Linux server removes the padding between the packets of isochronous IN transfer, see usbip_pad_iso.
+ * If this extension is accepted, the data of RET_SUBMIT is the transfer buffer from its start to the end of
+ * the last packet that has data, i.e. every packet is at its offset, and ret_submit.actual_length is the length
+ * of this span. The client receives it right into the buffer of URB, nothing has to be moved after that.
+ * The gaps are sent too, that pays off if packets are almost full (audio), but can double the traffic
+ * if they are not (compressed video), see tests/bench/isoc_in_bench.cpp.
+ *
+ * EXT_INTERRUPT_PUSH
+ * CMD_SUBMIT of interrupt IN endpoint with number_of_packets_subscription is a standing subscription.
+ * The server submits URB of transfer_buffer_length and resubmits it after every completion.
+ * Each completed URB is sent as RET_SUBMIT with the seqnum of the subscription, so there is no request
+ * leg per report. If URB fails, its RET_SUBMIT has the error status and the subscription ends.
+ * CMD_UNLINK with the seqnum of the subscription ends it too, RET_UNLINK is sent as usual.
+ */
+
 inline void byteswap(usbip_usb_interface&) {} // nothing to do
 void byteswap(usbip_usb_device &d);
 
@@ -115,4 +166,7 @@ inline void byteswap(op_devlist_request&) {} // nothing to do
 void byteswap(op_devlist_reply &r);
 inline void byteswap(op_devlist_reply_extra &r) { byteswap(r.udev); }
 
+void byteswap(op_extensions_request &r);
+void byteswap(op_extensions_reply &r);
+
 } // namespace usbip
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+
+/*
+ * Reports of interrupt IN endpoint that were pushed by the server while no URB was pending, see EXT_INTERRUPT_PUSH,
+ * and transfers of streamed bulk IN endpoint. Are used by drivers/ude/push.cpp and stream.cpp
+ * under push_lock and stream_lock, the slots are allocated by them from NonPagedPoolNx.
+ */
+
+namespace usbip
+{
+
+/*
+ * If the ring is full, the oldest report is dropped. HID reports usually carry the state of all controls,
+ * so the latest one matters most. A stream never overflows the ring, it limits its reads, see stream::max_reads.
+ *
+ * A zeroed ring has no slots and drops everything until init() is called.
+ */
+class report_ring
+{
+public:
+	enum { max_slots = 8 };
+
+	/*
+	 * @param buf slots*slot_size bytes
+	 */
+	constexpr void init(_In_ UINT8 *buf, _In_ UINT32 slot_size, _In_ int slots)
+	{
+		m_buf = buf;
+		m_slot_size = slot_size;
+		m_slots = slots < max_slots ? slots : max_slots;
+		m_head = m_cnt = 0;
+	}
+
+	constexpr auto slot_size() const { return m_slot_size; }
+
+	constexpr auto empty() const { return !m_cnt; }
+	constexpr auto size() const { return m_cnt; }
+
+	constexpr auto pushed() const { return m_pushed; }
+	constexpr auto dropped() const { return m_dropped; }
+
+	constexpr void clear() { m_head = m_cnt = 0; }
+
+	/*
+	 * @param len of the report, it is truncated to slot_size
+	 * @return the slot to copy len bytes into, nullptr if the ring has no slots
+	 */
+	constexpr UINT8* push(_Inout_ UINT32 &len)
+	{
+		if (!m_slots) {
+			++m_dropped;
+			return nullptr;
+		}
+
+		if (m_cnt == m_slots) {
+			pop();
+			++m_dropped;
+		}
+
+		if (len > m_slot_size) {
+			len = m_slot_size;
+		}
+
+		auto i = (m_head + m_cnt++) % m_slots;
+		m_len[i] = len;
+		++m_pushed;
+
+		return m_buf + i*m_slot_size;
+	}
+
+	/*
+	 * The oldest report, the ring must not be empty.
+	 */
+	constexpr const UINT8* front(_Out_ UINT32 &len) const
+	{
+		len = m_len[m_head];
+		return m_buf + m_head*m_slot_size;
+	}
+
+	constexpr void pop()
+	{
+		if (m_cnt) {
+			m_head = (m_head + 1) % m_slots;
+			--m_cnt;
+		}
+	}
+
+private:
+	UINT8 *m_buf;
+	UINT32 m_slot_size;
+	int m_slots;
+
+	int m_head;
+	int m_cnt;
+	UINT32 m_len[max_slots];
+
+	UINT64 m_pushed;
+	UINT64 m_dropped;
+};
+
+} // namespace usbip
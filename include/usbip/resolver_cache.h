@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+
+/*
+ * Cache of resolved (node name, service name) pairs.
+ * libusbip keeps one per process under a mutex, the driver keeps one per vhci under a wait lock.
+ */
+
+namespace usbip::dns
+{
+
+/*
+ * getaddrinfo does not return TTL of DNS records, so the lifetime of an entry is fixed.
+ * A failure is cached for a short time to avoid repeated timeouts of a slow resolver.
+ */
+enum : UINT32 {
+	positive_ttl_ms = 60*1000,
+	negative_ttl_ms = 5*1000,
+};
+
+enum {
+	max_key_len = 288, // "node:service", longer keys are not cached
+	max_addresses = 8, // per entry, the rest is ignored
+};
+
+struct counters
+{
+	UINT64 hits;
+	UINT64 negative_hits;
+	UINT64 misses;
+	UINT64 evictions; // live entries that were replaced
+};
+
+/*
+ * TTL-bounded LRU cache of N entries. Node names are compared case-insensitively (ASCII).
+ * All slots of a zeroed object are free because their expiration time is zero.
+ */
+template<typename Char, typename Addr, int N>
+class cache
+{
+public:
+	struct entry
+	{
+		UINT64 expires; // time in ms, zero if the slot is free
+		UINT64 last_used;
+
+		UINT32 hash;
+		int key_len;
+		Char key[max_key_len];
+
+		int error; // nonzero for a negative entry
+		int cnt;
+		Addr addrs[max_addresses];
+	};
+
+	/*
+	 * @param node, service are not null-terminated
+	 * @return the entry is valid until the next call, nullptr if it is missing or expired
+	 */
+	constexpr const entry* find(
+		_In_ const Char *node, _In_ int node_len, _In_ const Char *service, _In_ int service_len,
+		_In_ UINT64 now_ms)
+	{
+		Char key[max_key_len];
+		auto len = make_key(key, node, node_len, service, service_len);
+
+		auto e = len ? lookup(key, len, hash(key, len)) : nullptr;
+
+		if (!(e && now_ms < e->expires)) {
+			++m_counters.misses;
+			return nullptr;
+		}
+
+		e->last_used = now_ms;
+		++(e->error ? m_counters.negative_hits : m_counters.hits);
+
+		return e;
+	}
+
+	/*
+	 * Replaces existing entry or the least recently used one.
+	 * @param error nonzero for a negative entry
+	 * @return the entry to add addresses to, nullptr if the key is too long
+	 */
+	constexpr entry* insert(
+		_In_ const Char *node, _In_ int node_len, _In_ const Char *service, _In_ int service_len,
+		_In_ int error, _In_ UINT64 now_ms)
+	{
+		Char key[max_key_len];
+		auto len = make_key(key, node, node_len, service, service_len);
+		if (!len) {
+			return nullptr;
+		}
+
+		auto h = hash(key, len);
+		auto e = lookup(key, len, h);
+
+		if (!e) {
+			e = victim(now_ms);
+		}
+
+		for (int i = 0; i < len; ++i) {
+			e->key[i] = key[i];
+		}
+
+		e->key_len = len;
+		e->hash = h;
+
+		e->expires = now_ms + (error ? negative_ttl_ms : positive_ttl_ms);
+		e->last_used = now_ms;
+
+		e->error = error;
+		e->cnt = 0;
+
+		return e;
+	}
+
+	/*
+	 * @return false if the entry is full
+	 */
+	static constexpr bool add(_Inout_ entry &e, _In_ const Addr &addr)
+	{
+		if (e.cnt == max_addresses) {
+			return false;
+		}
+
+		e.addrs[e.cnt++] = addr;
+		return true;
+	}
+
+	constexpr void flush()
+	{
+		for (auto &e: m_entries) {
+			e.expires = 0;
+		}
+	}
+
+	constexpr int size(_In_ UINT64 now_ms) const
+	{
+		int cnt = 0;
+		for (auto &e: m_entries) {
+			cnt += now_ms < e.expires;
+		}
+		return cnt;
+	}
+
+	constexpr auto& get_counters() const { return m_counters; }
+
+private:
+	static_assert(N > 0);
+
+	entry m_entries[N];
+	counters m_counters;
+
+	static constexpr Char fold(_In_ Char c)
+	{
+		return c >= 'A' && c <= 'Z' ? static_cast<Char>(c - 'A' + 'a') : c;
+	}
+
+	/*
+	 * @return length of the key, zero if it does not fit
+	 */
+	static constexpr int make_key(
+		_Out_ Char *key, _In_ const Char *node, _In_ int node_len, _In_ const Char *service, _In_ int service_len)
+	{
+		if (node_len <= 0 || service_len < 0 || node_len + 1 + service_len > max_key_len) {
+			return 0;
+		}
+
+		int len = 0;
+
+		for (int i = 0; i < node_len; ++i) {
+			key[len++] = fold(node[i]);
+		}
+
+		key[len++] = ':';
+
+		for (int i = 0; i < service_len; ++i) {
+			key[len++] = service[i];
+		}
+
+		return len;
+	}
+
+	/*
+	 * FNV-1a.
+	 */
+	static constexpr UINT32 hash(_In_ const Char *key, _In_ int len)
+	{
+		UINT32 h = 2166136261U;
+
+		for (int i = 0; i < len; ++i) {
+			h = (h ^ static_cast<UINT32>(key[i])) * 16777619U;
+		}
+
+		return h;
+	}
+
+	constexpr entry* lookup(_In_ const Char *key, _In_ int len, _In_ UINT32 h)
+	{
+		for (auto &e: m_entries) {
+			if (e.expires && e.hash == h && e.key_len == len && equal(e.key, key, len)) {
+				return &e;
+			}
+		}
+
+		return nullptr;
+	}
+
+	static constexpr bool equal(_In_ const Char *a, _In_ const Char *b, _In_ int len)
+	{
+		for (int i = 0; i < len; ++i) {
+			if (a[i] != b[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/*
+	 * @return a free or expired entry, the least recently used one otherwise
+	 */
+	constexpr entry* victim(_In_ UINT64 now_ms)
+	{
+		auto lru = m_entries;
+
+		for (auto &e: m_entries) {
+			if (now_ms >= e.expires) {
+				return &e;
+			} else if (e.last_used < lru->last_used) {
+				lru = &e;
+			}
+		}
+
+		++m_counters.evictions;
+		return lru;
+	}
+};
+
+} // namespace usbip::dns
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "fair_queue.h"
+
+/*
+ * Send scheduler of the devices of a server: strict priority classes, deficit round robin
+ * of the devices inside a class and token buckets per device and per server.
+ * drivers/ude/mux.cpp calls it under mux_ctx::lock and arms mux_ctx::throttle_timer for wait_ms()
+ * if all pending queues are throttled.
+ */
+
+namespace usbip::mux
+{
+
+/*
+ * Interactive (control, interrupt) PDUs preempt queued isochronous ones, which preempt bulk ones.
+ */
+enum class pclass : UINT8 { interactive, isoch, bulk };
+enum { pclass_cnt = 3 };
+
+/*
+ * Rate is in bytes per second, zero is unlimited.
+ * The bucket can go into debt by one PDU, so a PDU larger than the burst is not stuck forever.
+ * A zeroed bucket is unlimited until configure() sets a rate, see mux::set_rate.
+ */
+class token_bucket
+{
+public:
+	enum : UINT32 { default_burst = 64*1024 };
+
+	constexpr void configure(_In_ UINT32 rate, _In_ UINT32 burst, _In_ UINT64 now_ms)
+	{
+		m_rate = rate;
+		m_burst = burst ? burst : default_burst;
+		m_tokens = m_burst;
+		m_last = now_ms;
+	}
+
+	constexpr auto rate() const { return m_rate; }
+	constexpr auto burst() const { return m_burst; }
+
+	constexpr bool ready(_In_ UINT64 now_ms)
+	{
+		if (!m_rate) {
+			return true;
+		}
+
+		refill(now_ms);
+		return m_tokens > 0;
+	}
+
+	constexpr void consume(_In_ UINT32 bytes)
+	{
+		if (m_rate) {
+			m_tokens -= bytes;
+		}
+	}
+
+	/*
+	 * @return milliseconds until ready() returns true
+	 */
+	constexpr UINT32 wait_ms() const
+	{
+		if (!m_rate || m_tokens > 0) {
+			return 0;
+		}
+
+		return static_cast<UINT32>((1 - m_tokens)*1000/m_rate + 1);
+	}
+
+private:
+	UINT32 m_rate;
+	UINT32 m_burst;
+	INT64 m_tokens; // bytes, negative is a debt
+	UINT64 m_last; // time in ms of the last refill
+
+	constexpr void refill(_In_ UINT64 now_ms)
+	{
+		auto add = static_cast<INT64>((now_ms - m_last)*m_rate/1000);
+		if (!add) {
+			return; // do not lose fractions of a byte
+		}
+
+		m_last = now_ms;
+		m_tokens = m_tokens + add < m_burst ? m_tokens + add : m_burst;
+	}
+};
+
+/*
+ * N flows (devices), a flow has a queue in each class.
+ * Interactive PDUs are never throttled, but they consume the tokens of the connection.
+ *
+ * mux_ctx is allocated from zeroed pool, a zeroed object has no active flows and no limits.
+ * A decision takes tens of nanoseconds if no queues are throttled, see tests/bench/shaper_bench.cpp.
+ */
+template<int N, UINT32 Quantum>
+class scheduler
+{
+public:
+	struct decision
+	{
+		int flow; // -1 if nothing can be sent now
+		pclass cls;
+	};
+
+	static constexpr UINT32 infinite = ~0U;
+
+	/*
+	 * Must be called when a queue of the flow gets pending items.
+	 */
+	constexpr void activate(_In_ int flow, _In_ pclass cls)
+	{
+		if (!m_throttled[idx(cls)][flow]) {
+			m_drr[idx(cls)].activate(flow);
+		}
+	}
+
+	/*
+	 * @param head_size(cls, flow) returns the size of the first pending item, zero if the queue is empty
+	 */
+	template<typename F>
+	constexpr decision next(_In_ const F &head_size, _In_ UINT64 now_ms)
+	{
+		release_throttled(now_ms);
+
+		for (int c = 0; c < pclass_cnt; ++c) {
+			auto cls = static_cast<pclass>(c);
+			UINT32 sz{};
+
+			auto size = [this, c, cls, &head_size, now_ms, &sz] (int flow) -> UINT32
+			{
+				sz = head_size(cls, flow);
+
+				if (sz && cls != pclass::interactive && !(m_link.ready(now_ms) && m_flows[flow].ready(now_ms))) {
+					m_throttled[c][flow] = true;
+					++m_throttled_now;
+					++m_throttled_cnt;
+					return 0; // drr deactivates the flow, release_throttled activates it again
+				}
+
+				return sz;
+			};
+
+			if (auto flow = m_drr[c].next(size); flow >= 0) {
+				if (cls != pclass::interactive) {
+					m_flows[flow].consume(sz);
+				}
+				m_link.consume(sz);
+				return { flow, cls };
+			}
+		}
+
+		return { -1, pclass::interactive };
+	}
+
+	/*
+	 * @return milliseconds until a throttled flow can send, infinite if there are no throttled flows
+	 */
+	constexpr UINT32 wait_ms() const
+	{
+		auto ms = infinite;
+		if (!m_throttled_now) {
+			return ms;
+		}
+
+		for (int c = 0; c < pclass_cnt; ++c) {
+			for (int flow = 0; flow < N; ++flow) {
+				if (m_throttled[c][flow]) {
+					auto a = m_flows[flow].wait_ms();
+					auto b = m_link.wait_ms();
+					auto w = a > b ? a : b;
+					if (w < ms) {
+						ms = w;
+					}
+				}
+			}
+		}
+
+		return ms;
+	}
+
+	constexpr auto& flow_bucket(_In_ int flow) { return m_flows[flow]; }
+	constexpr auto& link_bucket() { return m_link; }
+
+	/*
+	 * @return true if there are queues that are waiting for tokens
+	 */
+	constexpr bool throttled() const { return m_throttled_now; }
+
+	constexpr auto active_flows() const
+	{
+		int cnt = 0;
+		for (auto &d: m_drr) {
+			cnt += d.active_flows();
+		}
+		return cnt;
+	}
+
+	constexpr auto throttled_cnt() const { return m_throttled_cnt; }
+
+private:
+	drr<N, Quantum> m_drr[pclass_cnt];
+	bool m_throttled[pclass_cnt][N];
+	int m_throttled_now; // number of true elements in m_throttled
+
+	token_bucket m_flows[N];
+	token_bucket m_link;
+
+	UINT64 m_throttled_cnt;
+
+	static constexpr auto idx(_In_ pclass cls) { return static_cast<int>(cls); }
+
+	constexpr void release_throttled(_In_ UINT64 now_ms)
+	{
+		if (!m_throttled_now || !m_link.ready(now_ms)) {
+			return;
+		}
+
+		for (int c = 0; c < pclass_cnt; ++c) {
+			for (int flow = 0; flow < N; ++flow) {
+				if (m_throttled[c][flow] && m_flows[flow].ready(now_ms)) {
+					m_throttled[c][flow] = false;
+					--m_throttled_now;
+					m_drr[c].activate(flow);
+				}
+			}
+		}
+	}
+};
+
+} // namespace usbip::mux
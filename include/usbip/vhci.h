@@ -76,6 +76,13 @@ enum class function { // 12 bit
         get_imported_devices,
         set_persistent,
         get_persistent,
+        resolver_cache,
+        connection_pool,
+        set_heartbeat,
+        get_device_stats,
+        set_bandwidth_limit,
+        set_sched_policy,
+        get_sched_policy,
 };
 
 constexpr auto make(function id)
@@ -89,6 +96,13 @@ enum {
         GET_IMPORTED_DEVICES = make(function::get_imported_devices),
         SET_PERSISTENT = make(function::set_persistent),
         GET_PERSISTENT = make(function::get_persistent),
+        RESOLVER_CACHE = make(function::resolver_cache),
+        CONNECTION_POOL = make(function::connection_pool),
+        SET_HEARTBEAT = make(function::set_heartbeat),
+        GET_DEVICE_STATS = make(function::get_device_stats),
+        SET_BANDWIDTH_LIMIT = make(function::set_bandwidth_limit),
+        SET_SCHED_POLICY = make(function::set_sched_policy),
+        GET_SCHED_POLICY = make(function::get_sched_policy),
 };
 
 struct plugin_hardware : base, imported_device_location {};
@@ -108,4 +122,146 @@ constexpr auto get_imported_devices_size(_In_ ULONG n)
         return offsetof(get_imported_devices, devices) + n*sizeof(*get_imported_devices::devices);
 }
 
+/*
+ * Counters of the cache of resolved host names that is used by PLUGIN_HARDWARE.
+ */
+struct resolver_cache : base
+{
+        bool flush; // IN, remove all entries after the counters are read
+
+        int entries; // OUT, that are not expired
+        UINT64 hits;
+        UINT64 negative_hits; // cached failures of name resolution
+        UINT64 misses;
+        UINT64 evictions;
+};
+
+/*
+ * Counters of the pool of connections that is used by PLUGIN_HARDWARE.
+ */
+struct connection_pool : base
+{
+        int pool_size; // OUT, connections per server, zero if the pool is disabled
+        int hosts; // servers to keep connections to
+        int sockets; // ready to use
+        UINT64 hits; // PLUGIN_HARDWARE took a connection from the pool
+        UINT64 misses;
+};
+
+/*
+ * Application-level heartbeat of imported devices, overrides heartbeat_interval_value_name.
+ */
+struct set_heartbeat : base
+{
+        int port; // all ports if <= 0
+        UINT32 interval_ms; // zero disables
+        int max_misses; // unanswered probes in a row, the default is used if <= 0
+};
+
+/*
+ * Statistics of an imported device.
+ */
+struct device_stats : base
+{
+        int port; // IN
+
+        UINT64 sent_requests; // OUT
+        UINT64 bytes_sent; // PDUs over TCP
+        UINT64 bytes_received;
+
+        UINT32 srtt_us; // smoothed round-trip time of control transfers
+        UINT64 rx_rate; // bytes per second
+        UINT64 tx_rate;
+        UINT64 rx_bdp; // bandwidth-delay product, bytes
+        UINT64 tx_bdp;
+        UINT32 rcvbuf; // SO_RCVBUF, zero if it was not set
+        UINT32 sndbuf; // SO_SNDBUF
+        ULONG sockbuf_changes;
+
+        ULONG resumed_sessions;
+        ULONG heartbeat_probes;
+        ULONG heartbeat_failures;
+
+        UINT64 unlink_bursts; // CMD_UNLINK-s of a purged endpoint are sent by one WskSend
+        UINT64 unlinked_requests; // by these bursts
+        ULONG max_unlink_burst;
+
+        ULONG inflight_urbs; // admission control, see max_device_urbs_value_name
+        UINT64 inflight_bytes;
+        ULONG held_urbs; // over the limits, wait for completions
+        ULONG max_inflight_urbs; // high-water marks
+        UINT64 max_inflight_bytes;
+        ULONG max_held_urbs;
+        UINT64 held_total;
+
+        UINT64 isoc_in_urbs;
+        UINT64 isoc_moved_bytes; // to restore the offsets of compacted data, see EXT_ISOC_UNCOMPACTED
+        bool isoc_uncompacted;
+
+        ULONG suspends; // see suspend_passthrough_value_name
+        ULONG remote_wakes;
+        UINT64 suspended_ms; // time spent in suspend
+        UINT64 parked_urbs; // interrupt IN URBs that were unlinked while suspended
+
+        bool interrupt_push; // EXT_INTERRUPT_PUSH
+        UINT64 pushed_reports; // by the server for HID interrupt IN endpoints
+        UINT64 buffered_reports; // arrived while no URB was waiting
+        UINT64 dropped_reports; // the oldest buffered ones, the ring was full
+
+        UINT64 stream_transfers; // bulk IN reads of serial interfaces, see bulk_stream_reads_value_name
+        UINT64 stream_bytes;
+        UINT64 stream_throttled; // reads that were held back because the data was not consumed
+
+        int sched_rule; // index in sched_policy::rules of the receive thread's policy, -1 if the default is used
+        LONG recv_priority; // of the receive thread, zero if the device shares the connection
+        UINT64 recv_affinity; // zero if it is not restricted
+
+        UINT64 completion_batches; // URBs that were finished by the receive thread are completed in batches
+        UINT64 batched_urbs;
+        ULONG max_completion_batch;
+};
+
+/*
+ * The first rule that matches a device sets the priority and affinity of its receive thread,
+ * the first rule that matches an interface sets the priority boost of its completed URBs.
+ * A rule that matches an interface class also applies to the receive thread of the device.
+ */
+struct sched_rule
+{
+        UINT16 vendor; // zero matches any
+        UINT16 product;
+        INT16 cls; // interface class, -1 matches any
+        INT16 subclass; // -1 matches any
+
+        INT32 priority; // of the receive thread, zero keeps the default, LOW_REALTIME_PRIORITY at most
+        INT32 priority_boost; // of completed URBs of the interface, negative keeps the built-in one
+        UINT64 affinity; // processors of group zero for the receive thread, zero keeps the default
+};
+
+/*
+ * It is saved as sched_policy_value_name and is applied to imported devices.
+ * GET_SCHED_POLICY returns the current policy.
+ */
+struct sched_policy : base
+{
+        enum { max_rules = 16 };
+
+        int cnt; // of rules
+        sched_rule rules[max_rules];
+};
+
+/*
+ * Token buckets of the devices of a server (host:port).
+ * Devices that share the connection (EXT_MULTIPLEX) share the server's bucket of that connection,
+ * the other devices of the server share another one for their own connections.
+ * Control and interrupt transfers preempt isochronous ones, isochronous transfers preempt bulk ones.
+ */
+struct set_bandwidth_limit : base
+{
+        int port; // all ports if <= 0
+        UINT32 device_rate; // bytes per second, zero is unlimited
+        UINT32 server_rate; // of the devices of the server, see above
+        UINT32 burst; // bytes, the default is used if zero
+};
+
 } // namespace usbip::vhci::ioctl
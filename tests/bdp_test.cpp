@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/bdp.h>
+
+namespace
+{
+
+using namespace usbip::bdp;
+
+enum : UINT32 { KB = 1024, MB = 1024*KB };
+
+void srtt()
+{
+	estimator e{};
+	e.init(default_min_bytes, 4*MB, 0, 0);
+
+	e.rtt(8000);
+	CHECK_EQ(e.srtt_us(), 8000U); // the first sample is taken as is
+
+	e.rtt(16000);
+	CHECK_EQ(e.srtt_us(), 9000U); // 7/8 + 1/8
+}
+
+/*
+ * Buffers are not set until RTT is known.
+ */
+void no_rtt()
+{
+	estimator e{};
+	e.init(default_min_bytes, 4*MB, 0, 0);
+
+	CHECK(!e.update(250, 2'500'000, 0));
+	CHECK_EQ(e.rx_rate(), 10'000'000U);
+	CHECK_EQ(e.rcvbuf(), 0U);
+	CHECK_EQ(e.sndbuf(), 0U);
+}
+
+/*
+ * 10 MB/s at 20 ms RTT is 200 KB in flight, buffers are factor*BDP but not less than the minimum.
+ */
+void steady()
+{
+	estimator e{};
+	UINT64 now = 1000;
+	e.init(64*KB, 4*MB, 2, now);
+
+	e.rtt(20'000);
+
+	UINT64 rx = 0;
+	UINT64 tx = 0;
+	bool changed = false;
+
+	for (int i = 0; i < 20; ++i) {
+		now += rate_window_ms;
+		rx += 2'500'000;
+		tx += 25'000;
+		changed |= e.update(now, rx, tx);
+	}
+
+	CHECK(changed);
+	CHECK_EQ(e.rx_rate(), 10'000'000U);
+	CHECK_EQ(e.rx_bdp(), 200'000U);
+	CHECK_EQ(e.rcvbuf(), 400'000U);
+	CHECK_EQ(e.sndbuf(), 64*KB);
+
+	CHECK(!e.update(now + rate_window_ms - 1, rx + MB, tx)); // the window is not over
+}
+
+/*
+ * Small changes of the rate do not resize the buffers.
+ */
+void hysteresis()
+{
+	estimator e{};
+	UINT64 now = 0;
+	e.init(64*KB, 4*MB, 2, now);
+	e.rtt(20'000);
+
+	UINT64 rx = 0;
+	for (int i = 0; i < 4; ++i) {
+		now += rate_window_ms;
+		rx += 2'500'000;
+		e.update(now, rx, 0);
+	}
+	CHECK_EQ(e.rcvbuf(), 400'000U);
+
+	for (int i = 0; i < 20; ++i) { // +10%
+		now += rate_window_ms;
+		rx += 2'750'000;
+		CHECK(!e.update(now, rx, 0));
+	}
+	CHECK_EQ(e.rcvbuf(), 400'000U);
+
+	now += rate_window_ms;
+	rx += 5'000'000; // x2 is taken immediately
+	CHECK(e.update(now, rx, 0));
+	CHECK_EQ(e.rcvbuf(), 800'000U);
+
+	for (int i = 0; i < 40; ++i) { // drops to a tenth, the average decays
+		now += rate_window_ms;
+		rx += 250'000;
+		e.update(now, rx, 0);
+	}
+	CHECK(e.rcvbuf() < 400'000U);
+	CHECK(e.rcvbuf() >= 64*KB);
+}
+
+void bounds()
+{
+	estimator e{};
+	UINT64 now = 0;
+	e.init(64*KB, 4*MB, 2, now);
+	e.rtt(100'000);
+
+	UINT64 rx = 0;
+	for (int i = 0; i < 4; ++i) {
+		now += rate_window_ms;
+		rx += 500'000'000;
+		e.update(now, rx, 0);
+	}
+	CHECK_EQ(e.rcvbuf(), 4*MB);
+	CHECK_EQ(e.sndbuf(), 64*KB);
+
+	e.init(MB, KB, 2, now); // max is raised to min
+	e.rtt(100'000);
+	CHECK(e.update(now + rate_window_ms, rx + 500'000'000, 0));
+	CHECK_EQ(e.rcvbuf(), MB);
+}
+
+} // namespace
+
+
+int main()
+{
+	srtt();
+	no_rtt();
+	steady();
+	hysteresis();
+	bounds();
+
+	return check_result("bdp_test");
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _MSC_VER
+  #include <intrin.h>
+  #define BENCH_NOINLINE __declspec(noinline)
+#else
+  #define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+/*
+ * Microbenchmarks of the portable headers. ctest runs them with a few iterations to check that they work,
+ * run an executable without arguments to get the numbers.
+ */
+
+namespace bench
+{
+
+inline long long iterations(int argc, char *argv[], long long dflt = 10'000'000)
+{
+	return argc > 1 ? std::atoll(argv[1]) : dflt;
+}
+
+/*
+ * Prevents the compiler from removing a computation whose result is not used.
+ */
+template<typename T>
+inline void keep(const T &value)
+{
+#ifdef _MSC_VER
+	static const void* volatile sink;
+	sink = &value;
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : "r,m"(value) : "memory");
+#endif
+}
+
+/*
+ * @param f is called iters times with an index of the iteration
+ * @return nanoseconds per call
+ */
+template<typename F>
+inline double run(const char *name, long long iters, F &&f)
+{
+	using clock = std::chrono::steady_clock;
+
+	auto start = clock::now();
+	for (long long i = 0; i < iters; ++i) {
+		f(i);
+	}
+	std::chrono::duration<double, std::nano> d = clock::now() - start;
+
+	auto ns = iters ? d.count()/iters : 0;
+	std::printf("%-40s %8.2f ns/op\n", name, ns);
+	return ns;
+}
+
+} // namespace bench
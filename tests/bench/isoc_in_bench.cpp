@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+#include <usbip/proto.h>
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+/*
+ * Models reception of isochronous IN data of RET_SUBMIT by drivers/ude/wsk_receive.cpp:
+ * the compacted data of the Linux server that fill_isoc_data shifts back to the offsets of the packets,
+ * and the data with the gaps included if EXT_ISOC_UNCOMPACTED is accepted.
+ * The receive into the buffer of URB is modeled by memcpy of the bytes on the wire.
+ */
+
+namespace
+{
+
+using namespace usbip;
+using ULONG = UINT32;
+
+struct urb
+{
+	std::vector<iso_packet_descriptor> d; // offset, length, actual_length
+	ULONG compacted; // SUM(actual_length)
+	ULONG span; // from the start of the buffer to the end of the last packet that has data
+};
+
+/*
+ * See fill_isoc_data, the checks are omitted.
+ * @return bytes moved
+ */
+BENCH_NOINLINE ULONG fill_compacted(UINT8 *buffer, const urb &r)
+{
+	ULONG moved = 0;
+	auto length = r.compacted;
+
+	for (auto i = static_cast<int>(r.d.size()) - 1; i >= 0; --i) {
+		auto &d = r.d[i];
+		if (!d.actual_length) {
+			continue;
+		}
+
+		length -= d.actual_length;
+		if (d.offset > length) {
+			std::memmove(buffer + d.offset, buffer + length, d.actual_length);
+			moved += d.actual_length;
+		}
+	}
+
+	return moved;
+}
+
+std::vector<urb> make_urbs(int cnt, int packets, ULONG max_packet, ULONG min_actual, ULONG max_actual)
+{
+	std::mt19937 rnd(1);
+	std::vector<urb> v(cnt);
+
+	for (auto &r: v) {
+		r.d.resize(packets);
+		ULONG offset = 0;
+
+		for (auto &d: r.d) {
+			d.offset = offset;
+			d.length = max_packet;
+			d.actual_length = min_actual + rnd() % (max_actual - min_actual + 1);
+
+			r.compacted += d.actual_length;
+			if (d.actual_length) {
+				r.span = offset + d.actual_length;
+			}
+			offset += max_packet;
+		}
+	}
+
+	return v;
+}
+
+void run(const char *title, long long iters, const std::vector<urb> &urbs)
+{
+	UINT64 compacted = 0;
+	UINT64 span = 0;
+	UINT64 moved = 0;
+	UINT64 length = 0;
+
+	std::vector<UINT8> wire(urbs[0].d.size()*urbs[0].d[0].length);
+	std::vector<UINT8> buf(wire.size());
+
+	for (auto &r: urbs) {
+		compacted += r.compacted;
+		span += r.span;
+		length += r.d.size()*r.d[0].length;
+		moved += fill_compacted(buf.data(), r);
+	}
+
+	auto n = urbs.size();
+	std::printf("%s, %zu packets of %u bytes\n", title, urbs[0].d.size(), static_cast<unsigned>(urbs[0].d[0].length));
+	std::printf("  bytes per URB: buffer %llu, on the wire %llu compacted vs %llu uncompacted, moved %llu vs 0\n",
+		static_cast<unsigned long long>(length/n), static_cast<unsigned long long>(compacted/n), 
+		static_cast<unsigned long long>(span/n), static_cast<unsigned long long>(moved/n));
+
+	bench::run("  compacted: receive, fill_isoc_data", iters, [&] (auto i) 
+	{
+		auto &r = urbs[i % n];
+		std::memcpy(buf.data(), wire.data(), r.compacted);
+		bench::keep(fill_compacted(buf.data(), r));
+		bench::keep(buf);
+	});
+
+	bench::run("  uncompacted: receive", iters, [&] (auto i) 
+	{
+		auto &r = urbs[i % n];
+		std::memcpy(buf.data(), wire.data(), r.span);
+		bench::keep(buf);
+	});
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	auto iters = bench::iterations(argc, argv, 1'000'000);
+
+	// a microphone, 48 kHz 16 bit stereo, wMaxPacketSize leaves room for one extra sample
+	run("audio", iters, make_urbs(100, 10, 196, 192, 192));
+
+	// a webcam, high speed high bandwidth endpoint, frames are compressed
+	run("video", iters, make_urbs(100, 32, 3*1024, 0, 3*1024));
+
+	// packets are full, the layouts are the same
+	run("full packets", iters, make_urbs(100, 32, 1024, 1024, 1024));
+
+	return 0;
+}
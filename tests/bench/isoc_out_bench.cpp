@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+#include <usbip/proto.h>
+
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#ifdef _MSC_VER
+  #include <stdlib.h>
+#endif
+
+/*
+ * Models building of iso_packet_descriptor-s of isochronous OUT URBs by repack of drivers/ude/device_ioctl.cpp:
+ * in host byte order followed by byteswap in prepare_wsk_buf (the former way), in network byte order (the current one),
+ * and copying from the cached descriptors of the recent layouts of the endpoint under a spinlock.
+ * The cache does not pay off because a match must compare all offsets anyway, it was removed.
+ */
+
+namespace
+{
+
+using namespace usbip;
+using ULONG = UINT32;
+
+inline UINT32 bswap(UINT32 v)
+{
+#ifdef _MSC_VER
+	return _byteswap_ulong(v);
+#else
+	return __builtin_bswap32(v);
+#endif
+}
+
+struct USBD_ISO_PACKET_DESCRIPTOR
+{
+	ULONG Offset;
+	ULONG Length;
+	INT32 Status;
+};
+
+struct urb // _URB_ISOCH_TRANSFER
+{
+	ULONG TransferBufferLength;
+	ULONG NumberOfPackets;
+	USBD_ISO_PACKET_DESCRIPTOR IsoPacket[max_iso_packets];
+};
+
+template<bool net_order>
+BENCH_NOINLINE bool repack(iso_packet_descriptor *d, const urb &r)
+{
+	for (ULONG i = 0; i < r.NumberOfPackets; ++d) {
+		auto offset = r.IsoPacket[i].Offset;
+		auto next_offset = ++i < r.NumberOfPackets ? r.IsoPacket[i].Offset : r.TransferBufferLength;
+
+		if (!(next_offset >= offset && next_offset <= r.TransferBufferLength)) {
+			return false;
+		}
+
+		auto len = next_offset - offset;
+		d->offset = net_order ? bswap(offset) : offset;
+		d->length = net_order ? bswap(len) : len;
+		d->actual_length = 0;
+		d->status = 0;
+	}
+
+	return true;
+}
+
+/*
+ * See byteswap of drivers/libdrv/pdu.cpp.
+ */
+BENCH_NOINLINE void byteswap(iso_packet_descriptor *d, size_t cnt)
+{
+	for (size_t i = 0; i < cnt; ++i, ++d) {
+		for (auto v: {&d->offset, &d->length, &d->actual_length, &d->status}) {
+			*v = bswap(*v);
+		}
+	}
+}
+
+struct slot
+{
+	std::vector<iso_packet_descriptor> d;
+	ULONG length;
+	ULONG hits;
+};
+
+slot slots[3];
+long long hits, misses;
+
+bool matches(const slot &s, const urb &r)
+{
+	if (!(s.d.size() == r.NumberOfPackets && s.length == r.TransferBufferLength)) {
+		return false;
+	}
+
+	for (ULONG i = 0; i < r.NumberOfPackets; ++i) {
+		if (bswap(s.d[i].offset) != r.IsoPacket[i].Offset) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+BENCH_NOINLINE bool copy(iso_packet_descriptor *d, const urb &r)
+{
+	for (auto &s: slots) {
+		if (matches(s, r)) {
+			std::memcpy(d, s.d.data(), s.d.size()*sizeof(*d));
+			++s.hits;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+BENCH_NOINLINE void update(const iso_packet_descriptor *d, const urb &r)
+{
+	auto v = slots;
+	for (auto &s: slots) {
+		if (s.d.empty()) {
+			v = &s;
+			break;
+		} else if (s.hits < v->hits) {
+			v = &s;
+		}
+	}
+
+	v->d.assign(d, d + r.NumberOfPackets);
+	v->length = r.TransferBufferLength;
+	v->hits = 0;
+}
+
+std::atomic_flag lock; // of the endpoint, copy and update acquire it
+
+void with_templates(iso_packet_descriptor *d, const urb &r)
+{
+	while (lock.test_and_set(std::memory_order_acquire));
+	auto found = copy(d, r);
+	lock.clear(std::memory_order_release);
+
+	if (found) {
+		++hits;
+	} else if (repack<true>(d, r)) {
+		++misses;
+		while (lock.test_and_set(std::memory_order_acquire));
+		update(d, r);
+		lock.clear(std::memory_order_release);
+	}
+}
+
+/*
+ * Packets of an audio stream, the size of a packet is bytes_per_ms rounded down,
+ * the fractions accumulate and add a sample of frame_size bytes from time to time.
+ */
+std::vector<urb> make_stream(int urbs, ULONG packets, double bytes_per_ms, ULONG frame_size)
+{
+	std::vector<urb> v(urbs);
+	double acc = 0;
+
+	for (auto &r: v) {
+		r.NumberOfPackets = packets;
+		ULONG offset = 0;
+
+		for (ULONG i = 0; i < packets; ++i) {
+			acc += bytes_per_ms;
+			auto len = static_cast<ULONG>(acc/frame_size)*frame_size;
+			acc -= len;
+
+			r.IsoPacket[i] = { offset, 0, 0 };
+			offset += len;
+		}
+
+		r.TransferBufferLength = offset;
+	}
+
+	return v;
+}
+
+void run(const char *title, long long iters, const std::vector<urb> &stream)
+{
+	std::printf("%s, %u packets per URB\n", title, static_cast<unsigned>(stream[0].NumberOfPackets));
+
+	iso_packet_descriptor d[max_iso_packets];
+	auto n = stream.size();
+
+	bench::run("  repack, byteswap", iters, [&] (auto i) 
+	{
+		auto &r = stream[i % n];
+		repack<false>(d, r);
+		byteswap(d, r.NumberOfPackets);
+		bench::keep(d);
+	});
+
+	bench::run("  repack in network byte order", iters, [&] (auto i) 
+	{
+		repack<true>(d, stream[i % n]);
+		bench::keep(d);
+	});
+
+	for (auto &s: slots) {
+		s = slot{};
+	}
+	hits = misses = 0;
+
+	bench::run("  templates", iters, [&] (auto i) 
+	{
+		with_templates(d, stream[i % n]);
+		bench::keep(d);
+	});
+
+	if (auto total = hits + misses) {
+		std::printf("  template hits %.1f%%\n", 100.0*hits/total);
+	}
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	auto iters = bench::iterations(argc, argv, 1'000'000);
+
+	run("48 kHz, 16 bit stereo", iters, make_stream(100, 10, 192, 4)); // 192 bytes every packet
+	run("44.1 kHz, 16 bit stereo", iters, make_stream(100, 10, 176.4, 4)); // 176/180 cadence
+	run("44.1 kHz, 24 bit stereo, high speed", iters, make_stream(100, 32, 264.6/8, 6));
+
+	return 0;
+}
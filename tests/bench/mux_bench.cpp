@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+#include <usbip/fair_queue.h>
+
+#include <random>
+#include <unordered_map>
+
+namespace
+{
+
+using namespace usbip::mux;
+
+constexpr int ports = 60; // TOTAL_PORTS of drivers/ude, see mux_ctx
+constexpr UINT32 quantum = 16*1024;
+
+int devices[ports];
+devid_table<int*, ports> table;
+
+UINT32 devid(int i) { return (1U + i/30) << 16 | (2U + i%30); } // busnum << 16 | devnum
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	auto iters = bench::iterations(argc, argv);
+
+	for (int i = 0; i < ports; ++i) {
+		table.insert(devid(i), &devices[i]);
+	}
+
+	enum { MASK = 4095 };
+	UINT32 ids[MASK + 1];
+	UINT32 sizes[ports];
+	{
+		std::mt19937 rnd(1);
+		for (auto &id: ids) {
+			id = devid(rnd() % ports);
+		}
+		for (auto &sz: sizes) { // interrupt, control, bulk PDUs
+			UINT32 v[] { 48 + 8, 48 + 64, 48 + 64*1024 };
+			sz = v[rnd() % 3];
+		}
+	}
+
+	bench::run("devid_table::get, first slot", iters, [] (auto) { bench::keep(table.get(devid(0))); });
+	bench::run("devid_table::get, last slot", iters, [] (auto) { bench::keep(table.get(devid(ports - 1))); });
+	bench::run("devid_table::get, random", iters, [&ids] (auto i) { bench::keep(table.get(ids[i & MASK])); });
+
+	{
+		std::unordered_map<UINT32, int*> map;
+		for (int i = 0; i < ports; ++i) {
+			map.emplace(devid(i), &devices[i]);
+		}
+		bench::run("unordered_map::find, random", iters, [&] (auto i) { bench::keep(map.find(ids[i & MASK])->second); });
+	}
+
+	auto head = [&sizes] (int flow) { return sizes[flow]; }; // all flows always have pending PDUs
+
+	{
+		drr<ports, quantum> d{};
+		d.activate(0);
+		bench::run("drr::next, 1 flow", iters, [&] (auto) { bench::keep(d.next(head)); });
+	}
+
+	{
+		drr<ports, quantum> d{};
+		for (int i = 0; i < ports; ++i) {
+			d.activate(i);
+		}
+		bench::run("drr::next, 60 flows", iters, [&] (auto) { bench::keep(d.next(head)); });
+	}
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+#include <usbip/shaper.h>
+
+namespace
+{
+
+using namespace usbip::mux;
+
+constexpr int ports = 60; // TOTAL_PORTS of drivers/ude
+using sched_t = scheduler<ports, 16*1024>; // see mux_ctx::sched
+
+sched_t sched[3];
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	auto iters = bench::iterations(argc, argv);
+
+	// every flow always has a pending bulk PDU, flow 0 also has interrupt PDUs
+	auto head = [] (pclass cls, int flow) -> UINT32
+	{ 
+		switch (cls) {
+		case pclass::interactive:
+			return flow ? 0 : 48 + 8;
+		case pclass::bulk:
+			return 48 + 16*1024;
+		default:
+			return 0;
+		}
+	};
+
+	for (auto &s: sched) {
+		for (int flow = 0; flow < ports; ++flow) {
+			s.activate(flow, pclass::bulk);
+		}
+	}
+
+	bench::run("scheduler::next, 60 bulk flows", iters, [&] (auto i) 
+	{ 
+		bench::keep(sched[0].next(head, i/1000)); 
+	});
+
+	sched[1].activate(0, pclass::interactive);
+	bench::run("scheduler::next, + 1 interactive flow", iters, [&] (auto i) 
+	{ 
+		bench::keep(sched[1].next(head, i/1000)); 
+	});
+
+	/*
+	 * Ten flows are limited to 1 MB/s each, the clock advances by 1 ms every 100 decisions,
+	 * so most of the time they are throttled.
+	 */
+	auto &s = sched[2];
+	for (int flow = 0; flow < 10; ++flow) {
+		s.flow_bucket(flow).configure(1'000'000, 0, 0);
+	}
+
+	bench::run("scheduler::next, 10 of 60 throttled", iters, [&] (auto i) 
+	{ 
+		bench::keep(s.next(head, i/100)); 
+	});
+
+	bench::keep(s.throttled_cnt());
+	std::printf("throttled %llu times\n", static_cast<unsigned long long>(s.throttled_cnt()));
+
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+#include <usbip/proto.h>
+
+#include <cstring>
+
+#ifdef _MSC_VER
+  #include <stdlib.h>
+#endif
+
+/*
+ * Models CMD_SUBMIT of bulk, interrupt and isoch URBs in drivers/ude/proto.cpp:
+ * build the header in host byte order and byteswap it (as before endpoint_ctx::submit)
+ * versus copy the per-endpoint template in network byte order and patch it.
+ */
+
+namespace
+{
+
+using namespace usbip;
+using ULONG = UINT32;
+
+inline UINT32 bswap(UINT32 v)
+{
+#ifdef _MSC_VER
+	return _byteswap_ulong(v);
+#else
+	return __builtin_bswap32(v);
+#endif
+}
+
+template<typename T>
+inline void swap_inplace(T &v) { v = static_cast<T>(bswap(static_cast<UINT32>(v))); }
+
+// values of usbdi.h and linux/usb.h
+enum : ULONG { USBD_TRANSFER_DIRECTION_IN = 1, USBD_SHORT_TRANSFER_OK = 2, USBD_START_ISO_TRANSFER_ASAP = 4 };
+enum : UINT32 { URB_SHORT_NOT_OK = 1, URB_ISO_ASAP = 2 };
+
+struct endpoint
+{
+	UINT8 bEndpointAddress;
+	UINT8 bInterval;
+	header submit; // endpoint_ctx::submit
+};
+
+struct device
+{
+	UINT32 devid;
+	seqnum_t seqnum;
+};
+
+inline bool dir_out(const endpoint &e) { return !(e.bEndpointAddress & 0x80); }
+
+inline seqnum_t next_seqnum(device &dev, bool dir_in)
+{
+	return ++dev.seqnum << 1 | dir_in;
+}
+
+inline ULONG fix_transfer_flags(ULONG TransferFlags, bool dir_out)
+{
+	if (!(TransferFlags & USBD_TRANSFER_DIRECTION_IN) == dir_out) {
+		return TransferFlags;
+	}
+
+	const ULONG in_flags = USBD_SHORT_TRANSFER_OK | USBD_TRANSFER_DIRECTION_IN;
+	return dir_out ? TransferFlags & ~in_flags : TransferFlags | in_flags;
+}
+
+inline UINT32 to_linux_flags(ULONG TransferFlags, bool dir_in)
+{
+	UINT32 flags = 0;
+
+	if (TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
+		flags |= URB_ISO_ASAP;
+	} else if (dir_in && !(TransferFlags & USBD_SHORT_TRANSFER_OK)) {
+		flags |= URB_SHORT_NOT_OK;
+	}
+
+	return flags;
+}
+
+/*
+ * See byteswap_header of drivers/libdrv/pdu.cpp, it is called from another translation unit.
+ */
+BENCH_NOINLINE void byteswap_header(header &hdr)
+{
+	switch (hdr.command) {
+	case CMD_SUBMIT:
+		swap_inplace(hdr.cmd_submit.transfer_flags);
+		for (auto v: {&hdr.cmd_submit.transfer_buffer_length, &hdr.cmd_submit.start_frame, 
+			      &hdr.cmd_submit.number_of_packets, &hdr.cmd_submit.interval}) {
+			swap_inplace(*v);
+		}
+		break;
+	case RET_SUBMIT:
+		for (auto v: {&hdr.ret_submit.status, &hdr.ret_submit.actual_length, &hdr.ret_submit.start_frame, 
+			      &hdr.ret_submit.number_of_packets, &hdr.ret_submit.error_count}) {
+			swap_inplace(*v);
+		}
+		break;
+	case CMD_UNLINK:
+		swap_inplace(hdr.cmd_unlink.seqnum);
+		break;
+	case RET_UNLINK:
+		swap_inplace(hdr.ret_unlink.status);
+		break;
+	}
+
+	for (auto v: {&hdr.command, &hdr.seqnum, &hdr.devid, &hdr.direction, &hdr.ep}) {
+		swap_inplace(*v);
+	}
+}
+
+void build(header &hdr, device &dev, const endpoint &e, ULONG TransferFlags, ULONG TransferBufferLength)
+{
+	auto out = dir_out(e);
+	TransferFlags = fix_transfer_flags(TransferFlags, out);
+
+	hdr.command = CMD_SUBMIT;
+	hdr.seqnum = next_seqnum(dev, !out);
+	hdr.devid = dev.devid;
+	hdr.direction = out ? direction::out : direction::in;
+	hdr.ep = e.bEndpointAddress & 0xF;
+
+	if (auto r = &hdr.cmd_submit) {
+		r->transfer_flags = to_linux_flags(TransferFlags, !out);
+		r->transfer_buffer_length = TransferBufferLength;
+		r->start_frame = 0;
+		r->number_of_packets = number_of_packets_non_isoch;
+		r->interval = e.bInterval;
+		std::memset(r->setup, 0, sizeof(r->setup));
+	}
+
+	byteswap_header(hdr);
+}
+
+void make_template(header &hdr, const device &dev, const endpoint &e)
+{
+	std::memset(&hdr, 0, sizeof(hdr));
+
+	hdr.command = CMD_SUBMIT;
+	hdr.devid = dev.devid;
+	hdr.direction = dir_out(e) ? direction::out : direction::in;
+	hdr.ep = e.bEndpointAddress & 0xF;
+
+	hdr.cmd_submit.number_of_packets = number_of_packets_non_isoch;
+	hdr.cmd_submit.interval = e.bInterval;
+
+	byteswap_header(hdr);
+}
+
+void patch(header &hdr, device &dev, const endpoint &e, ULONG TransferFlags, ULONG TransferBufferLength)
+{
+	auto out = dir_out(e);
+	TransferFlags = fix_transfer_flags(TransferFlags, out);
+
+	hdr = e.submit;
+	hdr.seqnum = bswap(next_seqnum(dev, !out));
+
+	if (auto r = &hdr.cmd_submit) {
+		r->transfer_flags = bswap(to_linux_flags(TransferFlags, !out));
+		r->transfer_buffer_length = bswap(TransferBufferLength);
+	}
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	auto iters = bench::iterations(argc, argv);
+
+	device dev{ .devid = 1 << 16 | 2, .seqnum = 0 };
+	endpoint eps[] { {0x81, 1, {}}, {0x02, 0, {}}, {0x83, 4, {}} }; // bulk in, bulk out, interrupt in
+
+	for (auto &e: eps) {
+		make_template(e.submit, dev, e);
+	}
+
+	enum { EPS = sizeof(eps)/sizeof(*eps), MASK = 63 };
+	header hdr[MASK + 1];
+
+	for (auto &e: eps) { // both ways must produce the same PDU
+		header a, b;
+		auto seqnum = dev.seqnum;
+		build(a, dev, e, USBD_SHORT_TRANSFER_OK, 512);
+		dev.seqnum = seqnum;
+		patch(b, dev, e, USBD_SHORT_TRANSFER_OK, 512);
+		if (std::memcmp(&a, &b, sizeof(a))) {
+			std::puts("template differs from the built header");
+			return 1;
+		}
+	}
+
+	bench::run("build, byteswap_header", iters, [&] (auto i) 
+	{
+		build(hdr[i & MASK], dev, eps[i % EPS], USBD_SHORT_TRANSFER_OK, 16*1024);
+		bench::keep(hdr[i & MASK]);
+	});
+
+	bench::run("copy template, patch", iters, [&] (auto i) 
+	{
+		patch(hdr[i & MASK], dev, eps[i % EPS], USBD_SHORT_TRANSFER_OK, 16*1024);
+		bench::keep(hdr[i & MASK]);
+	});
+
+	return 0;
+}
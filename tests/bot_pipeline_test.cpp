@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/bot.h>
+
+namespace
+{
+
+using namespace usbip::bot;
+
+UINT32 unlink[pipeline::max_stages];
+UINT32 seqnum = 100;
+
+cbw make_cbw(UINT32 data_length, bool in)
+{
+	cbw c{};
+	c.signature = cbw_signature;
+	c.tag = 7;
+	c.data_length = data_length;
+	c.flags = in ? cbw_flag_in : 0;
+	c.cb_length = 10;
+	c.cb[0] = in ? scsi::READ_10 : 0x2A; // WRITE(10)
+	return c;
+}
+
+/*
+ * Plans the stages of CBW and "sends" them.
+ */
+int start(pipeline &p, const cbw &c)
+{
+	CHECK_EQ(p.cancel(unlink), 0); // nothing is left from the previous command
+
+	auto n = p.plan(c);
+	for (int i = 0; i < n; ++i) {
+		p.sent(i, ++seqnum);
+	}
+	return n;
+}
+
+void plan()
+{
+	pipeline p{};
+
+	CHECK_EQ(start(p, make_cbw(4096, true)), 2);
+	CHECK_EQ(p.length(0), 4096U);
+	CHECK_EQ(p.length(1), sizeof(csw));
+	p.cancel(unlink);
+
+	CHECK_EQ(start(p, make_cbw(4096, false)), 1); // data-out is not a bulk IN stage
+	CHECK_EQ(p.length(0), sizeof(csw));
+	p.cancel(unlink);
+
+	CHECK_EQ(start(p, make_cbw(0, true)), 1);
+	CHECK_EQ(p.length(0), sizeof(csw));
+	p.cancel(unlink);
+
+	auto bad = make_cbw(512, true);
+	bad.signature = 0;
+	CHECK_EQ(p.plan(bad), 0);
+	CHECK(!p.pending());
+
+	CHECK_EQ(p.commands(), 3U);
+}
+
+/*
+ * Both stages are unlinked, late RET_SUBMIT-s do not match them.
+ */
+void length_mismatch()
+{
+	pipeline p{};
+	start(p, make_cbw(4096, true));
+	auto s0 = p.seqnum(0);
+	auto s1 = p.seqnum(1);
+
+	CHECK_EQ(p.bind(512), -1);
+	CHECK_EQ(p.cancel(unlink), 2);
+	CHECK_EQ(unlink[0], s0);
+	CHECK_EQ(unlink[1], s1);
+
+	CHECK(!p.pending());
+	CHECK(p.find(s0) < 0);
+	CHECK(p.find(s1) < 0);
+}
+
+/*
+ * The host skipped the data stage.
+ */
+void csw_first()
+{
+	pipeline p{};
+	start(p, make_cbw(4096, true));
+
+	CHECK_EQ(p.bind(sizeof(csw)), -1);
+	CHECK_EQ(p.cancel(unlink), 2);
+}
+
+/*
+ * The data stage stalls before the host's URB is bound: the URB is completed from it, CSW stage is unlinked.
+ */
+void stall_before_bind()
+{
+	pipeline p{};
+	start(p, make_cbw(4096, true));
+	auto s1 = p.seqnum(1);
+
+	auto i = p.find(p.seqnum(0));
+	CHECK_EQ(i, 0);
+	CHECK(p.claim(i));
+	CHECK(!p.claim(i));
+	p.received(i);
+
+	CHECK_EQ(p.bind(4096), 0);
+	CHECK(p.state(0) == pipeline::stage_received);
+	p.release(0); // RET_SUBMIT with EPIPE completes the URB
+
+	CHECK_EQ(p.cancel(unlink), 1);
+	CHECK_EQ(unlink[0], s1);
+
+	CHECK(!p.pending());
+	CHECK_EQ(p.bind(sizeof(csw)), -1); // CSW after clear stall is sent as usual
+}
+
+/*
+ * The data stage stalls after the host's URB took its seqnum.
+ */
+void stall_after_bind()
+{
+	pipeline p{};
+	start(p, make_cbw(4096, true));
+	auto s0 = p.seqnum(0);
+	auto s1 = p.seqnum(1);
+
+	CHECK_EQ(p.bind(4096), 0);
+	CHECK(p.state(0) == pipeline::stage_sent);
+	p.release(0);
+
+	CHECK(p.find(s0) < 0); // RET_SUBMIT completes the URB as usual
+	CHECK_EQ(p.cancel(unlink), 1);
+	CHECK_EQ(unlink[0], s1);
+}
+
+/*
+ * Clear stall or purge while the payload of the data stage is being received and the host's URB waits for it.
+ */
+void cancel_receiving()
+{
+	pipeline p{};
+	start(p, make_cbw(4096, true));
+	auto s0 = p.seqnum(0);
+	auto s1 = p.seqnum(1);
+
+	CHECK(p.claim(p.find(s0)));
+	CHECK_EQ(p.bind(4096), 0);
+	CHECK(p.state(0) == pipeline::stage_receiving);
+
+	CHECK_EQ(p.cancel(unlink), 1); // RET_SUBMIT of s0 has arrived already
+	CHECK_EQ(unlink[0], s1);
+	CHECK(p.find(s0) < 0);
+
+	CHECK(!p.pending());
+	CHECK_EQ(p.bind(sizeof(csw)), -1);
+}
+
+void purge()
+{
+	pipeline p{};
+	start(p, make_cbw(4096, true));
+
+	CHECK_EQ(p.cancel(unlink), 2);
+	CHECK(p.find(p.seqnum(0)) < 0);
+	CHECK_EQ(p.cancel(unlink), 0);
+}
+
+/*
+ * RET_SUBMIT of the data stage arrives after bind, CSW arrives before it.
+ */
+void happy_path()
+{
+	pipeline p{};
+	start(p, make_cbw(4096, true));
+	auto s0 = p.seqnum(0);
+	auto s1 = p.seqnum(1);
+
+	CHECK_EQ(p.bind(4096), 0);
+	p.release(0);
+	CHECK(p.find(s0) < 0);
+
+	CHECK(p.claim(p.find(s1)));
+	p.received(p.find(s1));
+
+	CHECK_EQ(p.bind(sizeof(csw)), 1);
+	CHECK(p.state(1) == pipeline::stage_received);
+	p.release(1);
+
+	CHECK(!p.pending());
+	CHECK_EQ(p.cancel(unlink), 0);
+	CHECK_EQ(p.bound(), 2U);
+}
+
+/*
+ * RET_SUBMIT is being received when the host's URB is bound, it completes the URB.
+ */
+void bind_while_receiving()
+{
+	pipeline p{};
+	start(p, make_cbw(0, false));
+	auto s0 = p.seqnum(0);
+
+	CHECK(p.claim(p.find(s0)));
+	CHECK_EQ(p.bind(sizeof(csw)), 0);
+	CHECK(p.state(0) == pipeline::stage_receiving);
+
+	auto i = p.find(s0);
+	p.received(i);
+	p.release(i);
+
+	CHECK_EQ(p.cancel(unlink), 0);
+}
+
+/*
+ * The stages of the previous command are unlinked by the next CBW.
+ */
+void next_cbw()
+{
+	pipeline p{};
+	start(p, make_cbw(4096, true));
+	auto s0 = p.seqnum(0);
+	auto s1 = p.seqnum(1);
+
+	CHECK_EQ(p.cancel(unlink), 2);
+	CHECK_EQ(unlink[0], s0);
+	CHECK_EQ(unlink[1], s1);
+
+	start(p, make_cbw(512, true));
+	CHECK(p.find(s0) < 0);
+	CHECK(p.find(s1) < 0);
+	CHECK(p.seqnum(0) != s0);
+	CHECK_EQ(p.commands(), 2U);
+}
+
+} // namespace
+
+
+int main()
+{
+	plan();
+	length_mismatch();
+	csw_first();
+	stall_before_bind();
+	stall_after_bind();
+	cancel_receiving();
+	purge();
+	happy_path();
+	bind_while_receiving();
+	next_cbw();
+
+	return check_result("bot_pipeline_test");
+}
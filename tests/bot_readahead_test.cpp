@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/bot.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip::bot;
+
+enum : UINT32 { BS = 512, BLOCKS = 1000, CACHE = 64*1024 };
+
+cbw read10(UINT32 tag, UINT32 lba, UINT32 blocks)
+{
+	cbw c{};
+	c.signature = cbw_signature;
+	c.tag = tag;
+	c.flags = cbw_flag_in;
+	c.cb_length = 10;
+	c.data_length = blocks*BS;
+
+	c.cb[0] = scsi::READ_10;
+	scsi::set_be(c.cb + 2, 4, lba);
+	scsi::set_be(c.cb + 7, 2, blocks);
+
+	return c;
+}
+
+cbw read_capacity(UINT32 tag)
+{
+	cbw c{};
+	c.signature = cbw_signature;
+	c.tag = tag;
+	c.flags = cbw_flag_in;
+	c.cb_length = 10;
+	c.data_length = 8;
+	c.cb[0] = scsi::READ_CAPACITY_10;
+	return c;
+}
+
+/*
+ * The host, the device and the cache buffer of the driver.
+ */
+struct disk
+{
+	std::vector<UINT8> medium = std::vector<UINT8>(BS*BLOCKS);
+	std::vector<UINT8> cache = std::vector<UINT8>(CACHE);
+	readahead ra{};
+	int round_trips{};
+
+	disk()
+	{
+		for (size_t i = 0; i < medium.size(); ++i) {
+			medium[i] = static_cast<UINT8>(i*7 + i/BS);
+		}
+		ra.enable(CACHE);
+	}
+
+	/*
+	 * Executes CBW that can be enlarged.
+	 */
+	auto device(const cbw &c, bool fail, csw &s)
+	{
+		std::vector<UINT8> data;
+		s = { csw_signature, c.tag, 0, csw_passed };
+
+		if (fail) {
+			s.status = csw_failed;
+			s.residue = c.data_length;
+		} else if (scsi::read_cmd rd; scsi::parse_read(c, rd)) {
+			data.assign(medium.begin() + rd.lba*BS, medium.begin() + (rd.lba + rd.blocks)*BS);
+		} else if (c.cb[0] == scsi::READ_CAPACITY_10) {
+			data.resize(8);
+			scsi::set_be(data.data(), 4, BLOCKS - 1);
+			scsi::set_be(data.data() + 4, 4, BS);
+		}
+
+		s.residue = c.data_length - static_cast<UINT32>(data.size());
+		return data;
+	}
+
+	/*
+	 * @param urb length of data URB-s of the host
+	 * @return the data that the host has got
+	 */
+	auto command(cbw c, csw &s, UINT32 urb = 4096, bool fail = false)
+	{
+		auto host_len = c.data_length;
+		auto act = ra.command(c);
+
+		std::vector<UINT8> dev;
+		csw dev_csw{};
+
+		if (act != readahead::local) {
+			dev = device(c, fail, dev_csw);
+			++round_trips;
+		}
+
+		std::vector<UINT8> data;
+		size_t pos = 0; // in dev
+
+		while (data.size() < host_len) {
+			UINT32 len{};
+
+			switch (ra.next_in()) {
+			case readahead::in_expand:
+				len = std::min(static_cast<UINT32>(dev.size()), ra.device_length());
+				std::memcpy(cache.data(), dev.data(), len);
+				len = ra.data_received(urb, len, !fail);
+				data.insert(data.end(), cache.begin(), cache.begin() + len);
+				break;
+			case readahead::in_local_data:
+				if (UINT32 off; (len = ra.local_data(urb, off)) != 0) {
+					data.insert(data.end(), cache.begin() + off, cache.begin() + off + len);
+				}
+				break;
+			case readahead::in_forward:
+				len = std::min(urb, static_cast<UINT32>(dev.size() - pos));
+				ra.received(dev.data() + pos, len);
+				data.insert(data.end(), dev.begin() + pos, dev.begin() + pos + len);
+				pos += len;
+				break;
+			case readahead::in_local_status:
+				break;
+			}
+
+			if (len < urb) {
+				break; // short packet
+			}
+		}
+
+		if (ra.next_in() == readahead::in_local_status) {
+			ra.make_status(s);
+		} else {
+			s = dev_csw;
+			ra.received(&s, sizeof(s));
+		}
+
+		return data;
+	}
+
+	bool same(const std::vector<UINT8> &data, UINT32 lba, UINT32 blocks) const
+	{
+		return data.size() == blocks*BS && !std::memcmp(data.data(), medium.data() + lba*BS, data.size());
+	}
+};
+
+void parse()
+{
+	auto c = read10(1, 0x12345678, 0x100);
+	scsi::read_cmd rd;
+
+	CHECK(scsi::parse_read(c, rd));
+	CHECK_EQ(rd.lba, 0x12345678U);
+	CHECK_EQ(rd.blocks, 0x100U);
+	CHECK_EQ(rd.max_blocks, 0xFFFFU);
+
+	scsi::set_read_blocks(c, 0x200);
+	CHECK(scsi::parse_read(c, rd));
+	CHECK_EQ(rd.blocks, 0x200U);
+
+	c.cb[0] = scsi::READ_6;
+	c.cb[4] = 0; // 256 blocks
+	CHECK(scsi::parse_read(c, rd));
+	CHECK_EQ(rd.blocks, 256U);
+	CHECK_EQ(rd.max_blocks, 0U);
+
+	c.cb[0] = scsi::INQUIRY;
+	CHECK(!scsi::parse_read(c, rd));
+}
+
+void disabled()
+{
+	readahead ra{};
+	CHECK(!ra.enabled());
+
+	auto c = read10(1, 0, 8);
+	CHECK(ra.command(c) == readahead::forward);
+	CHECK(ra.command(c) == readahead::forward);
+	CHECK_EQ(c.data_length, 8*BS);
+}
+
+/*
+ * The first READ is forwarded, the second is enlarged to fill the cache, the following ones are answered locally.
+ */
+void sequential()
+{
+	disk d;
+	csw s;
+	UINT32 tag = 1;
+
+	d.command(read_capacity(tag++), s);
+	CHECK(s.status == csw_passed);
+
+	auto data = d.command(read10(tag++, 0, 8), s);
+	CHECK(d.same(data, 0, 8));
+	CHECK_EQ(d.ra.expanded(), 0U);
+
+	data = d.command(read10(tag, 8, 8), s);
+	CHECK(d.same(data, 8, 8));
+	CHECK_EQ(s.tag, tag++);
+	CHECK_EQ(s.residue, 0U); // as the host sees it
+	CHECK_EQ(d.ra.expanded(), 1U);
+	CHECK_EQ(d.ra.cached_blocks(), CACHE/BS);
+
+	auto rt = d.round_trips;
+
+	for (UINT32 lba = 16; lba < 136; lba += 8, ++tag) {
+		data = d.command(read10(tag, lba, 8), s);
+		CHECK(d.same(data, lba, 8));
+		CHECK_EQ(s.tag, tag);
+		CHECK_EQ(s.residue, 0U);
+		CHECK(s.status == csw_passed);
+	}
+
+	CHECK_EQ(d.round_trips, rt); // blocks 16..135 were in the cache
+	CHECK_EQ(d.ra.hits(), 15U);
+
+	data = d.command(read10(tag++, 136, 8), s);
+	CHECK(d.same(data, 136, 8));
+	CHECK_EQ(d.round_trips, rt + 1);
+	CHECK_EQ(d.ra.expanded(), 2U);
+}
+
+/*
+ * URB-s of the host are smaller than its data phase.
+ */
+void small_urbs()
+{
+	disk d;
+	csw s;
+	UINT32 tag = 1;
+
+	d.command(read_capacity(tag++), s);
+	d.command(read10(tag++, 0, 8), s);
+
+	auto data = d.command(read10(tag++, 8, 8), s, 1024);
+	CHECK(d.same(data, 8, 8));
+	CHECK_EQ(d.ra.cached_blocks(), CACHE/BS);
+
+	data = d.command(read10(tag++, 20, 4), s, 1000);
+	CHECK(d.same(data, 20, 4));
+	CHECK_EQ(s.residue, 0U);
+}
+
+void write_invalidates()
+{
+	disk d;
+	csw s;
+	UINT32 tag = 1;
+
+	d.command(read_capacity(tag++), s);
+	d.command(read10(tag++, 0, 8), s);
+	d.command(read10(tag++, 8, 8), s);
+	CHECK(d.ra.cached_blocks());
+
+	auto w = read10(tag++, 100, 1);
+	w.cb[0] = 0x2A; // WRITE(10)
+	w.flags = 0;
+	d.command(w, s);
+	CHECK_EQ(d.ra.cached_blocks(), 0U);
+
+	auto t = read_capacity(tag++);
+	t.cb[0] = scsi::TEST_UNIT_READY;
+	t.data_length = 0;
+	CHECK(d.ra.command(t) == readahead::forward); // harmless commands do not invalidate
+}
+
+/*
+ * A failed command invalidates the cache and the capacity of the medium, READ-s are not enlarged after that.
+ */
+void failure()
+{
+	disk d;
+	csw s;
+	UINT32 tag = 1;
+
+	d.command(read_capacity(tag++), s);
+	d.command(read10(tag++, 0, 8), s);
+	d.command(read10(tag++, 8, 8), s);
+	CHECK(d.ra.cached_blocks());
+
+	auto t = read_capacity(tag++);
+	t.cb[0] = scsi::TEST_UNIT_READY;
+	t.data_length = 0;
+	d.command(t, s, 4096, true);
+	CHECK(s.status == csw_failed);
+	CHECK_EQ(d.ra.cached_blocks(), 0U);
+
+	d.command(read10(tag++, 300, 8), s);
+	auto data = d.command(read10(tag++, 308, 8), s);
+	CHECK(d.same(data, 308, 8));
+	CHECK_EQ(d.ra.cached_blocks(), 0U);
+}
+
+/*
+ * The cache is not filled beyond the last block of the medium.
+ */
+void end_of_medium()
+{
+	disk d;
+	csw s;
+	UINT32 tag = 1;
+
+	d.command(read_capacity(tag++), s);
+	d.command(read10(tag++, BLOCKS - 20, 8), s);
+
+	auto data = d.command(read10(tag++, BLOCKS - 12, 8), s);
+	CHECK(d.same(data, BLOCKS - 12, 8));
+	CHECK_EQ(s.residue, 0U);
+	CHECK_EQ(d.ra.cached_blocks(), 12U);
+
+	data = d.command(read10(tag++, BLOCKS - 4, 4), s);
+	CHECK(d.same(data, BLOCKS - 4, 4));
+}
+
+/*
+ * READ CAPACITY has been seen, READ of blocks 0..7 is completed.
+ */
+void prime(readahead &ra)
+{
+	ra.enable(CACHE);
+
+	auto c = read_capacity(1);
+	CHECK(ra.command(c) == readahead::forward);
+
+	UINT8 cap[8];
+	scsi::set_be(cap, 4, 9999);
+	scsi::set_be(cap + 4, 4, BS);
+	ra.received(cap, sizeof(cap));
+
+	csw s{ csw_signature, 1, 0, csw_passed };
+	ra.received(&s, sizeof(s));
+
+	c = read10(2, 0, 8);
+	CHECK(ra.command(c) == readahead::forward);
+	s.tag = 2;
+	ra.status(s);
+}
+
+void short_device_data()
+{
+	readahead ra{};
+	prime(ra);
+
+	auto c = read10(3, 8, 8);
+	CHECK(ra.command(c) == readahead::expand);
+	CHECK_EQ(c.data_length, CACHE);
+	CHECK_EQ(scsi::get_be(c.cb + 7, 2), CACHE/BS);
+	CHECK(ra.next_in() == readahead::in_expand);
+	CHECK_EQ(ra.device_length(), CACHE);
+
+	CHECK_EQ(ra.data_received(4096, 4096 - BS, true), 4096 - BS); // less than the host asked for
+	CHECK(ra.next_in() == readahead::in_forward);
+
+	csw s{ csw_signature, 3, CACHE - (4096 - BS), csw_passed };
+	ra.status(s);
+	CHECK_EQ(s.residue, BS); // of the host
+	CHECK_EQ(ra.cached_blocks(), 0U);
+}
+
+void failed_expand()
+{
+	readahead ra{};
+	prime(ra);
+
+	auto c = read10(3, 8, 8);
+	CHECK(ra.command(c) == readahead::expand);
+	CHECK_EQ(ra.data_received(4096, 0, false), 0U);
+	CHECK(ra.next_in() == readahead::in_forward);
+
+	csw s{ csw_signature, 3, CACHE, csw_failed };
+	ra.status(s);
+	CHECK_EQ(s.residue, 4096U);
+	CHECK_EQ(ra.cached_blocks(), 0U);
+
+	c = read10(4, 16, 8);
+	CHECK(ra.command(c) == readahead::forward); // is not sequential after the failure
+}
+
+void other_tag()
+{
+	readahead ra{};
+	prime(ra);
+
+	auto c = read10(3, 8, 8);
+	CHECK(ra.command(c) == readahead::expand);
+	ra.data_received(CACHE, CACHE, true);
+
+	csw s{ csw_signature, 99, 0, csw_passed };
+	ra.status(s);
+	CHECK_EQ(ra.cached_blocks(), 0U);
+
+	s.tag = 3;
+	ra.status(s);
+	CHECK_EQ(ra.cached_blocks(), CACHE/BS);
+}
+
+void reset()
+{
+	readahead ra{};
+	prime(ra);
+
+	auto c = read10(3, 8, 8);
+	ra.command(c);
+	ra.data_received(CACHE, CACHE, true);
+
+	csw s{ csw_signature, 3, 0, csw_passed };
+	ra.status(s);
+	CHECK(ra.cached_blocks());
+
+	ra.reset();
+	CHECK_EQ(ra.cached_blocks(), 0U);
+
+	c = read10(4, 16, 8);
+	CHECK(ra.command(c) == readahead::forward);
+	CHECK(ra.next_in() == readahead::in_forward);
+}
+
+} // namespace
+
+
+int main()
+{
+	parse();
+	disabled();
+	sequential();
+	small_urbs();
+	write_invalidates();
+	failure();
+	end_of_medium();
+
+	short_device_data();
+	failed_expand();
+	other_tag();
+	reset();
+
+	return check_result("bot_readahead_test");
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <cstdio>
+
+/*
+ * Unlike assert, it is not disabled by NDEBUG and does not stop at the first failure.
+ */
+inline int check_failures;
+
+#define CHECK(expr) \
+	do { \
+		if (!(expr)) { \
+			std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+			++check_failures; \
+		} \
+	} while (false)
+
+#define CHECK_EQ(a, b) \
+	do { \
+		if (auto a_ = (a), b_ = decltype(a_)(b); a_ != b_) { \
+			std::fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed, %lld != %lld\n", \
+				     __FILE__, __LINE__, #a, #b, (long long)a_, (long long)b_); \
+			++check_failures; \
+		} \
+	} while (false)
+
+inline int check_result(const char *name)
+{
+	if (check_failures) {
+		std::fprintf(stderr, "%s: %d check(s) failed\n", name, check_failures);
+	}
+	return check_failures != 0;
+}
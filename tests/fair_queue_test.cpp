@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/fair_queue.h>
+
+namespace
+{
+
+using namespace usbip::mux;
+
+int devices[4];
+
+void table()
+{
+	static devid_table<int*, 3> t; // zeroed
+	CHECK(t.empty());
+	CHECK_EQ(t.find(0x10002), t.npos);
+	CHECK(!t.get(0x10002));
+
+	CHECK_EQ(t.insert(0x10002, &devices[0]), 0);
+	CHECK_EQ(t.insert(0x10003, &devices[1]), 1);
+	CHECK_EQ(t.insert(0x10003, &devices[2]), t.npos); // already present
+	CHECK_EQ(t.insert(0x10004, nullptr), t.npos);
+
+	CHECK_EQ(t.insert(0x20002, &devices[2]), 2);
+	CHECK_EQ(t.insert(0x20003, &devices[3]), t.npos); // full
+	CHECK_EQ(t.size(), 3);
+
+	CHECK(t.get(0x10003) == &devices[1]);
+	CHECK(t[2] == &devices[2]);
+
+	CHECK_EQ(t.erase(0x10003), 1);
+	CHECK_EQ(t.erase(0x10003), t.npos);
+	CHECK(!t.get(0x10003));
+
+	CHECK_EQ(t.insert(0x20003, &devices[3]), 1); // the freed slot is reused as a flow number
+	CHECK_EQ(t.size(), 3);
+}
+
+/*
+ * Zero devid is valid (busnum and devnum are assigned by the server), an empty slot is told by the value.
+ */
+void zero_devid()
+{
+	devid_table<int*, 2> t{};
+
+	CHECK_EQ(t.find(0), t.npos);
+	CHECK_EQ(t.insert(0, &devices[0]), 0);
+	CHECK_EQ(t.find(0), 0);
+}
+
+/*
+ * Flows with PDUs of different sizes get the same share of bytes.
+ */
+void fairness()
+{
+	constexpr UINT32 quantum = 16*1024;
+	const UINT32 sizes[] { 512, 1500, 64*1024 };
+
+	drr<4, quantum> d{};
+	for (int flow = 0; flow < 3; ++flow) {
+		d.activate(flow);
+		d.activate(flow); // ignored
+	}
+	CHECK_EQ(d.active_flows(), 3);
+
+	auto head = [&sizes] (int flow) { return flow < 3 ? sizes[flow] : 0U; };
+	UINT64 bytes[3]{};
+
+	for (int i = 0; i < 100'000; ++i) {
+		auto flow = d.next(head);
+		CHECK(flow >= 0 && flow < 3);
+		bytes[flow] += sizes[flow];
+	}
+
+	for (auto b: bytes) {
+		CHECK(b + sizes[2] + quantum >= bytes[0]);
+		CHECK(b <= bytes[0] + sizes[2] + quantum);
+	}
+}
+
+void empty_flows()
+{
+	drr<4, 1000> d{};
+	int pending[4] { 2, 0, 3, 0 };
+
+	auto head = [&pending] (int flow) { return pending[flow] ? 100U : 0U; };
+	CHECK_EQ(d.next(head), -1);
+
+	for (int flow = 0; flow < 4; ++flow) {
+		d.activate(flow);
+	}
+
+	int sent = 0;
+	for (int flow; (flow = d.next(head)) >= 0; ++sent) {
+		CHECK(pending[flow] > 0);
+		--pending[flow];
+	}
+
+	CHECK_EQ(sent, 5);
+	CHECK_EQ(d.active_flows(), 0);
+
+	pending[1] = 1;
+	d.activate(1);
+	CHECK_EQ(d.next(head), 1);
+}
+
+} // namespace
+
+
+int main()
+{
+	table();
+	zero_devid();
+	fairness();
+	empty_flows();
+
+	return check_result("fair_queue_test");
+}
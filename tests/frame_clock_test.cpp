@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/frame_clock.h>
+
+#include <initializer_list>
+#include <random>
+
+namespace
+{
+
+using namespace usbip::frame;
+
+void diff()
+{
+	CHECK_EQ(frame_diff(1, 1023, 1024), 2);
+	CHECK_EQ(frame_diff(1023, 1, 1024), -2);
+	CHECK_EQ(frame_diff(5, 5, 2048), 0);
+	CHECK_EQ(local_frame(12'345'678), 12'345U);
+}
+
+void unsynced()
+{
+	clock c{};
+
+	CHECK(!c.synced());
+	CHECK_EQ(c.modulus(), min_modulus);
+
+	c.sample(2000, 1000, 0, 10); // received before sent
+	CHECK(!c.synced());
+	CHECK_EQ(c.samples(), 0U);
+}
+
+/*
+ * Server frame is (local + 777) mod 2048, one-way delay is 3..5 ms there and 3..8 ms back.
+ */
+void sync()
+{
+	enum : UINT32 { offset = 777, mod = 2048 };
+
+	clock c{};
+	UINT64 t = 5'000'000'000ULL; // us since boot
+	std::mt19937 rnd(1);
+
+	for (int i = 0; i < 100; ++i, t += 10'000) {
+		UINT32 duration = 8*us_per_frame;
+		auto arrived = t + 3000 + rnd() % 2000;
+		auto server = static_cast<UINT32>((arrived/us_per_frame + offset) % mod);
+		auto received = arrived + duration + 3000 + rnd() % 5000;
+		c.sample(t, received, duration, server);
+	}
+
+	CHECK(c.synced());
+	CHECK_EQ(c.modulus(), UINT32(mod));
+	CHECK_EQ(c.samples(), 100U);
+
+	auto local = local_frame(t);
+	auto err = frame_diff(c.to_server(local), (local + offset) % mod, mod);
+	CHECK(err >= -1 && err <= 2);
+
+	for (UINT32 d: {0U, 5U, 500U}) {
+		auto s = c.to_server(local + d);
+		CHECK_EQ(c.to_local(s, local), local + d);
+		CHECK_EQ(c.to_local(s, local + 2*d), local + d);
+	}
+
+	CHECK_EQ(c.send_at_us(local + 10, 500), UINT64(local + 10)*us_per_frame - c.rtt_us()/2 - 500);
+	CHECK_EQ(c.send_at_us(0, 500), 0U);
+}
+
+/*
+ * The sample with minimal RTT is used until it leaves the window.
+ */
+void min_rtt()
+{
+	clock c{};
+	UINT64 t = 1'000'000;
+
+	c.sample(t, t + 2000, 0, 100);
+	auto offset = c.offset();
+	CHECK_EQ(c.rtt_us(), 2000U);
+
+	for (int i = 1; i < clock::window; ++i) {
+		t += 100'000;
+		c.sample(t, t + 20'000, 0, 100 + i); // congested, the server's frames are wrong
+		CHECK_EQ(c.offset(), offset);
+		CHECK_EQ(c.rtt_us(), 2000U);
+	}
+
+	t += 100'000;
+	c.sample(t, t + 30'000, 0, 500);
+	CHECK(c.rtt_us() == 20'000U); // the best one is gone
+}
+
+/*
+ * The modulus grows and the old samples are discarded.
+ */
+void modulus()
+{
+	clock c{};
+
+	c.sample(1000, 2000, 0, 100);
+	CHECK_EQ(c.modulus(), 1024U);
+
+	c.sample(3000, 4000, 0, 5000);
+	CHECK_EQ(c.modulus(), 8192U);
+	CHECK_EQ(c.samples(), 2U);
+	CHECK_EQ(c.to_server(local_frame(3500)), 5000U); // the first sample is not used
+}
+
+} // namespace
+
+
+int main()
+{
+	diff();
+	unsynced();
+	sync();
+	min_rtt();
+	modulus();
+
+	return check_result("frame_clock_test");
+}
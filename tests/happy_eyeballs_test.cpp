@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/happy_eyeballs.h>
+
+namespace
+{
+
+using namespace usbip::he;
+
+enum { V4 = 2, V6 = 23 }; // AF_INET, AF_INET6
+using race8 = race<8>;
+
+/*
+ * Families alternate starting with the family of the first address, the order within a family is kept.
+ */
+void interleave()
+{
+	const int families[] { V6, V6, V6, V4, V4 };
+
+	race8 r;
+	r.init(families, 5);
+
+	const int expected[] { 0, 3, 1, 4, 2 };
+	UINT64 now = 0;
+
+	for (auto idx: expected) {
+		CHECK_EQ(r.next(now), idx);
+		now += connection_attempt_delay_ms;
+	}
+
+	CHECK_EQ(r.next(now), r.npos);
+	CHECK_EQ(r.wait_ms(now), r.infinite);
+}
+
+void one_family()
+{
+	const int families[] { V4, V4, V4 };
+
+	race8 r;
+	r.init(families, 3);
+
+	for (int i = 0; i < 3; ++i) {
+		CHECK_EQ(r.next(i*connection_attempt_delay_ms), i);
+	}
+}
+
+/*
+ * The next attempt is started after the delay while the previous one is in progress.
+ */
+void delay()
+{
+	const int families[] { V6, V4 };
+
+	race8 r;
+	r.init(families, 2, 300);
+
+	CHECK_EQ(r.next(1000), 0);
+	CHECK_EQ(r.inflight(), 1);
+
+	CHECK_EQ(r.next(1299), r.npos);
+	CHECK_EQ(r.wait_ms(1100), 200U);
+	CHECK_EQ(r.wait_ms(1300), 0U);
+
+	CHECK_EQ(r.next(1300), 1);
+	CHECK_EQ(r.inflight(), 2);
+}
+
+/*
+ * If all started attempts have failed, the next one is started without waiting for the delay.
+ */
+void fallback_on_failure()
+{
+	const int families[] { V6, V4, V6 };
+
+	race8 r;
+	r.init(families, 3);
+
+	CHECK_EQ(r.next(0), 0);
+	r.failed(10);
+
+	CHECK_EQ(r.wait_ms(10), 0U);
+	CHECK_EQ(r.next(10), 1);
+
+	CHECK_EQ(r.next(20), r.npos); // one attempt is still in progress
+	CHECK_EQ(r.wait_ms(20), connection_attempt_delay_ms - 10);
+}
+
+void exhausted()
+{
+	const int families[] { V6, V4 };
+
+	race8 r;
+	r.init(families, 2);
+
+	CHECK_EQ(r.next(0), 0);
+	CHECK_EQ(r.next(connection_attempt_delay_ms), 1);
+	CHECK(!r.exhausted());
+
+	r.failed(300);
+	CHECK(!r.exhausted());
+
+	r.failed(400);
+	CHECK(r.exhausted());
+	CHECK_EQ(r.winner(), r.npos);
+	CHECK_EQ(r.next(400), r.npos);
+}
+
+/*
+ * The first success wins even if an earlier attempt is still in progress, later successes lose.
+ */
+void winner()
+{
+	const int families[] { V6, V4, V6 };
+
+	race8 r;
+	r.init(families, 3);
+
+	CHECK_EQ(r.next(0), 0);
+	CHECK_EQ(r.next(connection_attempt_delay_ms), 1);
+
+	CHECK(r.succeeded(1));
+	CHECK_EQ(r.winner(), 1);
+
+	CHECK(!r.succeeded(0));
+	CHECK_EQ(r.winner(), 1);
+	CHECK_EQ(r.inflight(), 0);
+
+	CHECK_EQ(r.next(1000), r.npos); // the third address is not tried
+	CHECK_EQ(r.wait_ms(1000), r.infinite);
+	CHECK(!r.exhausted());
+}
+
+void clamp_delay()
+{
+	const int families[] { V4, V4 };
+
+	race8 r;
+	r.init(families, 2, 1);
+
+	CHECK_EQ(r.next(0), 0);
+	CHECK_EQ(r.wait_ms(0), UINT32(min_connection_attempt_delay_ms));
+
+	r.init(families, 2, 60'000);
+
+	CHECK_EQ(r.next(0), 0);
+	CHECK_EQ(r.wait_ms(0), UINT32(max_connection_attempt_delay_ms));
+}
+
+void truncate()
+{
+	const int families[] { V4, V4, V4, V4 };
+
+	race<2> r;
+	r.init(families, 4);
+
+	CHECK_EQ(r.size(), 2);
+	CHECK_EQ(r.next(0), 0);
+	r.failed(0);
+	CHECK_EQ(r.next(0), 1);
+	r.failed(0);
+	CHECK(r.exhausted());
+}
+
+} // namespace
+
+
+int main()
+{
+	interleave();
+	one_family();
+	delay();
+	fallback_on_failure();
+	exhausted();
+	winner();
+	clamp_delay();
+	truncate();
+
+	return check_result("happy_eyeballs_test");
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/heartbeat.h>
+
+#include <initializer_list>
+
+namespace
+{
+
+using namespace usbip::hb;
+
+void disabled()
+{
+	static monitor m; // zeroed
+	CHECK(!m.enabled());
+	CHECK(m.tick(1'000'000, true) == action::none);
+
+	m.configure(0, 3);
+	CHECK(!m.enabled());
+	CHECK(m.tick(2'000'000, true) == action::none);
+}
+
+void configure()
+{
+	monitor m{};
+
+	m.configure(10, 0);
+	CHECK_EQ(m.interval_ms(), UINT32(min_interval_ms));
+	CHECK_EQ(m.max_misses(), default_max_misses);
+	CHECK_EQ(m.period_ms(), UINT32(min_period_ms));
+
+	m.configure(1000, 5);
+	CHECK_EQ(m.interval_ms(), 1000U);
+	CHECK_EQ(m.max_misses(), 5);
+	CHECK_EQ(m.period_ms(), 500U);
+}
+
+/*
+ * No probes while the peer keeps sending or nothing is outstanding.
+ */
+void no_probes()
+{
+	monitor m{};
+	m.configure(1000, 3);
+
+	UINT64 t = 5000;
+	m.received(t);
+
+	for (auto end = t + 10'000; t < end; t += m.period_ms()) {
+		m.received(t);
+		CHECK(m.tick(t, true) == action::none);
+	}
+
+	for (auto end = t + 10'000; t < end; t += m.period_ms()) {
+		CHECK(m.tick(t, false) == action::none);
+	}
+}
+
+/*
+ * An answered probe resets the count of misses.
+ */
+void answered()
+{
+	monitor m{};
+	m.configure(1000, 2);
+	m.received(0);
+
+	CHECK(m.tick(999, true) == action::none);
+	CHECK(m.tick(1000, true) == action::probe);
+	CHECK(m.tick(1500, true) == action::none); // waiting for the reply
+
+	CHECK(m.tick(2000, true) == action::probe); // the first miss
+	CHECK_EQ(m.misses(), 1);
+
+	m.received(2100); // late reply
+	CHECK(m.tick(2500, true) == action::none);
+	CHECK_EQ(m.misses(), 0);
+}
+
+/*
+ * A dead peer is detected in (max_misses + 1)*interval_ms + period_ms() at most.
+ */
+void dead()
+{
+	for (UINT32 interval: { 100U, 250U, 1000U, 5000U }) {
+		for (int misses: { 1, 3, 5 }) {
+
+			monitor m{};
+			m.configure(interval, misses);
+
+			auto p = m.period_ms();
+			UINT64 t = 123'456;
+			m.received(t);
+
+			auto last_recv = t;
+			int probes = 0;
+
+			for (auto end = t + 20*interval; t < end; t += p) { // the peer answers every probe
+				if (auto a = m.tick(t, true); a == action::probe) {
+					++probes;
+					m.received(last_recv = t + 1);
+				} else {
+					CHECK(a == action::none);
+				}
+			}
+			CHECK(probes > 0);
+			CHECK_EQ(m.misses(), 0);
+
+			action a{};
+
+			for (int i = 0; i < 1000 && (a = m.tick(t, true)) != action::dead; ++i, t += p);
+
+			CHECK(a == action::dead);
+			CHECK(t - last_recv <= (misses + 1ULL)*interval + p);
+		}
+	}
+}
+
+} // namespace
+
+
+int main()
+{
+	disabled();
+	configure();
+	no_probes();
+	answered();
+	dead();
+
+	return check_result("heartbeat_test");
+}
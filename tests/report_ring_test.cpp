@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/report_ring.h>
+
+#include <cstring>
+
+namespace
+{
+
+using namespace usbip;
+
+void no_slots()
+{
+	static report_ring r; // zeroed
+	CHECK(r.empty());
+
+	UINT32 len = 3;
+	CHECK(!r.push(len));
+	CHECK_EQ(r.dropped(), 1U);
+	CHECK_EQ(r.pushed(), 0U);
+
+	r.pop(); // is ignored
+	CHECK(r.empty());
+}
+
+/*
+ * The oldest reports are dropped, the latest ones are kept in order.
+ */
+void overwrite()
+{
+	UINT8 buf[4*8];
+	report_ring r{};
+	r.init(buf, 8, 4);
+
+	for (UINT8 i = 0; i < 6; ++i) {
+		UINT32 len = i + 1;
+		auto p = r.push(len);
+		CHECK(p >= buf && p + len <= buf + sizeof(buf));
+		std::memset(p, i, len);
+	}
+
+	CHECK_EQ(r.size(), 4);
+	CHECK_EQ(r.pushed(), 6U);
+	CHECK_EQ(r.dropped(), 2U);
+
+	for (UINT8 i = 2; i < 6; ++i) {
+		UINT32 len;
+		auto p = r.front(len);
+		CHECK_EQ(len, i + 1U);
+		CHECK_EQ(p[0], i);
+		CHECK_EQ(p[len - 1], i);
+		r.pop();
+	}
+
+	CHECK(r.empty());
+}
+
+void truncate()
+{
+	UINT8 buf[2*8];
+	report_ring r{};
+	r.init(buf, 8, 2);
+
+	UINT32 len = 100;
+	CHECK(r.push(len));
+	CHECK_EQ(len, 8U);
+
+	UINT32 front_len;
+	r.front(front_len);
+	CHECK_EQ(front_len, 8U);
+}
+
+void max_slots()
+{
+	UINT8 buf[report_ring::max_slots*4];
+	report_ring r{};
+	r.init(buf, 4, 100);
+
+	for (int i = 0; i < 100; ++i) {
+		UINT32 len = 4;
+		r.push(len);
+	}
+
+	CHECK_EQ(r.size(), report_ring::max_slots);
+	CHECK_EQ(r.dropped(), 100U - report_ring::max_slots);
+}
+
+/*
+ * Push and pop interleave, the head wraps around many times.
+ */
+void fifo()
+{
+	UINT8 buf[3*4];
+	report_ring r{};
+	r.init(buf, 4, 3);
+
+	UINT8 next_push = 0;
+	UINT8 next_pop = 0;
+
+	for (int round = 0; round < 100; ++round) {
+		for (int i = 0; i < 1 + round % 3; ++i) {
+			UINT32 len = 1;
+			*r.push(len) = next_push++;
+		}
+
+		for (int i = 0; i < 1 + (round + 1) % 3 && !r.empty(); ++i) {
+			UINT32 len;
+			CHECK_EQ(*r.front(len), next_pop++);
+			r.pop();
+		}
+	}
+
+	CHECK(!r.dropped());
+
+	r.clear();
+	CHECK(r.empty());
+	CHECK_EQ(r.slot_size(), 4U);
+}
+
+} // namespace
+
+
+int main()
+{
+	no_slots();
+	overwrite();
+	truncate();
+	max_slots();
+	fifo();
+
+	return check_result("report_ring_test");
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/resolver_cache.h>
+
+#include <string_view>
+
+namespace
+{
+
+using namespace usbip::dns;
+using std::wstring_view;
+
+using cache4 = cache<wchar_t, int, 4>;
+
+auto find(cache4 &c, wstring_view node, wstring_view service, UINT64 now)
+{
+	return c.find(node.data(), int(node.size()), service.data(), int(service.size()), now);
+}
+
+auto insert(cache4 &c, wstring_view node, wstring_view service, int error, UINT64 now)
+{
+	return c.insert(node.data(), int(node.size()), service.data(), int(service.size()), error, now);
+}
+
+void positive_ttl()
+{
+	static cache4 c; // zeroed
+	CHECK_EQ(c.size(0), 0);
+	CHECK(!find(c, L"server", L"3240", 0));
+
+	auto e = insert(c, L"server", L"3240", 0, 1000);
+	CHECK(e);
+	CHECK(c.add(*e, 1));
+	CHECK(c.add(*e, 2));
+
+	auto f = find(c, L"server", L"3240", 1000 + positive_ttl_ms - 1);
+	CHECK(f);
+	CHECK_EQ(f->error, 0);
+	CHECK_EQ(f->cnt, 2);
+	CHECK_EQ(f->addrs[1], 2);
+
+	CHECK(!find(c, L"server", L"3240", 1000 + positive_ttl_ms));
+	CHECK_EQ(c.size(1000 + positive_ttl_ms), 0);
+
+	auto &n = c.get_counters();
+	CHECK_EQ(n.hits, 1U);
+	CHECK_EQ(n.misses, 2U);
+}
+
+/*
+ * A failure expires much earlier than a success, so a fixed resolver is used soon.
+ */
+void negative_ttl()
+{
+	cache4 c{};
+
+	auto e = insert(c, L"nohost", L"3240", 11001, 0); // WSAHOST_NOT_FOUND
+	CHECK(e);
+
+	auto f = find(c, L"nohost", L"3240", negative_ttl_ms - 1);
+	CHECK(f);
+	CHECK_EQ(f->error, 11001);
+	CHECK_EQ(f->cnt, 0);
+	CHECK_EQ(c.get_counters().negative_hits, 1U);
+
+	CHECK(!find(c, L"nohost", L"3240", negative_ttl_ms));
+
+	e = insert(c, L"nohost", L"3240", 0, negative_ttl_ms); // resolved later
+	CHECK(c.add(*e, 7));
+
+	f = find(c, L"nohost", L"3240", 2*negative_ttl_ms);
+	CHECK(f);
+	CHECK_EQ(f->error, 0);
+	CHECK_EQ(c.size(2*negative_ttl_ms), 1);
+}
+
+void keys()
+{
+	cache4 c{};
+	insert(c, L"Server.Example", L"3240", 0, 0);
+
+	CHECK(find(c, L"server.example", L"3240", 1)); // DNS names are case-insensitive
+	CHECK(!find(c, L"server.example", L"3241", 1));
+	CHECK(!find(c, L"server", L"3240", 1));
+
+	wchar_t node[max_key_len]{};
+	for (auto &ch: node) {
+		ch = L'a';
+	}
+
+	CHECK(!c.insert(node, max_key_len, L"3240", 4, 0, 0)); // does not fit
+	CHECK(!c.insert(node, 0, L"3240", 4, 0, 0));
+	CHECK(c.insert(node, max_key_len - 1, L"", 0, 0, 0));
+}
+
+/*
+ * Expired slots are reused first, then the least recently used live entry is evicted.
+ */
+void eviction()
+{
+	cache4 c{};
+
+	insert(c, L"a", L"1", 0, 0);
+	insert(c, L"b", L"1", 0, 10);
+	insert(c, L"c", L"1", 0, 20);
+	insert(c, L"d", L"1", 11001, 30); // expires at 30 + negative_ttl_ms
+
+	find(c, L"a", L"1", 40); // "b" is the least recently used now
+
+	insert(c, L"e", L"1", 0, 50);
+	CHECK_EQ(c.get_counters().evictions, 1U);
+	CHECK(find(c, L"a", L"1", 60));
+	CHECK(!find(c, L"b", L"1", 60));
+
+	const UINT64 later = 30 + negative_ttl_ms;
+	insert(c, L"f", L"1", 0, later); // takes the slot of expired "d"
+
+	CHECK_EQ(c.get_counters().evictions, 1U);
+	CHECK(find(c, L"a", L"1", later));
+	CHECK(find(c, L"c", L"1", later));
+	CHECK(find(c, L"e", L"1", later));
+	CHECK(find(c, L"f", L"1", later));
+}
+
+void reinsert_and_flush()
+{
+	cache4 c{};
+
+	auto e = insert(c, L"srv", L"3240", 0, 0);
+	for (int i = 0; i < max_addresses; ++i) {
+		CHECK(c.add(*e, i));
+	}
+	CHECK(!c.add(*e, max_addresses));
+
+	e = insert(c, L"srv", L"3240", 0, 100); // the same slot, the addresses are replaced
+	CHECK_EQ(e->cnt, 0);
+	CHECK_EQ(c.size(100), 1);
+
+	c.flush();
+	CHECK_EQ(c.size(100), 0);
+	CHECK(!find(c, L"srv", L"3240", 100));
+}
+
+} // namespace
+
+
+int main()
+{
+	positive_ttl();
+	negative_ttl();
+	keys();
+	eviction();
+	reinsert_and_flush();
+
+	return check_result("resolver_cache_test");
+}
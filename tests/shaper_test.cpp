@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "check.h"
+#include <usbip/shaper.h>
+
+#include <initializer_list>
+#include <utility>
+
+namespace
+{
+
+using namespace usbip::mux;
+
+void unlimited()
+{
+	token_bucket b{};
+
+	CHECK(!b.rate());
+	CHECK(b.ready(0));
+	b.consume(1'000'000);
+	CHECK(b.ready(0));
+	CHECK_EQ(b.wait_ms(), 0U);
+
+	b.configure(0, 0, 0);
+	CHECK_EQ(b.burst(), token_bucket::default_burst);
+}
+
+void debt()
+{
+	token_bucket b{};
+	b.configure(1000, 500, 0); // bytes per second
+
+	CHECK(b.ready(0));
+	b.consume(600); // larger than the burst, goes into debt
+	CHECK(!b.ready(0));
+
+	auto ms = b.wait_ms();
+	CHECK_EQ(ms, 102U);
+
+	auto early = b;
+	CHECK(!early.ready(ms - 2));
+	CHECK(b.ready(ms));
+}
+
+void refill()
+{
+	token_bucket b{};
+	b.configure(1000, 500, 0);
+
+	b.consume(500);
+	CHECK(!b.ready(0));
+	CHECK(b.ready(1'000'000)); // tokens do not exceed the burst
+
+	b.consume(500);
+	CHECK(!b.ready(1'000'000));
+}
+
+/*
+ * Frequent polling must not lose fractions of a byte.
+ */
+void slow_rate()
+{
+	token_bucket b{};
+	b.configure(100, 100, 0);
+	b.consume(100);
+
+	UINT64 now = 0;
+	while (!b.ready(++now));
+
+	CHECK_EQ(now, 10U);
+}
+
+struct queues
+{
+	UINT32 size[pclass_cnt][4];
+	int pending[pclass_cnt][4];
+
+	auto head_size() 
+	{
+		return [this] (pclass cls, int flow) 
+		{ 
+			auto c = static_cast<int>(cls);
+			return pending[c][flow] ? size[c][flow] : 0U; 
+		};
+	}
+
+	template<typename S>
+	auto next(S &s, UINT64 now)
+	{
+		auto d = s.next(head_size(), now);
+		if (d.flow >= 0) {
+			auto &n = pending[static_cast<int>(d.cls)][d.flow];
+			CHECK(n > 0);
+			--n;
+		}
+		return d;
+	}
+};
+
+void priority()
+{
+	static scheduler<4, 1000> s;
+	queues q{};
+
+	q.size[int(pclass::bulk)][0] = 100;
+	q.pending[int(pclass::bulk)][0] = 2;
+	s.activate(0, pclass::bulk);
+
+	q.size[int(pclass::isoch)][1] = 100;
+	q.pending[int(pclass::isoch)][1] = 2;
+	s.activate(1, pclass::isoch);
+
+	q.size[int(pclass::interactive)][2] = 8;
+	q.pending[int(pclass::interactive)][2] = 2;
+	s.activate(2, pclass::interactive);
+
+	CHECK_EQ(s.active_flows(), 3);
+
+	for (auto [flow, cls]: { std::pair{2, pclass::interactive}, {2, pclass::interactive}, 
+				 {1, pclass::isoch}, {1, pclass::isoch}, {0, pclass::bulk}, {0, pclass::bulk} }) {
+		auto d = q.next(s, 0);
+		CHECK_EQ(d.flow, flow);
+		CHECK(d.cls == cls);
+	}
+
+	CHECK_EQ(q.next(s, 0).flow, -1);
+	CHECK_EQ(s.active_flows(), 0);
+	CHECK_EQ(s.wait_ms(), s.infinite);
+}
+
+void interactive_not_throttled()
+{
+	static scheduler<4, 1000> s;
+	s.link_bucket().configure(1000, 100, 0);
+	s.flow_bucket(0).configure(1000, 100, 0);
+
+	queues q{};
+	q.size[int(pclass::interactive)][0] = 64;
+	q.pending[int(pclass::interactive)][0] = 10;
+	s.activate(0, pclass::interactive);
+
+	for (int i = 0; i < 10; ++i) {
+		CHECK_EQ(q.next(s, 0).flow, 0);
+	}
+
+	CHECK(!s.throttled());
+	CHECK(!s.link_bucket().ready(0)); // but the tokens of the connection are consumed
+}
+
+void throttling()
+{
+	static scheduler<4, 1000> s;
+	s.flow_bucket(0).configure(1000, 1000, 0);
+
+	queues q{};
+	for (int flow: {0, 1}) {
+		q.size[int(pclass::bulk)][flow] = 500;
+		q.pending[int(pclass::bulk)][flow] = 100;
+		s.activate(flow, pclass::bulk);
+	}
+
+	int sent[2]{};
+	for (int i = 0; i < 20; ++i) {
+		auto d = q.next(s, 0);
+		CHECK(d.flow == 0 || d.flow == 1);
+		++sent[d.flow];
+	}
+
+	CHECK_EQ(sent[0], 2); // the burst, then the flow is throttled
+	CHECK_EQ(sent[1], 18); // is unlimited and is not delayed by flow 0
+
+	CHECK(s.throttled());
+	CHECK_EQ(s.throttled_cnt(), 1U);
+
+	auto ms = s.wait_ms();
+	CHECK(ms > 0 && ms != s.infinite);
+
+	q.pending[int(pclass::bulk)][1] = 0;
+	CHECK_EQ(q.next(s, ms - 2).flow, -1);
+	CHECK_EQ(q.next(s, ms).flow, 0); // released
+	CHECK(!s.throttled());
+}
+
+/*
+ * The connection bucket throttles all flows except interactive ones.
+ */
+void link_limit()
+{
+	static scheduler<4, 1000> s;
+	s.link_bucket().configure(1000, 1000, 0);
+
+	queues q{};
+	for (int flow: {0, 1}) {
+		q.size[int(pclass::isoch)][flow] = 400;
+		q.pending[int(pclass::isoch)][flow] = 100;
+		s.activate(flow, pclass::isoch);
+	}
+
+	int cnt = 0;
+	while (q.next(s, 0).flow >= 0) {
+		++cnt;
+	}
+
+	CHECK_EQ(cnt, 3); // the third one goes into debt
+	CHECK(s.throttled());
+
+	auto ms = s.wait_ms();
+	CHECK_EQ(ms, 202U);
+	CHECK(q.next(s, ms).flow >= 0);
+}
+
+} // namespace
+
+
+int main()
+{
+	unlimited();
+	debt();
+	refill();
+	slow_rate();
+
+	priority();
+	interactive_not_throttled();
+	throttling();
+	link_limit();
+
+	return check_result("shaper_test");
+}
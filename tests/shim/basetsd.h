@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Stand-in for the Windows SDK header to build the tests with any C++20 compiler.
+ *
+ * The headers of include/usbip that are tested here are shared by the driver and libusbip,
+ * they must not depend on the kernel, WinSock or WSK. Basic types and SAL annotations are all they use.
+ */
+
+#include <cstdint>
+#include <cstddef>
+
+using INT8 = std::int8_t;
+using INT16 = std::int16_t;
+using INT32 = std::int32_t;
+using INT64 = std::int64_t;
+
+using UINT8 = std::uint8_t;
+using UINT16 = std::uint16_t;
+using UINT32 = std::uint32_t;
+using UINT64 = std::uint64_t;
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _Out_writes_(size)
+#define _Inout_updates_bytes_(size)
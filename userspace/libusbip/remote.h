@@ -77,6 +77,25 @@ enum connect_flags_t : unsigned long {
  */
 USBIP_API Socket connect(_In_ const char *hostname, _In_ const char *service, _In_ unsigned long options);
 
+/*
+ * Counters of a cache of resolved host names.
+ * Positive entries live for a minute, failures of name resolution are cached for five seconds.
+ */
+struct resolver_cache_stats
+{
+        int entries{}; // that are not expired
+        UINT64 hits{};
+        UINT64 negative_hits{}; // cached failures of name resolution
+        UINT64 misses{};
+        UINT64 evictions{};
+};
+
+/**
+ * The cache is used by connect(), it is per process.
+ * @param flush remove all entries after the counters are read
+ */
+USBIP_API resolver_cache_stats get_resolver_cache(_In_ bool flush = false);
+
 /**
  * @param idx zero-based index of usb device
  * @param dev usb device
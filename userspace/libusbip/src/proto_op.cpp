@@ -45,3 +45,17 @@ void usbip::byteswap(op_devlist_reply &r)
 {
         bswap(r.ndev);
 }
+
+void usbip::byteswap(op_extensions_request &r)
+{
+        bswap(r.features);
+        bswap(r.udp_port);
+        bswap(r.session);
+}
+
+void usbip::byteswap(op_extensions_reply &r)
+{
+        bswap(r.features);
+        bswap(r.udp_port);
+        bswap(r.session);
+}
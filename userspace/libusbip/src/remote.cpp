@@ -12,8 +12,12 @@
 #include "output.h"
 
 #include <usbip\proto_op.h>
+#include <usbip\happy_eyeballs.h>
+#include <usbip\resolver_cache.h>
 
 #include <chrono>
+#include <mutex>
+#include <vector>
 
 #include <ws2tcpip.h>
 #include <mstcpip.h>
@@ -24,6 +28,8 @@ namespace
 
 using namespace usbip;
 
+using addresses = std::vector<SOCKADDR_INET>;
+
 /*
  * @see inet_ntop 
  */
@@ -65,11 +71,6 @@ inline auto set_keepalive(_Inout_ set_last_error &last, _In_ SOCKET s)
 	return do_setsockopt(last, s, SOL_SOCKET, SO_KEEPALIVE, true);
 }
 
-inline auto set_ipv6only(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ bool ipv6only)
-{
-	return do_setsockopt(last, s, IPPROTO_IPV6, IPV6_V6ONLY, ipv6only);
-}
-
 auto set_nonblock(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ bool nonblock)
 {
 	u_long mode = nonblock;
@@ -234,17 +235,10 @@ auto as_usb_device(_In_ const usbip_usb_device &d)
 }
 
 /*
- * WSAEnumNetworkEvents is not used because SOCKET is new,
- * WSAEventSelect here is the first call for it.
+ * SOCKET and WSAEVENT are new, WSAEventSelect here is the first call for them.
  */
 auto prepare_event(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ WSAEVENT evt)
 {
-	if (!WSAResetEvent(evt)) { // is reused in the loop
-		last.error = WSAGetLastError();
-		libusbip::output("WSAResetEvent error {}", last.error);
-		return false;
-	}
-
 	if (WSAEventSelect(s, evt, FD_CONNECT)) { // sets socket to nonblocking mode
 		last.error = WSAGetLastError();
 		libusbip::output("WSAEventSelect(FD_CONNECT) error {}", last.error);
@@ -254,43 +248,160 @@ auto prepare_event(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ WSAEVENT ev
 	return true;
 }
 
-auto try_connect(_In_ SOCKET s, _In_ WSAEVENT evt, _In_ const sockaddr &addr, _In_ DWORD len)
+/*
+ * @return zero if connection is in progress or established
+ */
+auto start_connect(_In_ SOCKET s, _In_ const SOCKADDR_INET &addr)
 {
-	libusbip::output(L"connecting to {}", address_to_string(addr, len));
+	auto &sa = reinterpret_cast<const sockaddr&>(addr);
+	int len = addr.si_family == AF_INET6 ? sizeof(addr.Ipv6) : sizeof(addr.Ipv4);
+
+	libusbip::output(L"connecting to {}", address_to_string(sa, len));
+
+	auto err = connect(s, &sa, len) ? WSAGetLastError() : 0;
 
-	if (auto err = connect(s, &addr, len) ? WSAGetLastError() : 0; !err) {
-		return 0;
-	} else if (err != WSAEWOULDBLOCK) {
+	if (err == WSAEWOULDBLOCK) {
+		err = 0;
+	} else if (err) {
 		libusbip::output("connect error {}", err);
-		return err;
 	}
 
+	return err;
+}
+
+auto get_connect_result(_In_ SOCKET s, _In_ WSAEVENT evt)
+{
 	int err;
 
-	switch (auto ret = WSAWaitForMultipleEvents(1, &evt, false, WSA_INFINITE, true)) {
-	case WSA_WAIT_EVENT_0:
-		if (WSANETWORKEVENTS events; WSAEnumNetworkEvents(s, evt, &events)) { // resets event if success
-			err = WSAGetLastError();
-			libusbip::output("WSAEnumNetworkEvents error {}", err);
-		} else {
-			assert(events.lNetworkEvents & FD_CONNECT);
-			err = events.iErrorCode[FD_CONNECT_BIT];
+	if (WSANETWORKEVENTS events; WSAEnumNetworkEvents(s, evt, &events)) { // resets event if success
+		err = WSAGetLastError();
+		libusbip::output("WSAEnumNetworkEvents error {}", err);
+	} else {
+		assert(events.lNetworkEvents & FD_CONNECT);
+		if (err = events.iErrorCode[FD_CONNECT_BIT]; err) {
+			libusbip::output("connect error {}", err);
 		}
-		break;
-	case WSA_WAIT_IO_COMPLETION: // see QueueUserAPC
-		libusbip::output("connect cancelled");
-		err = ERROR_CANCELLED;
-		break;
-	default:
-		assert(ret == WSA_WAIT_FAILED);
+	}
 
-		err = WSAGetLastError();
-		assert(err != ERROR_CANCELLED);
+	return err;
+}
 
-		libusbip::output("WSAWaitForMultipleEvents -> {}, error {}", ret, err);
+/*
+ * Cancel the association and selection of network events, restore blocking mode.
+ */
+auto finish_connect(_Inout_ set_last_error &last, _In_ SOCKET s)
+{
+	if (WSAEventSelect(s, WSA_INVALID_EVENT, 0)) {
+		last.error = WSAGetLastError();
+		libusbip::output("WSAEventSelect(0) error {}", last.error);
+		return false;
 	}
 
-	return err;
+	return set_nonblock(last, s, false);
+}
+
+/*
+ * Connection attempts to the resolved addresses are raced, see RFC 8305 and usbip::he::race.
+ * The first established connection is returned, the others are closed.
+ * @param alertable if true, the call is cancelled by an APC and last.error is ERROR_CANCELLED
+ */
+auto race_connect(_Inout_ set_last_error &last, _In_ const addresses &addrs, _In_ bool alertable)
+{
+	enum { N = dns::max_addresses };
+	static_assert(N <= WSA_MAXIMUM_WAIT_EVENTS);
+
+	int families[N];
+	auto cnt = static_cast<int>(std::min(addrs.size(), size_t(N)));
+
+	for (int i = 0; i < cnt; ++i) {
+		families[i] = addrs[i].si_family;
+	}
+
+	he::race<N> race;
+	race.init(families, cnt);
+
+	Socket socks[N];
+	WSAEvent events[N];
+	bool inflight[N]{};
+
+	for (;;) {
+		for (int i; (i = race.next(GetTickCount64())) != race.npos; ) {
+
+			auto &addr = addrs[i];
+			socks[i].reset(socket(addr.si_family, SOCK_STREAM, IPPROTO_TCP));
+
+			if (!socks[i]) {
+				last.error = WSAGetLastError();
+				libusbip::output("socket(family={}) error {}", addr.si_family, last.error);
+			} else if (events[i].reset(WSACreateEvent()); !events[i]) {
+				last.error = WSAGetLastError();
+				libusbip::output("WSACreateEvent error {}", last.error);
+			} else if (auto ok = set_options(last, socks[i].get()) && prepare_event(last, socks[i].get(), events[i].get()); !ok) {
+				//
+			} else if (auto err = start_connect(socks[i].get(), addr)) {
+				last.error = err;
+			} else {
+				inflight[i] = true;
+				continue;
+			}
+
+			socks[i].close();
+			race.failed(GetTickCount64());
+		}
+
+		if (race.exhausted()) {
+			break;
+		}
+
+		WSAEVENT wait[N];
+		int index[N];
+		DWORD n = 0;
+
+		for (int i = 0; i < cnt; ++i) {
+			if (inflight[i]) {
+				wait[n] = events[i].get();
+				index[n++] = i;
+			}
+		}
+
+		assert(n); // otherwise race.next() has started an attempt or race.exhausted()
+		auto timeout = race.wait_ms(GetTickCount64());
+
+		auto ret = WSAWaitForMultipleEvents(n, wait, false, timeout == race.infinite ? WSA_INFINITE : timeout, alertable);
+
+		if (ret == WSA_WAIT_TIMEOUT) {
+			continue; // start next attempt
+		} else if (ret == WSA_WAIT_IO_COMPLETION) { // see QueueUserAPC
+			libusbip::output("connect cancelled");
+			last.error = ERROR_CANCELLED;
+			break;
+		} else if (ret >= WSA_WAIT_EVENT_0 + n) {
+			assert(ret == WSA_WAIT_FAILED);
+			last.error = WSAGetLastError();
+			assert(last.error != ERROR_CANCELLED);
+			libusbip::output("WSAWaitForMultipleEvents -> {}, error {}", ret, last.error);
+			break;
+		}
+
+		auto i = index[ret - WSA_WAIT_EVENT_0];
+		inflight[i] = false;
+
+		if (auto err = get_connect_result(socks[i].get(), events[i].get())) {
+			last.error = err;
+			socks[i].close();
+			race.failed(GetTickCount64());
+		} else {
+			[[maybe_unused]] auto won = race.succeeded(i);
+			assert(won); // the loop exits after the first success
+
+			if (finish_connect(last, socks[i].get())) {
+				return std::move(socks[i]); // attempts in progress are closed by destructors
+			}
+			break;
+		}
+	}
+
+	return Socket();
 }
 
 INT wait_for_resolve(_Inout_ OVERLAPPED &ovlp, _In_opt_ HANDLE cancel, _In_ bool alertable)
@@ -323,7 +434,8 @@ INT wait_for_resolve(_Inout_ OVERLAPPED &ovlp, _In_opt_ HANDLE cancel, _In_ bool
 /*
  * Numeric IP addresses like "XXX.XXX.XXX.XXX" are resolved instantly. 
  */
-auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const char *service)
+auto get_addrinfo(
+	_Inout_ set_last_error &last, _In_ const std::wstring &host, _In_ const std::wstring &svc, _In_ bool alertable)
 {
 	std::unique_ptr<ADDRINFOEX, decltype(FreeAddrInfoEx)&> ptr(nullptr, FreeAddrInfoEx);
 
@@ -336,21 +448,18 @@ auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const
 
 	OVERLAPPED ovlp { .hEvent = evt.get() };
 
-	auto host = utf8_to_wchar(hostname);
-	auto svc = utf8_to_wchar(service);
-
 	const ADDRINFOEX hints{ .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
 	ADDRINFOEX *result{};
 	HANDLE cancel{};
 
-	libusbip::output("resolving {}:{}", hostname, service);
+	libusbip::output(L"resolving {}:{}", host, svc);
 
 	last.error = GetAddrInfoEx(host.c_str(), svc.c_str(), NS_ALL, nullptr, 
 				   &hints, &result, nullptr, &ovlp, nullptr, &cancel);
 
 	switch (last.error) {
 	case WSA_IO_PENDING:
-		if (last.error = wait_for_resolve(ovlp, cancel, true); last.error) {
+		if (last.error = wait_for_resolve(ovlp, cancel, alertable); last.error) {
 			break;
 		}
 		[[fallthrough]];
@@ -364,105 +473,122 @@ auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const
 	return ptr;
 }
 
-inline auto connect_by_name(_In_ SOCKET s, _In_ LPCWSTR hostname, _In_ _In_ LPCWSTR service) noexcept
+/*
+ * Per process, see get_resolver_cache.
+ */
+struct resolver_cache
 {
-	return WSAConnectByName(s, const_cast<wchar_t*>(hostname), const_cast<wchar_t*>(service), 
-				nullptr, nullptr, // LocalAddress
-				nullptr, nullptr, // RemoteAddress
-				nullptr, nullptr);
-}
+	std::mutex mtx;
+	dns::cache<wchar_t, SOCKADDR_INET, 16> cache;
+};
 
-} // namespace
-
-
-const char* usbip::get_tcp_port() noexcept
+auto& get_cache()
 {
-	return tcp_port;
+	static resolver_cache c;
+	return c;
 }
 
 /*
- * QueueUserAPC() does not terminate connect/WSAConnectByName.
+ * Only definite answers are cached, WSATRY_AGAIN, cancellation, etc. are not.
  */
-auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Socket
+constexpr auto is_cacheable(_In_ int err)
+{
+	return !err || err == WSAHOST_NOT_FOUND || err == WSANO_DATA;
+}
+
+auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const char *service, _In_ bool alertable)
 {
 	auto host = utf8_to_wchar(hostname);
 	auto svc = utf8_to_wchar(service);
 
-	set_last_error last(NO_ERROR); // restore after sock.close()
-	Socket sock;
-
-	for (auto family: {AF_INET, AF_INET6}) {
+	auto host_len = static_cast<int>(host.size());
+	auto svc_len = static_cast<int>(svc.size());
 
-		sock.reset(socket(family, SOCK_STREAM, 0));
+	auto &c = get_cache();
+	addresses v;
 
-		if (!sock) {
-			last.error = WSAGetLastError();
-			libusbip::output("socket(family={}) error {}", family, last.error);
-		} else if (family == AF_INET6 && !set_ipv6only(last, sock.get(), false)) {
-			//
-		} else if (!set_options(last, sock.get())) {
-			//
-		} else if (!connect_by_name(sock.get(), host.c_str(), svc.c_str())) {
-			last.error = WSAGetLastError();
-			libusbip::output("WSAConnectByName(family={}) error {}", family, last.error);
-			break; // it makes no sense to try next family
-		} else if (setsockopt(sock.get(), SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, nullptr, 0)) {
-			last.error = WSAGetLastError();
-			libusbip::output("setsockopt(SO_UPDATE_CONNECT_CONTEXT) error {}", last.error);
-			break;
+	if (std::lock_guard lck(c.mtx); 
+	    auto e = c.cache.find(host.data(), host_len, svc.data(), svc_len, GetTickCount64())) {
+		if (last.error = e->error; last.error) {
+			libusbip::output("{}:{} -> cached error {}", hostname, service, last.error);
 		} else {
-			return sock;
+			v.assign(e->addrs, e->addrs + e->cnt);
+		}
+		return v;
+	}
+
+	auto ai = get_addrinfo(last, host, svc, alertable);
+
+	for (auto r = ai.get(); r; r = r->ai_next) {
+		if (SOCKADDR_INET addr{}; r->ai_addrlen <= sizeof(addr)) {
+			memcpy(&addr, r->ai_addr, r->ai_addrlen);
+			v.push_back(addr);
 		}
 	}
 
-	sock.close();
-	return sock;
+	if (is_cacheable(last.error)) {
+		std::lock_guard lck(c.mtx);
+
+		if (auto e = c.cache.insert(host.data(), host_len, svc.data(), svc_len, last.error, GetTickCount64())) {
+			for (auto &addr: v) {
+				if (!c.cache.add(*e, addr)) {
+					break;
+				}
+			}
+		}
+	}
+
+	return v;
+}
+
+} // namespace
+
+
+const char* usbip::get_tcp_port() noexcept
+{
+	return tcp_port;
+}
+
+auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Socket
+{
+	set_last_error last(NO_ERROR);
+
+	auto addrs = resolve(last, hostname, service, false);
+	return addrs.empty() ? Socket() : race_connect(last, addrs, false);
 }
 
 auto usbip::connect(_In_ const char *hostname, _In_ const char *service, _In_ unsigned long options) -> Socket
 {
-	set_last_error last(ERROR_INVALID_PARAMETER); // restore after sock.close()
-	Socket sock;
+	set_last_error last(ERROR_INVALID_PARAMETER);
 
 	if (options != CANCEL_BY_APC) {
-		return sock;
+		return Socket();
 	}
 
-	auto ai = resolve(last, hostname, service);
-	if (!ai) {
-		return sock;
-	}
+	auto addrs = resolve(last, hostname, service, true);
+	return addrs.empty() ? Socket() : race_connect(last, addrs, true);
+}
 
-	WSAEvent evt(WSACreateEvent());
-	if (!evt) {
-		last.error = WSAGetLastError();
-		libusbip::output("WSACreateEvent error {}", last.error);
-		return sock;
-	}
+auto usbip::get_resolver_cache(_In_ bool flush) -> resolver_cache_stats
+{
+	auto &c = get_cache();
+	std::lock_guard lck(c.mtx);
 
-	for (auto r = ai.get(); r; r = r->ai_next) {
+	auto &cnt = c.cache.get_counters();
 
-		sock.reset(socket(r->ai_family, r->ai_socktype, r->ai_protocol));
+	resolver_cache_stats r {
+		.entries = c.cache.size(GetTickCount64()),
+		.hits = cnt.hits,
+		.negative_hits = cnt.negative_hits,
+		.misses = cnt.misses,
+		.evictions = cnt.evictions,
+	};
 
-		if (!sock) {
-			last.error = WSAGetLastError();
-			libusbip::output("socket(family={}) error {}", r->ai_family, last.error);
-		} else if (auto ok = set_options(last, sock.get()) && prepare_event(last, sock.get(), evt.get()); !ok) {
-			//
-		} else if (auto err = try_connect(sock.get(), evt.get(), *r->ai_addr, static_cast<DWORD>(r->ai_addrlen))) {
-			if (last.error = err; err == ERROR_CANCELLED) {
-				break;
-			}
-		} else if (WSAEventSelect(sock.get(), WSA_INVALID_EVENT, 0)) { // cancel the association and selection of network events
-			last.error = WSAGetLastError();
-			libusbip::output("WSAEventSelect(0) error {}", last.error);
-		} else if (set_nonblock(last, sock.get(), false)) {
-			return sock;
-		}
+	if (flush) {
+		c.cache.flush();
 	}
 
-	sock.close();
-	return sock;
+	return r;
 }
 
 bool usbip::enum_exportable_devices(
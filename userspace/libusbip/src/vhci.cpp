@@ -3,6 +3,7 @@
  */
 
 #include "..\vhci.h"
+#include "..\remote.h"
 
 #include "device_speed.h"
 #include "output.h"
@@ -287,6 +288,202 @@ bool usbip::vhci::detach(_In_ HANDLE dev, _In_ int port)
         return DeviceIoControl(dev, ioctl::PLUGOUT_HARDWARE, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr);
 }
 
+bool usbip::vhci::get_resolver_cache(_In_ HANDLE dev, _Out_ resolver_cache_stats &result, _In_ bool flush)
+{
+        ioctl::resolver_cache r { .flush = flush };
+        r.size = sizeof(r);
+
+        DWORD BytesReturned{};
+        if (!DeviceIoControl(dev, ioctl::RESOLVER_CACHE, &r, sizeof(r), &r, sizeof(r), &BytesReturned, nullptr)) {
+                return false;
+        } else if (BytesReturned != sizeof(r)) {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return false;
+        }
+
+        result = {
+                .entries = r.entries,
+                .hits = r.hits,
+                .negative_hits = r.negative_hits,
+                .misses = r.misses,
+                .evictions = r.evictions,
+        };
+
+        return true;
+}
+
+bool usbip::vhci::get_connection_pool(_In_ HANDLE dev, _Out_ connection_pool_stats &result)
+{
+        ioctl::connection_pool r;
+        r.size = sizeof(r);
+
+        DWORD BytesReturned{};
+        if (!DeviceIoControl(dev, ioctl::CONNECTION_POOL, &r, sizeof(r), &r, sizeof(r), &BytesReturned, nullptr)) {
+                return false;
+        } else if (BytesReturned != sizeof(r)) {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return false;
+        }
+
+        result = {
+                .pool_size = r.pool_size,
+                .hosts = r.hosts,
+                .sockets = r.sockets,
+                .hits = r.hits,
+                .misses = r.misses,
+        };
+
+        return true;
+}
+
+bool usbip::vhci::set_heartbeat(_In_ HANDLE dev, _In_ int port, _In_ UINT32 interval_ms, _In_ int max_misses)
+{
+        ioctl::set_heartbeat r { .port = port, .interval_ms = interval_ms, .max_misses = max_misses };
+        r.size = sizeof(r);
+
+        DWORD BytesReturned{};
+        return DeviceIoControl(dev, ioctl::SET_HEARTBEAT, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr);
+}
+
+bool usbip::vhci::set_bandwidth_limit(
+        _In_ HANDLE dev, _In_ int port, _In_ UINT32 device_rate, _In_ UINT32 server_rate, _In_ UINT32 burst)
+{
+        ioctl::set_bandwidth_limit r { 
+                .port = port, 
+                .device_rate = device_rate, 
+                .server_rate = server_rate, 
+                .burst = burst 
+        };
+        r.size = sizeof(r);
+
+        DWORD BytesReturned{};
+        return DeviceIoControl(dev, ioctl::SET_BANDWIDTH_LIMIT, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr);
+}
+
+bool usbip::vhci::set_sched_policy(_In_ HANDLE dev, _In_ const std::vector<sched_rule> &rules)
+{
+        ioctl::sched_policy r{};
+        r.size = sizeof(r);
+
+        if (rules.size() > ARRAYSIZE(r.rules)) {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return false;
+        }
+
+        for (auto &i: rules) {
+                r.rules[r.cnt++] = { 
+                        .vendor = i.vendor, 
+                        .product = i.product, 
+                        .cls = static_cast<INT16>(i.cls), 
+                        .subclass = static_cast<INT16>(i.subclass),
+                        .priority = i.priority, 
+                        .priority_boost = i.priority_boost, 
+                        .affinity = i.affinity 
+                };
+        }
+
+        DWORD BytesReturned{};
+        return DeviceIoControl(dev, ioctl::SET_SCHED_POLICY, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr);
+}
+
+std::vector<usbip::sched_rule> usbip::vhci::get_sched_policy(_In_ HANDLE dev, _Out_ bool &success)
+{
+        success = false;
+        std::vector<sched_rule> v;
+
+        ioctl::sched_policy r{};
+        r.size = sizeof(r);
+
+        DWORD BytesReturned{};
+        if (!DeviceIoControl(dev, ioctl::GET_SCHED_POLICY, &r, sizeof(r), &r, sizeof(r), &BytesReturned, nullptr)) {
+                return v;
+        } else if (BytesReturned != sizeof(r) || r.cnt < 0 || r.cnt > r.max_rules) {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return v;
+        }
+
+        v.reserve(r.cnt);
+
+        for (int i = 0; i < r.cnt; ++i) {
+                auto &s = r.rules[i];
+                v.push_back({
+                        .vendor = s.vendor,
+                        .product = s.product,
+                        .cls = s.cls,
+                        .subclass = s.subclass,
+                        .priority = s.priority,
+                        .priority_boost = s.priority_boost,
+                        .affinity = s.affinity,
+                });
+        }
+
+        success = true;
+        return v;
+}
+
+bool usbip::vhci::get_device_stats(_In_ HANDLE dev, _In_ int port, _Out_ device_stats &result)
+{
+        ioctl::device_stats r { .port = port };
+        r.size = sizeof(r);
+
+        DWORD BytesReturned{};
+        if (!DeviceIoControl(dev, ioctl::GET_DEVICE_STATS, &r, sizeof(r), &r, sizeof(r), &BytesReturned, nullptr)) {
+                return false;
+        } else if (BytesReturned != sizeof(r)) {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return false;
+        }
+
+        result = {
+                .sent_requests = r.sent_requests,
+                .bytes_sent = r.bytes_sent,
+                .bytes_received = r.bytes_received,
+                .srtt_us = r.srtt_us,
+                .rx_rate = r.rx_rate,
+                .tx_rate = r.tx_rate,
+                .rx_bdp = r.rx_bdp,
+                .tx_bdp = r.tx_bdp,
+                .rcvbuf = r.rcvbuf,
+                .sndbuf = r.sndbuf,
+                .sockbuf_changes = r.sockbuf_changes,
+                .resumed_sessions = r.resumed_sessions,
+                .heartbeat_probes = r.heartbeat_probes,
+                .heartbeat_failures = r.heartbeat_failures,
+                .unlink_bursts = r.unlink_bursts,
+                .unlinked_requests = r.unlinked_requests,
+                .max_unlink_burst = r.max_unlink_burst,
+                .inflight_urbs = r.inflight_urbs,
+                .inflight_bytes = r.inflight_bytes,
+                .held_urbs = r.held_urbs,
+                .max_inflight_urbs = r.max_inflight_urbs,
+                .max_inflight_bytes = r.max_inflight_bytes,
+                .max_held_urbs = r.max_held_urbs,
+                .held_total = r.held_total,
+                .isoc_in_urbs = r.isoc_in_urbs,
+                .isoc_moved_bytes = r.isoc_moved_bytes,
+                .isoc_uncompacted = r.isoc_uncompacted,
+                .suspends = r.suspends,
+                .remote_wakes = r.remote_wakes,
+                .suspended_ms = r.suspended_ms,
+                .parked_urbs = r.parked_urbs,
+                .interrupt_push = r.interrupt_push,
+                .pushed_reports = r.pushed_reports,
+                .buffered_reports = r.buffered_reports,
+                .dropped_reports = r.dropped_reports,
+                .stream_transfers = r.stream_transfers,
+                .stream_bytes = r.stream_bytes,
+                .stream_throttled = r.stream_throttled,
+                .sched_rule = r.sched_rule,
+                .recv_priority = r.recv_priority,
+                .recv_affinity = r.recv_affinity,
+                .completion_batches = r.completion_batches,
+                .batched_urbs = r.batched_urbs,
+                .max_completion_batch = r.max_completion_batch,
+        };
+
+        return true;
+}
+
 USBIP_API DWORD usbip::vhci::get_device_state_size() noexcept
 {
         return sizeof(vhci::device_state);
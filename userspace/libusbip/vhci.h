@@ -45,6 +45,98 @@ struct device_state
         state state = state::unplugged;
 };
 
+struct resolver_cache_stats; // remote.h
+
+/*
+ * Counters of the pool of connections that is used by attach().
+ */
+struct connection_pool_stats
+{
+        int pool_size{}; // connections per server, zero if the pool is disabled
+        int hosts{}; // servers to keep connections to
+        int sockets{}; // ready to use
+        UINT64 hits{}; // attach() took a connection from the pool
+        UINT64 misses{};
+};
+
+/*
+ * Statistics of an imported device.
+ */
+struct device_stats
+{
+        UINT64 sent_requests{};
+        UINT64 bytes_sent{}; // PDUs over TCP
+        UINT64 bytes_received{};
+
+        UINT32 srtt_us{}; // smoothed round-trip time of control transfers
+        UINT64 rx_rate{}; // bytes per second
+        UINT64 tx_rate{};
+        UINT64 rx_bdp{}; // bandwidth-delay product, bytes
+        UINT64 tx_bdp{};
+        UINT32 rcvbuf{}; // SO_RCVBUF, zero if it was not set
+        UINT32 sndbuf{}; // SO_SNDBUF
+        ULONG sockbuf_changes{};
+
+        ULONG resumed_sessions{};
+        ULONG heartbeat_probes{};
+        ULONG heartbeat_failures{};
+
+        UINT64 unlink_bursts{}; // CMD_UNLINK-s of a purged endpoint are sent by one WskSend
+        UINT64 unlinked_requests{}; // average burst size is unlinked_requests/unlink_bursts
+        ULONG max_unlink_burst{};
+
+        ULONG inflight_urbs{}; // admission control
+        UINT64 inflight_bytes{};
+        ULONG held_urbs{}; // over the limits, wait for completions
+        ULONG max_inflight_urbs{}; // high-water marks
+        UINT64 max_inflight_bytes{};
+        ULONG max_held_urbs{};
+        UINT64 held_total{};
+
+        UINT64 isoc_in_urbs{};
+        UINT64 isoc_moved_bytes{}; // to restore the offsets of compacted data
+        bool isoc_uncompacted{}; // the server sends isochronous IN data at the offsets of the packets
+
+        ULONG suspends{}; // selective suspend passthrough
+        ULONG remote_wakes{};
+        UINT64 suspended_ms{}; // time spent in suspend
+        UINT64 parked_urbs{}; // interrupt IN URBs that were unlinked while suspended
+
+        bool interrupt_push{}; // the server pushes reports of HID interrupt IN endpoints
+        UINT64 pushed_reports{};
+        UINT64 buffered_reports{}; // arrived while no URB was waiting
+        UINT64 dropped_reports{}; // the oldest buffered ones
+
+        UINT64 stream_transfers{}; // bulk IN streaming of serial ports
+        UINT64 stream_bytes{};
+        UINT64 stream_throttled{}; // reads that were held back because the data was not consumed
+
+        int sched_rule{-1}; // index of the rule of the receive thread, see set_sched_policy
+        LONG recv_priority{}; // of the receive thread, zero if the device shares the connection
+        UINT64 recv_affinity{}; // zero if it is not restricted
+
+        UINT64 completion_batches{}; // URBs are completed in batches by the receive thread
+        UINT64 batched_urbs{}; // average batch size is batched_urbs/completion_batches
+        ULONG max_completion_batch{};
+};
+
+/*
+ * A rule of the scheduling policy of imported devices.
+ * The first rule that matches a device sets the priority and affinity of its receive thread,
+ * the first rule that matches an interface sets the priority boost of its completed URBs.
+ */
+struct sched_rule
+{
+        UINT16 vendor{}; // zero matches any
+        UINT16 product{};
+        int cls = -1; // interface class, -1 matches any
+        int subclass = -1;
+
+        int priority{}; // of the receive thread, zero keeps the default
+        int priority_boost = -1; // of completed URBs of the interface, negative keeps the built-in one
+        UINT64 affinity{}; // processors of group zero for the receive thread, zero keeps the default
+};
+
 } // namespace usbip
 
 
@@ -79,6 +171,70 @@ USBIP_API int attach(_In_ HANDLE dev, _In_ const device_location &location);
  */
 USBIP_API bool detach(_In_ HANDLE dev, _In_ int port);
 
+/**
+ * The cache of resolved host names that is used by attach().
+ * @param dev handle of the driver device
+ * @param result counters of the cache
+ * @param flush remove all entries after the counters are read
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool get_resolver_cache(_In_ HANDLE dev, _Out_ resolver_cache_stats &result, _In_ bool flush = false);
+
+/**
+ * The pool of connections to the servers that is used by attach().
+ * @param dev handle of the driver device
+ * @param result counters of the pool
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool get_connection_pool(_In_ HANDLE dev, _Out_ connection_pool_stats &result);
+
+/**
+ * Application-level heartbeat detects a dead server faster than TCP keepalive.
+ * @param dev handle of the driver device
+ * @param port hub port number, <= 0 means all ports
+ * @param interval_ms a probe is sent if nothing was received during it, zero disables the heartbeat
+ * @param max_misses unanswered probes in a row after which the connection is aborted, <= 0 means the default
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool set_heartbeat(_In_ HANDLE dev, _In_ int port, _In_ UINT32 interval_ms, _In_ int max_misses = 0);
+
+/**
+ * @param dev handle of the driver device
+ * @param port hub port number
+ * @param result statistics of the device
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool get_device_stats(_In_ HANDLE dev, _In_ int port, _Out_ device_stats &result);
+
+/**
+ * Bandwidth shaping of the devices of a server (host:port).
+ * Control and interrupt transfers are never delayed by the limits and preempt queued bulk transfers.
+ * @param dev handle of the driver device
+ * @param port hub port number, <= 0 means all ports
+ * @param device_rate bytes per second the device can send, zero is unlimited
+ * @param server_rate bytes per second all devices of the server can send, zero is unlimited;
+ *        devices that share a connection and devices that have own connections are limited separately
+ * @param burst bytes that can be sent at once, zero means the default
+ * @return call GetLastError() if false is returned, ERROR_NOT_SUPPORTED if sends of the device are not scheduled
+ */
+USBIP_API bool set_bandwidth_limit(
+        _In_ HANDLE dev, _In_ int port, _In_ UINT32 device_rate, _In_ UINT32 server_rate = 0, _In_ UINT32 burst = 0);
+
+/**
+ * The policy is saved in the registry and is applied to imported devices at once.
+ * @param dev handle of the driver device
+ * @param rules at most 16, the first matching rule wins
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool set_sched_policy(_In_ HANDLE dev, _In_ const std::vector<sched_rule> &rules);
+
+/**
+ * @param dev handle of the driver device
+ * @param success call GetLastError() if false is returned
+ * @return current scheduling policy
+ */
+USBIP_API std::vector<sched_rule> get_sched_policy(_In_ HANDLE dev, _Out_ bool &success);
+
 /**
  * @return textual representation of the given constant
  */
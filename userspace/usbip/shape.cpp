@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "usbip.h"
+
+#include <libusbip\vhci.h>
+#include <spdlog\spdlog.h>
+
+bool usbip::cmd_shape(void *p)
+{
+	auto &args = *reinterpret_cast<shape_args*>(p);
+
+	auto dev = vhci::open();
+	if (!dev) {
+		spdlog::error(GetLastErrorMsg());
+		return false;
+	}
+
+	auto ok = vhci::set_bandwidth_limit(dev.get(), args.port, args.device_rate, args.server_rate, args.burst);
+
+	if (!ok) {
+		spdlog::error(GetLastErrorMsg());
+	} else if (args.port <= 0) {
+		printf("bandwidth limits are set for all ports\n");
+	} else {
+		printf("bandwidth limits are set for port %d\n", args.port);
+	}
+
+	return ok;
+}
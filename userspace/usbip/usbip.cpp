@@ -119,6 +119,25 @@ void add_cmd_port(CLI::App &app)
 		->expected(1, MAX_HUB_PORTS);
 }
 
+void add_cmd_shape(CLI::App &app)
+{
+	static shape_args r;
+
+	auto cmd = app.add_subcommand("shape", "Limit bandwidth of USB devices of a server")
+		->callback(pack(cmd_shape, &r));
+
+	auto port = cmd->add_option_group("port")->require_option(1);
+
+	port->add_option("-p,--port", r.port, "Hub port number the device is plugged in")
+		->check(CLI::Range(1, MAX_HUB_PORTS));
+
+	port->add_flag("-a,--all", [&port = r.port] (auto) { port = -1; }, "Apply to all devices");
+
+	cmd->add_option("-r,--rate", r.device_rate, "Bytes per second the device can send, 0 (default) is unlimited");
+	cmd->add_option("-s,--server-rate", r.server_rate, "Bytes per second all devices of the server can send");
+	cmd->add_option("-b,--burst", r.burst, "Bytes that can be sent at once, 0 is the default");
+}
+
 auto &msgtable_dll = L"resources"; // resource-only DLL that contains RT_MESSAGETABLE
 
 auto& get_resource_module() noexcept
@@ -152,6 +171,7 @@ void init(CLI::App &app)
 	add_cmd_detach(app);
 	add_cmd_list(app);
 	add_cmd_port(app);
+	add_cmd_shape(app);
 
 	app.require_subcommand(1);
 }
@@ -60,4 +60,13 @@ struct port_args
 };
 command_t cmd_port;
 
+struct shape_args
+{
+	int port{};
+	unsigned int device_rate{};
+	unsigned int server_rate{};
+	unsigned int burst{};
+};
+command_t cmd_shape;
+
 } // namespace usbip